@@ -0,0 +1,459 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "blkqueue.h"
+#include "device.h"
+#include "vfs.h"
+
+#define BLK_MAX_MERGE_SECTORS   256     // never build a device call larger than this
+#define BLK_READ_EXPIRE_MS      50      // readers are usually waiting, so they expire sooner
+#define BLK_WRITE_EXPIRE_MS     500
+
+typedef struct blk_queue
+{
+    int device_id;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;          // signaled when a request is queued
+    pthread_cond_t completed;       // broadcast when requests are completed
+    blk_request_t* pending;         // sorted by LBA
+    uint32_t position;              // LBA right after the last dispatched request
+    uint64_t sequence;
+    blk_stats_t stats;
+
+    pthread_t dispatcher;
+    bool stopping;                  // the dispatcher exits once the queue is empty
+    bool stopped;                   // it did, the requests are served by their submitter
+} blk_queue_t;
+
+static pthread_mutex_t queues_lock = PTHREAD_MUTEX_INITIALIZER;
+static blk_queue_t** queues;
+static int queue_count;
+static bool queues_stopping;        // blk_shutdown() was called, the new queues have no dispatcher
+static blk_policy_t blk_policy = BLK_POLICY_DEADLINE;
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool overlaps(blk_request_t* first, blk_request_t* second)
+{
+    return first->lba < second->lba + second->count && second->lba < first->lba + first->count;
+}
+
+/* Two requests must be served in submission order if they touch the same sectors and one of them writes */
+static bool conflicts(blk_request_t* first, blk_request_t* second)
+{
+    return (first->op == BLK_WRITE || second->op == BLK_WRITE) && overlaps(first, second);
+}
+
+/* Returns the oldest pending request that has to be served before 'request', or 'request' itself */
+static blk_request_t* first_conflict(blk_queue_t* queue, blk_request_t* request)
+{
+    bool found = true;
+
+    while(found)
+    {
+        found = false;
+        for(blk_request_t* other = queue->pending; other != NULL; other = other->next)
+        {
+            if(other->sequence < request->sequence && conflicts(other, request))
+            {
+                request = other;
+                found = true;
+            }
+        }
+    }
+
+    return request;
+}
+
+/*
+ * Chooses the request to serve next.
+ *
+ * With the deadline policy an expired request goes first. Otherwise the elevator continues
+ * upward from the last position, and wraps around at the end. Whatever the policy, an older
+ * request conflicting with the chosen one goes before it: a read never sees the sectors
+ * before a write submitted earlier, nor after one submitted later.
+ */
+static blk_request_t* choose_request(blk_queue_t* queue)
+{
+    blk_request_t* chosen = NULL;
+
+    if(blk_policy == BLK_POLICY_DEADLINE)
+    {
+        for(blk_request_t* request = queue->pending; request != NULL; request = request->next)
+            if(chosen == NULL || request->deadline < chosen->deadline)
+                chosen = request;
+
+        if(chosen->deadline > now_ms())
+            chosen = NULL;
+    }
+
+    if(chosen == NULL)
+    {
+        for(blk_request_t* request = queue->pending; request != NULL && chosen == NULL; request = request->next)
+            if(request->lba >= queue->position)
+                chosen = request;
+    }
+
+    return first_conflict(queue, (chosen != NULL) ? chosen : queue->pending);
+}
+
+static void unlink_request(blk_queue_t* queue, blk_request_t* request)
+{
+    blk_request_t** link = &queue->pending;
+
+    while(*link != request)
+        link = &(*link)->next;
+
+    *link = request->next;
+    request->next = NULL;
+}
+
+/*
+ * Removes the next request from the queue, along with the requests that follow it on the disk
+ * and can be served by the same device call (same operation, adjacent LBAs, nothing older to wait for).
+ * Returns the batch as a list in LBA order, and its size in sectors.
+ */
+static blk_request_t* pick_batch(blk_queue_t* queue, uint32_t* sectors)
+{
+    blk_request_t* first = choose_request(queue);
+    blk_request_t* candidate = first->next;
+    blk_request_t* last = first;
+
+    unlink_request(queue, first);
+    *sectors = first->count;
+
+    while(candidate != NULL && candidate->op == first->op && candidate->lba == first->lba + *sectors
+        && *sectors + candidate->count <= BLK_MAX_MERGE_SECTORS && first_conflict(queue, candidate) == candidate)
+    {
+        blk_request_t* next = candidate->next;
+
+        unlink_request(queue, candidate);
+        last->next = candidate;
+        last = candidate;
+        *sectors += candidate->count;
+        queue->stats.merged++;
+
+        candidate = next;
+    }
+
+    queue->position = first->lba + *sectors;
+    queue->stats.dispatched++;
+
+    return first;
+}
+
+static int device_call(device_t* device, blk_op_t op, void* buffer, uint32_t lba, uint32_t count)
+{
+    int ret;
+
+    if(op == BLK_READ)
+        ret = (device->read != NULL) ? device->read(buffer, lba, count, device->priv) : -1;
+    else
+        ret = (device->write != NULL) ? device->write(buffer, lba, count, device->priv) : -1;
+
+    return (ret == 0) ? VFS_OK : VFS_ERROR;
+}
+
+/* Serves a batch with a single device call, going through a bounce buffer if it holds several requests */
+static int dispatch_batch(blk_queue_t* queue, blk_request_t* batch, uint32_t sectors)
+{
+    device_t* device = device_list[queue->device_id];
+
+    if(batch->next == NULL)
+        return device_call(device, batch->op, batch->buffer, batch->lba, batch->count);
+
+    uint8_t* bounce = malloc(sectors * BLK_SECTOR_SIZE);
+    if(bounce == NULL)
+    {
+        // no memory for merging, serve them one by one
+        int status = VFS_OK;
+        for(blk_request_t* request = batch; request != NULL; request = request->next)
+            if(device_call(device, request->op, request->buffer, request->lba, request->count) != VFS_OK)
+                status = VFS_ERROR;
+        return status;
+    }
+
+    if(batch->op == BLK_WRITE)
+        for(blk_request_t* request = batch; request != NULL; request = request->next)
+            memcpy(bounce + (request->lba - batch->lba) * BLK_SECTOR_SIZE, request->buffer, request->count * BLK_SECTOR_SIZE);
+
+    int status = device_call(device, batch->op, bounce, batch->lba, sectors);
+
+    if(batch->op == BLK_READ && status == VFS_OK)
+        for(blk_request_t* request = batch; request != NULL; request = request->next)
+            memcpy(request->buffer, bounce + (request->lba - batch->lba) * BLK_SECTOR_SIZE, request->count * BLK_SECTOR_SIZE);
+
+    free(bounce);
+    return status;
+}
+
+static void* dispatcher_thread(void* arg)
+{
+    blk_queue_t* queue = arg;
+
+    pthread_mutex_lock(&queue->lock);
+    for(;;)
+    {
+        while(queue->pending == NULL && !queue->stopping)
+            pthread_cond_wait(&queue->wakeup, &queue->lock);
+
+        if(queue->pending == NULL)
+            break;  // stopping, and everything was served
+
+        uint32_t sectors;
+        blk_request_t* batch = pick_batch(queue, &sectors);
+        pthread_mutex_unlock(&queue->lock);
+
+        int status = dispatch_batch(queue, batch, sectors);
+
+        // the request may be freed as soon as it's completed, so we save the next one first
+        for(blk_request_t* request = batch, *next; request != NULL; request = next)
+        {
+            next = request->next;
+            request->status = status;
+
+            if(request->complete != NULL)
+                request->complete(request, request->arg);
+            else
+            {
+                pthread_mutex_lock(&queue->lock);
+                request->done = true;
+                pthread_mutex_unlock(&queue->lock);
+            }
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_broadcast(&queue->completed);
+    }
+
+    queue->stopped = true;
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+/* Returns the queue of a device, it's created (with its dispatcher) on first use */
+static blk_queue_t* get_queue(int device_id)
+{
+    blk_queue_t* queue = NULL;
+
+    pthread_mutex_lock(&queues_lock);
+
+    if(device_id >= queue_count)
+    {
+        blk_queue_t** new_queues = realloc(queues, sizeof(blk_queue_t*) * device_num);
+        if(new_queues == NULL)
+            goto out;
+
+        for(int i = queue_count; i < device_num; i++)
+            new_queues[i] = NULL;
+
+        queues = new_queues;
+        queue_count = device_num;
+    }
+
+    queue = queues[device_id];
+    if(queue != NULL)
+        goto out;
+
+    queue = calloc(1, sizeof(blk_queue_t));
+    if(queue == NULL)
+        goto out;
+
+    queue->device_id = device_id;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->wakeup, NULL);
+    pthread_cond_init(&queue->completed, NULL);
+
+    static bool shutdown_registered = false;
+
+    if(queues_stopping)
+        queue->stopping = queue->stopped = true;
+    else if(pthread_create(&queue->dispatcher, NULL, dispatcher_thread, queue) != 0)
+    {
+        free(queue);
+        queue = NULL;
+        goto out;
+    }
+    else if(!shutdown_registered)
+    {
+        atexit(blk_shutdown);
+        shutdown_registered = true;
+    }
+
+    queues[device_id] = queue;
+
+out:
+    pthread_mutex_unlock(&queues_lock);
+    return queue;
+}
+
+void blk_set_policy(blk_policy_t policy)
+{
+    blk_policy = policy;
+}
+
+/*
+ * Stops the dispatchers once they've served their queue, and waits for them. It's called at exit,
+ * after which the requests (the last write backs of the cache) are served by the submitting thread.
+ */
+void blk_shutdown()
+{
+    pthread_mutex_lock(&queues_lock);
+    queues_stopping = true;
+    pthread_mutex_unlock(&queues_lock);
+
+    // a completion callback may submit (and add a queue), the joins are done unlocked
+    for(int i = 0; ; i++)
+    {
+        pthread_mutex_lock(&queues_lock);
+        bool last = (i >= queue_count);
+        blk_queue_t* queue = last ? NULL : queues[i];
+        pthread_mutex_unlock(&queues_lock);
+
+        if(last)
+            break;
+        if(queue == NULL)
+            continue;
+
+        pthread_mutex_lock(&queue->lock);
+        bool running = !queue->stopping;
+        queue->stopping = true;
+        pthread_cond_signal(&queue->wakeup);
+        pthread_mutex_unlock(&queue->lock);
+
+        if(running)
+            pthread_join(queue->dispatcher, NULL);
+    }
+}
+
+/*
+ * Queues a request, it will be served asynchronously.
+ * Its completion is reported either through its callback or through blk_wait().
+ */
+int blk_submit(int device_id, blk_request_t* request)
+{
+    if(device_id < 0 || device_id >= device_num || request->count == 0)
+        return VFS_ERROR;
+
+    blk_queue_t* queue = get_queue(device_id);
+    if(queue == NULL)
+        return VFS_ERROR;
+
+    request->queue = queue;
+    request->status = VFS_OK;
+    request->done = false;
+    request->deadline = now_ms() + ((request->op == BLK_READ) ? BLK_READ_EXPIRE_MS : BLK_WRITE_EXPIRE_MS);
+
+    pthread_mutex_lock(&queue->lock);
+
+    // the dispatcher is gone, nothing is pending: the request is served right away
+    if(queue->stopped)
+    {
+        request->status = device_call(device_list[device_id], request->op, request->buffer, request->lba, request->count);
+        request->done = true;
+        queue->stats.requests++;
+        queue->stats.dispatched++;
+        pthread_mutex_unlock(&queue->lock);
+
+        if(request->complete != NULL)
+            request->complete(request, request->arg);
+
+        return VFS_OK;
+    }
+
+    request->sequence = queue->sequence++;
+
+    // keep the queue sorted, after the requests on the same LBA
+    blk_request_t** link = &queue->pending;
+    while(*link != NULL && (*link)->lba <= request->lba)
+        link = &(*link)->next;
+
+    request->next = *link;
+    *link = request;
+    queue->stats.requests++;
+
+    pthread_cond_signal(&queue->wakeup);
+    pthread_mutex_unlock(&queue->lock);
+
+    return VFS_OK;
+}
+
+int blk_wait(blk_request_t* request)
+{
+    blk_queue_t* queue = request->queue;
+
+    pthread_mutex_lock(&queue->lock);
+    while(!request->done)
+        pthread_cond_wait(&queue->completed, &queue->lock);
+    pthread_mutex_unlock(&queue->lock);
+
+    return request->status;
+}
+
+int blk_read(int device_id, void* buffer, uint32_t lba, uint32_t count)
+{
+    blk_request_t request = { .op = BLK_READ, .lba = lba, .count = count, .buffer = buffer };
+
+    if(blk_submit(device_id, &request) != VFS_OK)
+        return VFS_ERROR;
+
+    return blk_wait(&request);
+}
+
+int blk_write(int device_id, const void* buffer, uint32_t lba, uint32_t count)
+{
+    blk_request_t request = { .op = BLK_WRITE, .lba = lba, .count = count, .buffer = (void*)buffer };
+
+    if(blk_submit(device_id, &request) != VFS_OK)
+        return VFS_ERROR;
+
+    return blk_wait(&request);
+}
+
+void blk_get_stats(int device_id, blk_stats_t* stats)
+{
+    memset(stats, 0, sizeof(blk_stats_t));
+
+    pthread_mutex_lock(&queues_lock);
+    blk_queue_t* queue = (device_id >= 0 && device_id < queue_count) ? queues[device_id] : NULL;
+    pthread_mutex_unlock(&queues_lock);
+
+    if(queue == NULL)
+        return; // nothing was ever submitted to this device
+
+    pthread_mutex_lock(&queue->lock);
+    *stats = queue->stats;
+    pthread_mutex_unlock(&queue->lock);
+}
@@ -0,0 +1,92 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BLK_SECTOR_SIZE 512
+
+/*
+ * Block Request Queue
+ *
+ * Each device gets a queue of block requests served by its own dispatcher thread.
+ * Pending requests are kept sorted by LBA: the dispatcher serves them in elevator order
+ * (ascending LBAs from the last position, then wrapping around), and merges requests of the
+ * same kind on adjacent LBAs into a single device call.
+ * With the deadline policy, a request that waited too long is served first whatever its position.
+ * Requests on the same sectors are served in submission order when one of them writes.
+ * The dispatchers are stopped at exit by blk_shutdown(), once their queue is drained.
+*/
+typedef enum
+{
+    BLK_READ,
+    BLK_WRITE
+} blk_op_t;
+
+typedef enum
+{
+    BLK_POLICY_ELEVATOR,
+    BLK_POLICY_DEADLINE
+} blk_policy_t;
+
+typedef struct blk_request
+{
+    blk_op_t op;
+    uint32_t lba;
+    uint32_t count;     // in sectors
+    void* buffer;
+    int status;         // VFS_OK or an error, once completed
+
+    /* Optional, called by the dispatcher thread once the request is completed.
+    From then on the request belongs to the callback: it must not be waited for. */
+    void (*complete)(struct blk_request* request, void* arg);
+    void* arg;
+
+    /* Private to the queue */
+    struct blk_queue* queue;
+    struct blk_request* next;
+    uint64_t deadline;
+    uint64_t sequence;  // submission order
+    bool done;
+} blk_request_t;
+
+typedef struct blk_stats
+{
+    uint64_t requests;          // requests submitted
+    uint64_t dispatched;        // device calls actually made
+    uint64_t merged;            // requests served by the call of another one
+} blk_stats_t;
+
+void blk_set_policy(blk_policy_t policy);
+void blk_shutdown();
+
+int blk_submit(int device_id, blk_request_t* request);
+int blk_wait(blk_request_t* request);
+
+int blk_read(int device_id, void* buffer, uint32_t lba, uint32_t count);
+int blk_write(int device_id, const void* buffer, uint32_t lba, uint32_t count);
+
+void blk_get_stats(int device_id, blk_stats_t* stats);
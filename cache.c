@@ -0,0 +1,650 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "blkqueue.h"
+#include "device.h"
+#include "vfs.h"
+#include "membudget.h"
+
+#define CACHE_MAX_BLOCKS                8192    // 4 MiB of sectors
+#define CACHE_HASH_SIZE                 2048
+#define CACHE_FLUSH_INTERVAL_MS         500     // how often the flusher wakes up
+#define CACHE_DIRTY_EXPIRE_MS           3000    // a dirty sector older than this is written back
+#define CACHE_DIRTY_BACKGROUND_RATIO    10      // above this percentage of dirty sectors the flusher writes the oldest ones
+#define CACHE_DIRTY_RATIO               40      // above this percentage writers flush by themselves
+#define CACHE_MAX_WRITEBACK_HOOKS       16
+
+typedef struct cache_block
+{
+    int device_id;
+    uint32_t lba;
+    bool dirty;
+    bool flushing;                  // being written to the device, so it can't be evicted
+    uint64_t dirty_since;           // in milliseconds
+    struct cache_block *hash_next;
+    struct cache_block *lru_prev, *lru_next;
+    struct cache_block *dirty_prev, *dirty_next;
+    uint8_t data[CACHE_BLOCK_SIZE];
+} cache_block_t;
+
+/*
+ * 'cache_lock' protects every structure below, but is never held during device I/O.
+ * 'flush_lock' serializes the writes to the devices, so an older copy of a sector can
+ * never reach the device after a newer one.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher;
+static bool flusher_running = false;
+static bool flusher_stopping = false;
+
+static cache_mode_t cache_mode = CACHE_WRITE_BACK;
+static cache_block_t* buckets[CACHE_HASH_SIZE];
+static cache_block_t *lru_head, *lru_tail;      // most recently used first
+static cache_block_t *dirty_head, *dirty_tail;  // oldest dirty sector first
+static uint32_t block_count;
+static uint32_t dirty_count;
+
+/* 'hooks_lock' is held while the hooks run, so a hook is never called after being unregistered */
+static pthread_mutex_t hooks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct
+{
+    cache_writeback_t hook;
+    void* arg;
+} writeback_hooks[CACHE_MAX_WRITEBACK_HOOKS];
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t hash_block(int device_id, uint32_t lba)
+{
+    return (lba * 2654435761u + (uint32_t)device_id) % CACHE_HASH_SIZE;
+}
+
+static cache_block_t* find_block(int device_id, uint32_t lba)
+{
+    cache_block_t* block = buckets[hash_block(device_id, lba)];
+
+    while(block != NULL && (block->device_id != device_id || block->lba != lba))
+        block = block->hash_next;
+
+    return block;
+}
+
+static void lru_remove(cache_block_t* block)
+{
+    if(block->lru_prev) block->lru_prev->lru_next = block->lru_next;
+    else lru_head = block->lru_next;
+
+    if(block->lru_next) block->lru_next->lru_prev = block->lru_prev;
+    else lru_tail = block->lru_prev;
+}
+
+static void lru_push_front(cache_block_t* block)
+{
+    block->lru_prev = NULL;
+    block->lru_next = lru_head;
+
+    if(lru_head) lru_head->lru_prev = block;
+    else lru_tail = block;
+
+    lru_head = block;
+}
+
+static void lru_touch(cache_block_t* block)
+{
+    if(lru_head == block)
+        return;
+
+    lru_remove(block);
+    lru_push_front(block);
+}
+
+static void mark_dirty(cache_block_t* block)
+{
+    if(block->dirty)
+        return;
+
+    block->dirty = true;
+    block->dirty_since = now_ms();
+    block->dirty_next = NULL;
+    block->dirty_prev = dirty_tail;
+
+    if(dirty_tail) dirty_tail->dirty_next = block;
+    else dirty_head = block;
+
+    dirty_tail = block;
+    dirty_count++;
+}
+
+static void mark_clean(cache_block_t* block)
+{
+    if(!block->dirty)
+        return;
+
+    if(block->dirty_prev) block->dirty_prev->dirty_next = block->dirty_next;
+    else dirty_head = block->dirty_next;
+
+    if(block->dirty_next) block->dirty_next->dirty_prev = block->dirty_prev;
+    else dirty_tail = block->dirty_prev;
+
+    block->dirty = false;
+    dirty_count--;
+}
+
+static size_t cache_shrink(size_t bytes);
+
+/* The sectors are the first thing given back when the memory budget is exceeded: the file content they hold is in the page cache too */
+static membudget_account_t cache_account = { .name = "block cache", .priority = 0, .shrink = cache_shrink };
+
+/* Drops clean sectors, least recently used first, until there are no more than 'limit' */
+static void evict_blocks(uint32_t limit)
+{
+    cache_block_t* block = lru_tail;
+
+    while(block_count > limit && block != NULL)
+    {
+        cache_block_t* previous = block->lru_prev;
+
+        if(!block->dirty && !block->flushing)
+        {
+            cache_block_t** link = &buckets[hash_block(block->device_id, block->lba)];
+            while(*link != block)
+                link = &(*link)->hash_next;
+            *link = block->hash_next;
+
+            lru_remove(block);
+            free(block);
+            block_count--;
+            membudget_charge(&cache_account, -(ssize_t)sizeof(cache_block_t));
+        }
+
+        block = previous;
+    }
+}
+
+static cache_block_t* insert_block(int device_id, uint32_t lba, const uint8_t* data)
+{
+    cache_block_t* block = malloc(sizeof(cache_block_t));
+    if(block == NULL)
+        return NULL;
+
+    uint32_t index = hash_block(device_id, lba);
+
+    block->device_id = device_id;
+    block->lba = lba;
+    block->dirty = false;
+    block->flushing = false;
+    block->hash_next = buckets[index];
+    buckets[index] = block;
+    memcpy(block->data, data, CACHE_BLOCK_SIZE);
+
+    lru_push_front(block);
+    block_count++;
+    membudget_charge(&cache_account, sizeof(cache_block_t));
+
+    evict_blocks(CACHE_MAX_BLOCKS);
+
+    return block;
+}
+
+static int compare_blocks(const void* a, const void* b)
+{
+    const cache_block_t* first = *(cache_block_t* const*)a;
+    const cache_block_t* second = *(cache_block_t* const*)b;
+
+    if(first->device_id != second->device_id)
+        return first->device_id - second->device_id;
+
+    return (first->lba > second->lba) - (first->lba < second->lba);
+}
+
+static void device_flush(int device_id)
+{
+    if(device_list[device_id]->flush != NULL)
+        device_list[device_id]->flush(device_list[device_id]->priv);
+}
+
+/*
+ * Writes dirty sectors back to their devices.
+ *
+ * device_id:   only flush this device, or every device if negative
+ * expire:      if not 0, also select the sectors dirty since before this time
+ * target:      select the oldest sectors until at most this many stay dirty
+ *
+ * The selected sectors are sorted and contiguous ones are merged, so that
+ * each run of sectors reaches the device with a single write. All the runs are
+ * queued at once, letting the device queue order them. The sectors of a failed
+ * write are marked dirty again.
+ *
+ * Returns the status of the first run that failed, or VFS_ERROR if some selected
+ * sectors couldn't even be queued (they stay dirty).
+ */
+static int flush_blocks(int device_id, uint64_t expire, uint32_t target)
+{
+    int status = VFS_OK;
+
+    pthread_mutex_lock(&flush_lock);
+    pthread_mutex_lock(&cache_lock);
+
+    cache_block_t** selected = malloc(sizeof(cache_block_t*) * (dirty_count + 1));
+    uint32_t count = 0;
+    uint32_t remaining = dirty_count;
+
+    if(selected == NULL)
+    {
+        pthread_mutex_unlock(&cache_lock);
+        pthread_mutex_unlock(&flush_lock);
+        return VFS_ERROR;
+    }
+
+    for(cache_block_t* block = dirty_head; block != NULL; block = block->dirty_next)
+    {
+        if(device_id >= 0 && block->device_id != device_id)
+            continue;
+
+        if(remaining > target || (expire != 0 && block->dirty_since <= expire))
+        {
+            selected[count++] = block;
+            remaining--;
+        }
+    }
+
+    qsort(selected, count, sizeof(cache_block_t*), compare_blocks);
+
+    // snapshot the runs while we still hold the lock
+    blk_request_t* runs = calloc(count + 1, sizeof(blk_request_t));
+    uint32_t* run_start = malloc(sizeof(uint32_t) * (count + 1));
+    uint32_t run_count = 0;
+    uint32_t queued = 0;
+
+    for(uint32_t i = 0; runs != NULL && run_start != NULL && i < count; )
+    {
+        uint32_t length = 1;
+        while(i + length < count && selected[i + length]->device_id == selected[i]->device_id && selected[i + length]->lba == selected[i]->lba + length)
+            length++;
+
+        uint8_t* snapshot = malloc(length * CACHE_BLOCK_SIZE);
+        if(snapshot == NULL)
+            break;
+
+        for(uint32_t j = 0; j < length; j++)
+        {
+            memcpy(snapshot + j * CACHE_BLOCK_SIZE, selected[i + j]->data, CACHE_BLOCK_SIZE);
+            mark_clean(selected[i + j]);
+            selected[i + j]->flushing = true;
+        }
+
+        runs[run_count].op = BLK_WRITE;
+        runs[run_count].lba = selected[i]->lba;
+        runs[run_count].count = length;
+        runs[run_count].buffer = snapshot;
+        run_start[run_count++] = i;
+        i += length;
+        queued = i;
+    }
+
+    if(queued < count)
+        status = VFS_ERROR;     // out of memory, the others are still dirty
+
+    pthread_mutex_unlock(&cache_lock);
+
+    for(uint32_t r = 0; r < run_count; r++)
+        if(blk_submit(selected[run_start[r]]->device_id, &runs[r]) != VFS_OK)
+            runs[r].status = VFS_ERROR;
+
+    for(uint32_t r = 0; r < run_count; r++)
+        if(runs[r].queue != NULL)
+            blk_wait(&runs[r]);
+
+    pthread_mutex_lock(&cache_lock);
+    for(uint32_t r = 0; r < run_count; r++)
+    {
+        uint32_t end = (r + 1 < run_count) ? run_start[r + 1] : count;
+        for(uint32_t i = run_start[r]; i < end; i++)
+        {
+            selected[i]->flushing = false;
+
+            if(runs[r].status != VFS_OK)
+                mark_dirty(selected[i]);    // we'll try again later
+        }
+
+        if(runs[r].status != VFS_OK && status == VFS_OK)
+            status = runs[r].status;
+
+        free(runs[r].buffer);
+    }
+    evict_blocks(CACHE_MAX_BLOCKS);
+    pthread_mutex_unlock(&cache_lock);
+
+    pthread_mutex_unlock(&flush_lock);
+
+    free(runs);
+    free(run_start);
+    free(selected);
+
+    return status;
+}
+
+/*
+ * Gives back at least 'bytes' of sectors if possible: the clean ones are dropped first,
+ * then the oldest dirty ones are written back to be dropped as well.
+ */
+static size_t cache_shrink(size_t bytes)
+{
+    uint32_t wanted = (bytes + sizeof(cache_block_t) - 1) / sizeof(cache_block_t);
+
+    pthread_mutex_lock(&cache_lock);
+    uint32_t before = block_count;
+    evict_blocks((block_count > wanted) ? block_count - wanted : 0);
+    uint32_t freed = before - block_count;
+    uint32_t dirty = dirty_count;
+    pthread_mutex_unlock(&cache_lock);
+
+    if(freed < wanted && dirty > 0)
+    {
+        uint32_t missing = wanted - freed;
+        flush_blocks(-1, 0, (dirty > missing) ? dirty - missing : 0);
+
+        pthread_mutex_lock(&cache_lock);
+        before = block_count;
+        evict_blocks((block_count > missing) ? block_count - missing : 0);
+        freed += before - block_count;
+        pthread_mutex_unlock(&cache_lock);
+    }
+
+    return (size_t)freed * sizeof(cache_block_t);
+}
+
+static void run_writeback_hooks()
+{
+    pthread_mutex_lock(&hooks_lock);
+
+    for(int i = 0; i < CACHE_MAX_WRITEBACK_HOOKS; i++)
+        if(writeback_hooks[i].hook != NULL)
+            writeback_hooks[i].hook(writeback_hooks[i].arg);
+
+    pthread_mutex_unlock(&hooks_lock);
+}
+
+int cache_register_writeback(cache_writeback_t hook, void* arg)
+{
+    int ret = VFS_ERROR;
+
+    pthread_mutex_lock(&hooks_lock);
+    for(int i = 0; i < CACHE_MAX_WRITEBACK_HOOKS; i++)
+    {
+        if(writeback_hooks[i].hook == NULL)
+        {
+            writeback_hooks[i].hook = hook;
+            writeback_hooks[i].arg = arg;
+            ret = VFS_OK;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&hooks_lock);
+
+    return ret;
+}
+
+void cache_unregister_writeback(cache_writeback_t hook, void* arg)
+{
+    pthread_mutex_lock(&hooks_lock);
+    for(int i = 0; i < CACHE_MAX_WRITEBACK_HOOKS; i++)
+        if(writeback_hooks[i].hook == hook && writeback_hooks[i].arg == arg)
+            writeback_hooks[i].hook = NULL;
+    pthread_mutex_unlock(&hooks_lock);
+}
+
+/*
+ * The background flusher.
+ * It wakes up periodically (or when a writer notices too many dirty sectors) and writes
+ * back the expired sectors, and the oldest ones while the dirty ratio is too high.
+ */
+static void* flusher_thread(void* arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&cache_lock);
+    while(!flusher_stopping)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (CACHE_FLUSH_INTERVAL_MS % 1000) * 1000000;
+        deadline.tv_sec += CACHE_FLUSH_INTERVAL_MS / 1000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+
+        pthread_cond_timedwait(&flusher_wakeup, &cache_lock, &deadline);
+        if(flusher_stopping)
+            break;
+
+        pthread_mutex_unlock(&cache_lock);
+        run_writeback_hooks();
+        flush_blocks(-1, now_ms() - CACHE_DIRTY_EXPIRE_MS, CACHE_MAX_BLOCKS * CACHE_DIRTY_BACKGROUND_RATIO / 100);
+        membudget_balance();    // the sectors just written can be dropped
+        pthread_mutex_lock(&cache_lock);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return NULL;
+}
+
+/* Stops the flusher and writes everything back, so that no data is lost when the process exits */
+static void cache_shutdown()
+{
+    pthread_mutex_lock(&cache_lock);
+    flusher_stopping = true;
+    pthread_cond_signal(&flusher_wakeup);
+    pthread_mutex_unlock(&cache_lock);
+
+    pthread_join(flusher, NULL);
+    run_writeback_hooks();
+    cache_sync();
+}
+
+/* Must be called with cache_lock held */
+static void start_flusher()
+{
+    if(flusher_running)
+        return;
+
+    if(pthread_create(&flusher, NULL, flusher_thread, NULL) != 0)
+        return; // we'll simply rely on the writers and on cache_sync()
+
+    flusher_running = true;
+    atexit(cache_shutdown);
+}
+
+void cache_set_mode(cache_mode_t mode)
+{
+    if(mode == CACHE_WRITE_THROUGH)
+        cache_sync();   // there must be no dirty sector left in write-through mode
+
+    pthread_mutex_lock(&cache_lock);
+    cache_mode = mode;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Reads sectors through the cache.
+ * Runs of missing sectors are read from the device with a single call, then cached.
+ */
+int cache_read(int device_id, void* buffer, uint32_t lba, uint32_t count)
+{
+    device_t* device = device_list[device_id];
+    uint8_t* out = buffer;
+
+    if(device->read == NULL)
+        return VFS_ERROR;
+
+    pthread_mutex_lock(&cache_lock);
+
+    for(uint32_t i = 0; i < count; )
+    {
+        cache_block_t* block = find_block(device_id, lba + i);
+        if(block != NULL)
+        {
+            memcpy(out + i * CACHE_BLOCK_SIZE, block->data, CACHE_BLOCK_SIZE);
+            lru_touch(block);
+            i++;
+            continue;
+        }
+
+        uint32_t missing = 1;
+        while(i + missing < count && find_block(device_id, lba + i + missing) == NULL)
+            missing++;
+
+        pthread_mutex_unlock(&cache_lock);
+        int status = blk_read(device_id, out + i * CACHE_BLOCK_SIZE, lba + i, missing);
+        pthread_mutex_lock(&cache_lock);
+
+        if(status != VFS_OK)
+        {
+            pthread_mutex_unlock(&cache_lock);
+            return status;
+        }
+
+        for(uint32_t j = i; j < i + missing; j++)
+        {
+            // someone may have written this sector while we were reading the device
+            block = find_block(device_id, lba + j);
+            if(block != NULL)
+                memcpy(out + j * CACHE_BLOCK_SIZE, block->data, CACHE_BLOCK_SIZE);
+            else
+                insert_block(device_id, lba + j, out + j * CACHE_BLOCK_SIZE);
+        }
+
+        i += missing;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    membudget_balance();
+
+    return VFS_OK;
+}
+
+/*
+ * Copies the sectors into the cache, must be called with cache_lock held.
+ * A dirty sector that can't be cached is written through right away (it isn't cached,
+ * so no flush of an older copy can be in flight), returns the status of these writes.
+ */
+static int update_blocks(int device_id, const uint8_t* in, uint32_t lba, uint32_t count, bool dirty)
+{
+    int status = VFS_OK;
+
+    for(uint32_t i = 0; i < count; i++)
+    {
+        cache_block_t* block = find_block(device_id, lba + i);
+
+        if(block == NULL)
+            block = insert_block(device_id, lba + i, in + i * CACHE_BLOCK_SIZE);
+        else
+        {
+            memcpy(block->data, in + i * CACHE_BLOCK_SIZE, CACHE_BLOCK_SIZE);
+            lru_touch(block);
+        }
+
+        if(block != NULL && dirty)
+            mark_dirty(block);
+        else if(block == NULL && dirty && blk_write(device_id, in + i * CACHE_BLOCK_SIZE, lba + i, 1) != VFS_OK)
+            status = VFS_ERROR;
+    }
+
+    return status;
+}
+
+int cache_write(int device_id, const void* buffer, uint32_t lba, uint32_t count)
+{
+    device_t* device = device_list[device_id];
+
+    if(device->write == NULL)
+        return VFS_ERROR;
+
+    pthread_mutex_lock(&cache_lock);
+
+    if(cache_mode == CACHE_WRITE_THROUGH)
+    {
+        pthread_mutex_unlock(&cache_lock);
+
+        pthread_mutex_lock(&flush_lock);
+        pthread_mutex_lock(&cache_lock);
+        update_blocks(device_id, buffer, lba, count, false);
+        pthread_mutex_unlock(&cache_lock);
+
+        int status = blk_write(device_id, buffer, lba, count);
+        pthread_mutex_unlock(&flush_lock);
+        membudget_balance();
+
+        return status;
+    }
+
+    // throttle the writers if the flusher can't keep up
+    if(dirty_count + count > CACHE_MAX_BLOCKS * CACHE_DIRTY_RATIO / 100)
+    {
+        pthread_mutex_unlock(&cache_lock);
+        flush_blocks(-1, 0, CACHE_MAX_BLOCKS * CACHE_DIRTY_BACKGROUND_RATIO / 100);
+        pthread_mutex_lock(&cache_lock);
+    }
+
+    int status = update_blocks(device_id, buffer, lba, count, true);
+    start_flusher();
+
+    if(dirty_count > CACHE_MAX_BLOCKS * CACHE_DIRTY_BACKGROUND_RATIO / 100)
+        pthread_cond_signal(&flusher_wakeup);
+
+    pthread_mutex_unlock(&cache_lock);
+    membudget_balance();
+
+    return status;
+}
+
+int cache_sync_device(int device_id)
+{
+    int status = flush_blocks(device_id, 0, 0);
+    device_flush(device_id);
+    return status;
+}
+
+int cache_sync()
+{
+    int status = flush_blocks(-1, 0, 0);
+
+    for(int i = 0; i < device_num; i++)
+        device_flush(i);
+
+    return status;
+}
@@ -0,0 +1,64 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#define CACHE_BLOCK_SIZE 512    // the cache works with sectors
+
+/*
+ * Block Cache
+ *
+ * Every disk-backed file system reads and writes its sectors through this cache instead of
+ * calling the device callbacks directly.
+ *
+ * In write-through mode a write reaches the device before cache_write() returns.
+ * In write-back mode the sectors are only marked dirty: a background flusher thread writes them
+ * once they're old enough or once too much of the cache is dirty, and contiguous dirty sectors
+ * are coalesced into a single device write. cache_sync() and cache_sync_device() are the durability points.
+*/
+typedef enum
+{
+    CACHE_WRITE_THROUGH,
+    CACHE_WRITE_BACK
+} cache_mode_t;
+
+void cache_set_mode(cache_mode_t mode);
+
+int cache_read(int device_id, void* buffer, uint32_t lba, uint32_t count);
+int cache_write(int device_id, const void* buffer, uint32_t lba, uint32_t count);
+
+int cache_sync_device(int device_id);
+int cache_sync();
+
+/*
+ * Write-back hooks let a file system push the metadata it keeps dirty on its side
+ * (like FAT sectors) into the cache. They're called by the flusher on each of its rounds,
+ * and once more before the final flush when the process exits.
+ */
+typedef void (*cache_writeback_t)(void* arg);
+
+int cache_register_writeback(cache_writeback_t hook, void* arg);
+void cache_unregister_writeback(cache_writeback_t hook, void* arg);
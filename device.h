@@ -40,9 +40,10 @@ typedef struct device
 	char name[MAX_NAME_LENGTH];
 	uint32_t id;	// unique id
 
-	// functions to interact with the device
-	void (*read)(uint8_t* buffer, uint32_t offset , uint32_t len, void* dev);
-	void (*write)(const uint8_t *buffer, uint32_t offset, uint32_t len, void* dev);
+	// functions to interact with the device, they return 0 on success
+	int (*read)(uint8_t* buffer, uint32_t offset , uint32_t len, void* dev);
+	int (*write)(const uint8_t *buffer, uint32_t offset, uint32_t len, void* dev);
+	void (*flush)(void* dev);	// make the previous writes durable, may be NULL
 
 	void *priv;	// private data of the device ...
 } device_t;
@@ -28,6 +28,7 @@
 #include <string.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include "disk.h"
@@ -35,10 +36,215 @@
 
 #define BYTE_PER_SECTOR 512
 
+/* the pool of open images, most recently used first */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static disk_info_t* lru_head = NULL;
+static disk_info_t* lru_tail = NULL;
+static int open_count = 0;
+static int max_open = DISK_DEFAULT_MAX_OPEN;
+
 bool has_img_extension(const char* str)
 {
     char* ext = strchr(str, '.');
-    return (strcmp(ext, ".img") == 0) ? true : false;
+    return (ext != NULL && strcmp(ext, ".img") == 0) ? true : false;
+}
+
+bool has_simg_extension(const char* str)
+{
+    char* ext = strchr(str, '.');
+    return (ext != NULL && strcmp(ext, ".simg") == 0) ? true : false;
+}
+
+/*
+ * Sets how many images can be open at the same time.
+ * The pool may briefly go above it when all the open images are busy.
+ */
+void disk_set_max_open(int max)
+{
+    pthread_mutex_lock(&pool_lock);
+    max_open = (max > 0) ? max : 1;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// pool_lock must be held for these two
+static void lru_unlink(disk_info_t* disk)
+{
+    if(disk->lru_prev != NULL)
+        disk->lru_prev->lru_next = disk->lru_next;
+    else
+        lru_head = disk->lru_next;
+
+    if(disk->lru_next != NULL)
+        disk->lru_next->lru_prev = disk->lru_prev;
+    else
+        lru_tail = disk->lru_prev;
+
+    disk->lru_prev = disk->lru_next = NULL;
+}
+
+static void lru_push_front(disk_info_t* disk)
+{
+    disk->lru_prev = NULL;
+    disk->lru_next = lru_head;
+
+    if(lru_head != NULL)
+        lru_head->lru_prev = disk;
+    else
+        lru_tail = disk;
+
+    lru_head = disk;
+}
+
+// a suspended sparse image keeps its state but not its file, pool_lock must be held
+static bool disk_is_open(disk_info_t* disk)
+{
+    if(disk->sparse)
+        return disk->image != NULL && !simg_is_suspended(disk->image);
+
+    return disk->stream != NULL;
+}
+
+/*
+ * Closes the least recently used image nobody is using, if any.
+ * pool_lock must be held
+ */
+static void evict_one()
+{
+    for(disk_info_t* victim = lru_tail; victim != NULL; victim = victim->lru_prev)
+    {
+        if(victim->users != 0)
+            continue;
+
+        if(victim->sparse)
+        {
+            if(simg_suspend(victim->image) != 0)
+                continue;   // its written blocks must reach the file first
+        }
+        else
+        {
+            fclose(victim->stream);     // flushes what's still buffered
+            victim->stream = NULL;
+        }
+
+        lru_unlink(victim);
+        open_count--;
+        return;
+    }
+}
+
+/*
+ * Makes sure the image is open and marks it busy so that it stays open until disk_release().
+ * Returns false if the image can't be opened.
+ *
+ * The image is opened without the pool lock, the other disks don't wait for it. If another thread
+ * opened it meanwhile, its copy is used and ours is closed. A suspended sparse image only gets
+ * its file back, its index was kept.
+ */
+static bool disk_acquire(disk_info_t* disk)
+{
+    pthread_mutex_lock(&pool_lock);
+
+    if(disk_is_open(disk))
+    {
+        lru_unlink(disk);
+        lru_push_front(disk);
+
+        disk->users++;
+        pthread_mutex_unlock(&pool_lock);
+        return true;
+    }
+
+    bool suspended = (disk->image != NULL);
+    pthread_mutex_unlock(&pool_lock);
+
+    simg_info_t* image = NULL;
+    FILE* stream = NULL;
+    uint32_t total_sectors = 0;
+
+    if(disk->sparse && !suspended)
+    {
+        image = simg_open(disk->path);
+        if(image == NULL)
+        {
+            fprintf(stderr, "%s is not a valid sparse image\n", disk->path);
+            return false;
+        }
+
+        total_sectors = image->totalSectors;
+    }
+    else if(disk->sparse)
+    {
+        if((stream = fopen(disk->path, "rb+")) == NULL)
+        {
+            perror(disk->path);
+            return false;
+        }
+    }
+    else
+    {
+        struct stat metainfo;
+        if(stat(disk->path, &metainfo) != 0 || (stream = fopen(disk->path, "rb+")) == NULL)
+        {
+            perror(disk->path);
+            return false;
+        }
+
+        total_sectors = metainfo.st_size / BYTE_PER_SECTOR;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+
+    bool opened = disk_is_open(disk);
+    if(!opened && open_count >= max_open)
+        evict_one();
+
+    if(opened)
+        lru_unlink(disk);
+    else if(!disk->sparse)
+    {
+        disk->stream = stream;
+        disk->totalSectors = total_sectors;
+        stream = NULL;
+    }
+    else if(disk->image == NULL && image != NULL)
+    {
+        disk->image = image;
+        disk->totalSectors = total_sectors;
+        image = NULL;
+    }
+    else if(disk->image != NULL && stream != NULL)
+    {
+        simg_resume(disk->image, stream);
+        stream = NULL;
+    }
+    else
+    {
+        // opened and suspended again meanwhile, what we have doesn't fit anymore
+        pthread_mutex_unlock(&pool_lock);
+        simg_close(image);
+        return disk_acquire(disk);
+    }
+
+    if(!opened)
+        open_count++;
+
+    lru_push_front(disk);
+    disk->users++;
+    pthread_mutex_unlock(&pool_lock);
+
+    // we lost the race, nothing was done with our copy
+    if(stream != NULL)
+        fclose(stream);
+    simg_close(image);
+
+    return true;
+}
+
+static void disk_release(disk_info_t* disk)
+{
+    pthread_mutex_lock(&pool_lock);
+    disk->users--;
+    pthread_mutex_unlock(&pool_lock);
 }
 
 /**
@@ -49,112 +255,224 @@ bool has_img_extension(const char* str)
  * @param sector_num  Number of sectors to write.
  * @param priv        Pointer to the disk structure (cast from void*). This provides access to
  *                    the specific disk instance to operate on.
+ * @return            0 on success, -1 if the sectors are out of the disk or the I/O failed.
  *
  * Note:
  * The `priv` pointer is expected to reference a valid `disk` structure. While it's possible
  * to pass a device ID and resolve the disk through the device list, this design choice 
  * simplifies callback-based access by passing the disk reference directly.
  */
-void writeSectors(const uint8_t* buffer, uint32_t lba, uint32_t sector_num, void* priv)
+int writeSectors(const uint8_t* buffer, uint32_t lba, uint32_t sector_num, void* priv)
 {
     if(priv == NULL)
-        return;
+        return -1;
 
     disk_info_t* disk = (disk_info_t*)priv;
 
-    if(lba > disk->totalSectors || (lba + sector_num) > disk->totalSectors)
-        return;
+    if(!disk_acquire(disk))
+        return -1;
+
+    int status = -1;
 
-    fseek(disk->stream, lba * BYTE_PER_SECTOR, SEEK_SET);
+    if(disk->sparse)
+        status = simg_write_sectors(buffer, lba, sector_num, disk->image);
+    else if(lba <= disk->totalSectors && (lba + sector_num) <= disk->totalSectors)
+    {
+        pthread_mutex_lock(&disk->io_lock);
+        if(fseeko(disk->stream, (off_t)lba * BYTE_PER_SECTOR, SEEK_SET) == 0 &&
+            fwrite(buffer, sizeof(uint8_t), BYTE_PER_SECTOR * sector_num, disk->stream) == BYTE_PER_SECTOR * sector_num)
+            status = 0;
+        pthread_mutex_unlock(&disk->io_lock);
+    }
 
-    fwrite(buffer, sizeof(uint8_t), BYTE_PER_SECTOR * sector_num, disk->stream);
+    disk_release(disk);
+    return status;
 }
 
-void readSectors(uint8_t* buffer, uint32_t lba, uint32_t sector_num, void* priv)
+void flushDisk(void* priv)
 {
     if(priv == NULL)
         return;
 
     disk_info_t* disk = (disk_info_t*)priv;
 
-    if(lba > disk->totalSectors || (lba + sector_num) > disk->totalSectors)
+    // nothing to flush if the image isn't open (a suspended image was flushed)
+    pthread_mutex_lock(&pool_lock);
+    bool open = disk_is_open(disk);
+    if(open)
+        disk->users++;
+    pthread_mutex_unlock(&pool_lock);
+
+    if(!open)
         return;
 
-    fseek(disk->stream, lba * BYTE_PER_SECTOR, SEEK_SET);
+    if(disk->sparse)
+        simg_flush(disk->image);
+    else
+    {
+        pthread_mutex_lock(&disk->io_lock);
+        fflush(disk->stream);
+        pthread_mutex_unlock(&disk->io_lock);
+    }
 
-    fread(buffer, sizeof(uint8_t), BYTE_PER_SECTOR * sector_num, disk->stream);
+    disk_release(disk);
+}
+
+int readSectors(uint8_t* buffer, uint32_t lba, uint32_t sector_num, void* priv)
+{
+    if(priv == NULL)
+        return -1;
+
+    disk_info_t* disk = (disk_info_t*)priv;
+
+    if(!disk_acquire(disk))
+        return -1;
+
+    int status = -1;
+
+    if(disk->sparse)
+        status = simg_read_sectors(buffer, lba, sector_num, disk->image);
+    else if(lba <= disk->totalSectors && (lba + sector_num) <= disk->totalSectors)
+    {
+        pthread_mutex_lock(&disk->io_lock);
+        if(fseeko(disk->stream, (off_t)lba * BYTE_PER_SECTOR, SEEK_SET) == 0 &&
+            fread(buffer, sizeof(uint8_t), BYTE_PER_SECTOR * sector_num, disk->stream) == BYTE_PER_SECTOR * sector_num)
+            status = 0;
+        pthread_mutex_unlock(&disk->io_lock);
+    }
+
+    disk_release(disk);
+    return status;
 }
 
 /**
- * Initializes all available virtual disks.
+ * Registers a disk image as a new device, without opening it.
  *
- * This function scans the "disks" directory for all files with the `.img` extension.
- * Each `.img` file found is treated as a potential disk image. For each valid image,
- * a corresponding disk structure is created and added to the device list.
+ * @param path  the path of a raw (.img) or sparse (.simg) image.
+ * @return      0 on success, -1 if the device can't be created.
+ */
+int disk_register(const char* path)
+{
+    disk_info_t* disk = calloc(1, sizeof(disk_info_t));
+    device_t* new_device = malloc(sizeof(device_t));
+    char* path_copy = strdup(path);
+
+    if(disk == NULL || new_device == NULL || path_copy == NULL)
+    {
+        perror("error while creating a device");
+        free(disk);
+        free(new_device);
+        free(path_copy);
+        return -1;
+    }
+
+    disk->path = path_copy;
+    disk->sparse = has_simg_extension(path);
+    pthread_mutex_init(&disk->io_lock, NULL);
+
+    // the device is named after the file
+    const char* name = strrchr(path, '/');
+    name = (name != NULL) ? name + 1 : path;
+
+    new_device->priv = disk;    // yeah we store the disk structure here !
+    snprintf(new_device->name, MAX_NAME_LENGTH, "%s", name);
+    new_device->read = readSectors;
+    new_device->write = writeSectors;
+    new_device->flush = flushDisk;
+
+    add_device(new_device);
+    return 0;
+}
+
+/**
+ * Registers every image (.img or .simg) found in a directory.
  *
- * This setup simulates a simple virtual device discovery mechanism, useful for 
- * emulating hardware-like behavior in an OS development environment.
+ * @return  the number of images registered, -1 if the directory can't be read.
  */
-void disk_init()
+int disk_scan(const char* directory_path)
 {
-    DIR* directory = NULL;
+    DIR* directory = opendir(directory_path);
     struct dirent* info = NULL;
-    struct stat metainfo;
-    
+    int count = 0;
 
-    directory = opendir("disks");
     if(directory == NULL)
     {
-        perror("error while opening the disks directory");
-        exit(1);
+        perror(directory_path);
+        return -1;
     }
 
     while((info = readdir(directory)) != NULL)
     {
-        if(info->d_type != DT_REG || !has_img_extension(info->d_name))
-            continue;   // nothing to do it's not a .img file
-        
-        
-        // a .img file was found !
-        disk_info_t* disk = malloc(sizeof(disk_info_t));
-        
-        if(disk == NULL)
-        {
-            perror("error while creating disk");
-            exit(1);
-        }
+        if(info->d_type != DT_REG || (!has_img_extension(info->d_name) && !has_simg_extension(info->d_name)))
+            continue;   // nothing to do it's not a disk image
 
-        // because stat needs the full relative path
-        char path[64] = "disks/";
-        strcat(path, info->d_name);
+        // because we need the full relative path
+        char* path = malloc(strlen(directory_path) + strlen(info->d_name) + 2);
+        if(path == NULL)
+            break;
 
-        stat(path, &metainfo);
+        sprintf(path, "%s/%s", directory_path, info->d_name);
 
-        disk->totalSectors = metainfo.st_size / BYTE_PER_SECTOR;
-        disk->stream = fopen(path, "rb+");  // now our data stream
+        if(disk_register(path) == 0)
+            count++;
 
-        if(disk->stream == NULL)
-        {
-            perror("error while reading disk\n");
-            free(disk);
-            exit(1);
-        }
+        free(path);
+    }
 
-        device_t* new_device = malloc(sizeof(device_t));
-        if(new_device == NULL)
-        {
-            perror("error while creating a device\n");
-            free(disk);
-            exit(1);
-        }
+    closedir(directory);
+    return count;
+}
+
+/**
+ * Registers the images listed in a manifest, one path per line.
+ * Empty lines and lines starting with '#' are ignored.
+ *
+ * @return  the number of images registered, -1 if the manifest can't be read.
+ */
+int disk_load_manifest(const char* manifest)
+{
+    FILE* file = fopen(manifest, "r");
+    if(file == NULL)
+        return -1;
 
-        new_device->priv = disk;    // yeah we store the disk structure here !
-        strcpy(new_device->name, info->d_name);
-        new_device->read = readSectors;
-        new_device->write = writeSectors;
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int count = 0;
 
-        add_device(new_device);
+    while((length = getline(&line, &capacity, file)) != -1)
+    {
+        while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r' || line[length - 1] == ' '))
+            line[--length] = '\0';
+
+        if(length == 0 || line[0] == '#')
+            continue;
+
+        if(disk_register(line) == 0)
+            count++;
     }
 
-    closedir(directory);
-}
\ No newline at end of file
+    free(line);
+    fclose(file);
+    return count;
+}
+
+/**
+ * Initializes all available virtual disks.
+ *
+ * This function scans the "disks" directory for all files with the `.img` extension.
+ * Each `.img` file found is treated as a potential disk image. For each valid image,
+ * a corresponding disk structure is created and added to the device list.
+ * Files with the `.simg` extension are sparse images (see simg.h), they become devices too.
+ *
+ * If a manifest (disks/manifest) exists, the images it lists are registered instead.
+ * Either way nothing is opened here, a broken image only fails its own I/Os.
+ *
+ * This setup simulates a simple virtual device discovery mechanism, useful for 
+ * emulating hardware-like behavior in an OS development environment.
+ */
+void disk_init()
+{
+    if(disk_load_manifest(DISK_MANIFEST) < 0)
+        disk_scan("disks");
+}
@@ -26,7 +26,13 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
 
+#include "simg.h"
+
+#define DISK_DEFAULT_MAX_OPEN   32      // host files kept open at the same time
+#define DISK_MANIFEST           "disks/manifest"
 
 /*
  * Disk Structure  
@@ -34,11 +40,29 @@
  * This structure represents a disk in this case, a virtual disk. 
  * It doesn’t have many members, but it gets the job done. 
  * The stream member, in particular, acts as a kind of raw data buffer for the disk
+ *
+ * A disk is registered with its path only, the image is opened on the first I/O.
+ * The images share a pool of open files: when it's full the least recently used
+ * image that isn't busy gets closed, it'll be reopened on its next access.
+ * A sparse image is only suspended (see simg.h): its file is closed once flushed,
+ * but its state in 'image' stays, the index isn't read again.
 */
 typedef struct disk_info
 {
-    uint32_t totalSectors;
-    FILE* stream;
+    char* path;
+    bool sparse;
+    uint32_t totalSectors;      // known once the image was opened
+    FILE* stream;               // NULL when the raw image isn't in the pool
+    simg_info_t* image;         // sparse images only
+
+    pthread_mutex_t io_lock;    // the stream position is shared
+    int users;                  // I/O in progress, can't be closed meanwhile
+    struct disk_info* lru_prev;
+    struct disk_info* lru_next;
 }disk_info_t;
 
-void disk_init();
\ No newline at end of file
+void disk_init();
+int disk_register(const char* path);
+int disk_scan(const char* directory);
+int disk_load_manifest(const char* manifest);
+void disk_set_max_open(int max);
\ No newline at end of file
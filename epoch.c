@@ -0,0 +1,222 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "epoch.h"
+#include "pool.h"
+
+#define EPOCH_IDLE              0       // the thread isn't in a section
+#define EPOCH_RECLAIM_THRESHOLD 32      // retired objects kept by a thread before trying to free them
+
+/*
+ * How it works: the global epoch only moves forward once every thread inside a section has seen
+ * its current value. An object retired during epoch E can't be reached by a reader entering
+ * during E + 1 (it was unlinked before), so once the global epoch reaches E + 2 every reader
+ * that could have seen it is gone.
+ */
+
+typedef struct epoch_retired
+{
+    void* ptr;
+    void (*destroy)(void*);
+    uint64_t epoch;
+    struct epoch_retired* next;
+} epoch_retired_t;
+
+/* One per thread, they're never freed but reused by the next threads */
+typedef struct epoch_record
+{
+    _Atomic uint64_t epoch;     // global epoch seen when entering, EPOCH_IDLE outside
+    atomic_bool in_use;
+    int nesting;
+
+    epoch_retired_t* retired;   // waiting for the global epoch to move
+    int retired_count;
+
+    struct epoch_record* next;
+} epoch_record_t;
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(epoch_record_t*) records = NULL;
+
+static __thread epoch_record_t* self = NULL;
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+
+static objpool_t* retired_pool;     // the epoch_retired_t, retiring shouldn't hit the heap
+
+// a thread exits, its record (and what it retired) goes to the next thread
+static void release_record(void* arg)
+{
+    epoch_record_t* record = arg;
+
+    record->nesting = 0;
+    atomic_store(&record->epoch, EPOCH_IDLE);
+    atomic_store(&record->in_use, false);
+}
+
+static void create_record_key(void)
+{
+    pthread_key_create(&record_key, release_record);
+    retired_pool = objpool_create("epoch retired", sizeof(epoch_retired_t));
+}
+
+static epoch_record_t* get_record(void)
+{
+    if(self != NULL)
+        return self;
+
+    pthread_once(&record_key_once, create_record_key);
+
+    for(epoch_record_t* record = atomic_load(&records); record != NULL; record = record->next)
+    {
+        bool free_record = false;
+        if(atomic_compare_exchange_strong(&record->in_use, &free_record, true))
+        {
+            self = record;
+            break;
+        }
+    }
+
+    if(self == NULL)
+    {
+        epoch_record_t* record = calloc(1, sizeof(epoch_record_t));
+        if(record == NULL)
+            abort();    // nothing sensible to do, a reader can't fail
+
+        atomic_init(&record->epoch, EPOCH_IDLE);
+        atomic_init(&record->in_use, true);
+
+        record->next = atomic_load(&records);
+        while(!atomic_compare_exchange_weak(&records, &record->next, record))
+            ;
+
+        self = record;
+    }
+
+    pthread_setspecific(record_key, self);
+    return self;
+}
+
+void epoch_enter()
+{
+    epoch_record_t* record = get_record();
+
+    if(record->nesting++ > 0)
+        return;
+
+    atomic_store(&record->epoch, atomic_load(&global_epoch));
+
+    // what the reader loads from now on can't be older than its epoch
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit()
+{
+    epoch_record_t* record = get_record();
+
+    if(--record->nesting == 0)
+        atomic_store_explicit(&record->epoch, EPOCH_IDLE, memory_order_release);
+}
+
+/* Moves the global epoch forward if every reader has seen it, returns the global epoch */
+static uint64_t try_advance(void)
+{
+    uint64_t epoch = atomic_load(&global_epoch);
+
+    for(epoch_record_t* record = atomic_load(&records); record != NULL; record = record->next)
+    {
+        uint64_t seen = atomic_load(&record->epoch);
+        if(seen != EPOCH_IDLE && seen != epoch)
+            return epoch;   // a reader is still in the previous epoch
+    }
+
+    if(atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1))
+        return epoch + 1;
+
+    return epoch;   // someone else moved it
+}
+
+static void reclaim(epoch_record_t* record)
+{
+    uint64_t epoch = try_advance();
+    epoch_retired_t** link = &record->retired;
+
+    while(*link != NULL)
+    {
+        epoch_retired_t* retired = *link;
+
+        if(retired->epoch + 2 > epoch)
+        {
+            link = &retired->next;
+            continue;
+        }
+
+        *link = retired->next;
+        retired->destroy(retired->ptr);
+        objpool_free(retired);
+        record->retired_count--;
+    }
+}
+
+/*
+ * Frees 'ptr' with 'destroy' once no reader can reach it anymore.
+ * It must already be unlinked from everything the readers walk.
+ */
+void epoch_retire(void* ptr, void (*destroy)(void*))
+{
+    epoch_record_t* record = get_record();
+    epoch_retired_t* retired = objpool_alloc(retired_pool);
+
+    if(retired == NULL)
+        return;     // we can't keep track of it, leaking it is safer than freeing it under a reader
+
+    retired->ptr = ptr;
+    retired->destroy = destroy;
+    retired->epoch = atomic_load(&global_epoch);
+    retired->next = record->retired;
+    record->retired = retired;
+
+    if(++record->retired_count >= EPOCH_RECLAIM_THRESHOLD)
+        reclaim(record);
+}
+
+/*
+ * Waits until every reader that was in a section when this was called has left it.
+ */
+void epoch_synchronize()
+{
+    uint64_t target = atomic_load(&global_epoch) + 2;
+
+    while(try_advance() < target)
+        sched_yield();
+
+    reclaim(get_record());
+}
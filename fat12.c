@@ -27,11 +27,56 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
 #include "vfs.h"
 #include "device.h"
+#include "cache.h"
+#include "epoch.h"
+#include "pagecache.h"
+#include "membudget.h"
+#include "fat12.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT_SCAN_AVX2   1   // built whatever the compiler flags, used if the CPU has it
+#endif
 
 #define MAX_VNODE_PER_VFS   16
 
+#define BITMAP_SET(bitmap, bit)     ((bitmap)[(bit) / 8] |= (1 << ((bit) % 8)))
+#define BITMAP_CLEAR(bitmap, bit)   ((bitmap)[(bit) / 8] &= ~(1 << ((bit) % 8)))
+#define BITMAP_TEST(bitmap, bit)    (((bitmap)[(bit) / 8] >> ((bit) % 8)) & 1)
+
+typedef struct fat_extBS_16
+{
+    //extended fat12 and fat16 stuff
+    uint8_t bios_drive_num;
+    uint8_t reserved1;
+    uint8_t boot_signature;
+    uint32_t volume_id;
+    uint8_t volume_label[11];
+    uint8_t fat_type_label[8];
+}__attribute__((packed)) fat_extBS_16_t;
+
+typedef struct fat_extBS_32
+{
+    //extended fat32 stuff
+    uint32_t table_size_32;
+    uint16_t extended_flags;
+    uint16_t fat_version;
+    uint32_t root_cluster;
+    uint16_t fat_info;
+    uint16_t backup_BS_sector;
+    uint8_t reserved_0[12];
+    uint8_t drive_number;
+    uint8_t reserved_1;
+    uint8_t boot_signature;
+    uint32_t volume_id;
+    uint8_t volume_label[11];
+    uint8_t fat_type_label[8];
+}__attribute__((packed)) fat_extBS_32_t;
+
 typedef struct fat_BS
 {
     uint8_t bootjmp[3];
@@ -49,18 +94,39 @@ typedef struct fat_BS
     uint32_t hidden_sector_count;
     uint32_t total_sectors_32;
 
-    //extended fat12 and fat16 stuff
-    uint8_t bios_drive_num;
-    uint8_t reserved1;
-    uint8_t boot_signature;
-    uint32_t volume_id;
-    uint8_t volume_label[11];
-    uint8_t fat_type_label[8];
-
-    uint8_t Filler[448];            //needed to make struct 512 bytes
+    // the layout of the rest depends on the FAT type
+    union
+    {
+        fat_extBS_16_t ext16;
+        fat_extBS_32_t ext32;
+        uint8_t Filler[476];        //needed to make struct 512 bytes
+    };
 
 }__attribute__((packed)) fat_BS_t;
 
+/* The FAT32 FSInfo sector, it mostly gives us a hint about where to find free clusters */
+typedef struct fat_fsinfo
+{
+    uint32_t lead_signature;        // 0x41615252
+    uint8_t reserved0[480];
+    uint32_t struct_signature;      // 0x61417272
+    uint32_t free_count;            // last known free cluster count, 0xFFFFFFFF if unknown
+    uint32_t next_free;             // where to start looking for a free cluster, 0xFFFFFFFF if unknown
+    uint8_t reserved1[12];
+    uint32_t trail_signature;       // 0xAA550000
+}__attribute__((packed)) fat_fsinfo_t;
+
+#define FSINFO_LEAD_SIGNATURE   0x41615252
+#define FSINFO_STRUCT_SIGNATURE 0x61417272
+#define FSINFO_UNKNOWN          0xFFFFFFFF
+
+typedef enum
+{
+    FAT_TYPE_12,
+    FAT_TYPE_16,
+    FAT_TYPE_32
+} fat_type_t;
+
 typedef enum
 {
     FAT_ATTR_REGULAR    = 0x00, // Regular file with no special attribute
@@ -73,6 +139,10 @@ typedef enum
     FAT_ATTR_LFN        = 0x0F  // Long file name entry (special combination)
 } fat_attributes_t;
 
+#define FAT_ENTRY_END       0x00    // first byte of the entry ending a directory
+#define FAT_ENTRY_DELETED   0xE5    // first byte of a deleted entry
+#define FAT_ENTRY_KANJI_E5  0x05    // a name really starting with 0xE5 is stored with this
+
 typedef struct fat_dir_entry
 {
     char filename[11];            // File name (8 characters) and File extension (3 characters)
@@ -89,29 +159,128 @@ typedef struct fat_dir_entry
     uint32_t fileSize;           // File size in bytes
 } __attribute__((packed)) fat_dir_entry_t;
 
+/*
+ * What we store in a vnode: a copy of the directory entry, and where it lives
+ * on the disk so that we can write it back when the file changes.
+ */
+typedef struct fat_inode
+{
+    fat_dir_entry_t entry;
+    uint32_t entry_lba;         // sector holding the directory entry
+    uint16_t entry_offset;      // offset of the entry inside that sector
+} fat_inode_t;
+
 /* Important information for the file system ! */
 typedef struct fat12_info
 {
     vnode_t* total_vnode[MAX_VNODE_PER_VFS];
     vnode_t* root_vnode;
     fat_BS_t *bootSector;
-    void* file_allocation_table;
+    void* file_allocation_table;    // NULL when the FAT is paged in lazily
     void* fat_buffer;
+    int device_id;
+
+    /* Geometry computed once at mount time, it depends on the FAT type */
+    fat_type_t fat_type;
+    uint32_t fat_size;              // sectors per FAT
+    uint32_t root_dir_sectors;      // size of the fixed root directory (0 on FAT32)
+    uint32_t first_root_dir_sector; // only meaningful on FAT12/16
+    uint32_t first_data_sector;
+    uint32_t total_clusters;
+    uint32_t cluster_size;          // in bytes
+    uint32_t root_cluster;          // first cluster of the root directory (FAT32 only)
+    uint32_t end_of_chain;          // any cluster value above or equal to this one ends a chain
+
+    /* Free cluster hint coming from the FSInfo sector (FAT32), allocation starts searching from here */
+    uint32_t next_free_cluster;
+    uint32_t free_cluster_count;
+
+    /*
+     * Taken for writing by the calls changing the volume (they share 'fat_buffer' and change the
+     * inodes), for reading by the others, which can do their I/O side by side: they use their own
+     * buffers. Taken before 'fat_lock', which the cache flusher also takes on its own.
+     */
+    pthread_rwlock_t volume_lock;
+    pthread_mutex_t vnode_lock;     // the vnode table, a lookup only holds volume_lock for reading
+
+    /*
+     * The in-memory FAT is only written back at sync time (or by the cache flusher).
+     * One bit per FAT sector tells which ones changed since, 'mirror_dirty' tracks the
+     * sectors already written to the first FAT but not yet to its mirrors (lazy mode).
+     */
+    pthread_mutex_t fat_lock;
+    uint8_t* fat_dirty;
+    uint8_t* mirror_dirty;
+    bool lazy_mirrors;
+
+    /*
+     * In lazy FAT mode the table isn't loaded at mount, its sectors are read through the block
+     * cache when needed (so they can be evicted like any other sector). The last sector used is
+     * kept in 'fat_window', as FAT accesses tend to stay in the same area. Protected by 'fat_lock'.
+     */
+    uint8_t* fat_window;
+    uint32_t fat_window_sector;
+
+    /* The mounted volumes are listed for the defragmenter */
+    vfs_t* mountpoint;
+    struct fat12_info* next_volume;
+
+    size_t memory;                  // what the mount allocated, reported to the memory budget
 }fs_info_t;
 
+#define FAT_NO_WINDOW   0xFFFFFFFF
+
+static bool lazy_mirrors_enabled = false;
+static bool lazy_fat_enabled = false;
+
+/* The FAT of a mounted volume (unless it's lazy) and its buffers, they can't be given back */
+static membudget_account_t fat_account = { .name = "fat", .priority = 2 };
+
 int fat12_mount(vfs_t* mountpoint, int device_id);
 int fat12_unmount(vfs_t* mountpoint);
 int fat12_get_root(vfs_t* mountpoint, vnode_t** result);
+int fat12_sync(vfs_t* mountpoint);
+int fat12_warmup(vfs_t* mountpoint);
 
-int fat12_read(vnode_t* node, void *buffer, size_t size, uint32_t offset);
-int fat12_write(vnode_t* node, const void *buffer, size_t size, uint32_t offset);
+ssize_t fat12_read(vnode_t* node, void *buffer, size_t size, uint64_t offset);
+ssize_t fat12_write(vnode_t* node, const void *buffer, size_t size, uint64_t offset);
+int fat12_allocate(vnode_t* node, uint64_t offset, uint64_t length);
 int fat12_lookup(vnode_t* node, const char* name, struct vnode** result);
+int fat12_getattr(vnode_t* node, vfs_stat_t* stat);
+
+static void fat_flush_table(vfs_t* mountpoint, bool mirrors_now);
+static int fat_sync_volume(vfs_t* mountpoint);
+static void fat_writeback(void* arg);
+static void fat_register_volume(vfs_t* mountpoint);
+static void fat_unregister_volume(vfs_t* mountpoint);
 
+/*
+ * FAT12, FAT16 and FAT32 share the same driver: the FAT type is detected from the boot sector
+ * at mount time, whatever name was used to mount the device.
+ */
 filesystem_t fat12_op = {
     // fs_name will be filled later
     .get_root = fat12_get_root,
     .vfs_mount = fat12_mount,
     .vfs_unmount = fat12_unmount,
+    .vfs_sync = fat12_sync,
+    .vfs_warmup = fat12_warmup,
+};
+
+filesystem_t fat16_op = {
+    .get_root = fat12_get_root,
+    .vfs_mount = fat12_mount,
+    .vfs_unmount = fat12_unmount,
+    .vfs_sync = fat12_sync,
+    .vfs_warmup = fat12_warmup,
+};
+
+filesystem_t fat32_op = {
+    .get_root = fat12_get_root,
+    .vfs_mount = fat12_mount,
+    .vfs_unmount = fat12_unmount,
+    .vfs_sync = fat12_sync,
+    .vfs_warmup = fat12_warmup,
 };
 
 // vnode operation !!
@@ -119,22 +288,128 @@ vnodeops_t fat12_vnode_op = {
     .read = fat12_read,
     .write = fat12_write,
     .lookup = fat12_lookup,
+    .getattr = fat12_getattr,
+    .allocate = fat12_allocate,
 };
 
+static objpool_t* vnode_pool = NULL;   // the vnodes and their fat_inode_t
+
+/*
+ * In lazy mode, syncing a FAT volume only writes the first FAT,
+ * the mirror copies are written in the background by the cache flusher (and at unmount).
+ * This applies to the volumes mounted afterwards.
+ */
+void fat12_set_lazy_mirrors(bool enabled)
+{
+    lazy_mirrors_enabled = enabled;
+}
+
+/*
+ * In lazy FAT mode, mounting a FAT volume doesn't load its FAT: the FAT sectors are read
+ * from the block cache on first use. This applies to the volumes mounted afterwards.
+ */
+void fat12_set_lazy_fat(bool enabled)
+{
+    lazy_fat_enabled = enabled;
+}
+
 void fat12_init()
 {
+    if(vnode_pool == NULL)
+        vnode_pool = vfs_create_vnode_pool("fat vnode", sizeof(fat_inode_t));
+
     strcpy(fat12_op.fs_name, "fat12");
     vfs_register_new_filesystem(&fat12_op);
+
+    strcpy(fat16_op.fs_name, "fat16");
+    vfs_register_new_filesystem(&fat16_op);
+
+    strcpy(fat32_op.fs_name, "fat32");
+    vfs_register_new_filesystem(&fat32_op);
+}
+
+/*
+ * Computes the layout of the volume and detects its FAT type.
+ *
+ * As stated by the Microsoft specification, the FAT type is determined by the
+ * count of data clusters only: not by the label or by the name used to mount it.
+ */
+static int fat_compute_geometry(fs_info_t* fs_info)
+{
+    fat_BS_t* bootSector = fs_info->bootSector;
+
+    // the device only understands 512 bytes sectors
+    if(bootSector->bytes_per_sector != 512 || bootSector->sectors_per_cluster == 0 || bootSector->table_count == 0)
+        return VFS_ERROR;
+
+    uint32_t total_sectors = (bootSector->total_sectors_16 != 0) ? bootSector->total_sectors_16 : bootSector->total_sectors_32;
+    fs_info->fat_size = (bootSector->table_size_16 != 0) ? bootSector->table_size_16 : bootSector->ext32.table_size_32;
+    fs_info->root_dir_sectors = ((bootSector->root_entry_count * 32) + (bootSector->bytes_per_sector - 1)) / bootSector->bytes_per_sector;
+    fs_info->first_root_dir_sector = bootSector->reserved_sector_count + (bootSector->table_count * fs_info->fat_size);
+    fs_info->first_data_sector = fs_info->first_root_dir_sector + fs_info->root_dir_sectors;
+    fs_info->cluster_size = bootSector->sectors_per_cluster * bootSector->bytes_per_sector;
+
+    if(fs_info->fat_size == 0 || total_sectors <= fs_info->first_data_sector)
+        return VFS_ERROR;
+
+    fs_info->total_clusters = (total_sectors - fs_info->first_data_sector) / bootSector->sectors_per_cluster;
+
+    if(fs_info->total_clusters < 4085)
+    {
+        fs_info->fat_type = FAT_TYPE_12;
+        fs_info->end_of_chain = 0xFF8;
+        fs_info->root_cluster = 0;
+    }
+    else if(fs_info->total_clusters < 65525)
+    {
+        fs_info->fat_type = FAT_TYPE_16;
+        fs_info->end_of_chain = 0xFFF8;
+        fs_info->root_cluster = 0;
+    }
+    else
+    {
+        fs_info->fat_type = FAT_TYPE_32;
+        fs_info->end_of_chain = 0x0FFFFFF8;
+        fs_info->root_cluster = bootSector->ext32.root_cluster;
+    }
+
+    fs_info->next_free_cluster = 2;
+    fs_info->free_cluster_count = FSINFO_UNKNOWN;
+
+    return VFS_OK;
+}
+
+/*
+ * Reads the FSInfo sector of a FAT32 volume.
+ * It's only a hint, so an invalid FSInfo sector isn't an error: the search simply starts from the first cluster.
+ */
+static void fat_read_fsinfo(fs_info_t* fs_info, int device_id)
+{
+    if(fs_info->fat_type != FAT_TYPE_32 || fs_info->bootSector->ext32.fat_info == 0)
+        return;
+
+    fat_fsinfo_t* fsinfo = fs_info->fat_buffer;
+    cache_read(device_id, fsinfo, fs_info->bootSector->ext32.fat_info, 1);
+
+    if(fsinfo->lead_signature != FSINFO_LEAD_SIGNATURE || fsinfo->struct_signature != FSINFO_STRUCT_SIGNATURE)
+        return;
+
+    if(fsinfo->next_free >= 2 && fsinfo->next_free < fs_info->total_clusters + 2)
+        fs_info->next_free_cluster = fsinfo->next_free;
+
+    if(fsinfo->free_count <= fs_info->total_clusters)
+        fs_info->free_cluster_count = fsinfo->free_count;
 }
 
 /*
- * Mounts a FAT12 file system on the given mount point.
+ * Mounts a FAT12/16/32 file system on the given mount point.
  *
- * Mounting a FAT12 device involves reading and storing key metadata
+ * Mounting a FAT device involves reading and storing key metadata
  * from the disk, such as the boot sector and the File Allocation Table (FAT).
+ * In lazy FAT mode the FAT itself is left on the disk, see fat12_set_lazy_fat().
  *
  * All relevant information is saved in the 'vfs_data' field of the mount point,
- * allowing the file system to manage and access FAT12 structures effectively.
+ * allowing the file system to manage and access FAT structures effectively.
  */
 int fat12_mount(vfs_t* mountpoint, int device_id)
 {
@@ -153,19 +428,41 @@ int fat12_mount(vfs_t* mountpoint, int device_id)
         return VFS_ERROR; // error
     }
     
-    device_list[device_id]->read((void*)bootSector, 0, 1, device_list[device_id]->priv);
+    if(cache_read(device_id, bootSector, 0, 1) != VFS_OK)
+    {
+        free(fs_info);
+        free(bootSector);
+        return VFS_ERROR; // the device can't be read, the buffer holds garbage
+    }
+
+    fs_info->bootSector = bootSector;
+
+    if(fat_compute_geometry(fs_info) != VFS_OK)
+    {
+        free(fs_info);
+        free(bootSector);
+        return VFS_ERROR; // not a FAT volume we understand
+    }
 
-    void* file_allocation_table = malloc(sizeof(uint8_t) * bootSector->table_size_16 * bootSector->bytes_per_sector);
+    // either the whole FAT or a single sector window on it
+    size_t table_bytes = (lazy_fat_enabled ? 1 : fs_info->fat_size) * bootSector->bytes_per_sector;
+    void* file_allocation_table = malloc(table_bytes);
     if(file_allocation_table == NULL)
     {
         free(fs_info);
         free(bootSector);
         return VFS_ERROR; // error
     }
-    
-    device_list[device_id]->read(file_allocation_table, bootSector->reserved_sector_count, bootSector->table_size_16, device_list[device_id]->priv);
 
-    void *fat_buffer = malloc(bootSector->sectors_per_cluster * bootSector->bytes_per_sector);
+    if(!lazy_fat_enabled && cache_read(device_id, file_allocation_table, bootSector->reserved_sector_count, fs_info->fat_size) != VFS_OK)
+    {
+        free(fs_info);
+        free(bootSector);
+        free(file_allocation_table);
+        return VFS_ERROR; // error
+    }
+
+    void *fat_buffer = malloc(fs_info->cluster_size);
     if(fat_buffer == NULL)
     {
         free(fs_info);
@@ -174,10 +471,31 @@ int fat12_mount(vfs_t* mountpoint, int device_id)
         return VFS_ERROR; // error
     }
 
+    // both dirty bitmaps share the same allocation
+    uint8_t* dirty_bitmaps = calloc(2, (fs_info->fat_size + 7) / 8);
+    if(dirty_bitmaps == NULL)
+    {
+        free(fs_info);
+        free(bootSector);
+        free(file_allocation_table);
+        free(fat_buffer);
+        return VFS_ERROR; // error
+    }
+
     // registering info ...
-    fs_info->bootSector = bootSector;
     fs_info->fat_buffer = fat_buffer;
-    fs_info->file_allocation_table = file_allocation_table;
+    fs_info->file_allocation_table = lazy_fat_enabled ? NULL : file_allocation_table;
+    fs_info->fat_window = lazy_fat_enabled ? file_allocation_table : NULL;
+    fs_info->fat_window_sector = FAT_NO_WINDOW;
+    fs_info->device_id = device_id;
+    fs_info->fat_dirty = dirty_bitmaps;
+    fs_info->mirror_dirty = dirty_bitmaps + (fs_info->fat_size + 7) / 8;
+    fs_info->lazy_mirrors = lazy_mirrors_enabled;
+    pthread_mutex_init(&fs_info->fat_lock, NULL);
+    pthread_rwlock_init(&fs_info->volume_lock, NULL);
+    pthread_mutex_init(&fs_info->vnode_lock, NULL);
+
+    fat_read_fsinfo(fs_info, device_id);
 
     fs_info->root_vnode = malloc(sizeof(vnode_t));
     if(fs_info->root_vnode == NULL)
@@ -186,6 +504,7 @@ int fat12_mount(vfs_t* mountpoint, int device_id)
         free(bootSector);
         free(file_allocation_table);
         free(fat_buffer);
+        free(dirty_bitmaps);
         return VFS_ERROR; // error
     }
 
@@ -197,9 +516,15 @@ int fat12_mount(vfs_t* mountpoint, int device_id)
     fs_info->root_vnode->vnode_vfs = mountpoint;
     fs_info->root_vnode->vnode_data = NULL; // its the root !!
 
+    fs_info->memory = sizeof(fs_info_t) + sizeof(fat_BS_t) + table_bytes + fs_info->cluster_size + 2 * ((fs_info->fat_size + 7) / 8) + sizeof(vnode_t);
+    membudget_charge(&fat_account, fs_info->memory);
+
     // here we need to fill specific filesystem info !
     mountpoint->vfs_data = fs_info;
 
+    cache_register_writeback(fat_writeback, mountpoint);
+    fat_register_volume(mountpoint);
+
     return VFS_OK;
 }
 
@@ -207,14 +532,33 @@ int fat12_unmount(vfs_t* mountpoint)
 {
     fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
 
+    fat_unregister_volume(mountpoint);
+
+    // a defragmentation that found the volume before may still be running
+    pthread_rwlock_wrlock(&fs_info->volume_lock);
+    pthread_rwlock_unlock(&fs_info->volume_lock);
+
+    cache_unregister_writeback(fat_writeback, mountpoint);
+    fat_flush_table(mountpoint, true);  // don't leave the mirrors behind
+    fat_sync_volume(mountpoint);
+    pagecache_invalidate_volume(fs_info);
+
     for(int i = 0; i < MAX_VNODE_PER_VFS; i++)
+    {
         if(fs_info->total_vnode[i] != NULL)
-            free(fs_info->total_vnode[i]);
+            vfs_free_vnode(fs_info->total_vnode[i]);    // with its inode !
+    }
     
     free(fs_info->root_vnode);
     free(fs_info->bootSector);
     free(fs_info->fat_buffer);
     free(fs_info->file_allocation_table);
+    free(fs_info->fat_window);
+    free(fs_info->fat_dirty);
+    pthread_mutex_destroy(&fs_info->fat_lock);
+    pthread_rwlock_destroy(&fs_info->volume_lock);
+    pthread_mutex_destroy(&fs_info->vnode_lock);
+    membudget_charge(&fat_account, -(ssize_t)fs_info->memory);
     free(fs_info);
     
     return VFS_OK;
@@ -225,229 +569,1971 @@ int fat12_get_root(vfs_t* mountpoint, vnode_t** result)
     fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
 
     *result = fs_info->root_vnode;
+    (*result)->ref_count++;
     
     return VFS_OK;
 }
 
-uint32_t get_next_cluster(uint32_t currentCluster, void* fat_table)
-{    
-    uint32_t fatIndex = currentCluster * 3 / 2;
+/*
+ * Makes 'fat_window' hold the given sector of the first FAT (lazy FAT mode).
+ * fat_lock must be held
+ */
+static int fat_load_window(fs_info_t* fs_info, uint32_t sector)
+{
+    if(fs_info->fat_window_sector == sector)
+        return VFS_OK;
 
-    if (currentCluster % 2 == 0)
-        return (*(uint16_t*)(fat_table + fatIndex)) & 0x0FFF;
-    else
-        return (*(uint16_t*)(fat_table + fatIndex)) >> 4;
+    fs_info->fat_window_sector = FAT_NO_WINDOW;
+    if(cache_read(fs_info->device_id, fs_info->fat_window, fs_info->bootSector->reserved_sector_count + sector, 1) != VFS_OK)
+        return VFS_ERROR;
+
+    fs_info->fat_window_sector = sector;
+    return VFS_OK;
 }
 
-uint32_t cluster_to_Lba(uint32_t cluster, fat_BS_t* bootSector)
+/*
+ * Reads 'size' bytes (little endian) at 'offset' in the first FAT, from memory or through the window.
+ * fat_lock must be held in lazy mode. On error we return all ones, which reads as an end of chain.
+ */
+static uint32_t fat_read_raw(fs_info_t* fs_info, uint32_t offset, uint32_t size)
 {
-    uint16_t root_dir_size = (bootSector->root_entry_count * 32) / bootSector->bytes_per_sector;
-    uint16_t fat_total_size = (bootSector->table_size_16 * bootSector->table_count);
+    uint32_t value = 0;
+    uint32_t bytes_per_sector = fs_info->bootSector->bytes_per_sector;
 
-    return (bootSector->reserved_sector_count + fat_total_size + root_dir_size) + (cluster - 2) * bootSector->sectors_per_cluster;
-}
+    for(uint32_t i = 0; i < size; i++)
+    {
+        uint8_t byte;
 
-int fat12_read(vnode_t* node, void *buffer, size_t size, uint32_t offset)
-{
-    if(node->vnode_type != VREG)
-        return VFS_EISDIR;
-    
-    fat_dir_entry_t* inode = node->vnode_data;
-    fs_info_t* fs_info = node->vnode_vfs->vfs_data;
+        if(fs_info->file_allocation_table != NULL)
+            byte = ((uint8_t*)fs_info->file_allocation_table)[offset + i];
+        else if(fat_load_window(fs_info, (offset + i) / bytes_per_sector) == VFS_OK)
+            byte = fs_info->fat_window[(offset + i) % bytes_per_sector];
+        else
+            return 0xFFFFFFFF;
 
-    // EOF ?
-    if (offset >= inode->fileSize)
-        return 0;
+        value |= (uint32_t)byte << (8 * i);
+    }
 
-    // ajust the size to read !
-    size = ((offset + size) > inode->fileSize) ? (inode->fileSize - offset) : size;
+    return value;
+}
 
-    uint16_t currentCluster = inode->firstClusterLow;
-    uint16_t skippedClusters = (uint16_t)(offset / (fs_info->bootSector->sectors_per_cluster * fs_info->bootSector->bytes_per_sector));
-    
-    /* Some clusters are skipped since, based on the offset, their content doesn't need to be read. */
-    for(int i = 0; i < skippedClusters; i++)
-        currentCluster = get_next_cluster(currentCluster, fs_info->file_allocation_table);
+/*
+ * Writes 'size' bytes (little endian) at 'offset' in the first FAT.
+ * In lazy mode the window goes straight back to the cache, so the first FAT is up to date there.
+ * fat_lock must be held
+ */
+static void fat_write_raw(fs_info_t* fs_info, uint32_t offset, uint32_t value, uint32_t size)
+{
+    uint32_t bytes_per_sector = fs_info->bootSector->bytes_per_sector;
 
-    /* This is an offset based on the cluster currently being read, hence the name 'hypothetical'. */
-    uint32_t hypothetical_offset = offset - (skippedClusters * fs_info->bootSector->sectors_per_cluster * fs_info->bootSector->bytes_per_sector);
-    size_t to_read = 0; // to keep track of how many byte we've read
-    while (currentCluster < 0xFF8 && to_read < size)
+    for(uint32_t i = 0; i < size; i++)
     {
-        device_list[node->vnode_vfs->device_id]->read(fs_info->fat_buffer, cluster_to_Lba(currentCluster, fs_info->bootSector), fs_info->bootSector->sectors_per_cluster, device_list[node->vnode_vfs->device_id]->priv);
+        uint8_t byte = (value >> (8 * i)) & 0xFF;
 
-        /* "Bytes to read, to ensure we don’t exceed the size of the data in the buffer. */
-        uint16_t byte_to_read = (fs_info->bootSector->sectors_per_cluster * fs_info->bootSector->bytes_per_sector) - hypothetical_offset;
-        byte_to_read = ((byte_to_read + to_read) > size) ? (size - to_read) : byte_to_read; // ajust the byte to read based on the actual size to read !
+        if(fs_info->file_allocation_table != NULL)
+        {
+            ((uint8_t*)fs_info->file_allocation_table)[offset + i] = byte;
+            continue;
+        }
 
-        memcpy(buffer + to_read, fs_info->fat_buffer + hypothetical_offset, byte_to_read);
+        uint32_t sector = (offset + i) / bytes_per_sector;
+        if(fat_load_window(fs_info, sector) != VFS_OK)
+            return;
 
-        to_read += byte_to_read;    // increase the number of byte read
-        hypothetical_offset = 0;    // the hypothetical offset reset to 0 for the next cluster !
-        currentCluster = get_next_cluster(currentCluster, fs_info->file_allocation_table);
+        fs_info->fat_window[(offset + i) % bytes_per_sector] = byte;
+
+        // the last byte in this sector ?
+        if(i == size - 1 || (offset + i + 1) / bytes_per_sector != sector)
+            cache_write(fs_info->device_id, fs_info->fat_window, fs_info->bootSector->reserved_sector_count + sector, 1);
     }
-    
-    return to_read; // return the number of byte read !
 }
 
-int fat12_write(vnode_t* node, const void *buffer, size_t size, uint32_t offset)
+uint32_t get_next_cluster(uint32_t currentCluster, fs_info_t* fs_info)
 {
-    /* I hate warnings !*/
-    node = node;
-    buffer = buffer;
-    size = size;
-    offset = offset;
-    return 0;   // unfortunately I haven't implemented this yet !
-}
+    uint32_t value;
 
-static vnode_t* create_vnode(vfs_t* mountpoint, fat_dir_entry_t* inode_info)
-{
-    fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
+    if(fs_info->file_allocation_table == NULL)
+        pthread_mutex_lock(&fs_info->fat_lock);
 
-    /* Here we try to determine if the vnode of the target element is already present in the cache. */
-    for(int i = 0; i < MAX_VNODE_PER_VFS; i++)
+    switch (fs_info->fat_type)
     {
-        if(fs_info->total_vnode[i] != NULL)
-        {
-            fat_dir_entry_t* existing_inode = (fat_dir_entry_t*)fs_info->total_vnode[i]->vnode_data;
+    case FAT_TYPE_12:
+    {
+        uint32_t entry = fat_read_raw(fs_info, currentCluster * 3 / 2, 2);
 
-            if(strncmp(existing_inode->filename, inode_info->filename, 11) == 0)
-                return fs_info->total_vnode[i];    // if the vnode already exist in the vnode table
-        }
+        if (currentCluster % 2 == 0)
+            value = entry & 0x0FFF;
+        else
+            value = (entry >> 4) & 0x0FFF;
+        break;
     }
 
-    /* Otherwise, we create a new vnode and ensure that we also generate a new inode,
-    since the one we received is temporary (as it came from the FAT buffer). */
-    fat_dir_entry_t* file_inode = malloc(sizeof(fat_dir_entry_t));
-    memcpy(file_inode, inode_info, sizeof(fat_dir_entry_t));
-
-    vnode_t* newVnode = malloc(sizeof(vnode_t));
-    newVnode->flags = VNODE_NONE;
-    newVnode->ref_count = 0;
-    newVnode->vfs_mountedhere = NULL;
-    newVnode->vnode_data = file_inode;    // we store the inode here !!
-    newVnode->vnode_op = &fat12_vnode_op;
-    newVnode->vnode_vfs = mountpoint;
+    case FAT_TYPE_16:
+        value = fat_read_raw(fs_info, currentCluster * 2, 2) & 0xFFFF;
+        break;
 
-    if((file_inode->attributes & FAT_ATTR_DIRECTORY) == FAT_ATTR_DIRECTORY)
-        newVnode->vnode_type = VDIR;
-    else
-        newVnode->vnode_type = VREG;
+    default:
+        value = fat_read_raw(fs_info, currentCluster * 4, 4) & 0x0FFFFFFF;   // the high 4 bits are reserved
+        break;
+    }
 
-    // we'll search a free place in the cache
-    for(int i = 0; i < MAX_VNODE_PER_VFS; i++)
-    {   
-        if(fs_info->total_vnode[i] == NULL)
-        {
-            fs_info->total_vnode[i] = newVnode;
-            return newVnode;
-        } 
+    if(fs_info->file_allocation_table == NULL)
+        pthread_mutex_unlock(&fs_info->fat_lock);
 
-        // if the vnode is unused
-        if(fs_info->total_vnode[i]->ref_count <= 0)
-        {
-            free(fs_info->total_vnode[i]->vnode_data);  // free the inode !
-            free(fs_info->total_vnode[i]);
+    return value;
+}
 
-            fs_info->total_vnode[i] = newVnode;
-            return newVnode;
-        }
-    }
+/* Returns true if this cluster value doesn't point to any further cluster */
+static bool is_end_of_chain(uint32_t cluster, fs_info_t* fs_info)
+{
+    return cluster < 2 || cluster >= fs_info->end_of_chain;
+}
 
-    free(newVnode->vnode_data); // free the inode !
-    free(newVnode);
-    return NULL;    // cannot create vnode because too many vnodes are in used
+uint32_t cluster_to_Lba(uint32_t cluster, fs_info_t* fs_info)
+{
+    return fs_info->first_data_sector + (cluster - 2) * fs_info->bootSector->sectors_per_cluster;
 }
 
-void string_to_fatname(const char* name, char* nameOut)
+/* Only FAT32 uses the high word of the first cluster */
+static uint32_t entry_first_cluster(fat_dir_entry_t* entry, fs_info_t* fs_info)
 {
-    char fatName[12];
+    uint32_t cluster = entry->firstClusterLow;
 
-    // convert from name to fat name
-    memset(fatName, ' ', sizeof(fatName));
-    fatName[11] = '\0';
+    if(fs_info->fat_type == FAT_TYPE_32)
+        cluster |= (uint32_t)entry->firstClusterHigh << 16;
 
-    const char* ext = strchr(name, '.');
-    if (ext == NULL)
-        ext = name + 11;
+    return cluster;
+}
 
-    for (int i = 0; i < 8 && name[i] && name + i < ext; i++)
-        fatName[i] = toupper(name[i]);
+#define FAT_WARMUP_MAX_CLUSTERS 64
 
-    if (ext != name + 11)
-        for (int i = 0; i < 3 && ext[i + 1]; i++)
-            fatName[i + 8] = toupper(ext[i + 1]);
+/*
+ * Reads the root directory into the cache, so that the first lookups don't wait for the device.
+ * A FAT32 root directory can grow, we stop after FAT_WARMUP_MAX_CLUSTERS clusters.
+ */
+int fat12_warmup(vfs_t* mountpoint)
+{
+    fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
 
-    memcpy(nameOut, fatName, 12);
-}
+    if(fs_info->root_cluster == 0)
+    {
+        void* buffer = malloc(fs_info->root_dir_sectors * fs_info->bootSector->bytes_per_sector);
+        if(buffer == NULL)
+            return VFS_ERROR;
 
-fat_dir_entry_t* fat12_lookup_in_dir(uint32_t* dir, char* fatname, int dirEntryCount)
-{
-    fat_dir_entry_t* current_entry;
+        int status = cache_read(mountpoint->device_id, buffer, fs_info->first_root_dir_sector, fs_info->root_dir_sectors);
+        free(buffer);
+        return status;
+    }
+
+    void* buffer = malloc(fs_info->cluster_size);
+    if(buffer == NULL)
+        return VFS_ERROR;
 
-    for(int i = 0; i < dirEntryCount; i++)
+    int status = VFS_OK;
+    pthread_rwlock_rdlock(&fs_info->volume_lock);
+
+    uint32_t cluster = fs_info->root_cluster;
+    for(int i = 0; i < FAT_WARMUP_MAX_CLUSTERS && !is_end_of_chain(cluster, fs_info); i++)
     {
-        current_entry = (fat_dir_entry_t*)dir + i;
+        if(cache_read(mountpoint->device_id, buffer, cluster_to_Lba(cluster, fs_info), fs_info->bootSector->sectors_per_cluster) != VFS_OK)
+        {
+            status = VFS_ERROR;
+            break;
+        }
 
-        if(strncmp(current_entry->filename, fatname, 11) == 0)
-            return current_entry;
+        cluster = get_next_cluster(cluster, fs_info);
     }
 
-    return NULL;
+    pthread_rwlock_unlock(&fs_info->volume_lock);
+    free(buffer);
+    return status;
 }
 
-int fat12_lookup(vnode_t* node, const char* name, struct vnode** result)
+/*
+ * Reads [offset, offset + size) from the clusters of a file, the range must be within the file.
+ * Returns the number of bytes read, less than 'size' if the chain is too short or on an I/O error.
+ * The parts of clusters go through a buffer of our own, other readers may be running.
+ */
+static size_t fat_read_clusters(vnode_t* node, void *buffer, size_t size, uint64_t offset)
 {
-    if(node->vnode_type != VDIR)
-    {
-        *result = NULL;
-        return VFS_ENOTDIR;
-    }
-    
-    fat_dir_entry_t* inode = node->vnode_data;
+    fat_dir_entry_t* inode = &((fat_inode_t*)node->vnode_data)->entry;
     fs_info_t* fs_info = node->vnode_vfs->vfs_data;
+
+    uint32_t currentCluster = entry_first_cluster(inode, fs_info);
+    uint32_t skippedClusters = offset / fs_info->cluster_size;
     
-    char fatName[12];
-    string_to_fatname(name, fatName);
+    /* Some clusters are skipped since, based on the offset, their content doesn't need to be read. */
+    for(uint32_t i = 0; i < skippedClusters && !is_end_of_chain(currentCluster, fs_info); i++)
+        currentCluster = get_next_cluster(currentCluster, fs_info);
 
-    // here we need to look either on the root directory or another directory
-    if((node->flags & VNODE_ROOT) == VNODE_ROOT)
+    /* This is an offset based on the cluster currently being read, hence the name 'hypothetical'. */
+    uint32_t hypothetical_offset = offset - (skippedClusters * fs_info->cluster_size);
+    size_t to_read = 0; // to keep track of how many byte we've read
+    uint8_t* cluster = NULL;
+    while (!is_end_of_chain(currentCluster, fs_info) && to_read < size)
     {
-        inode = NULL;   // we reuse this variable just to avoid creating a new one !
-        
-        uint16_t root_dir_size = (fs_info->bootSector->root_entry_count * 32) / fs_info->bootSector->bytes_per_sector;
-        uint16_t root_dir_offset = fs_info->bootSector->reserved_sector_count + (fs_info->bootSector->table_size_16 * fs_info->bootSector->table_count);
-        
-        int dirEntryCount = fs_info->bootSector->bytes_per_sector / 32; // because we're reading sector by sector of the root directory length
-        for(int i = 0; i < root_dir_size && inode == NULL; i++)
+        /* Whole clusters go straight to the caller: a run of contiguous ones is read at once */
+        if(hypothetical_offset == 0 && size - to_read >= fs_info->cluster_size)
         {
-            device_list[node->vnode_vfs->device_id]->read(fs_info->fat_buffer, root_dir_offset + i, 1, device_list[node->vnode_vfs->device_id]->priv);
-            inode = fat12_lookup_in_dir(fs_info->fat_buffer, fatName, dirEntryCount);
+            uint32_t run = 1;
+            uint32_t nextCluster = get_next_cluster(currentCluster, fs_info);
+            while(nextCluster == currentCluster + run && (run + 1) * (size_t)fs_info->cluster_size <= size - to_read)
+            {
+                run++;
+                nextCluster = get_next_cluster(nextCluster, fs_info);
+            }
+
+            if(cache_read(node->vnode_vfs->device_id, buffer + to_read, cluster_to_Lba(currentCluster, fs_info), run * fs_info->bootSector->sectors_per_cluster) != VFS_OK)
+                break;
+
+            to_read += run * fs_info->cluster_size;
+            currentCluster = nextCluster;
+            continue;
         }
-        
-    }
-    else
-    {
-        uint16_t currentCluster = inode->firstClusterLow;
-        inode = NULL;
 
-        /* because we're reading cluster size directory length */
-        int dirEntryCount = (fs_info->bootSector->sectors_per_cluster * fs_info->bootSector->bytes_per_sector) / 32;
-        while (currentCluster < 0xFF8 && inode == NULL)
-        {
-            device_list[node->vnode_vfs->device_id]->read(fs_info->fat_buffer, cluster_to_Lba(currentCluster, fs_info->bootSector), fs_info->bootSector->sectors_per_cluster, device_list[node->vnode_vfs->device_id]->priv);
-            inode = fat12_lookup_in_dir(fs_info->fat_buffer, fatName, dirEntryCount);
+        if(cluster == NULL && (cluster = malloc(fs_info->cluster_size)) == NULL)
+            break;
 
-            currentCluster = get_next_cluster(currentCluster, fs_info->file_allocation_table);
-        }
-    }
+        if(cache_read(node->vnode_vfs->device_id, cluster, cluster_to_Lba(currentCluster, fs_info), fs_info->bootSector->sectors_per_cluster) != VFS_OK)
+            break;
 
-    if(inode != NULL)
-    {
-        *result = create_vnode(node->vnode_vfs, inode);
-        return VFS_OK;
-    }
+        /* "Bytes to read, to ensure we don’t exceed the size of the data in the buffer. */
+        uint32_t byte_to_read = fs_info->cluster_size - hypothetical_offset;
+        byte_to_read = ((byte_to_read + to_read) > size) ? (size - to_read) : byte_to_read; // ajust the byte to read based on the actual size to read !
 
-    *result = NULL;
-    return VFS_ENOENT;
-}
\ No newline at end of file
+        memcpy(buffer + to_read, cluster + hypothetical_offset, byte_to_read);
+
+        to_read += byte_to_read;    // increase the number of byte read
+        hypothetical_offset = 0;    // the hypothetical offset reset to 0 for the next cluster !
+        currentCluster = get_next_cluster(currentCluster, fs_info);
+    }
+
+    free(cluster);
+    return to_read; // return the number of byte read !
+}
+
+/* The pages of a file are cached under the location of its directory entry, it doesn't change while the volume is mounted */
+static uint64_t fat_file_id(fat_inode_t* inode)
+{
+    return ((uint64_t)inode->entry_lba << 16) | inode->entry_offset;
+}
+
+/*
+ * Reads a file through the page cache: a cached page is copied without looking at the FAT.
+ * The missing pages are read from the clusters and cached, straight into the caller's buffer
+ * when it wants them whole. volume_lock must be held (for reading at least), so that a page isn't
+ * cached from a read racing with a write (which invalidates it with the lock held for writing).
+ * Returns the bytes read, short on an I/O error or a damaged chain, VFS_ERROR if none could be.
+ */
+static ssize_t fat_read(vnode_t* node, void *buffer, size_t size, uint64_t offset)
+{
+    fat_inode_t* inode = node->vnode_data;
+    fs_info_t* fs_info = node->vnode_vfs->vfs_data;
+    uint32_t fileSize = inode->entry.fileSize;
+    uint64_t id = fat_file_id(inode);
+
+    // EOF ?
+    if (offset >= fileSize)
+        return 0;
+
+    // ajust the size to read !
+    size = ((offset + size) > fileSize) ? (fileSize - offset) : size;
+
+    size_t done = 0;
+    while(done < size)
+    {
+        uint64_t position = offset + done;
+        uint64_t index = position / PAGECACHE_PAGE_SIZE;
+        uint32_t in_page = position % PAGECACHE_PAGE_SIZE;
+        uint32_t chunk = (size - done < PAGECACHE_PAGE_SIZE - in_page) ? size - done : PAGECACHE_PAGE_SIZE - in_page;
+
+        if(pagecache_read(fs_info, id, index, buffer + done, in_page, chunk))
+        {
+            done += chunk;
+            continue;
+        }
+
+        uint64_t page_start = index * PAGECACHE_PAGE_SIZE;
+        uint32_t page_length = (fileSize - page_start < PAGECACHE_PAGE_SIZE) ? fileSize - page_start : PAGECACHE_PAGE_SIZE;
+
+        // whole pages: every one the caller wants whole is read at once, in place
+        if(in_page == 0 && chunk == page_length)
+        {
+            size_t length = (offset + size == fileSize) ? size - done : (size - done) / PAGECACHE_PAGE_SIZE * PAGECACHE_PAGE_SIZE;
+            size_t read = fat_read_clusters(node, buffer + done, length, position);
+
+            for(size_t cached = 0; cached < read && (read - cached >= PAGECACHE_PAGE_SIZE || read == length); cached += PAGECACHE_PAGE_SIZE)
+                pagecache_insert(fs_info, id, index++, buffer + done + cached, (read - cached < PAGECACHE_PAGE_SIZE) ? read - cached : PAGECACHE_PAGE_SIZE);
+
+            done += read;
+            if(read < length)
+                break;  // I/O error or damaged chain
+
+            continue;
+        }
+
+        // part of a page: the whole page is read so that it can be cached
+        uint8_t page[PAGECACHE_PAGE_SIZE];
+        if(fat_read_clusters(node, page, page_length, page_start) != page_length)
+            break;
+
+        pagecache_insert(fs_info, id, index, page, page_length);
+        memcpy(buffer + done, page + in_page, chunk);
+        done += chunk;
+    }
+
+    // 0 would look like the end of the file
+    return (done == 0) ? VFS_ERROR : (ssize_t)done;
+}
+
+/* The cached pages are copied without waiting for the volume, from the first missing one it's locked */
+ssize_t fat12_read(vnode_t* node, void *buffer, size_t size, uint64_t offset)
+{
+    if(node->vnode_type != VREG)
+        return VFS_EISDIR;
+
+    fat_inode_t* inode = node->vnode_data;
+    fs_info_t* fs_info = node->vnode_vfs->vfs_data;
+
+    pthread_rwlock_rdlock(&fs_info->volume_lock);
+    uint32_t fileSize = inode->entry.fileSize;
+    pthread_rwlock_unlock(&fs_info->volume_lock);
+
+    if (offset >= fileSize)
+        return 0;
+
+    size = ((offset + size) > fileSize) ? (fileSize - offset) : size;
+
+    size_t done = 0;
+    while(done < size)
+    {
+        uint64_t position = offset + done;
+        uint32_t in_page = position % PAGECACHE_PAGE_SIZE;
+        uint32_t chunk = (size - done < PAGECACHE_PAGE_SIZE - in_page) ? size - done : PAGECACHE_PAGE_SIZE - in_page;
+
+        if(!pagecache_read(fs_info, fat_file_id(inode), position / PAGECACHE_PAGE_SIZE, buffer + done, in_page, chunk))
+            break;
+
+        done += chunk;
+    }
+
+    if(done == size)
+        return done;
+
+    pthread_rwlock_rdlock(&fs_info->volume_lock);
+    ssize_t read = fat_read(node, buffer + done, size - done, offset + done);
+    pthread_rwlock_unlock(&fs_info->volume_lock);
+
+    // what came from the page cache is still good
+    if(read < 0)
+        return (done > 0) ? (ssize_t)done : read;
+
+    return done + read;
+}
+
+/*
+ * Writes the sectors flagged in 'bitmap' to the FAT copies [first_copy, last_copy], then clears the flags.
+ * Contiguous dirty sectors are written together.
+ * In lazy FAT mode the first FAT is already up to date in the cache, the mirrors are copied from it.
+ */
+static void fat_write_dirty_sectors(vfs_t* mountpoint, uint8_t* bitmap, uint32_t first_copy, uint32_t last_copy)
+{
+    fs_info_t* fs_info = mountpoint->vfs_data;
+    uint32_t bytes_per_sector = fs_info->bootSector->bytes_per_sector;
+    bool lazy = (fs_info->file_allocation_table == NULL);
+    uint8_t* sectors = NULL;
+
+    if(lazy && first_copy == 0)
+        first_copy = 1;
+
+    for(uint32_t sector = 0; sector < fs_info->fat_size; )
+    {
+        if(!BITMAP_TEST(bitmap, sector))
+        {
+            sector++;
+            continue;
+        }
+
+        uint32_t count = 0;
+        while(sector + count < fs_info->fat_size && BITMAP_TEST(bitmap, sector + count))
+        {
+            BITMAP_CLEAR(bitmap, sector + count);
+            count++;
+        }
+
+        void* source = fs_info->file_allocation_table + sector * bytes_per_sector;
+        if(lazy && first_copy <= last_copy)
+        {
+            uint8_t* grown = realloc(sectors, count * bytes_per_sector);
+            if(grown == NULL || cache_read(mountpoint->device_id, grown, fs_info->bootSector->reserved_sector_count + sector, count) != VFS_OK)
+            {
+                // keep them dirty for the next time
+                for(uint32_t i = 0; i < count; i++)
+                    BITMAP_SET(bitmap, sector + i);
+
+                sectors = (grown != NULL) ? grown : sectors;
+                sector += count;
+                continue;
+            }
+
+            sectors = grown;
+            source = sectors;
+        }
+
+        for(uint32_t copy = first_copy; copy <= last_copy && copy < fs_info->bootSector->table_count; copy++)
+        {
+            uint32_t lba = fs_info->bootSector->reserved_sector_count + copy * fs_info->fat_size + sector;
+            cache_write(mountpoint->device_id, source, lba, count);
+        }
+
+        sector += count;
+    }
+
+    free(sectors);
+}
+
+/*
+ * Writes the dirty sectors of the in-memory FAT to the disk (through the cache).
+ * The first FAT is always written. The mirrors are written along with it, unless the lazy mode
+ * is enabled and 'mirrors_now' is false: they're then remembered for a later call.
+ */
+static void fat_flush_table(vfs_t* mountpoint, bool mirrors_now)
+{
+    fs_info_t* fs_info = mountpoint->vfs_data;
+    uint32_t last_copy = fs_info->bootSector->table_count - 1;
+
+    pthread_mutex_lock(&fs_info->fat_lock);
+
+    if(fs_info->lazy_mirrors && !mirrors_now)
+    {
+        for(uint32_t i = 0; i < (fs_info->fat_size + 7) / 8; i++)
+            fs_info->mirror_dirty[i] |= fs_info->fat_dirty[i];
+
+        last_copy = 0;
+    }
+
+    fat_write_dirty_sectors(mountpoint, fs_info->fat_dirty, 0, last_copy);
+
+    if(mirrors_now)
+        fat_write_dirty_sectors(mountpoint, fs_info->mirror_dirty, 1, fs_info->bootSector->table_count - 1);
+
+    pthread_mutex_unlock(&fs_info->fat_lock);
+}
+
+/* Called by the cache flusher: the FAT changes (mirrors included) reach the disk in the background */
+static void fat_writeback(void* arg)
+{
+    fat_flush_table((vfs_t*)arg, true);
+}
+
+/* Changes the FAT entry of a cluster, the sectors holding it are flagged dirty */
+static void set_next_cluster(vfs_t* mountpoint, uint32_t cluster, uint32_t value)
+{
+    fs_info_t* fs_info = mountpoint->vfs_data;
+    uint32_t fatIndex;
+    uint32_t entry_size;
+
+    pthread_mutex_lock(&fs_info->fat_lock);
+
+    switch (fs_info->fat_type)
+    {
+    case FAT_TYPE_12:
+    {
+        fatIndex = cluster * 3 / 2;
+        entry_size = 2;
+        uint32_t entry = fat_read_raw(fs_info, fatIndex, 2);
+
+        if (cluster % 2 == 0)
+            entry = (entry & 0xF000) | (value & 0x0FFF);
+        else
+            entry = (entry & 0x000F) | ((value & 0x0FFF) << 4);
+
+        fat_write_raw(fs_info, fatIndex, entry, 2);
+        break;
+    }
+
+    case FAT_TYPE_16:
+        fatIndex = cluster * 2;
+        entry_size = 2;
+        fat_write_raw(fs_info, fatIndex, value, 2);
+        break;
+
+    default:
+        fatIndex = cluster * 4;
+        entry_size = 4;
+        fat_write_raw(fs_info, fatIndex, (fat_read_raw(fs_info, fatIndex, 4) & 0xF0000000) | (value & 0x0FFFFFFF), 4);   // keep the reserved bits
+        break;
+    }
+
+    // a FAT12 entry may straddle two sectors
+    uint32_t bytes_per_sector = fs_info->bootSector->bytes_per_sector;
+    BITMAP_SET(fs_info->fat_dirty, fatIndex / bytes_per_sector);
+    BITMAP_SET(fs_info->fat_dirty, (fatIndex + entry_size - 1) / bytes_per_sector);
+
+    pthread_mutex_unlock(&fs_info->fat_lock);
+}
+
+/*
+ * Allocates a free cluster and links it after 'previous' (if not 0).
+ *
+ * The search starts from the free cluster hint (initialized from the FSInfo sector on FAT32)
+ * instead of the beginning of the FAT, so that a sequence of allocations doesn't rescan the
+ * same used clusters again and again.
+ *
+ * Returns the new cluster, or 0 if the volume is full.
+ */
+static uint32_t allocate_cluster(vfs_t* mountpoint, uint32_t previous)
+{
+    fs_info_t* fs_info = mountpoint->vfs_data;
+    uint32_t cluster = fs_info->next_free_cluster;
+
+    for(uint32_t i = 0; i < fs_info->total_clusters; i++, cluster++)
+    {
+        if(cluster >= fs_info->total_clusters + 2)
+            cluster = 2;
+
+        if(get_next_cluster(cluster, fs_info) != 0)
+            continue;   // already used
+
+        set_next_cluster(mountpoint, cluster, fs_info->end_of_chain | 0x7);   // it's the new end of the chain
+
+        if(previous != 0)
+            set_next_cluster(mountpoint, previous, cluster);
+
+        fs_info->next_free_cluster = cluster + 1;
+        if(fs_info->free_cluster_count != FSINFO_UNKNOWN && fs_info->free_cluster_count > 0)
+            fs_info->free_cluster_count--;
+
+        return cluster;
+    }
+
+    return 0;   // no space left on the device
+}
+
+/* Converts the current local time to the FAT date/time format */
+static void fat_current_time(uint16_t* date, uint16_t* time_out)
+{
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+
+    *date = ((local.tm_year - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday;
+    *time_out = (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2);
+}
+
+/* Writes the directory entry of a file back to its directory */
+static void fat_write_entry(vfs_t* mountpoint, fat_inode_t* inode)
+{
+    fs_info_t* fs_info = mountpoint->vfs_data;
+    uint8_t sector[CACHE_BLOCK_SIZE];
+
+    if(fs_info->bootSector->bytes_per_sector > CACHE_BLOCK_SIZE)
+        return;
+
+    cache_read(mountpoint->device_id, sector, inode->entry_lba, 1);
+    memcpy(sector + inode->entry_offset, &inode->entry, sizeof(fat_dir_entry_t));
+    cache_write(mountpoint->device_id, sector, inode->entry_lba, 1);
+}
+
+/*
+ * Writes 'size' bytes at 'offset' in the clusters of a file, allocating the missing ones.
+ * If 'buffer' is NULL, zeros are written (used to fill the gap when writing past the end of the file).
+ *
+ * Only the sectors actually touched are read and written, the block cache merges
+ * the sectors of consecutive small writes.
+ *
+ * Returns the number of bytes written, which is less than 'size' if the disk is full.
+ */
+static size_t fat_write_clusters(vnode_t* node, const void* buffer, size_t size, uint32_t offset)
+{
+    fat_inode_t* inode = node->vnode_data;
+    fs_info_t* fs_info = node->vnode_vfs->vfs_data;
+    int device_id = node->vnode_vfs->device_id;
+    uint32_t bytes_per_sector = fs_info->bootSector->bytes_per_sector;
+
+    uint32_t currentCluster = entry_first_cluster(&inode->entry, fs_info);
+    uint32_t previousCluster = 0;
+    uint32_t skippedClusters = offset / fs_info->cluster_size;
+
+    /* Walk (and grow if needed) the chain until the cluster holding 'offset' */
+    for(uint32_t i = 0; ; i++)
+    {
+        if(is_end_of_chain(currentCluster, fs_info))
+        {
+            currentCluster = allocate_cluster(node->vnode_vfs, previousCluster);
+            if(currentCluster == 0)
+                return 0;   // disk full
+
+            if(previousCluster == 0)   // it was an empty file
+            {
+                inode->entry.firstClusterLow = currentCluster & 0xFFFF;
+                inode->entry.firstClusterHigh = (fs_info->fat_type == FAT_TYPE_32) ? currentCluster >> 16 : 0;
+            }
+        }
+
+        if(i == skippedClusters)
+            break;
+
+        previousCluster = currentCluster;
+        currentCluster = get_next_cluster(currentCluster, fs_info);
+    }
+
+    uint32_t hypothetical_offset = offset % fs_info->cluster_size;
+    size_t written = 0;
+    while(written < size)
+    {
+        uint32_t byte_to_write = fs_info->cluster_size - hypothetical_offset;
+        byte_to_write = ((byte_to_write + written) > size) ? (size - written) : byte_to_write;
+
+        uint32_t first_sector = hypothetical_offset / bytes_per_sector;
+        uint32_t sector_count = (hypothetical_offset + byte_to_write - 1) / bytes_per_sector - first_sector + 1;
+        uint32_t lba = cluster_to_Lba(currentCluster, fs_info) + first_sector;
+        uint8_t* sectors = fs_info->fat_buffer;
+
+        // partially written sectors need their old content
+        if(hypothetical_offset % bytes_per_sector != 0 || byte_to_write % bytes_per_sector != 0)
+            cache_read(device_id, sectors, lba, sector_count);
+
+        if(buffer != NULL)
+            memcpy(sectors + hypothetical_offset % bytes_per_sector, buffer + written, byte_to_write);
+        else
+            memset(sectors + hypothetical_offset % bytes_per_sector, 0, byte_to_write);
+
+        cache_write(device_id, sectors, lba, sector_count);
+
+        written += byte_to_write;
+        hypothetical_offset = 0;
+
+        if(written < size)
+        {
+            previousCluster = currentCluster;
+            currentCluster = get_next_cluster(currentCluster, fs_info);
+
+            if(is_end_of_chain(currentCluster, fs_info))
+                currentCluster = allocate_cluster(node->vnode_vfs, previousCluster);
+
+            if(currentCluster == 0)
+                break;  // disk full
+        }
+    }
+
+    return written;
+}
+
+/* volume_lock must be held for writing */
+static ssize_t fat_write(vnode_t* node, const void *buffer, size_t size, uint64_t offset)
+{
+    fat_inode_t* inode = node->vnode_data;
+
+    if(inode->entry.attributes & FAT_ATTR_READ_ONLY)
+        return VFS_EACCESS;
+
+    if(size == 0)
+        return 0;
+
+    // a FAT file can't be larger than 4 GiB
+    if(offset >= 0xFFFFFFFF)
+        return VFS_ERROR;
+
+    if(offset + size > 0xFFFFFFFF)
+        size = 0xFFFFFFFF - offset;
+
+    // the cached pages of the range (and of a gap left before it) are stale
+    uint64_t first_changed = (offset < inode->entry.fileSize) ? offset : inode->entry.fileSize;
+    pagecache_invalidate(node->vnode_vfs->vfs_data, fat_file_id(inode), first_changed / PAGECACHE_PAGE_SIZE, (offset + size - 1) / PAGECACHE_PAGE_SIZE);
+
+    // writing past the end of the file leaves a gap that must read back as zeros
+    if(offset > inode->entry.fileSize)
+    {
+        uint32_t gap = offset - inode->entry.fileSize;
+
+        if(fat_write_clusters(node, NULL, gap, inode->entry.fileSize) != gap)
+            return VFS_ERROR;
+
+        inode->entry.fileSize = offset;
+    }
+
+    size_t written = fat_write_clusters(node, buffer, size, offset);
+
+    if(offset + written > inode->entry.fileSize)
+        inode->entry.fileSize = offset + written;
+
+    uint16_t date, now;
+    fat_current_time(&date, &now);
+    inode->entry.writeDate = date;
+    inode->entry.writeTime = now;
+    inode->entry.lastAccessDate = date;
+    inode->entry.attributes |= FAT_ATTR_ARCHIVE;
+    fat_write_entry(node->vnode_vfs, inode);
+
+    if(written == 0)
+        return VFS_ERROR;   // the disk is full
+
+    return written;
+}
+
+ssize_t fat12_write(vnode_t* node, const void *buffer, size_t size, uint64_t offset)
+{
+    if(node->vnode_type != VREG)
+        return VFS_EISDIR;
+
+    fs_info_t* fs_info = node->vnode_vfs->vfs_data;
+
+    pthread_rwlock_wrlock(&fs_info->volume_lock);
+    ssize_t written = fat_write(node, buffer, size, offset);
+    pthread_rwlock_unlock(&fs_info->volume_lock);
+
+    return written;
+}
+
+/*
+ * Looks for 'count' free clusters in a row: right after 'last' if possible, so that the file
+ * is extended in place, else the first run long enough.
+ * Returns its first cluster, or 0 if there's none, then 'free_count' is the number of free clusters.
+ */
+static uint32_t fat_find_free_run(fs_info_t* fs_info, uint32_t last, uint32_t count, uint32_t* free_count)
+{
+    uint32_t end = fs_info->total_clusters + 2;
+    uint32_t length = 0;
+
+    if(last != 0)
+    {
+        while(last + 1 + length < end && length < count && get_next_cluster(last + 1 + length, fs_info) == 0)
+            length++;
+
+        if(length == count)
+            return last + 1;
+    }
+
+    *free_count = 0;
+    length = 0;
+
+    for(uint32_t cluster = 2; cluster < end; cluster++)
+    {
+        if(get_next_cluster(cluster, fs_info) != 0)
+        {
+            length = 0;
+            continue;
+        }
+
+        (*free_count)++;
+        if(++length == count)
+            return cluster + 1 - count;
+    }
+
+    return 0;
+}
+
+/*
+ * Reserves the clusters of [offset, offset + length) and grows the file to cover them.
+ *
+ * The missing clusters are taken as a single run when the volume has one (after the last cluster
+ * of the file if it's free), so a file written once its size is known isn't fragmented.
+ * FAT has no holes: the new part of the file is zeroed. volume_lock must be held for writing.
+ */
+static int fat_allocate(vnode_t* node, uint64_t offset, uint64_t length)
+{
+    fat_inode_t* inode = node->vnode_data;
+    fs_info_t* fs_info = node->vnode_vfs->vfs_data;
+
+    if(inode->entry.attributes & FAT_ATTR_READ_ONLY)
+        return VFS_EACCESS;
+
+    // a FAT file can't be larger than 4 GiB
+    if(offset + length > 0xFFFFFFFF)
+        return VFS_ERROR;
+
+    uint32_t end = offset + length;
+    if(end <= inode->entry.fileSize)
+        return VFS_OK;  // already there
+
+    uint32_t needed = (end + fs_info->cluster_size - 1) / fs_info->cluster_size;
+    uint32_t have = 0;
+    uint32_t last = 0;
+
+    for(uint32_t cluster = entry_first_cluster(&inode->entry, fs_info); !is_end_of_chain(cluster, fs_info); cluster = get_next_cluster(cluster, fs_info))
+    {
+        last = cluster;
+        have++;
+    }
+
+    if(needed > have)
+    {
+        uint32_t missing = needed - have;
+        uint32_t free_count;
+        uint32_t run = fat_find_free_run(fs_info, last, missing, &free_count);
+
+        if(run == 0 && free_count < missing)
+            return VFS_ERROR;   // the disk is too full
+
+        for(uint32_t i = 0; i < missing; i++)
+        {
+            uint32_t cluster;
+
+            if(run != 0)
+            {
+                cluster = run + i;
+                set_next_cluster(node->vnode_vfs, cluster, fs_info->end_of_chain | 0x7);
+                if(last != 0)
+                    set_next_cluster(node->vnode_vfs, last, cluster);
+
+                if(fs_info->free_cluster_count != FSINFO_UNKNOWN && fs_info->free_cluster_count > 0)
+                    fs_info->free_cluster_count--;
+            }
+            else    // no run long enough, the space is still reserved
+                cluster = allocate_cluster(node->vnode_vfs, last);
+
+            if(last == 0)
+            {
+                inode->entry.firstClusterLow = cluster & 0xFFFF;
+                inode->entry.firstClusterHigh = (fs_info->fat_type == FAT_TYPE_32) ? cluster >> 16 : 0;
+            }
+            last = cluster;
+        }
+
+        if(run != 0)
+            fs_info->next_free_cluster = run + missing;
+    }
+
+    // the clusters are all there, the zeros don't allocate anything
+    uint32_t gap = end - inode->entry.fileSize;
+    pagecache_invalidate(fs_info, fat_file_id(inode), inode->entry.fileSize / PAGECACHE_PAGE_SIZE, (end - 1) / PAGECACHE_PAGE_SIZE);
+    if(fat_write_clusters(node, NULL, gap, inode->entry.fileSize) != gap)
+        return VFS_ERROR;
+
+    inode->entry.fileSize = end;
+
+    uint16_t date, now;
+    fat_current_time(&date, &now);
+    inode->entry.writeDate = date;
+    inode->entry.writeTime = now;
+    inode->entry.lastAccessDate = date;
+    inode->entry.attributes |= FAT_ATTR_ARCHIVE;
+    fat_write_entry(node->vnode_vfs, inode);
+
+    return VFS_OK;
+}
+
+int fat12_allocate(vnode_t* node, uint64_t offset, uint64_t length)
+{
+    if(node->vnode_type != VREG)
+        return VFS_EISDIR;
+
+    fs_info_t* fs_info = node->vnode_vfs->vfs_data;
+
+    pthread_rwlock_wrlock(&fs_info->volume_lock);
+    int status = fat_allocate(node, offset, length);
+    pthread_rwlock_unlock(&fs_info->volume_lock);
+
+    return status;
+}
+
+/*
+ * Makes every change to this file system durable.
+ * The dirty FAT sectors and the FAT32 FSInfo sector (with the free cluster hint) are written,
+ * then every dirty sector of the device is written back. volume_lock must be held (for reading at
+ * least, nothing changes the FAT then), or the volume unused.
+ */
+static int fat_sync_volume(vfs_t* mountpoint)
+{
+    fs_info_t* fs_info = mountpoint->vfs_data;
+
+    fat_flush_table(mountpoint, false);
+
+    if(fs_info->fat_type == FAT_TYPE_32 && fs_info->bootSector->ext32.fat_info != 0)
+    {
+        fat_fsinfo_t fsinfo;
+
+        cache_read(mountpoint->device_id, &fsinfo, fs_info->bootSector->ext32.fat_info, 1);
+
+        // nothing to write if nothing was allocated (the volume may be used read only)
+        if(fsinfo.lead_signature == FSINFO_LEAD_SIGNATURE && fsinfo.struct_signature == FSINFO_STRUCT_SIGNATURE
+            && (fsinfo.next_free != fs_info->next_free_cluster || fsinfo.free_count != fs_info->free_cluster_count))
+        {
+            fsinfo.next_free = fs_info->next_free_cluster;
+            fsinfo.free_count = fs_info->free_cluster_count;
+            cache_write(mountpoint->device_id, &fsinfo, fs_info->bootSector->ext32.fat_info, 1);
+        }
+    }
+
+    return cache_sync_device(mountpoint->device_id);
+}
+
+int fat12_sync(vfs_t* mountpoint)
+{
+    fs_info_t* fs_info = mountpoint->vfs_data;
+
+    pthread_rwlock_rdlock(&fs_info->volume_lock);
+    int status = fat_sync_volume(mountpoint);
+    pthread_rwlock_unlock(&fs_info->volume_lock);
+
+    return status;
+}
+
+/* volume_lock must be held, for reading at least. The vnode returned is held for the caller. */
+static vnode_t* create_vnode(vfs_t* mountpoint, fat_dir_entry_t* inode_info, uint32_t entry_lba, uint16_t entry_offset)
+{
+    fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
+    vnode_t* evicted = NULL;
+    vnode_t* result = NULL;
+
+    pthread_mutex_lock(&fs_info->vnode_lock);
+
+    /* Here we try to determine if the vnode of the target element is already present in the cache.
+    A directory entry is identified by its location, two files can share the same name in different directories. */
+    for(int i = 0; i < MAX_VNODE_PER_VFS && result == NULL; i++)
+    {
+        if(fs_info->total_vnode[i] != NULL)
+        {
+            fat_inode_t* existing_inode = (fat_inode_t*)fs_info->total_vnode[i]->vnode_data;
+
+            if(existing_inode->entry_lba == entry_lba && existing_inode->entry_offset == entry_offset)
+            {
+                result = fs_info->total_vnode[i];   // if the vnode already exist in the vnode table
+                result->ref_count++;
+            }
+        }
+    }
+
+    if(result != NULL)
+    {
+        pthread_mutex_unlock(&fs_info->vnode_lock);
+        return result;
+    }
+
+    /* Otherwise, we create a new vnode and ensure that we also generate a new inode,
+    since the one we received is temporary (as it came from the FAT buffer).
+    The inode comes with the vnode, from the pool. */
+    vnode_t* newVnode = vfs_alloc_vnode(vnode_pool);
+    if(newVnode == NULL)
+    {
+        pthread_mutex_unlock(&fs_info->vnode_lock);
+        return NULL;
+    }
+
+    fat_inode_t* file_inode = newVnode->vnode_data;    // we store the inode here !!
+    memcpy(&file_inode->entry, inode_info, sizeof(fat_dir_entry_t));
+    file_inode->entry_lba = entry_lba;
+    file_inode->entry_offset = entry_offset;
+
+    newVnode->ref_count = 1;
+    newVnode->flags = VNODE_NONE;
+    newVnode->vnode_op = &fat12_vnode_op;
+    newVnode->vnode_vfs = mountpoint;
+
+    if((file_inode->entry.attributes & FAT_ATTR_DIRECTORY) == FAT_ATTR_DIRECTORY)
+        newVnode->vnode_type = VDIR;
+    else
+        newVnode->vnode_type = VREG;
+
+    // we'll search a free place in the cache, or an unused vnode (a path lookup may still be looking at it, but it doesn't hold it)
+    for(int i = 0; i < MAX_VNODE_PER_VFS && result == NULL; i++)
+    {
+        if(fs_info->total_vnode[i] == NULL || fs_info->total_vnode[i]->ref_count <= 0)
+        {
+            evicted = fs_info->total_vnode[i];
+            fs_info->total_vnode[i] = result = newVnode;
+        }
+    }
+
+    pthread_mutex_unlock(&fs_info->vnode_lock);
+
+    if(evicted != NULL)
+        epoch_retire(evicted, vfs_free_vnode);
+
+    if(result == NULL)
+        vfs_free_vnode(newVnode);   // cannot create vnode because too many vnodes are in used
+
+    return result;
+}
+
+void string_to_fatname(const char* name, char* nameOut)
+{
+    char fatName[12];
+
+    // convert from name to fat name
+    memset(fatName, ' ', sizeof(fatName));
+    fatName[11] = '\0';
+
+    const char* ext = strchr(name, '.');
+    if (ext == NULL)
+        ext = name + 11;
+
+    for (int i = 0; i < 8 && name[i] && name + i < ext; i++)
+        fatName[i] = toupper(name[i]);
+
+    if (ext != name + 11)
+        for (int i = 0; i < 3 && ext[i + 1]; i++)
+            fatName[i + 8] = toupper(ext[i + 1]);
+
+    memcpy(nameOut, fatName, 12);
+}
+
+/*
+ * Directory scan
+ *
+ * A lookup in a directory nothing has cached yet compares the name with every entry, so it's done
+ * 8 entries at a time: the first 8 bytes of their names are compared with the first 8 bytes of
+ * the one we look for, and their first byte with the end of directory marker. On x86 the AVX2
+ * kernel is always built (for that function only) and picked at run time when the CPU has it,
+ * otherwise it's SSE2 when the compiler has it and word compares on the other CPUs. Only the
+ * (rare) blocks with a candidate or the end are looked at entry by entry.
+ */
+#define FAT_SCAN_BLOCK  8
+
+static inline uint64_t fat_name_head(const fat_dir_entry_t* entry)
+{
+    uint64_t head;
+    memcpy(&head, entry->filename, 8);
+    return head;
+}
+
+#if defined(FAT_SCAN_AVX2)
+__attribute__((target("avx2")))
+static inline void fat_scan_block_avx2(const fat_dir_entry_t* entries, uint64_t head, uint32_t* hits, uint32_t* ends)
+{
+    const __m256i name = _mm256_set1_epi64x(head);
+    const __m256i first_byte = _mm256_set1_epi64x(0xFF);
+    const __m128i offsets = _mm_setr_epi32(0, 4, 8, 12);   // in 8 byte units, an entry is 32 bytes
+
+    *hits = *ends = 0;
+    for(int i = 0; i < FAT_SCAN_BLOCK; i += 4)
+    {
+        __m256i heads = _mm256_i32gather_epi64((const long long*)&entries[i], offsets, 8);
+
+        *hits |= _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(heads, name))) << i;
+        *ends |= _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(heads, first_byte), _mm256_setzero_si256()))) << i;
+    }
+}
+#endif
+
+#if defined(__SSE2__)
+static inline void fat_scan_block(const fat_dir_entry_t* entries, uint64_t head, uint32_t* hits, uint32_t* ends)
+{
+    const __m128i name = _mm_set1_epi64x(head);
+    const __m128i first_byte = _mm_set1_epi64x(0xFF);
+
+    *hits = *ends = 0;
+    for(int i = 0; i < FAT_SCAN_BLOCK; i += 2)
+    {
+        __m128i heads = _mm_set_epi64x(fat_name_head(&entries[i + 1]), fat_name_head(&entries[i]));
+
+        // no 64 bit compare in SSE2: both halves must be equal
+        __m128i equal = _mm_cmpeq_epi32(heads, name);
+        equal = _mm_and_si128(equal, _mm_shuffle_epi32(equal, _MM_SHUFFLE(2, 3, 0, 1)));
+        *hits |= _mm_movemask_pd(_mm_castsi128_pd(equal)) << i;
+
+        // the masked high halves are always zero, look at the low ones only
+        int nul = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(heads, first_byte), _mm_setzero_si128())));
+        *ends |= ((nul & 1) | ((nul >> 1) & 2)) << i;
+    }
+}
+#else
+static inline void fat_scan_block(const fat_dir_entry_t* entries, uint64_t head, uint32_t* hits, uint32_t* ends)
+{
+    *hits = *ends = 0;
+    for(int i = 0; i < FAT_SCAN_BLOCK; i++)
+    {
+        *hits |= (uint32_t)(fat_name_head(&entries[i]) == head) << i;
+        *ends |= (uint32_t)((uint8_t)entries[i].filename[0] == FAT_ENTRY_END) << i;
+    }
+}
+#endif
+
+/* Looks at one entry, 1 if it's the one, -1 if it ends the directory */
+static inline int fat_scan_check(const fat_dir_entry_t* entry, const char* fatname)
+{
+    if((uint8_t)entry->filename[0] == FAT_ENTRY_END)
+        return -1;
+
+    // a deleted entry or a piece of long name can't be what we look for
+    if(memcmp(entry->filename, fatname, 11) == 0 && (uint8_t)entry->filename[0] != FAT_ENTRY_DELETED && entry->attributes != FAT_ATTR_LFN)
+        return 1;
+
+    return 0;
+}
+
+/* The scan itself, built once with each kernel */
+static inline __attribute__((always_inline)) fat_dir_entry_t* fat_scan_dir(const fat_dir_entry_t* entries, char* fatname, int dirEntryCount, bool* end, bool avx2)
+{
+    char name[11];
+
+    memcpy(name, fatname, 11);
+    if((uint8_t)name[0] == FAT_ENTRY_DELETED)
+        name[0] = FAT_ENTRY_KANJI_E5;
+
+    uint64_t head;
+    memcpy(&head, name, 8);
+
+    *end = false;
+
+    for(int i = 0; i < dirEntryCount; i += FAT_SCAN_BLOCK)
+    {
+        int count = FAT_SCAN_BLOCK;
+        uint32_t hits = 0, ends = 0;
+
+        if(i + FAT_SCAN_BLOCK <= dirEntryCount)
+        {
+#if defined(FAT_SCAN_AVX2)
+            if(avx2)
+                fat_scan_block_avx2(&entries[i], head, &hits, &ends);
+            else
+#endif
+                fat_scan_block(&entries[i], head, &hits, &ends);
+            if((hits | ends) == 0)
+                continue;
+        }
+        else
+            count = dirEntryCount - i;  // what's left, less than a block
+
+        for(int j = 0; j < count; j++)
+        {
+            int found = fat_scan_check(&entries[i + j], name);
+            if(found != 0)
+            {
+                *end = found < 0;
+                return (found > 0) ? (fat_dir_entry_t*)&entries[i + j] : NULL;
+            }
+        }
+    }
+
+    (void)avx2;
+    return NULL;
+}
+
+#if defined(FAT_SCAN_AVX2)
+__attribute__((target("avx2")))
+static fat_dir_entry_t* fat_scan_dir_avx2(const fat_dir_entry_t* entries, char* fatname, int dirEntryCount, bool* end)
+{
+    return fat_scan_dir(entries, fatname, dirEntryCount, end, true);
+}
+#endif
+
+/*
+ * Finds 'fatname' in a buffer of directory entries, *end is set when the
+ * end of the directory is met: the next sectors don't need to be read.
+ */
+fat_dir_entry_t* fat12_lookup_in_dir(uint32_t* dir, char* fatname, int dirEntryCount, bool* end)
+{
+    const fat_dir_entry_t* entries = (const fat_dir_entry_t*)dir;
+
+#if defined(FAT_SCAN_AVX2)
+    if(__builtin_cpu_supports("avx2"))
+        return fat_scan_dir_avx2(entries, fatname, dirEntryCount, end);
+#endif
+
+    return fat_scan_dir(entries, fatname, dirEntryCount, end, false);
+}
+
+/* volume_lock must be held, for reading at least: the directory is read in a buffer of our own */
+static int fat_lookup(vnode_t* node, const char* name, struct vnode** result)
+{
+    fat_inode_t* dir_inode = node->vnode_data;
+    fs_info_t* fs_info = node->vnode_vfs->vfs_data;
+    int device_id = node->vnode_vfs->device_id;
+    
+    char fatName[12];
+    string_to_fatname(name, fatName);
+
+    /* The root directory has no entry, and ".." entries use cluster 0 to point to it */
+    uint32_t currentCluster = (dir_inode == NULL) ? 0 : entry_first_cluster(&dir_inode->entry, fs_info);
+    if(currentCluster == 0)
+        currentCluster = fs_info->root_cluster;   // on FAT32 the root directory is a regular cluster chain
+
+    fat_dir_entry_t* inode = NULL;
+    bool end = false;           // we met the end of the directory
+    uint32_t sector_lba = 0;    // first sector of what is currently in the buffer
+
+    uint32_t* buffer = malloc((currentCluster == 0) ? fs_info->bootSector->bytes_per_sector : fs_info->cluster_size);
+    if(buffer == NULL)
+    {
+        *result = NULL;
+        return VFS_ERROR;
+    }
+
+    // here we need to look either on the fixed root directory (FAT12/16) or on a cluster chain
+    if(currentCluster == 0)
+    {
+        int dirEntryCount = fs_info->bootSector->bytes_per_sector / 32; // because we're reading sector by sector of the root directory length
+        for(uint32_t i = 0; i < fs_info->root_dir_sectors && inode == NULL && !end; i++)
+        {
+            sector_lba = fs_info->first_root_dir_sector + i;
+            cache_read(device_id, buffer, sector_lba, 1);
+            inode = fat12_lookup_in_dir(buffer, fatName, dirEntryCount, &end);
+        }
+        
+    }
+    else
+    {
+        /* because we're reading cluster size directory length */
+        int dirEntryCount = fs_info->cluster_size / 32;
+        while (!is_end_of_chain(currentCluster, fs_info) && inode == NULL && !end)
+        {
+            sector_lba = cluster_to_Lba(currentCluster, fs_info);
+            cache_read(device_id, buffer, sector_lba, fs_info->bootSector->sectors_per_cluster);
+            inode = fat12_lookup_in_dir(buffer, fatName, dirEntryCount, &end);
+
+            currentCluster = get_next_cluster(currentCluster, fs_info);
+        }
+    }
+
+    *result = NULL;
+    if(inode != NULL)
+    {
+        uint32_t position = (uint8_t*)inode - (uint8_t*)buffer;
+        uint32_t bytes_per_sector = fs_info->bootSector->bytes_per_sector;
+
+        *result = create_vnode(node->vnode_vfs, inode, sector_lba + position / bytes_per_sector, position % bytes_per_sector);
+    }
+
+    free(buffer);
+
+    if(inode == NULL)
+        return VFS_ENOENT;
+
+    return (*result == NULL) ? VFS_ERROR : VFS_OK;
+}
+
+int fat12_lookup(vnode_t* node, const char* name, struct vnode** result)
+{
+    if(node->vnode_type != VDIR)
+    {
+        *result = NULL;
+        return VFS_ENOTDIR;
+    }
+
+    fs_info_t* fs_info = node->vnode_vfs->vfs_data;
+
+    pthread_rwlock_rdlock(&fs_info->volume_lock);
+    int status = fat_lookup(node, name, result);
+    pthread_rwlock_unlock(&fs_info->volume_lock);
+
+    return status;
+}
+
+/*
+ * Converts a FAT date/time pair to seconds since the epoch.
+ *
+ * FAT dates count years from 1980 and store the seconds divided by two.
+ * The day count uses the usual civil-from-days arithmetic so we don't depend on the host timezone.
+ */
+static uint64_t fat_to_unix_time(uint16_t date, uint16_t time)
+{
+    if(date == 0)
+        return 0;
+
+    int64_t year = 1980 + (date >> 9);
+    int64_t month = (date >> 5) & 0x0F;
+    int64_t day = date & 0x1F;
+
+    year -= (month <= 2);
+    int64_t era = year / 400;
+    int64_t year_of_era = year - era * 400;
+    int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    int64_t days = era * 146097 + day_of_era - 719468;
+
+    return days * 86400 + (time >> 11) * 3600 + ((time >> 5) & 0x3F) * 60 + (time & 0x1F) * 2;
+}
+
+int fat12_getattr(vnode_t* node, vfs_stat_t* stat)
+{
+    memset(stat, 0, sizeof(vfs_stat_t));
+    stat->type = node->vnode_type;
+
+    if((node->flags & VNODE_ROOT) == VNODE_ROOT)
+        return VFS_OK;  // the root directory has no entry, so no attributes !
+
+    fat_dir_entry_t* inode = &((fat_inode_t*)node->vnode_data)->entry;
+    fs_info_t* fs_info = node->vnode_vfs->vfs_data;
+
+    pthread_rwlock_rdlock(&fs_info->volume_lock);
+
+    stat->size = inode->fileSize;
+
+    if(inode->attributes & FAT_ATTR_READ_ONLY)
+        stat->flags |= VFS_STAT_RDONLY;
+    if(inode->attributes & FAT_ATTR_HIDDEN)
+        stat->flags |= VFS_STAT_HIDDEN;
+    if(inode->attributes & FAT_ATTR_SYSTEM)
+        stat->flags |= VFS_STAT_SYSTEM;
+
+    stat->create_time = fat_to_unix_time(inode->creationDate, inode->creationTime);
+    stat->modify_time = fat_to_unix_time(inode->writeDate, inode->writeTime);
+    stat->access_time = fat_to_unix_time(inode->lastAccessDate, 0);
+
+    pthread_rwlock_unlock(&fs_info->volume_lock);
+
+    return VFS_OK;
+}
+
+/*
+ * Fragmentation
+ *
+ * The files and directories of a volume are found by walking its tree: each one is a chain of
+ * clusters, and each break in a chain (the next cluster isn't the following one) starts a new extent.
+ *
+ * The defragmenter lays the chains out again from the start of the data area, a directory
+ * followed by its files, the directories in breadth-first order. For each chain, the clusters
+ * of other chains in the way are first moved to a free place, then the clusters of the chain
+ * are moved in order. A cluster is moved by copying it, linking the new one in place of the
+ * old one (in the FAT or in the directory entry) and freeing the old one, so the volume stays
+ * consistent between moves. The first cluster of a directory is also in its "." entry and in
+ * the ".." entries of its subdirectories. A FAT32 root directory and bad clusters don't move.
+ *
+ * It works on a mounted volume: the inodes of the open files are updated along the way, the
+ * volume is locked meanwhile.
+ */
+#define FAT_NO_CHAIN    0xFFFFFFFF  // owner of a free cluster, parent of the entries of a fixed root directory
+#define FAT_PINNED      0xFFFFFFFE  // owner of the clusters that can't move
+#define FAT_LOST        0xFFFFFFFD  // used in the FAT, until a chain claims it (pinned if none does)
+#define FAT_PATH_MAX    256
+
+typedef struct fat_chain
+{
+    uint32_t first;             // 0 for an empty file
+    uint32_t length;            // in clusters
+    uint32_t parent;            // chain of the directory holding the entry
+    uint32_t entry_index;       // position of the entry in that directory (FAT_NO_CHAIN for a root)
+    uint32_t children_start;    // the entries of a directory, in the chains
+    uint32_t children_end;
+    bool directory;
+    char path[FAT_PATH_MAX];
+} fat_chain_t;
+
+typedef struct fat_layout
+{
+    vfs_t* mountpoint;
+    fs_info_t* fs_info;
+    fat_chain_t* chains;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* owner;            // chain of each cluster
+    uint32_t* prev;             // previous cluster in its chain, 0 for the first one
+    uint8_t* buffer;            // a cluster
+    uint32_t moved;
+} fat_layout_t;
+
+/* The mounted volumes, the defragmenter must work on the FAT and the inodes they have in memory */
+static fs_info_t* mounted_volumes = NULL;
+static pthread_mutex_t volumes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void fat_register_volume(vfs_t* mountpoint)
+{
+    fs_info_t* fs_info = mountpoint->vfs_data;
+
+    pthread_mutex_lock(&volumes_lock);
+    fs_info->mountpoint = mountpoint;
+    fs_info->next_volume = mounted_volumes;
+    mounted_volumes = fs_info;
+    pthread_mutex_unlock(&volumes_lock);
+}
+
+static void fat_unregister_volume(vfs_t* mountpoint)
+{
+    pthread_mutex_lock(&volumes_lock);
+    for(fs_info_t** volume = &mounted_volumes; *volume != NULL; volume = &(*volume)->next_volume)
+    {
+        if(*volume == mountpoint->vfs_data)
+        {
+            *volume = (*volume)->next_volume;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&volumes_lock);
+}
+
+static uint32_t fat_add_chain(fat_layout_t* layout, uint32_t parent, uint32_t entry_index, const char* name, bool directory, uint32_t first)
+{
+    if(layout->count == layout->capacity)
+    {
+        uint32_t capacity = (layout->capacity == 0) ? 64 : layout->capacity * 2;
+        fat_chain_t* chains = realloc(layout->chains, capacity * sizeof(fat_chain_t));
+        if(chains == NULL)
+            return FAT_NO_CHAIN;
+
+        layout->chains = chains;
+        layout->capacity = capacity;
+    }
+
+    fat_chain_t* chain = &layout->chains[layout->count];
+    memset(chain, 0, sizeof(fat_chain_t));
+    chain->first = first;
+    chain->parent = parent;
+    chain->entry_index = entry_index;
+    chain->directory = directory;
+    if(snprintf(chain->path, FAT_PATH_MAX, "%s/%s", (parent == FAT_NO_CHAIN) ? "" : layout->chains[parent].path, name) >= FAT_PATH_MAX)
+        memcpy(chain->path + FAT_PATH_MAX - 4, "...", 4);   // only used to report it
+
+    return layout->count++;
+}
+
+/* Follows a new chain, its clusters must not belong to another one */
+static int fat_claim_chain(fat_layout_t* layout, uint32_t index, uint32_t owner)
+{
+    fs_info_t* fs_info = layout->fs_info;
+    uint32_t previous = 0;
+
+    for(uint32_t cluster = layout->chains[index].first; !is_end_of_chain(cluster, fs_info); cluster = get_next_cluster(cluster, fs_info))
+    {
+        if(cluster >= fs_info->total_clusters + 2 || layout->owner[cluster] != FAT_LOST)
+            return VFS_ERROR;   // cross-linked, looping or free cluster, the volume needs to be repaired first
+
+        layout->owner[cluster] = owner;
+        layout->prev[cluster] = previous;
+        layout->chains[index].length++;
+        previous = cluster;
+    }
+
+    return VFS_OK;
+}
+
+/* Turns "NAME    EXT" into "NAME.EXT" */
+static void fatname_to_string(const char* fatname, char* name)
+{
+    int length = 0;
+
+    for(int i = 0; i < 8 && fatname[i] != ' '; i++)
+        name[length++] = fatname[i];
+
+    if(fatname[8] != ' ')
+    {
+        name[length++] = '.';
+        for(int i = 8; i < 11 && fatname[i] != ' '; i++)
+            name[length++] = fatname[i];
+    }
+
+    name[length] = '\0';
+}
+
+/* Adds the entries of a directory (the fixed root directory if 'index' is FAT_NO_CHAIN) */
+static int fat_scan_directory(fat_layout_t* layout, uint32_t index)
+{
+    fs_info_t* fs_info = layout->fs_info;
+    uint32_t bytes_per_sector = fs_info->bootSector->bytes_per_sector;
+    bool fixed = (index == FAT_NO_CHAIN);
+    uint32_t cluster = fixed ? 0 : layout->chains[index].first;
+    uint32_t entries_per_block = (fixed ? bytes_per_sector : fs_info->cluster_size) / 32;
+    uint32_t entry_index = 0;
+    uint32_t start = layout->count;
+
+    for(uint32_t block = 0; fixed ? block < fs_info->root_dir_sectors : !is_end_of_chain(cluster, fs_info); block++)
+    {
+        if(fixed)
+            cache_read(layout->mountpoint->device_id, layout->buffer, fs_info->first_root_dir_sector + block, 1);
+        else
+            cache_read(layout->mountpoint->device_id, layout->buffer, cluster_to_Lba(cluster, fs_info), fs_info->bootSector->sectors_per_cluster);
+
+        for(uint32_t i = 0; i < entries_per_block; i++, entry_index++)
+        {
+            fat_dir_entry_t* entry = (fat_dir_entry_t*)layout->buffer + i;
+            uint8_t first_byte = entry->filename[0];
+
+            if(first_byte == FAT_ENTRY_END)
+                goto out;
+
+            if(first_byte == FAT_ENTRY_DELETED || first_byte == '.' || entry->attributes == FAT_ATTR_LFN || (entry->attributes & FAT_ATTR_VOLUME_ID))
+                continue;
+
+            char name[13];
+            fatname_to_string(entry->filename, name);
+
+            uint32_t child = fat_add_chain(layout, index, entry_index, name, (entry->attributes & FAT_ATTR_DIRECTORY) != 0, entry_first_cluster(entry, fs_info));
+            if(child == FAT_NO_CHAIN || fat_claim_chain(layout, child, child) != VFS_OK)
+                return VFS_ERROR;
+        }
+
+        if(!fixed)
+            cluster = get_next_cluster(cluster, fs_info);
+    }
+
+out:
+    if(!fixed)
+    {
+        layout->chains[index].children_start = start;
+        layout->chains[index].children_end = layout->count;
+    }
+
+    return VFS_OK;
+}
+
+static void fat_free_layout(fat_layout_t* layout)
+{
+    free(layout->chains);
+    free(layout->owner);
+    free(layout->prev);
+    free(layout->buffer);
+}
+
+/* Finds every chain of the volume, the directories in breadth-first order */
+static int fat_scan_layout(vfs_t* mountpoint, fat_layout_t* layout)
+{
+    fs_info_t* fs_info = mountpoint->vfs_data;
+    uint32_t cluster_count = fs_info->total_clusters + 2;
+
+    memset(layout, 0, sizeof(fat_layout_t));
+    layout->mountpoint = mountpoint;
+    layout->fs_info = fs_info;
+    layout->owner = malloc(cluster_count * sizeof(uint32_t));
+    layout->prev = calloc(cluster_count, sizeof(uint32_t));
+    layout->buffer = malloc(fs_info->cluster_size);
+
+    if(layout->owner == NULL || layout->prev == NULL || layout->buffer == NULL)
+    {
+        fat_free_layout(layout);
+        return VFS_ERROR;
+    }
+
+    for(uint32_t cluster = 0; cluster < cluster_count; cluster++)
+    {
+        uint32_t value = (cluster < 2) ? 0 : get_next_cluster(cluster, fs_info);
+        bool bad = (value == fs_info->end_of_chain - 1);
+
+        if(cluster < 2 || bad)
+            layout->owner[cluster] = FAT_PINNED;
+        else
+            layout->owner[cluster] = (value == 0) ? FAT_NO_CHAIN : FAT_LOST;
+    }
+
+    int status;
+    if(fs_info->root_cluster != 0)
+    {
+        // the FAT32 root directory is a chain, but its first cluster is in the boot sector
+        uint32_t root = fat_add_chain(layout, FAT_NO_CHAIN, FAT_NO_CHAIN, "", true, fs_info->root_cluster);
+        status = (root == FAT_NO_CHAIN) ? VFS_ERROR : fat_claim_chain(layout, root, FAT_PINNED);
+        layout->chains[0].path[0] = '\0';
+    }
+    else
+        status = fat_scan_directory(layout, FAT_NO_CHAIN);
+
+    for(uint32_t i = 0; status == VFS_OK && i < layout->count; i++)
+    {
+        if(layout->chains[i].directory && layout->chains[i].first != 0)
+            status = fat_scan_directory(layout, i);
+    }
+
+    if(status != VFS_OK)
+    {
+        fat_free_layout(layout);
+        return status;
+    }
+
+    // lost clusters (no entry leads to them) aren't free, leave them where they are
+    for(uint32_t cluster = 2; cluster < cluster_count; cluster++)
+    {
+        if(layout->owner[cluster] == FAT_LOST)
+            layout->owner[cluster] = FAT_PINNED;
+    }
+
+    return VFS_OK;
+}
+
+static uint32_t fat_count_extents(fat_layout_t* layout, uint32_t index)
+{
+    fs_info_t* fs_info = layout->fs_info;
+    uint32_t extents = 0;
+    uint32_t previous = 0;
+
+    for(uint32_t cluster = layout->chains[index].first; !is_end_of_chain(cluster, fs_info); cluster = get_next_cluster(cluster, fs_info))
+    {
+        if(cluster != previous + 1)
+            extents++;
+        previous = cluster;
+    }
+
+    return extents;
+}
+
+static void fat_report_layout(fat_layout_t* layout, fat_frag_report_t report, void* arg, fat_frag_stats_t* stats)
+{
+    memset(stats, 0, sizeof(fat_frag_stats_t));
+    stats->moved = layout->moved;
+
+    for(uint32_t i = 0; i < layout->count; i++)
+    {
+        fat_chain_t* chain = &layout->chains[i];
+        if(chain->length == 0)
+            continue;
+
+        uint32_t extents = fat_count_extents(layout, i);
+
+        stats->files++;
+        stats->clusters += chain->length;
+        stats->extents += extents;
+        if(extents > 1)
+            stats->fragmented++;
+
+        if(report != NULL)
+            report(chain->path[0] ? chain->path : "/", chain->length, extents, arg);
+    }
+}
+
+/* Where the entry of a chain is on the disk */
+static void fat_entry_location(fat_layout_t* layout, uint32_t index, uint32_t* lba, uint16_t* offset)
+{
+    fs_info_t* fs_info = layout->fs_info;
+    fat_chain_t* chain = &layout->chains[index];
+    uint32_t bytes_per_sector = fs_info->bootSector->bytes_per_sector;
+    uint32_t position = chain->entry_index * sizeof(fat_dir_entry_t);
+
+    if(chain->parent == FAT_NO_CHAIN)
+        *lba = fs_info->first_root_dir_sector + position / bytes_per_sector;
+    else
+    {
+        uint32_t cluster = layout->chains[chain->parent].first;
+        for(uint32_t i = 0; i < position / fs_info->cluster_size; i++)
+            cluster = get_next_cluster(cluster, fs_info);
+
+        *lba = cluster_to_Lba(cluster, fs_info) + (position % fs_info->cluster_size) / bytes_per_sector;
+    }
+
+    *offset = position % bytes_per_sector;
+}
+
+/* Changes the first cluster stored in a directory entry on the disk */
+static void fat_patch_entry(fat_layout_t* layout, uint32_t lba, uint16_t offset, uint32_t cluster)
+{
+    uint8_t sector[CACHE_BLOCK_SIZE];
+    int device_id = layout->mountpoint->device_id;
+
+    cache_read(device_id, sector, lba, 1);
+
+    fat_dir_entry_t* entry = (fat_dir_entry_t*)(sector + offset);
+    entry->firstClusterLow = cluster & 0xFFFF;
+    entry->firstClusterHigh = (layout->fs_info->fat_type == FAT_TYPE_32) ? cluster >> 16 : 0;
+
+    cache_write(device_id, sector, lba, 1);
+}
+
+/* A chain starts somewhere else: its entry, its inode if it's open, and for a directory "." and the ".." of its subdirectories */
+static void fat_set_first_cluster(fat_layout_t* layout, uint32_t index, uint32_t cluster)
+{
+    fs_info_t* fs_info = layout->fs_info;
+    fat_chain_t* chain = &layout->chains[index];
+    uint32_t lba;
+    uint16_t offset;
+
+    fat_entry_location(layout, index, &lba, &offset);
+    fat_patch_entry(layout, lba, offset, cluster);
+
+    for(int i = 0; i < MAX_VNODE_PER_VFS; i++)
+    {
+        fat_inode_t* inode = (fs_info->total_vnode[i] != NULL) ? fs_info->total_vnode[i]->vnode_data : NULL;
+
+        if(inode != NULL && inode->entry_lba == lba && inode->entry_offset == offset)
+        {
+            inode->entry.firstClusterLow = cluster & 0xFFFF;
+            inode->entry.firstClusterHigh = (fs_info->fat_type == FAT_TYPE_32) ? cluster >> 16 : 0;
+        }
+    }
+
+    chain->first = cluster;
+
+    if(!chain->directory)
+        return;
+
+    uint8_t* first = layout->buffer;
+    cache_read(layout->mountpoint->device_id, first, cluster_to_Lba(cluster, fs_info), 1);
+    if(first[0] == '.')
+        fat_patch_entry(layout, cluster_to_Lba(cluster, fs_info), 0, cluster);
+
+    for(uint32_t child = chain->children_start; child < chain->children_end; child++)
+    {
+        fat_chain_t* subdirectory = &layout->chains[child];
+        if(!subdirectory->directory || subdirectory->first == 0)
+            continue;
+
+        cache_read(layout->mountpoint->device_id, first, cluster_to_Lba(subdirectory->first, fs_info), 1);
+        if(first[sizeof(fat_dir_entry_t)] == '.')
+            fat_patch_entry(layout, cluster_to_Lba(subdirectory->first, fs_info), sizeof(fat_dir_entry_t), cluster);
+    }
+}
+
+/* Moves a cluster to a free one, its chain stays valid */
+static void fat_move_cluster(fat_layout_t* layout, uint32_t from, uint32_t to)
+{
+    fs_info_t* fs_info = layout->fs_info;
+    vfs_t* mountpoint = layout->mountpoint;
+    uint32_t sectors = fs_info->bootSector->sectors_per_cluster;
+    uint32_t index = layout->owner[from];
+
+    cache_read(mountpoint->device_id, layout->buffer, cluster_to_Lba(from, fs_info), sectors);
+    cache_write(mountpoint->device_id, layout->buffer, cluster_to_Lba(to, fs_info), sectors);
+
+    uint32_t next = get_next_cluster(from, fs_info);
+    set_next_cluster(mountpoint, to, next);
+
+    layout->owner[to] = index;
+    layout->prev[to] = layout->prev[from];
+
+    if(layout->prev[from] != 0)
+        set_next_cluster(mountpoint, layout->prev[from], to);
+    else
+        fat_set_first_cluster(layout, index, to);
+
+    set_next_cluster(mountpoint, from, 0);
+    layout->owner[from] = FAT_NO_CHAIN;
+    layout->prev[from] = 0;
+
+    if(!is_end_of_chain(next, fs_info))
+        layout->prev[next] = to;
+
+    // the open files having their entry in this cluster
+    if(layout->chains[index].directory)
+    {
+        uint32_t old_lba = cluster_to_Lba(from, fs_info);
+
+        for(int i = 0; i < MAX_VNODE_PER_VFS; i++)
+        {
+            fat_inode_t* inode = (fs_info->total_vnode[i] != NULL) ? fs_info->total_vnode[i]->vnode_data : NULL;
+
+            if(inode != NULL && inode->entry_lba >= old_lba && inode->entry_lba < old_lba + sectors)
+                inode->entry_lba = inode->entry_lba - old_lba + cluster_to_Lba(to, fs_info);
+        }
+    }
+
+    layout->moved++;
+}
+
+/* A free cluster outside of [start, end), searching from 'end' */
+static uint32_t fat_find_free(fat_layout_t* layout, uint32_t start, uint32_t end)
+{
+    uint32_t cluster_count = layout->fs_info->total_clusters + 2;
+
+    for(uint32_t i = 0, cluster = end; i < cluster_count; i++, cluster++)
+    {
+        if(cluster >= cluster_count)
+            cluster = 2;
+
+        if((cluster < start || cluster >= end) && layout->owner[cluster] == FAT_NO_CHAIN)
+            return cluster;
+    }
+
+    return 0;
+}
+
+/* Makes the chain contiguous from 'target', where no cluster is pinned */
+static int fat_place_chain(fat_layout_t* layout, uint32_t index, uint32_t target)
+{
+    fs_info_t* fs_info = layout->fs_info;
+    uint32_t length = layout->chains[index].length;
+
+    // first the clusters in the way, ours included when they're not at their place
+    uint32_t position = 0;
+    for(uint32_t cluster = layout->chains[index].first; !is_end_of_chain(cluster, fs_info); position++)
+    {
+        uint32_t next = get_next_cluster(cluster, fs_info);
+        if(cluster >= target && cluster < target + length && cluster != target + position)
+        {
+            uint32_t free_cluster = fat_find_free(layout, target, target + length);
+            if(free_cluster == 0)
+                return VFS_ERROR;
+
+            fat_move_cluster(layout, cluster, free_cluster);
+        }
+        cluster = next;
+    }
+
+    for(uint32_t cluster = target; cluster < target + length; cluster++)
+    {
+        uint32_t owner = layout->owner[cluster];
+        if(owner == FAT_NO_CHAIN || owner == index)
+            continue;
+
+        uint32_t free_cluster = fat_find_free(layout, target, target + length);
+        if(free_cluster == 0)
+            return VFS_ERROR;
+
+        fat_move_cluster(layout, cluster, free_cluster);
+    }
+
+    // then ours, in order
+    position = 0;
+    for(uint32_t cluster = layout->chains[index].first; !is_end_of_chain(cluster, fs_info); position++)
+    {
+        uint32_t next = get_next_cluster(cluster, fs_info);
+        if(cluster != target + position)
+            fat_move_cluster(layout, cluster, target + position);
+        cluster = next;
+    }
+
+    return VFS_OK;
+}
+
+/* The order of the chains on the disk: a directory then its files, the directories breadth-first */
+static uint32_t fat_layout_order(fat_layout_t* layout, uint32_t* order)
+{
+    uint32_t count = 0;
+
+    // the files of a fixed root directory come first, they're the first chains
+    for(uint32_t i = 0; i < layout->count && layout->chains[i].parent == FAT_NO_CHAIN; i++)
+    {
+        if(!layout->chains[i].directory)
+            order[count++] = i;
+    }
+
+    for(uint32_t directory = 0; directory < layout->count; directory++)
+    {
+        fat_chain_t* chain = &layout->chains[directory];
+        if(!chain->directory)
+            continue;
+
+        if(chain->entry_index != FAT_NO_CHAIN)
+            order[count++] = directory;     // not the FAT32 root directory, it can't move
+
+        for(uint32_t child = chain->children_start; child < chain->children_end; child++)
+        {
+            if(!layout->chains[child].directory)
+                order[count++] = child;
+        }
+    }
+
+    return count;
+}
+
+/* The first cluster from 'target' where 'length' clusters fit between the pinned ones */
+static uint32_t fat_fit(fat_layout_t* layout, uint32_t target, uint32_t length)
+{
+    uint32_t cluster_count = layout->fs_info->total_clusters + 2;
+
+    for(uint32_t i = 0; i < length && target + i < cluster_count; )
+    {
+        if(layout->owner[target + i] == FAT_PINNED)
+        {
+            target += i + 1;
+            i = 0;
+        }
+        else
+            i++;
+    }
+
+    return target;
+}
+
+static int fat_defrag_layout(fat_layout_t* layout)
+{
+    fs_info_t* fs_info = layout->fs_info;
+    uint32_t cluster_count = fs_info->total_clusters + 2;
+    uint32_t target = 2;
+
+    uint32_t* order = malloc((layout->count + 1) * sizeof(uint32_t));
+    if(order == NULL)
+        return VFS_ERROR;
+
+    int status = VFS_OK;
+    uint32_t count = fat_layout_order(layout, order);
+
+    for(uint32_t i = 0; i < count && status == VFS_OK; i++)
+    {
+        fat_chain_t* chain = &layout->chains[order[i]];
+        if(chain->length == 0)
+            continue;   // an empty file
+
+        target = fat_fit(layout, target, chain->length);
+        if(target + chain->length > cluster_count)
+            status = VFS_ERROR;
+        else
+            status = fat_place_chain(layout, order[i], target);
+
+        target += chain->length;
+    }
+
+    free(order);
+
+    // the free space starts right after the files now
+    if(status == VFS_OK && target < cluster_count)
+        fs_info->next_free_cluster = target;
+
+    return status;
+}
+
+/*
+ * Runs the scan, and the defragmentation if asked, on the volume of a device. If it's mounted
+ * we work on the mounted volume, with its FAT and its open files, otherwise it's mounted for the time of it.
+ */
+static int fat_run_on_volume(int device_id, bool defrag, fat_frag_report_t report, void* arg, fat_frag_stats_t* stats)
+{
+    if(device_id < 0 || device_id >= device_num)
+        return VFS_ERROR;
+
+    pthread_mutex_lock(&volumes_lock);
+
+    vfs_t* mountpoint = NULL;
+    for(fs_info_t* volume = mounted_volumes; volume != NULL && mountpoint == NULL; volume = volume->next_volume)
+    {
+        if(volume->device_id == device_id)
+            mountpoint = volume->mountpoint;
+    }
+
+    // once we have its lock the volume can't go away, fat12_unmount() waits for it
+    if(mountpoint != NULL)
+        pthread_rwlock_wrlock(&((fs_info_t*)mountpoint->vfs_data)->volume_lock);
+
+    pthread_mutex_unlock(&volumes_lock);
+
+    vfs_t offline;
+    if(mountpoint == NULL)
+    {
+        memset(&offline, 0, sizeof(vfs_t));
+        offline.device_id = device_id;
+        offline.vfs_op = &fat12_op;
+        if(fat12_mount(&offline, device_id) != VFS_OK)
+            return VFS_ERROR;
+
+        mountpoint = &offline;
+        pthread_rwlock_wrlock(&((fs_info_t*)mountpoint->vfs_data)->volume_lock);
+    }
+
+    fs_info_t* fs_info = mountpoint->vfs_data;
+
+    fat_layout_t layout;
+    int status = fat_scan_layout(mountpoint, &layout);
+
+    if(status == VFS_OK)
+    {
+        if(defrag)
+        {
+            status = fat_defrag_layout(&layout);
+
+            // the cached pages are named after directory entries that may have moved
+            pagecache_invalidate_volume(mountpoint->vfs_data);
+
+            // both FAT copies, even in lazy mirror mode
+            fat_flush_table(mountpoint, true);
+            fat_sync_volume(mountpoint);
+        }
+
+        if(stats != NULL)
+            fat_report_layout(&layout, report, arg, stats);
+
+        fat_free_layout(&layout);
+    }
+
+    pthread_rwlock_unlock(&fs_info->volume_lock);
+
+    if(mountpoint == &offline)
+        fat12_unmount(&offline);
+
+    return status;
+}
+
+/*
+ * Reports the fragmentation of a FAT volume: 'report' (may be NULL) is called for each file and
+ * directory having clusters, and 'stats' gets the totals.
+ */
+int fat12_fragmentation(int device_id, fat_frag_report_t report, void* arg, fat_frag_stats_t* stats)
+{
+    fat_frag_stats_t totals;
+    return fat_run_on_volume(device_id, false, report, arg, (stats != NULL) ? stats : &totals);
+}
+
+/*
+ * Makes the files and directories of a FAT volume contiguous, see "Fragmentation".
+ * 'stats' (may be NULL) gets the fragmentation left and the count of clusters moved. If there's not
+ * enough free space to move a file out of the way we stop there, the volume stays consistent.
+ */
+int fat12_defrag(int device_id, fat_frag_stats_t* stats)
+{
+    return fat_run_on_volume(device_id, true, NULL, NULL, stats);
+}
@@ -24,4 +24,23 @@
 
 #pragma once
 
-void fat12_init();
\ No newline at end of file
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Fragmentation of a FAT volume, the files and directories having clusters */
+typedef struct fat_frag_stats
+{
+    uint32_t files;
+    uint32_t fragmented;    // files made of more than one extent
+    uint32_t extents;       // runs of contiguous clusters
+    uint32_t clusters;
+    uint32_t moved;         // clusters moved by fat12_defrag()
+} fat_frag_stats_t;
+
+typedef void (*fat_frag_report_t)(const char* path, uint32_t clusters, uint32_t extents, void* arg);
+
+void fat12_init();
+void fat12_set_lazy_mirrors(bool enabled);
+void fat12_set_lazy_fat(bool enabled);
+int fat12_fragmentation(int device_id, fat_frag_report_t report, void* arg, fat_frag_stats_t* stats);
+int fat12_defrag(int device_id, fat_frag_stats_t* stats);
@@ -41,13 +41,25 @@ int main()
 
     printf("device number %d\n\n", device_num);
 
-    printf("mounting %s to /\n", device_list[0]->name);
-    if(vfs_mount("fat12", "/", 0) != VFS_OK)
-        printf("error while mounting %s at /!\n", device_list[0]->name);
+    // both devices are mounted in parallel, the second one on a directory of the first one
+    vfs_mount_request_t mounts[] = {
+        {.fs_name = "fat12", .mount_point = "/", .device_id = 0},
+        {.fs_name = "fat12", .mount_point = "/mydir", .device_id = 1},
+    };
 
-    printf("mounting %s to /mydir\n", device_list[1]->name);
-    if(vfs_mount("fat12", "/mydir", 1) != VFS_OK)
-        printf("error while mounting %s at /mydir!\n", device_list[1]->name);
+    // the second one needs a second disk
+    int mount_count = (device_num < 2) ? device_num : 2;
+    if(mount_count < 2)
+        printf("only %d disk(s) found, %d mount(s) skipped\n", device_num, 2 - mount_count);
+
+    vfs_mount_many(mounts, mount_count, true);
+
+    for(int i = 0; i < mount_count; i++)
+    {
+        printf("mounting %s to %s\n", device_list[mounts[i].device_id]->name, mounts[i].mount_point);
+        if(mounts[i].status != VFS_OK)
+            printf("error while mounting %s at %s!\n", device_list[mounts[i].device_id]->name, mounts[i].mount_point);
+    }
 
     printf("\n");
 
@@ -56,15 +68,14 @@ int main()
 
     printf("descriptor: %d\n", fd1);
 
-    size_t read = 0;
+    ssize_t read = 0;
 
     printf("content:\n");
-    do
+    while((read = vfs_read(fd1, buffer, 9)) > 0)
     {
-        read = vfs_read(fd1, buffer, 9);
         buffer[read] = '\0';
         printf("%s", buffer);
-    }while(read != 0);
+    }
 
     printf("\n");
     vfs_close(fd1);
@@ -0,0 +1,142 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "membudget.h"
+
+#define MEMBUDGET_MAX_SHRINKERS 16
+
+/* 'accounts_lock' protects the list, 'reclaim_lock' lets a single thread shrink the caches at once */
+static pthread_mutex_t accounts_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static membudget_account_t* accounts;  // sorted by priority
+static _Atomic size_t total_usage;
+static _Atomic size_t limit;
+
+static void register_account(membudget_account_t* account)
+{
+    pthread_mutex_lock(&accounts_lock);
+
+    if(!atomic_load(&account->registered))
+    {
+        membudget_account_t** link = &accounts;
+        while(*link != NULL && (*link)->priority <= account->priority)
+            link = &(*link)->next;
+
+        account->next = *link;
+        *link = account;
+        atomic_store(&account->registered, true);
+    }
+
+    pthread_mutex_unlock(&accounts_lock);
+}
+
+void membudget_charge(membudget_account_t* account, ssize_t bytes)
+{
+    if(!atomic_load_explicit(&account->registered, memory_order_acquire))
+        register_account(account);
+
+    atomic_fetch_add_explicit(&account->usage, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&total_usage, bytes, memory_order_relaxed);
+}
+
+/*
+ * Shrinks the caches until the total is back under the budget.
+ * Nothing happens if another thread is already at it: the caller doesn't wait, the budget is a
+ * target and the memory above it is given back soon.
+ */
+void membudget_balance()
+{
+    size_t budget = atomic_load_explicit(&limit, memory_order_relaxed);
+    if(budget == 0 || atomic_load_explicit(&total_usage, memory_order_relaxed) <= budget)
+        return;
+
+    if(pthread_mutex_trylock(&reclaim_lock) != 0)
+        return;
+
+    // the shrinkers take their own locks, they're called once the list is released
+    membudget_shrink_t shrinkers[MEMBUDGET_MAX_SHRINKERS];
+    int count = 0;
+
+    pthread_mutex_lock(&accounts_lock);
+    for(membudget_account_t* account = accounts; account != NULL && count < MEMBUDGET_MAX_SHRINKERS; account = account->next)
+    {
+        if(account->shrink != NULL)
+            shrinkers[count++] = account->shrink;
+    }
+    pthread_mutex_unlock(&accounts_lock);
+
+    for(int i = 0; i < count; i++)
+    {
+        size_t total = atomic_load_explicit(&total_usage, memory_order_relaxed);
+        if(total <= budget)
+            break;
+
+        shrinkers[i](total - budget);
+    }
+
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+void membudget_set_limit(size_t bytes)
+{
+    atomic_store(&limit, bytes);
+    membudget_balance();
+}
+
+size_t membudget_get_limit()
+{
+    return atomic_load(&limit);
+}
+
+size_t membudget_total()
+{
+    return atomic_load(&total_usage);
+}
+
+int membudget_usage(membudget_usage_t usage[], int max)
+{
+    int count = 0;
+
+    pthread_mutex_lock(&accounts_lock);
+
+    for(membudget_account_t* account = accounts; account != NULL; account = account->next, count++)
+    {
+        if(count >= max)
+            continue;
+
+        usage[count].name = account->name;
+        usage[count].priority = account->priority;
+        usage[count].shrinkable = (account->shrink != NULL);
+        usage[count].usage = atomic_load(&account->usage);
+    }
+
+    pthread_mutex_unlock(&accounts_lock);
+
+    return count;
+}
@@ -0,0 +1,78 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Memory budget
+ *
+ * Every cache reports the memory it holds to an account, and the accounts are kept in a single
+ * list so the total can be held under a budget (membudget_set_limit(), or VFS_MEMORY_LIMIT for a
+ * whole run, in bytes with an optional K, M or G suffix).
+ *
+ * Over the budget, the accounts having a shrinker are asked to give memory back, lowest priority
+ * first, until the total fits. The memory that can't be given back (file content, the FAT of a
+ * mounted volume...) still counts: the caches shrink to leave room for it.
+ *
+ * Accounts are static objects registered on their first charge. Charging never shrinks anything,
+ * as the caller may hold the locks a shrinker needs: membudget_balance() does, and it's called
+ * by the allocators once their locks are released (and by the cache flusher on each round).
+ */
+
+/* Frees at least 'bytes' if possible, returns what was freed */
+typedef size_t (*membudget_shrink_t)(size_t bytes);
+
+typedef struct membudget_account
+{
+    const char* name;
+    int priority;                       // the accounts with the lowest priority are shrunk first
+    membudget_shrink_t shrink;          // NULL if this memory can't be given back
+    _Atomic size_t usage;               // in bytes
+    _Atomic bool registered;
+    struct membudget_account* next;
+} membudget_account_t;
+
+/* What membudget_usage() reports for an account */
+typedef struct membudget_usage
+{
+    const char* name;
+    int priority;
+    bool shrinkable;
+    size_t usage;
+} membudget_usage_t;
+
+void membudget_charge(membudget_account_t* account, ssize_t bytes);
+void membudget_balance();
+
+void membudget_set_limit(size_t bytes);     // 0 for no limit (the default)
+size_t membudget_get_limit();
+size_t membudget_total();
+
+/* Fills 'usage' with up to 'max' accounts in priority order, returns how many there are */
+int membudget_usage(membudget_usage_t usage[], int max);
@@ -0,0 +1,937 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "overlay.h"
+#include "vfs.h"
+#include "device.h"
+#include "epoch.h"
+#include "ramfs.h"
+
+/*
+ * Each overlay vnode pins its vnodes in the layers (up to two in the upper layer) until it's freed,
+ * a bit after its eviction, and the tables of the layers only have 16 slots.
+ */
+#define MAX_VNODE_PER_VFS   6
+
+#define BITMAP_SET(bitmap, bit)     ((bitmap)[(bit) / 8] |= (1 << ((bit) % 8)))
+#define BITMAP_TEST(bitmap, bit)    (((bitmap)[(bit) / 8] >> ((bit) % 8)) & 1)
+
+/* What overlay_create() stores in the 'priv' field of the device */
+typedef struct ovl_device
+{
+    filesystem_t* lower_fs;
+    int lower_device_id;
+    int upper_device_id;
+} ovl_device_t;
+
+/*
+ * 'upper' is only set once (by a copy up, or when ovl_upper_dir() makes the upper directory) and
+ * read without lock, everything a copy up sets is in place before it. The copy state of a partially
+ * copied file then changes under 'copy_lock'.
+ */
+typedef struct ovl_inode
+{
+    char* path;             // path inside the overlay, "" for the root
+    vnode_t* upper;         // NULL when the upper layer has nothing (yet)
+    vnode_t* lower;         // NULL when the lower layer has nothing or is hidden
+    pthread_mutex_t copy_lock;      // serializes the copy up and the writes of the file
+
+    /* Only for a lower file partially copied up */
+    vnode_t* copyup_map;    // upper file keeping 'copied' across mounts
+    uint8_t* copied;        // one bit per page, set once the page lives in the upper layer
+    uint64_t lower_size;
+} ovl_inode_t;
+
+/* Important information for the file system ! */
+typedef struct ovl_info
+{
+    // the vnode table, and the upper part of the directories found by ovl_upper_dir(). Nothing is called with it held.
+    pthread_mutex_t vnode_lock;
+    vnode_t* total_vnode[MAX_VNODE_PER_VFS];
+    vnode_t* root_vnode;
+
+    // the layers are mounted here, they don't appear in the mount list
+    vfs_t lower;
+    vfs_t upper;
+} fs_info_t;
+
+int ovl_mount(vfs_t* mountpoint, int device_id);
+int ovl_unmount(vfs_t* mountpoint);
+int ovl_get_root(vfs_t* mountpoint, vnode_t** result);
+
+ssize_t ovl_read(vnode_t* node, void *buffer, size_t size, uint64_t offset);
+ssize_t ovl_write(vnode_t* node, const void *buffer, size_t size, uint64_t offset);
+int ovl_lookup(vnode_t* node, const char* name, struct vnode** result);
+int ovl_getattr(vnode_t* node, vfs_stat_t* stat);
+int ovl_create(vnode_t* node_dir, const char* name, vtype type, struct vnode** result);
+int ovl_remove(vnode_t* node_dir, const char* name);
+
+filesystem_t ovl_op = {
+    // fs_name will be filled later
+    .get_root = ovl_get_root,
+    .vfs_mount = ovl_mount,
+    .vfs_unmount = ovl_unmount,
+};
+
+vnodeops_t ovl_vnode_op = {
+    .read = ovl_read,
+    .write = ovl_write,
+    .lookup = ovl_lookup,
+    .getattr = ovl_getattr,
+    .create = ovl_create,
+    .remove = ovl_remove,
+};
+
+static objpool_t* vnode_pool = NULL;   // the vnodes and their ovl_inode_t
+
+void overlay_init()
+{
+    if(vnode_pool == NULL)
+        vnode_pool = vfs_create_vnode_pool("overlay vnode", sizeof(ovl_inode_t));
+
+    strcpy(ovl_op.fs_name, "overlay");
+    vfs_register_new_filesystem(&ovl_op);
+}
+
+/*
+ * Registers a device combining two other devices, mount it with the "overlay" file system.
+ *
+ * @param device_name      the name of the new device.
+ * @param lower_fs         the file system of the lower device (e.g. "fat12"), only read.
+ * @param lower_device_id  the read-only device.
+ * @param upper_device_id  a ramfs device receiving every change.
+ * @return                 the id of the new device, or VFS_ERROR.
+ */
+int overlay_create(const char* device_name, const char* lower_fs, int lower_device_id, int upper_device_id)
+{
+    filesystem_t* fs = vfs_find_filesystem(lower_fs);
+
+    if(fs == NULL || lower_device_id < 0 || lower_device_id >= device_num || upper_device_id < 0 || upper_device_id >= device_num)
+        return VFS_ERROR;
+
+    ovl_device_t* ovl = malloc(sizeof(ovl_device_t));
+    device_t* device = malloc(sizeof(device_t));
+    if(ovl == NULL || device == NULL)
+    {
+        free(ovl);
+        free(device);
+        return VFS_ERROR;
+    }
+
+    ovl->lower_fs = fs;
+    ovl->lower_device_id = lower_device_id;
+    ovl->upper_device_id = upper_device_id;
+
+    snprintf(device->name, MAX_NAME_LENGTH, "%s", device_name);
+    device->priv = ovl;
+    device->read = NULL;
+    device->write = NULL;
+    device->flush = NULL;
+    add_device(device);
+
+    return device_num - 1;
+}
+
+static bool ovl_reserved_name(const char* name)
+{
+    return strncmp(name, OVERLAY_WHITEOUT, strlen(OVERLAY_WHITEOUT)) == 0;
+}
+
+/* Looks 'name' up in a layer, the vnode found is held by the caller */
+static int ovl_layer_lookup(vnode_t* dir, const char* prefix, const char* name, vnode_t** result)
+{
+    char full_name[VFS_MAX_FILENAME + 16];
+
+    *result = NULL;
+    if(dir == NULL || dir->vnode_type != VDIR)
+        return VFS_ENOENT;
+
+    snprintf(full_name, sizeof(full_name), "%s%s", prefix, name);
+
+    return dir->vnode_op->lookup(dir, full_name, result);
+}
+
+static bool ovl_layer_has(vnode_t* dir, const char* prefix, const char* name)
+{
+    vnode_t* node;
+
+    if(ovl_layer_lookup(dir, prefix, name, &node) != VFS_OK)
+        return false;
+
+    vfs_release_vnode(node);
+    return true;
+}
+
+static void ovl_release(vnode_t* node)
+{
+    vfs_release_vnode(node);
+}
+
+static vnode_t* ovl_upper(ovl_inode_t* inode)
+{
+    return __atomic_load_n(&inode->upper, __ATOMIC_ACQUIRE);
+}
+
+static void ovl_release_layers(ovl_inode_t* inode)
+{
+    ovl_release(inode->upper);
+    ovl_release(inode->lower);
+    ovl_release(inode->copyup_map);
+}
+
+/* Frees the vnode with its inode, the layers must be released already */
+static void ovl_destroy_vnode(void* node)
+{
+    ovl_inode_t* inode = (ovl_inode_t*)((vnode_t*)node)->vnode_data;
+
+    pthread_mutex_destroy(&inode->copy_lock);
+    free(inode->copied);
+    free(inode->path);
+    vfs_free_vnode(node);
+}
+
+/*
+ * The references on the layers go right away, or the vnodes waiting to be freed would fill the
+ * tables of the layers (and keep their files busy). The pointers stay, a path lookup still looking
+ * at the vnode can follow them: the layers free their vnodes with epoch_retire() too.
+ */
+static void ovl_free_vnode(vnode_t* node)
+{
+    ovl_release_layers((ovl_inode_t*)node->vnode_data);
+    epoch_retire(node, ovl_destroy_vnode);
+}
+
+/* The vnode of 'path' if it's in the table, vnode_lock must be held */
+static vnode_t* ovl_find_vnode(fs_info_t* fs_info, const char* path)
+{
+    for(int i = 0; i < MAX_VNODE_PER_VFS; i++)
+        if(fs_info->total_vnode[i] != NULL && strcmp(((ovl_inode_t*)fs_info->total_vnode[i]->vnode_data)->path, path) == 0)
+            return fs_info->total_vnode[i];
+
+    return NULL;
+}
+
+/* Makes a new vnode (not in the table yet), it takes over the path and the references on the layers */
+static vnode_t* ovl_alloc_vnode(vfs_t* mountpoint, char* path, vnode_t* upper, vnode_t* lower, vnode_t* copyup_map)
+{
+    vnode_t* newVnode = vfs_alloc_vnode(vnode_pool);
+
+    if(newVnode == NULL)
+    {
+        free(path);
+        ovl_release(upper);
+        ovl_release(lower);
+        ovl_release(copyup_map);
+        return NULL;
+    }
+
+    ovl_inode_t* inode = newVnode->vnode_data;    // overlay store the inode here !!
+    memset(inode, 0, sizeof(ovl_inode_t));
+    inode->path = path;
+    inode->upper = upper;
+    inode->lower = lower;
+    inode->copyup_map = copyup_map;
+    pthread_mutex_init(&inode->copy_lock, NULL);
+
+    newVnode->flags = VNODE_NONE;
+    newVnode->vnode_op = &ovl_vnode_op;
+    newVnode->vnode_vfs = mountpoint;
+
+    return newVnode;
+}
+
+/*
+ * Creates the vnode of 'path', held by the caller. It takes over the path and the references
+ * held on the vnodes of the layers, even when it fails.
+ * If another lookup made the vnode meanwhile, that one is returned instead.
+ */
+static vnode_t* create_vnode(vfs_t* mountpoint, char* path, vnode_t* upper, vnode_t* lower, vnode_t* copyup_map)
+{
+    fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
+    vnode_t* newVnode = ovl_alloc_vnode(mountpoint, path, upper, lower, copyup_map);
+
+    if(newVnode == NULL)
+        return NULL;
+
+    ovl_inode_t* inode = newVnode->vnode_data;
+    newVnode->ref_count = 1;
+    newVnode->vnode_type = (upper != NULL) ? upper->vnode_type : lower->vnode_type;
+
+    // the copy up state of a partially copied file
+    if(copyup_map != NULL)
+    {
+        vfs_stat_t stat;
+
+        lower->vnode_op->getattr(lower, &stat);
+        inode->lower_size = stat.size;
+
+        uint32_t pages = (inode->lower_size + OVERLAY_PAGE_SIZE - 1) / OVERLAY_PAGE_SIZE;
+        inode->copied = calloc((pages + 7) / 8 + 1, 1);
+        if(inode->copied != NULL)
+            copyup_map->vnode_op->read(copyup_map, inode->copied, (pages + 7) / 8, 0);
+    }
+
+    vnode_t* result = NULL;
+    vnode_t* evicted = NULL;
+
+    pthread_mutex_lock(&fs_info->vnode_lock);
+
+    if((result = ovl_find_vnode(fs_info, path)) != NULL)
+        result->ref_count++;    // another lookup was faster
+
+    for(int i = 0; i < MAX_VNODE_PER_VFS && result == NULL; i++)
+    {
+        // a free slot, or an unused vnode (a path lookup may still be looking at it, but it doesn't hold it)
+        if(fs_info->total_vnode[i] == NULL || fs_info->total_vnode[i]->ref_count <= 0)
+        {
+            evicted = fs_info->total_vnode[i];
+            fs_info->total_vnode[i] = result = newVnode;
+        }
+    }
+
+    pthread_mutex_unlock(&fs_info->vnode_lock);
+
+    if(evicted != NULL)
+        ovl_free_vnode(evicted);
+
+    if(result != newVnode)
+    {
+        // nobody saw it
+        ovl_release_layers(inode);
+        ovl_destroy_vnode(newVnode);
+    }
+
+    return result;  // NULL if we cannot create vnode
+}
+
+static char* ovl_child_path(const char* dir_path, const char* name)
+{
+    char* path = malloc(strlen(dir_path) + strlen(name) + 2);
+
+    if(path != NULL)
+        sprintf(path, "%s/%s", dir_path, name);
+
+    return path;
+}
+
+/*
+ * Returns the upper directory of 'path', held by the caller.
+ * The lower directories on the way are copied up (only the directories, not what they contain).
+ */
+static vnode_t* ovl_upper_dir(vfs_t* mountpoint, const char* path)
+{
+    fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
+    char parsed_path[VFS_MAX_PATH_LENGTH];
+    char walked_path[VFS_MAX_PATH_LENGTH] = "";
+    char* save;
+    vnode_t* dir;
+
+    if(strlen(path) >= VFS_MAX_PATH_LENGTH)
+        return NULL;
+
+    strcpy(parsed_path, path);
+    fs_info->upper.vfs_op->get_root(&fs_info->upper, &dir);
+
+    for(char* name = strtok_r(parsed_path, "/", &save); name != NULL; name = strtok_r(NULL, "/", &save))
+    {
+        vnode_t* next = NULL;
+        int status = dir->vnode_op->lookup(dir, name, &next);
+
+        if(status == VFS_ENOENT)
+        {
+            // another copy up may create it first
+            status = dir->vnode_op->create(dir, name, VDIR, &next);
+            if(status == VFS_EEXIST)
+                status = dir->vnode_op->lookup(dir, name, &next);
+        }
+
+        ovl_release(dir);
+        if(status != VFS_OK)
+            return NULL;
+
+        dir = next;
+        if(dir->vnode_type != VDIR)
+        {
+            ovl_release(dir);
+            return NULL;
+        }
+
+        // the vnode of this directory may already exist without its upper part
+        strcat(walked_path, "/");
+        strcat(walked_path, name);
+
+        pthread_mutex_lock(&fs_info->vnode_lock);
+
+        vnode_t* node = ovl_find_vnode(fs_info, walked_path);
+        if(node != NULL && ((ovl_inode_t*)node->vnode_data)->upper == NULL)
+        {
+            dir->ref_count++;
+            __atomic_store_n(&((ovl_inode_t*)node->vnode_data)->upper, dir, __ATOMIC_RELEASE);
+        }
+
+        pthread_mutex_unlock(&fs_info->vnode_lock);
+    }
+
+    return dir;
+}
+
+/*
+ * Mounts both layers, then builds the root of the overlay on top of their roots.
+ */
+int ovl_mount(vfs_t* mountpoint, int device_id)
+{
+    ovl_device_t* device = (ovl_device_t*)device_list[device_id]->priv;
+    filesystem_t* upper_fs = vfs_find_filesystem("ramfs");
+
+    if(upper_fs == NULL)
+        return VFS_ERROR;   // ramfs_init() wasn't called
+
+    fs_info_t* fs_info = calloc(1, sizeof(fs_info_t));
+    if(fs_info == NULL)
+        return VFS_ERROR;
+
+    fs_info->lower.device_id = device->lower_device_id;
+    fs_info->lower.vfs_op = device->lower_fs;
+    fs_info->upper.device_id = device->upper_device_id;
+    fs_info->upper.vfs_op = upper_fs;
+
+    if(fs_info->lower.vfs_op->vfs_mount(&fs_info->lower, fs_info->lower.device_id) != VFS_OK)
+    {
+        free(fs_info);
+        return VFS_ERROR;
+    }
+
+    if(fs_info->upper.vfs_op->vfs_mount(&fs_info->upper, fs_info->upper.device_id) != VFS_OK)
+    {
+        fs_info->lower.vfs_op->vfs_unmount(&fs_info->lower);
+        free(fs_info);
+        return VFS_ERROR;
+    }
+
+    // here we need to fill specific filesystem info !
+    pthread_mutex_init(&fs_info->vnode_lock, NULL);
+    mountpoint->vfs_data = fs_info;
+
+    vnode_t* upper_root;
+    vnode_t* lower_root;
+    fs_info->upper.vfs_op->get_root(&fs_info->upper, &upper_root);
+    fs_info->lower.vfs_op->get_root(&fs_info->lower, &lower_root);
+
+    fs_info->root_vnode = ovl_alloc_vnode(mountpoint, strdup(""), upper_root, lower_root, NULL);
+    fs_info->root_vnode->flags = VNODE_ROOT;
+    fs_info->root_vnode->vnode_type = VDIR;
+
+    return VFS_OK;
+}
+
+int ovl_unmount(vfs_t* mountpoint)
+{
+    fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
+
+    for(int i = 0; i < MAX_VNODE_PER_VFS; i++)
+        if(fs_info->total_vnode[i] != NULL)
+            ovl_free_vnode(fs_info->total_vnode[i]);
+
+    ovl_free_vnode(fs_info->root_vnode);
+
+    fs_info->upper.vfs_op->vfs_unmount(&fs_info->upper);
+    fs_info->lower.vfs_op->vfs_unmount(&fs_info->lower);
+
+    pthread_mutex_destroy(&fs_info->vnode_lock);
+    free(fs_info);
+
+    return VFS_OK;
+}
+
+int ovl_get_root(vfs_t* mountpoint, vnode_t** result)
+{
+    fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
+
+    *result = fs_info->root_vnode;
+    (*result)->ref_count++;
+
+    return VFS_OK;
+}
+
+/*
+ * The upper layer wins, unless it holds a whiteout for the name. The lower layer is still
+ * looked at behind an upper directory (both are merged, if not opaque) and behind a file
+ * partially copied up.
+ */
+int ovl_lookup(vnode_t* node_dir, const char* name, struct vnode** result)
+{
+    fs_info_t* fs_info = (fs_info_t*)node_dir->vnode_vfs->vfs_data;
+    ovl_inode_t* dir = (ovl_inode_t*)node_dir->vnode_data;
+
+    if(node_dir->vnode_type != VDIR)
+        return VFS_ENOTDIR;
+
+    if(ovl_reserved_name(name))
+        return VFS_ENOENT;
+
+    char* path = ovl_child_path(dir->path, name);
+    if(path == NULL)
+        return VFS_ERROR;
+
+    pthread_mutex_lock(&fs_info->vnode_lock);
+
+    *result = ovl_find_vnode(fs_info, path);
+    if(*result != NULL)
+        (*result)->ref_count++;
+
+    pthread_mutex_unlock(&fs_info->vnode_lock);
+
+    if(*result != NULL)
+    {
+        free(path);
+        return VFS_OK;
+    }
+
+    vnode_t* upper = NULL;
+    vnode_t* lower = NULL;
+    vnode_t* copyup_map = NULL;
+    vnode_t* upper_dir = ovl_upper(dir);
+    bool look_lower;
+
+    ovl_layer_lookup(upper_dir, "", name, &upper);
+
+    if(upper == NULL)
+        look_lower = !ovl_layer_has(upper_dir, OVERLAY_WHITEOUT, name);
+    else if(upper->vnode_type == VDIR)
+        look_lower = !ovl_layer_has(upper, "", OVERLAY_OPAQUE);
+    else
+        look_lower = ovl_layer_lookup(upper_dir, OVERLAY_COPYUP_MAP, name, &copyup_map) == VFS_OK;
+
+    if(look_lower)
+        ovl_layer_lookup(dir->lower, "", name, &lower);
+
+    // a file hides a directory and the other way around
+    if(upper != NULL && lower != NULL && upper->vnode_type != lower->vnode_type)
+    {
+        ovl_release(lower);
+        lower = NULL;
+    }
+
+    if(copyup_map != NULL && lower == NULL)
+    {
+        ovl_release(copyup_map);
+        copyup_map = NULL;
+    }
+
+    if(upper == NULL && lower == NULL)
+    {
+        free(path);
+        return VFS_ENOENT;
+    }
+
+    *result = create_vnode(node_dir->vnode_vfs, path, upper, lower, copyup_map);
+
+    return (*result == NULL) ? VFS_ERROR : VFS_OK;
+}
+
+int ovl_getattr(vnode_t* node, vfs_stat_t* stat)
+{
+    ovl_inode_t* inode = (ovl_inode_t*)node->vnode_data;
+    vnode_t* upper = ovl_upper(inode);
+    vnode_t* layer = (upper != NULL) ? upper : inode->lower;
+
+    return layer->vnode_op->getattr(layer, stat);
+}
+
+/* Partially copied: each page comes from the layer holding it, copy_lock must be held */
+static ssize_t ovl_read_pages(ovl_inode_t* inode, void *buffer, size_t size, uint64_t offset)
+{
+    vfs_stat_t stat;
+    inode->upper->vnode_op->getattr(inode->upper, &stat);
+
+    if(offset >= stat.size)
+        return 0;
+
+    if(size > stat.size - offset)
+        size = stat.size - offset;
+
+    size_t done = 0;
+    while(done < size)
+    {
+        uint64_t position = offset + done;
+        uint32_t page = position / OVERLAY_PAGE_SIZE;
+        size_t chunk = OVERLAY_PAGE_SIZE - position % OVERLAY_PAGE_SIZE;
+        if(chunk > size - done)
+            chunk = size - done;
+
+        vnode_t* layer = inode->upper;
+        if(position < inode->lower_size && !BITMAP_TEST(inode->copied, page))
+            layer = inode->lower;
+
+        ssize_t ret = layer->vnode_op->read(layer, (uint8_t*)buffer + done, chunk, position);
+        if(ret < 0)
+            return (done > 0) ? (ssize_t)done : ret;
+
+        done += ret;
+        if((size_t)ret < chunk)
+            break;
+    }
+
+    return done;
+}
+
+ssize_t ovl_read(vnode_t* node, void *buffer, size_t size, uint64_t offset)
+{
+    ovl_inode_t* inode = (ovl_inode_t*)node->vnode_data;
+    vnode_t* upper = ovl_upper(inode);
+
+    if(upper == NULL)
+        return inode->lower->vnode_op->read(inode->lower, buffer, size, offset);
+
+    if(inode->copied == NULL)
+        return upper->vnode_op->read(upper, buffer, size, offset);
+
+    pthread_mutex_lock(&inode->copy_lock);
+    ssize_t ret = ovl_read_pages(inode, buffer, size, offset);
+    pthread_mutex_unlock(&inode->copy_lock);
+
+    return ret;
+}
+
+/*
+ * Creates the upper copy of a lower file, without its content: it has the size of the lower file
+ * but only holes, its pages are copied on their first write (see ovl_copy_up_pages()).
+ * copy_lock must be held.
+ */
+static int ovl_copy_up(vfs_t* mountpoint, ovl_inode_t* inode)
+{
+    char parent_path[VFS_MAX_PATH_LENGTH];
+    char* name = strrchr(inode->path, '/');
+
+    if(name - inode->path >= VFS_MAX_PATH_LENGTH)
+        return VFS_ERROR;
+
+    memcpy(parent_path, inode->path, name - inode->path);
+    parent_path[name - inode->path] = '\0';
+    name++;
+
+    vnode_t* parent = ovl_upper_dir(mountpoint, parent_path);
+    if(parent == NULL)
+        return VFS_ERROR;
+
+    vfs_stat_t stat;
+    vnode_t* upper = NULL;
+    vnode_t* copyup_map = NULL;
+    char map_name[VFS_MAX_FILENAME + 16];
+    int status = parent->vnode_op->create(parent, name, VREG, &upper);
+
+    if(status != VFS_OK)
+        goto out;
+
+    inode->lower->vnode_op->getattr(inode->lower, &stat);
+
+    if(stat.size == 0)
+    {
+        // nothing to copy, the lower file is only kept for the readers still looking at it
+        __atomic_store_n(&inode->upper, upper, __ATOMIC_RELEASE);
+        goto out;
+    }
+
+    uint32_t pages = (stat.size + OVERLAY_PAGE_SIZE - 1) / OVERLAY_PAGE_SIZE;
+    uint8_t* copied = calloc((pages + 7) / 8 + 1, 1);
+
+    snprintf(map_name, sizeof(map_name), "%s%s", OVERLAY_COPYUP_MAP, name);
+    status = (copied == NULL) ? VFS_ERROR : parent->vnode_op->create(parent, map_name, VREG, &copyup_map);
+
+    if(status != VFS_OK)
+    {
+        free(copied);
+        ovl_release(upper);
+        parent->vnode_op->remove(parent, name);
+        goto out;
+    }
+
+    copyup_map->vnode_op->write(copyup_map, copied, (pages + 7) / 8, 0);
+    upper->vnode_op->write(upper, NULL, stat.size, 0);
+
+    inode->copyup_map = copyup_map;
+    inode->copied = copied;
+    inode->lower_size = stat.size;
+    __atomic_store_n(&inode->upper, upper, __ATOMIC_RELEASE);
+
+out:
+    ovl_release(parent);
+    return status;
+}
+
+/*
+ * Copies up the pages of a partially copied file that a write will touch.
+ * The pages entirely overwritten don't need their lower content. copy_lock must be held.
+ */
+static int ovl_copy_up_pages(ovl_inode_t* inode, size_t size, uint64_t offset)
+{
+    uint8_t* page_buffer = NULL;
+    uint64_t end = offset + size;
+
+    for(uint64_t start = offset - offset % OVERLAY_PAGE_SIZE; start < end && start < inode->lower_size; start += OVERLAY_PAGE_SIZE)
+    {
+        uint32_t page = start / OVERLAY_PAGE_SIZE;
+        uint64_t page_end = (start + OVERLAY_PAGE_SIZE < inode->lower_size) ? start + OVERLAY_PAGE_SIZE : inode->lower_size;
+
+        if(BITMAP_TEST(inode->copied, page))
+            continue;
+
+        if(offset > start || end < page_end)
+        {
+            if(page_buffer == NULL && (page_buffer = malloc(OVERLAY_PAGE_SIZE)) == NULL)
+                return VFS_ERROR;
+
+            ssize_t ret = inode->lower->vnode_op->read(inode->lower, page_buffer, page_end - start, start);
+            if(ret < 0 || inode->upper->vnode_op->write(inode->upper, page_buffer, ret, start) < 0)
+            {
+                free(page_buffer);
+                return VFS_ERROR;
+            }
+        }
+
+        BITMAP_SET(inode->copied, page);
+        inode->copyup_map->vnode_op->write(inode->copyup_map, &inode->copied[page / 8], 1, page / 8);
+    }
+
+    free(page_buffer);
+    return VFS_OK;
+}
+
+ssize_t ovl_write(vnode_t* node, const void *buffer, size_t size, uint64_t offset)
+{
+    ovl_inode_t* inode = (ovl_inode_t*)node->vnode_data;
+
+    if(node->vnode_type != VREG)
+        return VFS_EISDIR;
+
+    // the pages being copied (or overwritten whole) must not be read from the upper layer meanwhile
+    pthread_mutex_lock(&inode->copy_lock);
+
+    int status = VFS_OK;
+    if(inode->upper == NULL)
+        status = ovl_copy_up(node->vnode_vfs, inode);
+
+    if(status == VFS_OK && inode->copied != NULL && size > 0)
+        status = ovl_copy_up_pages(inode, size, offset);
+
+    ssize_t ret = status;
+    if(status == VFS_OK)
+        ret = inode->upper->vnode_op->write(inode->upper, buffer, size, offset);
+
+    pthread_mutex_unlock(&inode->copy_lock);
+
+    return ret;
+}
+
+int ovl_create(vnode_t* node_dir, const char* name, vtype type, struct vnode** result)
+{
+    ovl_inode_t* dir = (ovl_inode_t*)node_dir->vnode_data;
+    vnode_t* existing;
+
+    if(ovl_reserved_name(name))
+        return VFS_EACCESS;
+
+    int status = ovl_lookup(node_dir, name, &existing);
+    if(status != VFS_ENOENT)
+    {
+        if(status == VFS_OK)
+            ovl_release(existing);
+
+        return (status == VFS_OK) ? VFS_EEXIST : status;
+    }
+
+    vnode_t* upper_dir = ovl_upper_dir(node_dir->vnode_vfs, dir->path);
+    vnode_t* upper = NULL;
+    bool opaque = false;
+
+    if(upper_dir == NULL)
+        return VFS_ERROR;
+
+    // a directory created over a removed one must not show the old content
+    if(ovl_layer_has(upper_dir, OVERLAY_WHITEOUT, name))
+    {
+        char whiteout[VFS_MAX_FILENAME + 16];
+        snprintf(whiteout, sizeof(whiteout), "%s%s", OVERLAY_WHITEOUT, name);
+        upper_dir->vnode_op->remove(upper_dir, whiteout);
+        opaque = (type == VDIR);
+    }
+
+    status = upper_dir->vnode_op->create(upper_dir, name, type, &upper);
+    if(status == VFS_OK)
+    {
+        vnode_t* marker;
+
+        if(opaque && upper->vnode_op->create(upper, OVERLAY_OPAQUE, VREG, &marker) == VFS_OK)
+            ovl_release(marker);
+
+        *result = create_vnode(node_dir->vnode_vfs, ovl_child_path(dir->path, name), upper, NULL, NULL);
+        status = (*result == NULL) ? VFS_ERROR : VFS_OK;
+    }
+
+    ovl_release(upper_dir);
+
+    return status;
+}
+
+/*
+ * Lists the whiteouts and markers of an upper directory, the caller frees 'names'.
+ * Returns VFS_ERROR if the directory holds anything else.
+ */
+static int ovl_list_reserved(vnode_t* upper, char (**names)[MAX_NAME_LENGTH], int* count)
+{
+    *names = NULL;
+    *count = ramfs_list(upper, NULL, 0);
+    if(*count <= 0)
+        return (*count < 0) ? *count : VFS_OK;
+
+    *names = malloc(*count * sizeof(**names));
+    if(*names == NULL)
+        return VFS_ERROR;
+
+    // something created meanwhile isn't listed, removing the directory will fail
+    int listed = ramfs_list(upper, *names, *count);
+    if(listed < *count)
+        *count = listed;
+
+    for(int i = 0; i < *count; i++)
+    {
+        if(!ovl_reserved_name((*names)[i]))
+        {
+            free(*names);
+            *names = NULL;
+            return VFS_ERROR;   // not empty
+        }
+    }
+
+    return VFS_OK;
+}
+
+/*
+ * Removes the upper entry, and hides the lower one with a whiteout.
+ * A directory has to be empty in the upper layer but for its whiteouts and markers, which are
+ * removed with it. The lower one can't be listed so it isn't checked.
+ */
+int ovl_remove(vnode_t* node_dir, const char* name)
+{
+    fs_info_t* fs_info = (fs_info_t*)node_dir->vnode_vfs->vfs_data;
+    ovl_inode_t* dir = (ovl_inode_t*)node_dir->vnode_data;
+    vnode_t* node;
+
+    if(ovl_reserved_name(name))
+        return VFS_ENOENT;
+
+    int status = ovl_lookup(node_dir, name, &node);
+    if(status != VFS_OK)
+        return status;
+
+    // our lookup holds it, anyone else is using it. Otherwise nobody can find it once out of the table.
+    pthread_mutex_lock(&fs_info->vnode_lock);
+
+    bool busy = node->ref_count > 1;
+    for(int i = 0; !busy && i < MAX_VNODE_PER_VFS; i++)
+        if(fs_info->total_vnode[i] == node)
+            fs_info->total_vnode[i] = NULL;
+
+    pthread_mutex_unlock(&fs_info->vnode_lock);
+
+    if(busy)
+    {
+        ovl_release(node);
+        return VFS_EACCESS;
+    }
+
+    ovl_inode_t* inode = (ovl_inode_t*)node->vnode_data;
+    bool in_upper = inode->upper != NULL;
+    bool in_lower = inode->lower != NULL || ovl_layer_has(dir->lower, "", name);    // even hidden, by an opaque directory or a recreated file
+    char (*reserved)[MAX_NAME_LENGTH] = NULL;
+    int reserved_count = 0;
+
+    if(in_upper && node->vnode_type == VDIR)
+        status = ovl_list_reserved(inode->upper, &reserved, &reserved_count);
+
+    // the vnodes of the layers are released before removing them
+    ovl_free_vnode(node);
+
+    if(status != VFS_OK)
+        return status;
+
+    char map_name[VFS_MAX_FILENAME + 16];
+    snprintf(map_name, sizeof(map_name), "%s%s", OVERLAY_COPYUP_MAP, name);
+
+    vnode_t* upper_dir = ovl_upper_dir(node_dir->vnode_vfs, dir->path);
+    vnode_t* upper;
+    if(upper_dir == NULL)
+        status = VFS_ERROR;
+    else if(in_upper)
+    {
+        // the whiteouts and markers of a directory go first
+        if(reserved_count > 0 && upper_dir->vnode_op->lookup(upper_dir, name, &upper) == VFS_OK)
+        {
+            for(int i = 0; i < reserved_count; i++)
+                upper->vnode_op->remove(upper, reserved[i]);
+
+            ovl_release(upper);
+        }
+
+        status = upper_dir->vnode_op->remove(upper_dir, name);
+    }
+
+    if(status == VFS_OK && in_upper)
+        upper_dir->vnode_op->remove(upper_dir, map_name);
+
+    // still there (something was created meanwhile), it keeps hiding what it hid
+    if(status != VFS_OK && upper_dir != NULL && reserved_count > 0
+        && upper_dir->vnode_op->lookup(upper_dir, name, &upper) == VFS_OK)
+    {
+        vnode_t* marker;
+        for(int i = 0; i < reserved_count; i++)
+            if(upper->vnode_op->create(upper, reserved[i], VREG, &marker) == VFS_OK)
+                ovl_release(marker);
+
+        ovl_release(upper);
+    }
+
+    free(reserved);
+
+    if(status == VFS_OK && in_lower)
+    {
+        vnode_t* whiteout;
+        char whiteout_name[VFS_MAX_FILENAME + 16];
+
+        snprintf(whiteout_name, sizeof(whiteout_name), "%s%s", OVERLAY_WHITEOUT, name);
+        status = upper_dir->vnode_op->create(upper_dir, whiteout_name, VREG, &whiteout);
+        if(status == VFS_OK)
+            ovl_release(whiteout);
+    }
+
+    ovl_release(upper_dir);
+
+    return status;
+}
@@ -0,0 +1,47 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#include "vfs.h"
+
+/*
+ * Overlay stacks a writable ramfs device (upper) over a read-only device (lower, usually fat12).
+ * Files are looked up in the upper layer first, then in the lower one. The lower device is never written:
+ *  - a lower file is copied up by pages of OVERLAY_PAGE_SIZE, only the pages written so far,
+ *    the others are still read from the lower layer
+ *  - a removed lower entry is hidden by a whiteout ".wh.<name>" in the upper layer
+ *  - a directory created over a whiteout gets a ".wh..opq" marker, the lower one doesn't show through
+ * The names starting with ".wh." are reserved, they're never visible in the overlay.
+ */
+
+#define OVERLAY_PAGE_SIZE       4096
+#define OVERLAY_WHITEOUT        ".wh."
+#define OVERLAY_OPAQUE          ".wh..opq"
+#define OVERLAY_COPYUP_MAP      ".wh..cu."     // bitmap of the copied pages of a partially copied file
+
+void overlay_init();
+int overlay_create(const char* device_name, const char* lower_fs, int lower_device_id, int upper_device_id);
@@ -0,0 +1,240 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pagecache.h"
+#include "membudget.h"
+
+#define PAGECACHE_MAX_PAGES     1024    // 4 MiB of file content
+#define PAGECACHE_HASH_SIZE     1024
+
+typedef struct cached_page
+{
+    const void* volume;
+    uint64_t file;
+    uint64_t index;
+    uint32_t length;                // valid bytes, the last page of a file is shorter
+    struct cached_page *hash_next;
+    struct cached_page *lru_prev, *lru_next;
+    uint8_t data[PAGECACHE_PAGE_SIZE];
+} cached_page_t;
+
+/* 'pagecache_lock' protects everything below, data is copied in and out under it */
+static pthread_mutex_t pagecache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cached_page_t* buckets[PAGECACHE_HASH_SIZE];
+static cached_page_t *lru_head, *lru_tail;     // most recently used first
+static uint32_t page_count;
+
+static size_t pagecache_shrink(size_t bytes);
+
+/* Given back once the block cache can't give anything more */
+static membudget_account_t pagecache_account = { .name = "page cache", .priority = 1, .shrink = pagecache_shrink };
+
+static uint32_t hash_page(const void* volume, uint64_t file, uint64_t index)
+{
+    uint64_t key = (uintptr_t)volume ^ (file * 0x9E3779B97F4A7C15ull) ^ (index * 2654435761u);
+    return (key ^ (key >> 29)) % PAGECACHE_HASH_SIZE;
+}
+
+static cached_page_t* find_page(const void* volume, uint64_t file, uint64_t index)
+{
+    cached_page_t* page = buckets[hash_page(volume, file, index)];
+
+    while(page != NULL && (page->volume != volume || page->file != file || page->index != index))
+        page = page->hash_next;
+
+    return page;
+}
+
+static void lru_remove(cached_page_t* page)
+{
+    if(page->lru_prev) page->lru_prev->lru_next = page->lru_next;
+    else lru_head = page->lru_next;
+
+    if(page->lru_next) page->lru_next->lru_prev = page->lru_prev;
+    else lru_tail = page->lru_prev;
+}
+
+static void lru_push_front(cached_page_t* page)
+{
+    page->lru_prev = NULL;
+    page->lru_next = lru_head;
+
+    if(lru_head) lru_head->lru_prev = page;
+    else lru_tail = page;
+
+    lru_head = page;
+}
+
+static void unlink_page(cached_page_t* page)
+{
+    cached_page_t** link = &buckets[hash_page(page->volume, page->file, page->index)];
+    while(*link != page)
+        link = &(*link)->hash_next;
+    *link = page->hash_next;
+
+    lru_remove(page);
+    page_count--;
+}
+
+static void remove_page(cached_page_t* page)
+{
+    unlink_page(page);
+    free(page);
+    membudget_charge(&pagecache_account, -(ssize_t)sizeof(cached_page_t));
+}
+
+// drops the least recently used pages
+static size_t pagecache_shrink(size_t bytes)
+{
+    size_t freed = 0;
+
+    pthread_mutex_lock(&pagecache_lock);
+
+    while(freed < bytes && lru_tail != NULL)
+    {
+        remove_page(lru_tail);
+        freed += sizeof(cached_page_t);
+    }
+
+    pthread_mutex_unlock(&pagecache_lock);
+
+    return freed;
+}
+
+bool pagecache_read(const void* volume, uint64_t file, uint64_t index, void* buffer, uint32_t offset, uint32_t size)
+{
+    pthread_mutex_lock(&pagecache_lock);
+
+    cached_page_t* page = find_page(volume, file, index);
+    bool hit = (page != NULL && offset + size <= page->length);
+
+    if(hit)
+    {
+        memcpy(buffer, page->data + offset, size);
+
+        if(lru_head != page)
+        {
+            lru_remove(page);
+            lru_push_front(page);
+        }
+    }
+
+    pthread_mutex_unlock(&pagecache_lock);
+
+    return hit;
+}
+
+void pagecache_insert(const void* volume, uint64_t file, uint64_t index, const void* data, uint32_t length)
+{
+    if(length > PAGECACHE_PAGE_SIZE)
+        length = PAGECACHE_PAGE_SIZE;
+
+    pthread_mutex_lock(&pagecache_lock);
+
+    cached_page_t* page = find_page(volume, file, index);
+    if(page != NULL)
+        lru_remove(page);
+    else
+    {
+        if(page_count >= PAGECACHE_MAX_PAGES)
+        {
+            page = lru_tail;    // recycle the least recently used page
+            unlink_page(page);
+        }
+        else if((page = malloc(sizeof(cached_page_t))) == NULL)
+        {
+            pthread_mutex_unlock(&pagecache_lock);
+            return;     // it's only a cache
+        }
+        else
+            membudget_charge(&pagecache_account, sizeof(cached_page_t));
+
+        uint32_t bucket = hash_page(volume, file, index);
+
+        page->volume = volume;
+        page->file = file;
+        page->index = index;
+        page->hash_next = buckets[bucket];
+        buckets[bucket] = page;
+        page_count++;
+    }
+
+    page->length = length;
+    memcpy(page->data, data, length);
+    lru_push_front(page);
+
+    pthread_mutex_unlock(&pagecache_lock);
+    membudget_balance();
+}
+
+void pagecache_invalidate(const void* volume, uint64_t file, uint64_t first, uint64_t last)
+{
+    pthread_mutex_lock(&pagecache_lock);
+
+    if(last - first < page_count)
+    {
+        for(uint64_t index = first; index <= last; index++)
+        {
+            cached_page_t* page = find_page(volume, file, index);
+            if(page != NULL)
+                remove_page(page);
+        }
+    }
+    else    // a wide range, looking at every page is shorter
+    {
+        for(cached_page_t* page = lru_head; page != NULL; )
+        {
+            cached_page_t* next = page->lru_next;
+
+            if(page->volume == volume && page->file == file && page->index >= first && page->index <= last)
+                remove_page(page);
+
+            page = next;
+        }
+    }
+
+    pthread_mutex_unlock(&pagecache_lock);
+}
+
+void pagecache_invalidate_volume(const void* volume)
+{
+    pthread_mutex_lock(&pagecache_lock);
+
+    for(cached_page_t* page = lru_head; page != NULL; )
+    {
+        cached_page_t* next = page->lru_next;
+
+        if(page->volume == volume)
+            remove_page(page);
+
+        page = next;
+    }
+
+    pthread_mutex_unlock(&pagecache_lock);
+}
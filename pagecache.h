@@ -0,0 +1,57 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PAGECACHE_PAGE_SIZE 4096
+
+/*
+ * Page Cache
+ *
+ * Caches the content of files by page, for the disk-backed drivers. The block cache below knows
+ * sectors, so reading a file through it still means walking its cluster chain: a page found here
+ * is copied right away, without looking at the allocation table or the device.
+ *
+ * A page is identified by its volume (any pointer unique to a mounted volume), a file id chosen
+ * by the driver (unique on the volume, it doesn't have to follow the vnodes, so the pages of a file
+ * outlive its vnode) and its index in the file. A page covers PAGECACHE_PAGE_SIZE bytes of the
+ * file, less for the last one. Pages are evicted from a global LRU list, also to stay under the
+ * memory budget (see membudget.h).
+ *
+ * Nothing is ever written through this cache: a driver invalidates the pages of a file it writes.
+ */
+
+/* Copies [offset, offset + size) of a page if it's cached, returns false otherwise */
+bool pagecache_read(const void* volume, uint64_t file, uint64_t index, void* buffer, uint32_t offset, uint32_t size);
+
+/* Caches a page of 'length' bytes (up to PAGECACHE_PAGE_SIZE), replacing any cached copy */
+void pagecache_insert(const void* volume, uint64_t file, uint64_t index, const void* data, uint32_t length);
+
+/* Drops the pages [first, last] of a file, or every page of a volume */
+void pagecache_invalidate(const void* volume, uint64_t file, uint64_t first, uint64_t last);
+void pagecache_invalidate_volume(const void* volume);
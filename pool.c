@@ -0,0 +1,334 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "membudget.h"
+
+#define POOL_SLAB_SIZE      (64 * 1024)     // slabs are aligned on their size, see objpool_free()
+#define POOL_MAGAZINE_SIZE  32              // objects in a full magazine
+#define POOL_MAX_POOLS      16
+#define POOL_ALIGN          16
+
+/* Slabs are never given back, they're only reported */
+static membudget_account_t pool_account = { .name = "object pools", .priority = 4 };
+
+typedef struct pool_magazine
+{
+    struct pool_magazine* next;
+    int count;
+    void* objects[POOL_MAGAZINE_SIZE];
+} pool_magazine_t;
+
+/* Stored at the start of each slab, the objects follow */
+typedef struct pool_slab
+{
+    objpool_t* pool;
+    struct pool_slab* next;
+} pool_slab_t;
+
+#define POOL_SLAB_HEADER    ((sizeof(pool_slab_t) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+struct objpool
+{
+    char name[32];
+    size_t object_size;
+    int index;                  // of its magazines in the per-thread caches
+
+    // the depot, shared by every thread
+    pthread_mutex_t lock;
+    pool_magazine_t* full;      // magazines holding objects (not always full)
+    pool_magazine_t* empty;
+    void* loose;                // objects freed when no magazine could be allocated, linked by their first word
+    pool_slab_t* slabs;
+    uint8_t* next_object;       // what's left of the last slab
+    uint8_t* slab_end;
+};
+
+typedef struct pool_cache
+{
+    pool_magazine_t* loaded;    // objects are taken from / given back to this one
+    pool_magazine_t* previous;  // swapped with it when it's empty (or full)
+} pool_cache_t;
+
+static objpool_t pools[POOL_MAX_POOLS];
+static int pool_count = 0;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread pool_cache_t caches[POOL_MAX_POOLS];
+static __thread bool caches_registered = false;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+// called with the depot locked, a magazine with objects is kept, the others are recycled
+static void depot_put(objpool_t* pool, pool_magazine_t* magazine)
+{
+    if(magazine == NULL)
+        return;
+
+    if(magazine->count > 0)
+    {
+        magazine->next = pool->full;
+        pool->full = magazine;
+    }
+    else
+    {
+        magazine->next = pool->empty;
+        pool->empty = magazine;
+    }
+}
+
+// called with the depot locked, may return NULL
+static pool_magazine_t* depot_get_empty(objpool_t* pool)
+{
+    pool_magazine_t* magazine = pool->empty;
+
+    if(magazine != NULL)
+        pool->empty = magazine->next;
+    else
+        magazine = malloc(sizeof(pool_magazine_t));    // the pool grows, it's rare
+
+    if(magazine != NULL)
+    {
+        magazine->next = NULL;
+        magazine->count = 0;
+    }
+
+    return magazine;
+}
+
+// called with the depot locked, a loose object or a new one from the slabs
+static void* depot_get_object(objpool_t* pool)
+{
+    if(pool->loose != NULL)
+    {
+        void* object = pool->loose;
+        pool->loose = *(void**)object;
+        return object;
+    }
+
+    if(pool->next_object == NULL || pool->next_object + pool->object_size > pool->slab_end)
+    {
+        pool_slab_t* slab = aligned_alloc(POOL_SLAB_SIZE, POOL_SLAB_SIZE);
+        if(slab == NULL)
+            return NULL;
+        membudget_charge(&pool_account, POOL_SLAB_SIZE);
+
+        slab->pool = pool;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+
+        pool->next_object = (uint8_t*)slab + POOL_SLAB_HEADER;
+        pool->slab_end = (uint8_t*)slab + POOL_SLAB_SIZE;
+    }
+
+    void* object = pool->next_object;
+    pool->next_object += pool->object_size;
+    return object;
+}
+
+// a thread exits, its magazines go back to the depots
+static void flush_caches(void* arg)
+{
+    pool_cache_t* thread_caches = arg;
+
+    pthread_mutex_lock(&pools_lock);
+    int count = pool_count;
+    pthread_mutex_unlock(&pools_lock);
+
+    for(int i = 0; i < count; i++)
+    {
+        pthread_mutex_lock(&pools[i].lock);
+        depot_put(&pools[i], thread_caches[i].loaded);
+        depot_put(&pools[i], thread_caches[i].previous);
+        pthread_mutex_unlock(&pools[i].lock);
+
+        thread_caches[i].loaded = thread_caches[i].previous = NULL;
+    }
+
+    // an object freed by a later destructor registers the caches again
+    caches_registered = false;
+}
+
+static void create_cache_key(void)
+{
+    pthread_key_create(&cache_key, flush_caches);
+}
+
+static pool_cache_t* get_cache(objpool_t* pool)
+{
+    if(!caches_registered)
+    {
+        pthread_once(&cache_key_once, create_cache_key);
+        pthread_setspecific(cache_key, caches);
+        caches_registered = true;
+    }
+
+    return &caches[pool->index];
+}
+
+/**
+ * Creates a pool of objects of 'object_size' bytes.
+ * Pools are meant to be created once by the modules using them, and never destroyed.
+ *
+ * @param name          describes the objects, for debugging.
+ * @param object_size   the size of the objects, at most a few KiB.
+ * @return              the pool, it aborts if there are too many pools (there's a fixed number of them).
+ */
+objpool_t* objpool_create(const char* name, size_t object_size)
+{
+    object_size = (object_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    if(object_size == 0)
+        object_size = POOL_ALIGN;   // it must hold the link of the loose objects
+
+    pthread_mutex_lock(&pools_lock);
+
+    // nothing sensible to do, it's a fixed configuration
+    if(pool_count == POOL_MAX_POOLS || object_size > (POOL_SLAB_SIZE - POOL_SLAB_HEADER) / 8)
+        abort();
+
+    objpool_t* pool = &pools[pool_count];
+
+    memset(pool, 0, sizeof(objpool_t));
+    strncpy(pool->name, name, sizeof(pool->name) - 1);
+    pool->object_size = object_size;
+    pool->index = pool_count;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    pool_count++;
+    pthread_mutex_unlock(&pools_lock);
+
+    return pool;
+}
+
+/**
+ * Takes an object from the pool, its content is undefined.
+ *
+ * @return  the object, or NULL if there's no memory left.
+ */
+void* objpool_alloc(objpool_t* pool)
+{
+    pool_cache_t* cache = get_cache(pool);
+
+    if(cache->loaded != NULL && cache->loaded->count > 0)
+        return cache->loaded->objects[--cache->loaded->count];
+
+    if(cache->previous != NULL && cache->previous->count > 0)
+    {
+        pool_magazine_t* previous = cache->previous;
+        cache->previous = cache->loaded;
+        cache->loaded = previous;
+
+        return cache->loaded->objects[--cache->loaded->count];
+    }
+
+    // both are empty: we trade one for a magazine of the depot, or fill it
+    void* object = NULL;
+    pthread_mutex_lock(&pool->lock);
+
+    if(pool->full != NULL)
+    {
+        pool_magazine_t* full = pool->full;
+        pool->full = full->next;
+
+        depot_put(pool, cache->loaded);
+        cache->loaded = full;
+    }
+    else
+    {
+        if(cache->loaded == NULL)
+            cache->loaded = depot_get_empty(pool);
+
+        while(cache->loaded != NULL && cache->loaded->count < POOL_MAGAZINE_SIZE)
+        {
+            void* fresh = depot_get_object(pool);
+            if(fresh == NULL)
+                break;
+
+            cache->loaded->objects[cache->loaded->count++] = fresh;
+        }
+    }
+
+    if(cache->loaded != NULL && cache->loaded->count > 0)
+        object = cache->loaded->objects[--cache->loaded->count];
+    else
+        object = depot_get_object(pool);    // without a magazine
+
+    pthread_mutex_unlock(&pool->lock);
+    return object;
+}
+
+/**
+ * Gives an object back to its pool.
+ *
+ * @param object    an object from objpool_alloc(), may be NULL.
+ */
+void objpool_free(void* object)
+{
+    if(object == NULL)
+        return;
+
+    // here we find its pool through the header of its slab
+    pool_slab_t* slab = (pool_slab_t*)((uintptr_t)object & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+    objpool_t* pool = slab->pool;
+    pool_cache_t* cache = get_cache(pool);
+
+    if(cache->loaded != NULL && cache->loaded->count < POOL_MAGAZINE_SIZE)
+    {
+        cache->loaded->objects[cache->loaded->count++] = object;
+        return;
+    }
+
+    if(cache->previous != NULL && cache->previous->count < POOL_MAGAZINE_SIZE)
+    {
+        pool_magazine_t* previous = cache->previous;
+        cache->previous = cache->loaded;
+        cache->loaded = previous;
+
+        cache->loaded->objects[cache->loaded->count++] = object;
+        return;
+    }
+
+    // both are full: the previous one goes to the depot, we start an empty one
+    pthread_mutex_lock(&pool->lock);
+
+    depot_put(pool, cache->previous);
+    cache->previous = cache->loaded;
+    cache->loaded = depot_get_empty(pool);
+
+    if(cache->loaded != NULL)
+        cache->loaded->objects[cache->loaded->count++] = object;
+    else
+    {
+        *(void**)object = pool->loose;
+        pool->loose = object;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
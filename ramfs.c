@@ -22,28 +22,639 @@
  * SOFTWARE.
 */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "device.h"
+#include "epoch.h"
 #include "vfs.h"
+#include "membudget.h"
 
 #include "ramfs.h"
 
+/* The content of the files (not the mapped snapshot pages), it can't be given back */
+static membudget_account_t ramfs_account = { .name = "ramfs", .priority = 3 };
+
+/*
+ * Snapshot format
+ *
+ * A snapshot is a flat, position independent image of a ramfs tree, so it can be mmaped as is:
+ *
+ *   | header | node table | name blob | padding | data pages ... |
+ *
+ * Nodes are stored breadth first, starting with the root: the children of a directory are
+ * contiguous in the table. Links are indexes and offsets from the start of the file, and the
+ * data of every file starts on a page boundary so that its pages can be used in place.
+ */
+#define RAMFS_SNAPSHOT_MAGIC    "RAMFSNAP"
+#define RAMFS_SNAPSHOT_VERSION  1
+
+typedef struct ramfs_snapshot_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t node_count;
+    uint32_t reserved;
+    uint64_t nodes_offset;
+    uint64_t names_offset;
+    uint64_t names_size;
+    uint64_t data_offset;
+} __attribute__((packed)) ramfs_snapshot_header_t;
+
+typedef struct ramfs_snapshot_node
+{
+    uint32_t first_child;       // index of the first child in the table
+    uint32_t child_count;
+    uint32_t name_offset;       // in the name blob
+    uint16_t name_length;
+    uint8_t type;
+    uint8_t reserved;
+    uint64_t size;
+    uint64_t create_time;
+    uint64_t modify_time;
+    uint64_t access_time;
+    uint64_t data_offset;       // from the start of the file
+} __attribute__((packed)) ramfs_snapshot_node_t;
+
+typedef struct ramfs_snapshot
+{
+    const uint8_t *base;        // the whole mapped file
+    size_t size;
+    const ramfs_snapshot_header_t *header;
+    const ramfs_snapshot_node_t *nodes;
+    const char *names;
+} ramfs_snapshot_t;
+
 static uint64_t get_current_time() {
     return (uint64_t)time(NULL);
 }
 
-static treenode_t* ramfs_lookup(treenode_t *dir, const char *name)
+/*
+ * Locking
+ *
+ * Each node has a reader/writer lock: it protects the children of a directory, the pages
+ * and the size of a file. Lookups and reads share it, so they run in parallel, changes take
+ * it exclusively. Only remove_node() holds two of them: the parent, then the child.
+ *
+ * What's shared with a snapshot or between clones (the lazy expansion and the lists of
+ * dependents) is protected by 'share_lock'. It's only taken when such nodes are around, and
+ * never by a thread holding a node lock, it's always taken first.
+ *
+ * The access times are updated by the readers, they're written atomically.
+ *
+ * A node found by a lookup may be removed right after: removed nodes are freed through
+ * epoch_retire(), once every VFS call that could have found them is over.
+ * The vnode table of a mount has its own rwlock, a node is flagged removed under the write
+ * lock so that no vnode is made for it afterwards. Lookups finding a vnode already in the
+ * table only take the read lock, nothing can be evicted while they hold it.
+ */
+static pthread_mutex_t share_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static objpool_t* vnode_pool = NULL;
+
+// most lookups happen within the same second, don't dirty the line shared by the readers for nothing
+#define RAMFS_TOUCH(node, time)                                                         \
+    do {                                                                                \
+        uint64_t touch_time_ = (time);                                                  \
+        if(__atomic_load_n(&(node)->meta.access_time, __ATOMIC_RELAXED) != touch_time_) \
+            __atomic_store_n(&(node)->meta.access_time, touch_time_, __ATOMIC_RELAXED); \
+    } while(0)
+
+static treenode_t* ramfs_alloc_node(const char *name, nodetype_t type)
 {
-    if (!dir || dir->meta.type != NODE_DIRECTORY)
+    treenode_t *new_node = (treenode_t*)calloc(1, sizeof(treenode_t));
+    if (!new_node)
         return NULL;
-    
-    // update
-    dir->meta.access_time = get_current_time();
-    
+
+    strncpy(new_node->meta.name, name, MAX_NAME_LENGTH - 1);
+    new_node->meta.name[MAX_NAME_LENGTH - 1] = '\0';
+    new_node->meta.type = type;
+    pthread_rwlock_init(&new_node->lock, NULL);
+
+    return new_node;
+}
+
+static void ramfs_add_child(treenode_t *parent, treenode_t *child, treenode_t **last_child)
+{
+    child->parent = parent;
+
+    if (*last_child == NULL)
+        parent->first_child = child;
+    else
+        (*last_child)->next_sibling = child;
+
+    *last_child = child;
+}
+
+/*
+ * Creates a node of a clone: it gets the metadata of its source right away,
+ * the rest is shared until ramfs_expand(). Called with 'share_lock' held.
+ */
+static treenode_t* ramfs_alloc_clone(treenode_t *source)
+{
+    treenode_t *clone = ramfs_alloc_node(source->meta.name, source->meta.type);
+    if (!clone)
+        return NULL;
+
+    // the name and type were copied already, the access time is touched without the lock
+    pthread_rwlock_rdlock(&source->lock);
+    clone->meta.size = source->meta.size;
+    clone->meta.create_time = source->meta.create_time;
+    clone->meta.modify_time = source->meta.modify_time;
+    clone->meta.access_time = __atomic_load_n(&source->meta.access_time, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&source->lock);
+
+    clone->source = source;
+
+    // we're now one of its dependents
+    clone->next_dependent = source->first_dependent;
+    if (source->first_dependent)
+        source->first_dependent->prev_dependent = clone;
+    source->first_dependent = clone;
+
+    return clone;
+}
+
+static void ramfs_expand_locked(treenode_t *node);
+
+/*
+ * Gives a node of a clone its own copy of what it shares with its source: new (unexpanded)
+ * clones of the children for a directory, or references on the same pages for a file.
+ * Called with 'share_lock' and the node held, the source is only read.
+ */
+static void ramfs_expand_clone(treenode_t *node)
+{
+    treenode_t *source = node->source;
+
+    // we don't depend on it anymore
+    if (node->prev_dependent)
+        node->prev_dependent->next_dependent = node->next_dependent;
+    else
+        source->first_dependent = node->next_dependent;
+
+    if (node->next_dependent)
+        node->next_dependent->prev_dependent = node->prev_dependent;
+
+    node->source = NULL;
+    node->next_dependent = node->prev_dependent = NULL;
+
+    pthread_rwlock_rdlock(&source->lock);
+
+    if (node->meta.type == NODE_DIRECTORY)
+    {
+        treenode_t *last_child = NULL;
+        for (treenode_t *child = source->first_child; child; child = child->next_sibling)
+        {
+            treenode_t *clone = ramfs_alloc_clone(child);
+            if (!clone)
+                break;
+
+            ramfs_add_child(node, clone, &last_child);
+        }
+    }
+    else if (source->store == RAMFS_STORE_INLINE)
+        memcpy(node->inline_data, source->inline_data, RAMFS_INLINE_SIZE);
+    else if (source->store == RAMFS_STORE_EXTENT)
+    {
+        // it's small, no need to share it
+        node->extent = malloc(source->extent_capacity);
+        if (!node->extent)
+            node->meta.size = 0;
+        else
+        {
+            memcpy(node->extent, source->extent, source->extent_capacity);
+            node->extent_capacity = source->extent_capacity;
+            membudget_charge(&ramfs_account, node->extent_capacity);
+            node->store = RAMFS_STORE_EXTENT;
+        }
+    }
+    else if (source->page_count > 0)
+    {
+        node->store = RAMFS_STORE_PAGED;
+        node->pages = malloc(source->page_count * sizeof(ramfs_page_t*));
+        if (!node->pages)
+            node->meta.size = 0;
+        else
+        {
+            for (uint32_t i = 0; i < source->page_count; i++)
+            {
+                node->pages[i] = source->pages[i];
+                if (node->pages[i])
+                    node->pages[i]->ref_count++;    // copy-on-write from now on
+            }
+
+            node->page_count = source->page_count;
+        }
+    }
+
+    pthread_rwlock_unlock(&source->lock);
+}
+
+/* Does this node, or one of its ancestors, still have clones sharing it ? */
+static bool ramfs_has_dependents(treenode_t *node)
+{
+    for (; node != NULL; node = node->parent)
+        if (node->first_dependent != NULL)
+            return true;
+
+    return false;
+}
+
+/*
+ * The clones of a node must get their own copy of it before it changes.
+ * A clone of one of its ancestors may reach it later too, so we expand the clones of the whole
+ * path from the root: the clones of each ancestor become clones of the next node on the path.
+ * Called with 'share_lock' held.
+ */
+static void ramfs_detach_dependents_locked(treenode_t *node)
+{
+    if (node->parent)
+        ramfs_detach_dependents_locked(node->parent);
+
+    while (node->first_dependent)
+        ramfs_expand_locked(node->first_dependent);
+}
+
+static void ramfs_detach_dependents(treenode_t *node)
+{
+    if (!ramfs_has_dependents(node))
+        return;
+
+    pthread_mutex_lock(&share_lock);
+    ramfs_detach_dependents_locked(node);
+    pthread_mutex_unlock(&share_lock);
+}
+
+/*
+ * Creates what a node still shares with a snapshot or a source node: the children of a directory,
+ * or the pages of a file (pointing into the mapping). Does nothing for the other nodes.
+ * Broken entries in the snapshot are loaded as empty nodes.
+ * Called with 'share_lock' held.
+ */
+static void ramfs_expand_locked(treenode_t *node)
+{
+    if (node->source != NULL)
+    {
+        ramfs_expand_locked(node->source);  // it may come from a snapshot or be a clone itself
+
+        pthread_rwlock_wrlock(&node->lock);
+        if (node->source != NULL)
+            ramfs_expand_clone(node);
+        pthread_rwlock_unlock(&node->lock);
+        return;
+    }
+
+    if (node->snapshot == NULL)
+        return;
+
+    pthread_rwlock_wrlock(&node->lock);
+
+    const ramfs_snapshot_t *snapshot = node->snapshot;
+    node->snapshot = NULL;
+
+    const ramfs_snapshot_node_t *entry = &snapshot->nodes[node->snapshot_index];
+    uint32_t node_count = snapshot->header->node_count;
+
+    if (node->meta.type == NODE_DIRECTORY)
+    {
+        if (entry->first_child >= node_count || entry->child_count > node_count - entry->first_child)
+            goto out;
+
+        treenode_t *last_child = NULL;
+        for (uint32_t i = entry->first_child; i < entry->first_child + entry->child_count; i++)
+        {
+            const ramfs_snapshot_node_t *child_entry = &snapshot->nodes[i];
+            if (child_entry->name_offset > snapshot->header->names_size || child_entry->name_length > snapshot->header->names_size - child_entry->name_offset)
+                continue;
+
+            char name[MAX_NAME_LENGTH];
+            uint32_t length = (child_entry->name_length < MAX_NAME_LENGTH - 1) ? child_entry->name_length : MAX_NAME_LENGTH - 1;
+            memcpy(name, snapshot->names + child_entry->name_offset, length);
+            name[length] = '\0';
+
+            treenode_t *child = ramfs_alloc_node(name, (child_entry->type == NODE_DIRECTORY) ? NODE_DIRECTORY : NODE_FILE);
+            if (child == NULL)
+                goto out;
+
+            child->meta.size = (child->meta.type == NODE_FILE) ? child_entry->size : 0;
+            child->meta.create_time = child_entry->create_time;
+            child->meta.modify_time = child_entry->modify_time;
+            child->meta.access_time = child_entry->access_time;
+            child->snapshot = snapshot;
+            child->snapshot_index = i;
+
+            ramfs_add_child(node, child, &last_child);
+        }
+    }
+    else
+    {
+        uint64_t page_count = (node->meta.size + RAMFS_PAGE_SIZE - 1) / RAMFS_PAGE_SIZE;
+
+        if (entry->data_offset > snapshot->size || page_count * RAMFS_PAGE_SIZE > snapshot->size - entry->data_offset ||
+            (node->pages = calloc(page_count + 1, sizeof(ramfs_page_t*))) == NULL)
+        {
+            node->meta.size = 0;
+            goto out;
+        }
+
+        node->store = RAMFS_STORE_PAGED;
+
+        for (uint32_t i = 0; i < page_count; i++)
+        {
+            ramfs_page_t *page = malloc(sizeof(ramfs_page_t));
+            if (page == NULL)
+                break;
+
+            page->ref_count = 1;
+            page->mapped = true;
+            page->hashed = false;
+            page->data = (uint8_t*)snapshot->base + entry->data_offset + (uint64_t)i * RAMFS_PAGE_SIZE;
+            node->pages[i] = page;
+        }
+
+        node->page_count = page_count;
+    }
+
+out:
+    pthread_rwlock_unlock(&node->lock);
+}
+
+static void ramfs_expand(treenode_t *node)
+{
+    // most nodes are already expanded, no need to lock anything
+    if (node->source == NULL && node->snapshot == NULL)
+        return;
+
+    pthread_mutex_lock(&share_lock);
+    ramfs_expand_locked(node);
+    pthread_mutex_unlock(&share_lock);
+}
+
+/*
+ * Write-locks a node about to change. Its clones (and the clones of its ancestors) must have
+ * their own copy first, which can't be done under the lock: we retry if a new one showed up meanwhile.
+ */
+static void ramfs_lock_for_change(treenode_t *node)
+{
+    while (true)
+    {
+        ramfs_expand(node);
+        ramfs_detach_dependents(node);
+
+        pthread_rwlock_wrlock(&node->lock);
+        if (!ramfs_has_dependents(node))
+            return;
+
+        pthread_rwlock_unlock(&node->lock);
+    }
+}
+
+/*
+ * Dedup mode
+ *
+ * The pages written while it's enabled are hashed once the write is done: a page identical to one
+ * already in the table is dropped and the file shares the one of the table instead (copy-on-write
+ * as any shared page), a page of zeros becomes a hole. Pages are compared byte by byte on a hash
+ * match. The dedup is by page, at fixed offsets in the files: a page is the unit of sharing, a
+ * chunking defined by the content wouldn't let a file reach its pages by their index.
+ *
+ * 'dedup_lock' protects the table, taken after the lock of a file. A hashed page is only freed
+ * under it (the table may be handing it out meanwhile).
+ */
+#define RAMFS_DEDUP_MIN_BUCKETS 1024
+
+static bool dedup_enabled = false;
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+static ramfs_page_t **dedup_buckets = NULL;
+static uint64_t dedup_bucket_count = 0;
+static ramfs_dedup_stats_t dedup_stats;
+
+/**
+ * Enables or disables the dedup of the file pages, for the writes done afterwards.
+ * The pages already shared stay shared.
+ */
+void ramfs_set_dedup(bool enabled)
+{
+    dedup_enabled = enabled;
+}
+
+void ramfs_dedup_stats(ramfs_dedup_stats_t *stats)
+{
+    pthread_mutex_lock(&dedup_lock);
+    *stats = dedup_stats;
+    pthread_mutex_unlock(&dedup_lock);
+}
+
+// FNV-1a, by words
+static uint64_t ramfs_hash_page(const uint8_t *data)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < RAMFS_PAGE_SIZE; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ull;
+    }
+
+    return hash ^ (hash >> 29);
+}
+
+// called with 'dedup_lock' held
+static void ramfs_unhash_page(ramfs_page_t *page)
+{
+    ramfs_page_t **link = &dedup_buckets[page->hash & (dedup_bucket_count - 1)];
+    while (*link != page)
+        link = &(*link)->hash_next;
+
+    *link = page->hash_next;
+    page->hashed = false;
+    dedup_stats.unique_pages--;
+}
+
+// called with 'dedup_lock' held, the table doubles when it's full (it never shrinks)
+static void ramfs_grow_dedup_table(void)
+{
+    uint64_t count = (dedup_bucket_count == 0) ? RAMFS_DEDUP_MIN_BUCKETS : dedup_bucket_count * 2;
+    ramfs_page_t **buckets = calloc(count, sizeof(ramfs_page_t*));
+    if (!buckets)
+        return;
+
+    for (uint64_t i = 0; i < dedup_bucket_count; i++)
+    {
+        while (dedup_buckets[i])
+        {
+            ramfs_page_t *page = dedup_buckets[i];
+            dedup_buckets[i] = page->hash_next;
+
+            page->hash_next = buckets[page->hash & (count - 1)];
+            buckets[page->hash & (count - 1)] = page;
+        }
+    }
+
+    free(dedup_buckets);
+    dedup_buckets = buckets;
+    dedup_bucket_count = count;
+}
+
+static void ramfs_release_page(ramfs_page_t *page)
+{
+    if (page == NULL)
+        return;
+
+    if (page->hashed)
+    {
+        pthread_mutex_lock(&dedup_lock);
+
+        bool last = (--page->ref_count == 0);
+        if (last && page->hashed)
+            ramfs_unhash_page(page);
+
+        pthread_mutex_unlock(&dedup_lock);
+
+        if (!last)
+            return;
+    }
+    else if (--page->ref_count > 0)
+        return;
+
+    if (!page->mapped)
+    {
+        free(page->data);
+        membudget_charge(&ramfs_account, -RAMFS_PAGE_SIZE);
+    }
+    free(page);
+}
+
+/*
+ * Looks for a copy of a page of the file in the dedup table, the file gets it instead of its own.
+ * Otherwise its page goes in the table. Called with the file write locked.
+ */
+static void ramfs_dedup_page(treenode_t *file, uint32_t index)
+{
+    ramfs_page_t *page = file->pages[index];
+    if (page == NULL || page->mapped || page->hashed)
+        return;
+
+    static const uint8_t zeros[RAMFS_PAGE_SIZE];
+    if (memcmp(page->data, zeros, RAMFS_PAGE_SIZE) == 0)
+    {
+        file->pages[index] = NULL;     // it reads as zeros anyway
+        ramfs_release_page(page);
+
+        pthread_mutex_lock(&dedup_lock);
+        dedup_stats.deduplicated++;
+        pthread_mutex_unlock(&dedup_lock);
+        return;
+    }
+
+    uint64_t hash = ramfs_hash_page(page->data);
+    ramfs_page_t *found = NULL;
+
+    pthread_mutex_lock(&dedup_lock);
+
+    if (dedup_bucket_count == 0 || dedup_stats.unique_pages >= dedup_bucket_count)
+        ramfs_grow_dedup_table();
+
+    if (dedup_bucket_count == 0)
+    {
+        pthread_mutex_unlock(&dedup_lock);
+        return;
+    }
+
+    for (found = dedup_buckets[hash & (dedup_bucket_count - 1)]; found; found = found->hash_next)
+        if (found->hash == hash && memcmp(found->data, page->data, RAMFS_PAGE_SIZE) == 0)
+            break;
+
+    if (found)
+    {
+        found->ref_count++;
+        dedup_stats.deduplicated++;
+    }
+    else
+    {
+        page->hash = hash;
+        page->hashed = true;
+        page->hash_next = dedup_buckets[hash & (dedup_bucket_count - 1)];
+        dedup_buckets[hash & (dedup_bucket_count - 1)] = page;
+        dedup_stats.unique_pages++;
+    }
+
+    pthread_mutex_unlock(&dedup_lock);
+
+    if (found)
+    {
+        file->pages[index] = found;
+        ramfs_release_page(page);
+    }
+}
+
+/* Returns a page of the file that can be written, copying it if it's shared or mapped */
+static ramfs_page_t* ramfs_writable_page(treenode_t *file, uint32_t index)
+{
+    ramfs_page_t *page = file->pages[index];
+
+    // if we're its only user, it can leave the table and be written in place
+    if (page != NULL && page->hashed)
+    {
+        pthread_mutex_lock(&dedup_lock);
+        if (page->ref_count == 1)
+            ramfs_unhash_page(page);
+        pthread_mutex_unlock(&dedup_lock);
+    }
+
+    if (page != NULL && page->ref_count == 1 && !page->mapped && !page->hashed)
+        return page;
+
+    ramfs_page_t *copy = malloc(sizeof(ramfs_page_t));
+    uint8_t *data = (page != NULL) ? malloc(RAMFS_PAGE_SIZE) : calloc(1, RAMFS_PAGE_SIZE);
+    if (copy == NULL || data == NULL)
+    {
+        free(copy);
+        free(data);
+        return NULL;
+    }
+
+    if (page != NULL)
+        memcpy(data, page->data, RAMFS_PAGE_SIZE);
+
+    copy->ref_count = 1;
+    copy->mapped = false;
+    copy->hashed = false;
+    copy->data = data;
+    membudget_charge(&ramfs_account, RAMFS_PAGE_SIZE);
+
+    ramfs_release_page(page);
+    file->pages[index] = copy;
+
+    return copy;
+}
+
+/* Frees a node that was unlinked from the tree, once no lookup can be looking at it */
+static void ramfs_destroy_node(void *arg)
+{
+    treenode_t *node = arg;
+
+    for (uint32_t i = 0; i < node->page_count; i++)
+        ramfs_release_page(node->pages[i]);
+
+    pthread_rwlock_destroy(&node->lock);
+    free(node->pages);
+    free(node->extent);
+    membudget_charge(&ramfs_account, -(ssize_t)node->extent_capacity);
+    free(node);
+}
+
+// the directory must be locked
+static treenode_t* ramfs_find_child(treenode_t *dir, const char *name)
+{
     treenode_t *child = dir->first_child;
     while (child)
     {
@@ -56,98 +667,333 @@ static treenode_t* ramfs_lookup(treenode_t *dir, const char *name)
     return NULL;
 }
 
-static treenode_t* ramfs_create_node(treenode_t *parent, const char *name, nodetype_t type)
-{
-    if (!parent || parent->meta.type != NODE_DIRECTORY)
-        return NULL;
-    
-    // verifies if the node doesn't already exists
-    if (ramfs_lookup(parent, name) != NULL)
-        return NULL; // Le nom existe déjà
-    
-    treenode_t *new_node = (treenode_t*)malloc(sizeof(treenode_t));
-    if (!new_node)
-        return NULL;
-    
-    // initialize metadata
-    strncpy(new_node->meta.name, name, MAX_NAME_LENGTH - 1);
-    new_node->meta.name[MAX_NAME_LENGTH - 1] = '\0';
-    new_node->meta.type = type;
-    new_node->meta.size = 0;
-    uint64_t current_time = get_current_time();
-    new_node->meta.create_time = current_time;
-    new_node->meta.modify_time = current_time;
-    new_node->meta.access_time = current_time;
-    
-    // initialize links
-    new_node->parent = parent;
-    new_node->first_child = NULL;
-    new_node->next_sibling = NULL;
-    new_node->data = NULL;
-    
-    // add to the parent's child list
-    if (!parent->first_child)
-        parent->first_child = new_node;
-    else
+static treenode_t* ramfs_lookup(treenode_t *dir, const char *name)
+{
+    if (!dir || dir->meta.type != NODE_DIRECTORY)
+        return NULL;
+    
+    ramfs_expand(dir);
+
+    // update
+    RAMFS_TOUCH(dir, get_current_time());
+
+    pthread_rwlock_rdlock(&dir->lock);
+    treenode_t *child = ramfs_find_child(dir, name);
+    pthread_rwlock_unlock(&dir->lock);
+
+    return child;
+}
+
+static treenode_t* ramfs_create_node(treenode_t *parent, const char *name, nodetype_t type)
+{
+    if (!parent || parent->meta.type != NODE_DIRECTORY)
+        return NULL;
+    
+    treenode_t *new_node = ramfs_alloc_node(name, type);
+    if (!new_node)
+        return NULL;
+
+    ramfs_lock_for_change(parent);
+
+    // verifies if the node doesn't already exists (or if the directory itself was removed)
+    if (parent->removed || ramfs_find_child(parent, name) != NULL)
+    {
+        pthread_rwlock_unlock(&parent->lock);
+        ramfs_destroy_node(new_node);
+        return NULL; // Le nom existe déjà
+    }
+    
+    // initialize metadata
+    uint64_t current_time = get_current_time();
+    new_node->meta.create_time = current_time;
+    new_node->meta.modify_time = current_time;
+    new_node->meta.access_time = current_time;
+    
+    // add to the parent's child list
+    treenode_t *last_child = parent->first_child;
+    while (last_child && last_child->next_sibling)
+        last_child = last_child->next_sibling;
+
+    ramfs_add_child(parent, new_node, &last_child);
+    
+    // update !
+    parent->meta.modify_time = current_time;
+
+    pthread_rwlock_unlock(&parent->lock);
+    
+    return new_node;
+}
+
+/*
+ * Storage tiers
+ *
+ * A tiny file is kept in its node (RAMFS_INLINE_SIZE bytes), reading it doesn't touch anything else.
+ * Up to RAMFS_EXTENT_MAX it gets a single buffer grown as needed, then pages: only pages can be
+ * shared (clones, snapshots, dedup) or have holes. A write making a file too big for its store moves
+ * it to the next one, it never goes back. The bytes past the size of an inline or extent file are zeros.
+ */
+
+// copies a part of the content, it must be within the size of the file
+static void ramfs_copy_out(treenode_t *file, uint8_t *buffer, uint64_t size, uint64_t offset)
+{
+    if (file->store == RAMFS_STORE_INLINE)
+    {
+        memcpy(buffer, file->inline_data + offset, size);
+        return;
+    }
+
+    if (file->store == RAMFS_STORE_EXTENT)
+    {
+        memcpy(buffer, file->extent + offset, size);
+        return;
+    }
+
+    for (uint64_t done = 0; done < size; )
+    {
+        uint64_t position = offset + done;
+        uint64_t in_page = RAMFS_PAGE_SIZE - position % RAMFS_PAGE_SIZE;
+        uint64_t chunk = (size - done < in_page) ? size - done : in_page;
+        ramfs_page_t *page = file->pages[position / RAMFS_PAGE_SIZE];
+
+        if (page != NULL)
+            memcpy(buffer + done, page->data + position % RAMFS_PAGE_SIZE, chunk);
+        else
+            memset(buffer + done, 0, chunk);    // a hole
+
+        done += chunk;
+    }
+}
+
+// moves the content of an inline or extent file to pages
+static int ramfs_move_to_pages(treenode_t *file)
+{
+    const uint8_t *data = (file->store == RAMFS_STORE_INLINE) ? file->inline_data : file->extent;
+    uint32_t count = (file->meta.size + RAMFS_PAGE_SIZE - 1) / RAMFS_PAGE_SIZE;
+    ramfs_page_t **pages = calloc(count + 1, sizeof(ramfs_page_t*));
+    if (!pages)
+        return VFS_ERROR;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint64_t length = (file->meta.size - (uint64_t)i * RAMFS_PAGE_SIZE < RAMFS_PAGE_SIZE) ? file->meta.size - (uint64_t)i * RAMFS_PAGE_SIZE : RAMFS_PAGE_SIZE;
+
+        pages[i] = malloc(sizeof(ramfs_page_t));
+        uint8_t *page_data = calloc(1, RAMFS_PAGE_SIZE);
+        if (!pages[i] || !page_data)
+        {
+            free(page_data);
+            free(pages[i]);     // not initialized yet
+            for (uint32_t j = 0; j < i; j++)
+                ramfs_release_page(pages[j]);
+            free(pages);
+            return VFS_ERROR;
+        }
+
+        memcpy(page_data, data + (uint64_t)i * RAMFS_PAGE_SIZE, length);
+        pages[i]->ref_count = 1;
+        pages[i]->mapped = false;
+        pages[i]->hashed = false;
+        pages[i]->data = page_data;
+        membudget_charge(&ramfs_account, RAMFS_PAGE_SIZE);
+    }
+
+    membudget_charge(&ramfs_account, -(ssize_t)file->extent_capacity);
+    free(file->extent);
+    file->extent = NULL;
+    file->extent_capacity = 0;
+    memset(file->inline_data, 0, RAMFS_INLINE_SIZE);
+
+    file->pages = pages;
+    file->page_count = count;
+    file->store = RAMFS_STORE_PAGED;
+
+    return VFS_OK;
+}
+
+// makes room for 'size' bytes in the file, moving it to the next store if needed
+// (an extent grows by doubling, or to 'size' right away when it's 'exact')
+static int ramfs_reserve(treenode_t *file, uint64_t size, bool exact)
+{
+    if (file->store == RAMFS_STORE_INLINE && size <= RAMFS_INLINE_SIZE)
+        return VFS_OK;
+
+    if (file->store != RAMFS_STORE_PAGED && size <= RAMFS_EXTENT_MAX)
+    {
+        if (file->store == RAMFS_STORE_EXTENT && size <= file->extent_capacity)
+            return VFS_OK;
+
+        uint32_t capacity = (file->extent_capacity > 0) ? file->extent_capacity : RAMFS_INLINE_SIZE;
+        while (capacity < size && !exact)
+            capacity *= 2;
+        if (capacity < size)
+            capacity = size;
+        if (capacity > RAMFS_EXTENT_MAX)
+            capacity = RAMFS_EXTENT_MAX;
+
+        uint8_t *extent = realloc(file->extent, capacity);
+        if (!extent)
+            return VFS_ERROR;
+
+        if (file->store == RAMFS_STORE_INLINE)
+        {
+            memcpy(extent, file->inline_data, RAMFS_INLINE_SIZE);
+            memset(extent + RAMFS_INLINE_SIZE, 0, capacity - RAMFS_INLINE_SIZE);
+        }
+        else
+            memset(extent + file->extent_capacity, 0, capacity - file->extent_capacity);
+
+        membudget_charge(&ramfs_account, capacity - file->extent_capacity);
+        file->extent = extent;
+        file->extent_capacity = capacity;
+        file->store = RAMFS_STORE_EXTENT;
+
+        return VFS_OK;
+    }
+
+    if (file->store != RAMFS_STORE_PAGED && ramfs_move_to_pages(file) != VFS_OK)
+        return VFS_ERROR;
+
+    // grow the page table if necessary, the new pages are holes until written
+    uint64_t page_count = (size + RAMFS_PAGE_SIZE - 1) / RAMFS_PAGE_SIZE;
+    if (page_count > file->page_count)
     {
-        treenode_t *sibling = parent->first_child;
-        while (sibling->next_sibling)
-            sibling = sibling->next_sibling;
+        ramfs_page_t **new_pages = realloc(file->pages, page_count * sizeof(ramfs_page_t*));
+        if (!new_pages)
+            return VFS_ERROR;
 
-        sibling->next_sibling = new_node;
+        memset(new_pages + file->page_count, 0, (page_count - file->page_count) * sizeof(ramfs_page_t*));
+        file->pages = new_pages;
+        file->page_count = page_count;
     }
-    
-    // update !
-    parent->meta.modify_time = current_time;
-    
-    return new_node;
+
+    return VFS_OK;
 }
 
-static size_t ramfs_write(treenode_t *file, const uint8_t *data, uint64_t size, uint64_t offset)
+static ssize_t ramfs_write(treenode_t *file, const uint8_t *data, uint64_t size, uint64_t offset)
 {
     if (!file || file->meta.type != NODE_FILE)
         return VFS_ENOENT;
+
+    ramfs_lock_for_change(file);
     
+    ssize_t written = size;
     uint64_t new_size = (offset + size > file->meta.size) ? offset + size : file->meta.size;
-    
-    // allocate memory if necessary
-    if (new_size > file->meta.size || !file->data) 
+
+    if (ramfs_reserve(file, new_size, false) != VFS_OK)
     {
-        uint8_t *new_data = (uint8_t*)realloc(file->data, new_size);
-        if (!new_data)
-            return VFS_ERROR;
-        
-        file->data = new_data;
+        written = VFS_ERROR;
+        goto out;
     }
+
+    if (data && file->store == RAMFS_STORE_INLINE)
+        memcpy(file->inline_data + offset, data, size);
+    else if (data && file->store == RAMFS_STORE_EXTENT)
+        memcpy(file->extent + offset, data, size);
     
-    if (data && size > 0)
-        memcpy(file->data + offset, data, size);
+    for (uint64_t done = 0; data && file->store == RAMFS_STORE_PAGED && done < size; )
+    {
+        uint64_t position = offset + done;
+        uint64_t in_page = RAMFS_PAGE_SIZE - position % RAMFS_PAGE_SIZE;
+        uint64_t chunk = (size - done < in_page) ? size - done : in_page;
+
+        ramfs_page_t *page = ramfs_writable_page(file, position / RAMFS_PAGE_SIZE);
+        if (!page)
+        {
+            written = VFS_ERROR;
+            goto out;
+        }
+
+        memcpy(page->data + position % RAMFS_PAGE_SIZE, data + done, chunk);
+        done += chunk;
+    }
     
     // update file size
     file->meta.size = new_size;
+
+    if (dedup_enabled && data && file->store == RAMFS_STORE_PAGED)
+    {
+        for (uint64_t index = offset / RAMFS_PAGE_SIZE; size > 0 && index <= (offset + size - 1) / RAMFS_PAGE_SIZE; index++)
+            ramfs_dedup_page(file, index);
+    }
     
     uint64_t current_time = get_current_time();
     file->meta.modify_time = current_time;
-    file->meta.access_time = current_time;
-    
-    return size;
+    RAMFS_TOUCH(file, current_time);
+
+out:
+    pthread_rwlock_unlock(&file->lock);
+    membudget_balance();
+    return written;
+}
+
+/*
+ * Sizes the storage of the file for [offset, offset + length) in one step: an extent gets its
+ * final capacity, the page table its final length and the holes of the range their pages,
+ * so the writes filling the range don't allocate anything anymore.
+ */
+static int ramfs_allocate(treenode_t *file, uint64_t offset, uint64_t length)
+{
+    if (!file || file->meta.type != NODE_FILE)
+        return VFS_ENOENT;
+
+    ramfs_lock_for_change(file);
+
+    int status = VFS_OK;
+    uint64_t end = offset + length;
+    uint64_t new_size = (end > file->meta.size) ? end : file->meta.size;
+
+    if (ramfs_reserve(file, new_size, true) != VFS_OK)
+    {
+        status = VFS_ERROR;
+        goto out;
+    }
+
+    // shared pages are left alone, they're copied by the write anyway
+    for (uint64_t index = offset / RAMFS_PAGE_SIZE; file->store == RAMFS_STORE_PAGED && index <= (end - 1) / RAMFS_PAGE_SIZE; index++)
+    {
+        if (file->pages[index] == NULL && ramfs_writable_page(file, index) == NULL)
+        {
+            status = VFS_ERROR;
+            goto out;
+        }
+    }
+
+    if (new_size != file->meta.size)
+    {
+        file->meta.size = new_size;
+        file->meta.modify_time = get_current_time();
+    }
+
+out:
+    pthread_rwlock_unlock(&file->lock);
+    membudget_balance();
+    return status;
 }
 
-static size_t ramfs_read(treenode_t *file, uint8_t *buffer, uint64_t size, uint64_t offset)
+static ssize_t ramfs_read(treenode_t *file, uint8_t *buffer, uint64_t size, uint64_t offset)
 {
     if (!file || file->meta.type != NODE_FILE || !buffer)
         return VFS_ENOENT;
     
-    file->meta.access_time = get_current_time();
+    ramfs_expand(file);
+
+    RAMFS_TOUCH(file, get_current_time());
+
+    // the readers of a file run in parallel, only a write stops them
+    pthread_rwlock_rdlock(&file->lock);
     
     // EOF ?
     if (offset >= file->meta.size)
+    {
+        pthread_rwlock_unlock(&file->lock);
         return 0;
+    }
     
     // calculate byte to read
     uint64_t to_read = (offset + size > file->meta.size) ? file->meta.size - offset : size;
-    
-    memcpy(buffer, file->data + offset, to_read);
+    ramfs_copy_out(file, buffer, to_read, offset);
+
+    pthread_rwlock_unlock(&file->lock);
 
     return to_read;
 }
@@ -157,6 +1003,7 @@ static size_t ramfs_read(treenode_t *file, uint8_t *buffer, uint64_t size, uint6
 /* Important information for the file system ! */
 typedef struct ramfs_info
 {
+    pthread_rwlock_t vnode_lock;    // the vnode table is shared by every node
     vnode_t* total_vnode[MAX_VNODE_PER_VFS];
     vnode_t* root_vnode;
     treenode_t* root_node;
@@ -166,9 +1013,13 @@ int ramfs_mount(vfs_t* mountpoint, int device_id);
 int ramfs_unmount(vfs_t* mountpoint);
 int ramfs_get_root(vfs_t* mountpoint, vnode_t** result);
 
-int read(vnode_t* node, void *buffer, size_t size, uint32_t offset);
-int write(vnode_t* node, const void *buffer, size_t size, uint32_t offset);
+ssize_t read(vnode_t* node, void *buffer, size_t size, uint64_t offset);
+ssize_t write(vnode_t* node, const void *buffer, size_t size, uint64_t offset);
 int lookup(vnode_t* node, const char* name, struct vnode** result);
+int getattr(vnode_t* node, vfs_stat_t* stat);
+int create(vnode_t* node_dir, const char* name, vtype type, struct vnode** result);
+int remove_node(vnode_t* node_dir, const char* name);
+int allocate(vnode_t* node, uint64_t offset, uint64_t length);
 
 filesystem_t ramfs_op = {
     // fs_name will be filled later
@@ -182,6 +1033,10 @@ vnodeops_t ramfs_vnode_op = {
     .read = read,
     .write = write,
     .lookup = lookup,
+    .getattr = getattr,
+    .create = create,
+    .remove = remove_node,
+    .allocate = allocate,
 };
 
 /*
@@ -194,16 +1049,31 @@ vnodeops_t ramfs_vnode_op = {
  * This setup enables the VFS to interact with the RAM-based file systems
  * through a uniform interface.
  */
+static int add_ramfs_device(const char* name, treenode_t* root)
+{
+    device_t* device = malloc(sizeof(device_t));
+    if(device == NULL)
+        return VFS_ERROR;
+
+    snprintf(device->name, MAX_NAME_LENGTH, "%s", name);
+    device->priv = root;
+    device->read = NULL;
+    device->write = NULL;
+    device->flush = NULL;
+    add_device(device);
+
+    return device_num - 1;
+}
+
 void ramfs_init()
 {
+    if(vnode_pool == NULL)
+        vnode_pool = vfs_create_vnode_pool("ramfs vnode", 0);   // the nodes live in the tree
+
     strcpy(ramfs_op.fs_name, "ramfs");
     vfs_register_new_filesystem(&ramfs_op);
 
-    treenode_t* root0_fs = malloc(sizeof(treenode_t));
-    root0_fs->meta.type = NODE_DIRECTORY;
-    root0_fs->parent = NULL;
-    root0_fs->first_child = NULL;
-    root0_fs->next_sibling = NULL;
+    treenode_t* root0_fs = ramfs_alloc_node("", NODE_DIRECTORY);
 
     treenode_t* doc = ramfs_create_node(root0_fs, "doc", NODE_DIRECTORY);
     treenode_t* hello = ramfs_create_node(doc, "hello.txt", NODE_FILE);
@@ -211,28 +1081,266 @@ void ramfs_init()
     ramfs_write(hello, (const uint8_t*)"hello world !", 13, 0);
     ramfs_create_node(root0_fs, "mnt", NODE_DIRECTORY);
 
-    device_t* device_1 = malloc(sizeof(device_t));
-    strcpy(device_1->name, "ramfs0");
-    device_1->priv = root0_fs;
-    device_1->read = NULL;
-    device_1->write = NULL;
-    add_device(device_1);
+    add_ramfs_device("ramfs0", root0_fs);
 
-    treenode_t* root1_fs = malloc(sizeof(treenode_t));
-    root1_fs->meta.type = NODE_DIRECTORY;
-    root1_fs->parent = NULL;
-    root1_fs->first_child = NULL;
-    root1_fs->next_sibling = NULL;
+    treenode_t* root1_fs = ramfs_alloc_node("", NODE_DIRECTORY);
 
     treenode_t* hi = ramfs_create_node(root1_fs, "hi.txt", NODE_FILE);
-    ramfs_write(hi, (const uint8_t*)"hi from ramfs1 !", 18, 0);
+    ramfs_write(hi, (const uint8_t*)"hi from ramfs1 !", 16, 0);
+
+    add_ramfs_device("ramfs1", root1_fs);
+}
+
+/**
+ * Writes the tree of a ramfs device to a snapshot file (see the format at the top of this file).
+ *
+ * @param device_id  a ramfs device.
+ * @param path       the snapshot to create, overwritten if it exists.
+ * @return           VFS_OK on success, VFS_ERROR otherwise.
+ */
+int ramfs_save(int device_id, const char* path)
+{
+    if(device_id < 0 || device_id >= device_num)
+        return VFS_ERROR;
+
+    // breadth first, so that the children of a directory end up next to each other
+    size_t capacity = 64;
+    size_t count = 1;
+    treenode_t** queue = malloc(capacity * sizeof(treenode_t*));
+    ramfs_snapshot_node_t* nodes = malloc(capacity * sizeof(ramfs_snapshot_node_t));
+    uint64_t names_size = 0;
+
+    if(queue == NULL || nodes == NULL)
+    {
+        free(queue);
+        free(nodes);
+        return VFS_ERROR;
+    }
+
+    queue[0] = (treenode_t*)device_list[device_id]->priv;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        treenode_t* node = queue[i];
+        ramfs_expand(node);
+
+        // the node stays read locked until its children are queued
+        pthread_rwlock_rdlock(&node->lock);
+
+        memset(&nodes[i], 0, sizeof(ramfs_snapshot_node_t));
+        nodes[i].first_child = count;
+        nodes[i].name_offset = names_size;
+        nodes[i].name_length = strlen(node->meta.name);
+        nodes[i].type = node->meta.type;
+        nodes[i].size = node->meta.size;
+        nodes[i].create_time = node->meta.create_time;
+        nodes[i].modify_time = node->meta.modify_time;
+        nodes[i].access_time = node->meta.access_time;
+        names_size += nodes[i].name_length;
+
+        for(treenode_t* child = node->first_child; child != NULL; child = child->next_sibling)
+        {
+            if(count == capacity)
+            {
+                capacity *= 2;
+                treenode_t** new_queue = realloc(queue, capacity * sizeof(treenode_t*));
+                ramfs_snapshot_node_t* new_nodes = realloc(nodes, capacity * sizeof(ramfs_snapshot_node_t));
+                queue = (new_queue != NULL) ? new_queue : queue;
+                nodes = (new_nodes != NULL) ? new_nodes : nodes;
+
+                if(new_queue == NULL || new_nodes == NULL)
+                {
+                    pthread_rwlock_unlock(&node->lock);
+                    free(queue);
+                    free(nodes);
+                    return VFS_ERROR;
+                }
+            }
+
+            queue[count++] = child;
+            nodes[i].child_count++;
+        }
+
+        pthread_rwlock_unlock(&node->lock);
+    }
+
+    ramfs_snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RAMFS_SNAPSHOT_MAGIC, 8);
+    header.version = RAMFS_SNAPSHOT_VERSION;
+    header.page_size = RAMFS_PAGE_SIZE;
+    header.node_count = count;
+    header.nodes_offset = sizeof(header);
+    header.names_offset = header.nodes_offset + count * sizeof(ramfs_snapshot_node_t);
+    header.names_size = names_size;
+    header.data_offset = (header.names_offset + names_size + RAMFS_PAGE_SIZE - 1) / RAMFS_PAGE_SIZE * RAMFS_PAGE_SIZE;
+
+    // every file starts on a page boundary
+    uint64_t data_end = header.data_offset;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(nodes[i].type != NODE_FILE)
+            continue;
+
+        nodes[i].data_offset = data_end;
+        data_end += (nodes[i].size + RAMFS_PAGE_SIZE - 1) / RAMFS_PAGE_SIZE * RAMFS_PAGE_SIZE;
+    }
+
+    FILE* file = fopen(path, "wb");
+    int status = (file != NULL) ? VFS_OK : VFS_ERROR;
+
+    if(status == VFS_OK && (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(nodes, sizeof(ramfs_snapshot_node_t), count, file) != count))
+        status = VFS_ERROR;
+
+    for(size_t i = 0; status == VFS_OK && i < count; i++)
+        if(fwrite(queue[i]->meta.name, 1, nodes[i].name_length, file) != nodes[i].name_length)
+            status = VFS_ERROR;
+
+    static const uint8_t zeros[RAMFS_PAGE_SIZE];
+    uint64_t padding = header.data_offset - (header.names_offset + names_size);
+    if(status == VFS_OK && fwrite(zeros, 1, padding, file) != padding)
+        status = VFS_ERROR;
+
+    // the pages are written whole, the end of the last one is zeros anyway
+    for(size_t i = 0; status == VFS_OK && i < count; i++)
+    {
+        treenode_t* node = queue[i];
+        if(node->meta.type != NODE_FILE)
+            continue;
+
+        // the size was taken with the node table, a file written meanwhile is cut (or padded) to it
+        pthread_rwlock_rdlock(&node->lock);
+
+        uint64_t page_count = (nodes[i].size + RAMFS_PAGE_SIZE - 1) / RAMFS_PAGE_SIZE;
+        uint8_t page[RAMFS_PAGE_SIZE];
+
+        for(uint64_t p = 0; status == VFS_OK && p < page_count; p++)
+        {
+            const uint8_t* data = zeros;
+
+            if(node->store == RAMFS_STORE_PAGED && p < node->page_count && node->pages[p] != NULL)
+                data = node->pages[p]->data;
+            else if(node->store != RAMFS_STORE_PAGED && p * RAMFS_PAGE_SIZE < node->meta.size)
+            {
+                // the content is smaller than a page, padded with zeros
+                uint64_t length = node->meta.size - p * RAMFS_PAGE_SIZE;
+                if(length > RAMFS_PAGE_SIZE)
+                    length = RAMFS_PAGE_SIZE;
+                if(length > nodes[i].size - p * RAMFS_PAGE_SIZE)
+                    length = nodes[i].size - p * RAMFS_PAGE_SIZE;
+
+                memset(page, 0, RAMFS_PAGE_SIZE);
+                ramfs_copy_out(node, page, length, p * RAMFS_PAGE_SIZE);
+                data = page;
+            }
+
+            if(fwrite(data, 1, RAMFS_PAGE_SIZE, file) != RAMFS_PAGE_SIZE)
+                status = VFS_ERROR;
+        }
+
+        pthread_rwlock_unlock(&node->lock);
+    }
+
+    if(file != NULL && fclose(file) != 0)
+        status = VFS_ERROR;
+
+    free(queue);
+    free(nodes);
+    return status;
+}
+
+/**
+ * Registers a new ramfs device holding a copy-on-write clone of another ramfs device.
+ *
+ * Nothing is copied here: the clone shares the nodes and pages of the source. A directory gets its
+ * own node list when it's first used (in either device), and pages are only copied when written.
+ * So a clone costs one node, then grows with what is used and changed.
+ *
+ * @param device_id    the ramfs device to clone.
+ * @param device_name  the name of the new device.
+ * @return             the id of the new device, or VFS_ERROR.
+ */
+int ramfs_clone(int device_id, const char* device_name)
+{
+    if(device_id < 0 || device_id >= device_num)
+        return VFS_ERROR;
+
+    pthread_mutex_lock(&share_lock);
+    treenode_t* root = ramfs_alloc_clone((treenode_t*)device_list[device_id]->priv);
+    pthread_mutex_unlock(&share_lock);
+
+    if(root == NULL)
+        return VFS_ERROR;
+
+    return add_ramfs_device(device_name, root);
+}
+
+/**
+ * Registers a ramfs device backed by a snapshot made with ramfs_save().
+ *
+ * The snapshot is mapped, not read: nodes are created when their directory is first looked up
+ * and file pages are used right from the mapping until they're written (they're copied then).
+ * So loading a big tree only costs the mapping, whatever its size.
+ *
+ * @param path         the snapshot file.
+ * @param device_name  the name of the new device.
+ * @return             the id of the new device, or VFS_ERROR.
+ */
+int ramfs_load(const char* path, const char* device_name)
+{
+    FILE* file = fopen(path, "rb");
+    if(file == NULL)
+        return VFS_ERROR;
+
+    struct stat metainfo;
+    if(fstat(fileno(file), &metainfo) != 0 || (size_t)metainfo.st_size < sizeof(ramfs_snapshot_header_t))
+    {
+        fclose(file);
+        return VFS_ERROR;
+    }
+
+    // private and read only: a written page is copied to the heap first
+    void* base = mmap(NULL, metainfo.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    fclose(file);
+    if(base == MAP_FAILED)
+        return VFS_ERROR;
+
+    ramfs_snapshot_t* snapshot = malloc(sizeof(ramfs_snapshot_t));
+    const ramfs_snapshot_header_t* header = base;
+    uint64_t size = metainfo.st_size;
+
+    if(snapshot == NULL || memcmp(header->magic, RAMFS_SNAPSHOT_MAGIC, 8) != 0 ||
+        header->version != RAMFS_SNAPSHOT_VERSION || header->page_size != RAMFS_PAGE_SIZE || header->node_count == 0 ||
+        header->nodes_offset > size || header->node_count > (size - header->nodes_offset) / sizeof(ramfs_snapshot_node_t) ||
+        header->names_offset > size || header->names_size > size - header->names_offset)
+    {
+        free(snapshot);
+        munmap(base, metainfo.st_size);
+        return VFS_ERROR;
+    }
+
+    snapshot->base = base;
+    snapshot->size = size;
+    snapshot->header = header;
+    snapshot->nodes = (const ramfs_snapshot_node_t*)(snapshot->base + header->nodes_offset);
+    snapshot->names = (const char*)(snapshot->base + header->names_offset);
+
+    treenode_t* root = ramfs_alloc_node("", NODE_DIRECTORY);
+    if(root == NULL)
+    {
+        free(snapshot);
+        munmap(base, metainfo.st_size);
+        return VFS_ERROR;
+    }
 
-    device_t* device_2 = malloc(sizeof(device_t));
-    strcpy(device_2->name, "ramfs1");
-    device_2->priv = root1_fs;
-    device_2->read = NULL;
-    device_2->write = NULL;
-    add_device(device_2);
+    root->meta.create_time = snapshot->nodes[0].create_time;
+    root->meta.modify_time = snapshot->nodes[0].modify_time;
+    root->meta.access_time = snapshot->nodes[0].access_time;
+    root->snapshot = snapshot;
+    root->snapshot_index = 0;
+
+    return add_ramfs_device(device_name, root);
 }
 
 /*
@@ -249,12 +1357,13 @@ int ramfs_mount(vfs_t* mountpoint, int device_id)
 {
     fs_info_t* fs_info = malloc(sizeof(fs_info_t));
 
+    pthread_rwlock_init(&fs_info->vnode_lock, NULL);
     for(int i = 0; i < MAX_VNODE_PER_VFS; i++)
         fs_info->total_vnode[i] = NULL;
 
     fs_info->root_vnode = malloc(sizeof(vnode_t));
     fs_info->root_vnode->ref_count = 0;
-    fs_info->root_vnode->flags = VNODE_NONE;
+    fs_info->root_vnode->flags = VNODE_ROOT;
     fs_info->root_vnode->vnode_type = VDIR;
     fs_info->root_vnode->vfs_mountedhere = NULL;
     fs_info->root_vnode->vnode_op = &ramfs_vnode_op;
@@ -275,10 +1384,11 @@ int ramfs_unmount(vfs_t* mountpoint)
 
     for(int i = 0; i < MAX_VNODE_PER_VFS; i++)
         if(fs_info->total_vnode[i] != NULL)
-            free(fs_info->total_vnode[i]);
+            vfs_free_vnode(fs_info->total_vnode[i]);
 
     free(fs_info->root_vnode);
 
+    pthread_rwlock_destroy(&fs_info->vnode_lock);
     free(fs_info);
 
     return VFS_OK;
@@ -289,6 +1399,7 @@ int ramfs_get_root(vfs_t* mountpoint, vnode_t** result)
     fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
 
     *result = fs_info->root_vnode;
+    (*result)->ref_count++;
     
     return VFS_OK;
 }
@@ -299,22 +1410,35 @@ int ramfs_get_root(vfs_t* mountpoint, vnode_t** result)
  * This function checks the vnode table of the file system to see if a vnode
  * already exists for the given tree node. If it does, that vnode is returned.
  * Otherwise, a new vnode is created and added to the table.
+ * Either way the vnode is held for the caller, while the table is write locked.
  *
- * If there is no space left in the vnode table for a new entry, the function
- * returns NULL.
+ * Returns VFS_ENOENT if the node was removed since it was found, and VFS_ERROR
+ * if there is no space left in the vnode table for a new entry.
  */
-static vnode_t* create_vnode(vfs_t* mountpoint, treenode_t* node)
+static int create_vnode_locked(vfs_t* mountpoint, treenode_t* node, vnode_t** result)
 {
     fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
 
+    *result = NULL;
+    if(node->removed)
+        return VFS_ENOENT;
+
     for(int i = 0; i < MAX_VNODE_PER_VFS; i++)
+    {
         if(fs_info->total_vnode[i] != NULL && fs_info->total_vnode[i]->vnode_data == (void*)node)
-            return fs_info->total_vnode[i];    // if the vnode already exist in the vnode table
+        {
+            *result = fs_info->total_vnode[i];    // if the vnode already exist in the vnode table
+            (*result)->ref_count++;
+            return VFS_OK;
+        }
+    }
+
+    vnode_t* newVnode = vfs_alloc_vnode(vnode_pool);
+    if(newVnode == NULL)
+        return VFS_ERROR;
 
-    vnode_t* newVnode = malloc(sizeof(vnode_t));
-    newVnode->ref_count = 0;
+    newVnode->ref_count = 1;
     newVnode->flags = VNODE_NONE;
-    newVnode->vfs_mountedhere = NULL;
     newVnode->vnode_data = node;    // ramfs store the node here !!
     newVnode->vnode_op = &ramfs_vnode_op;
     newVnode->vnode_vfs = mountpoint;
@@ -340,20 +1464,56 @@ static vnode_t* create_vnode(vfs_t* mountpoint, treenode_t* node)
         if(fs_info->total_vnode[i] == NULL)
         {
             fs_info->total_vnode[i] = newVnode;
-            return newVnode;
+            *result = newVnode;
+            return VFS_OK;
         } 
 
-        // if the vnode is unused
+        // if the vnode is unused (a path lookup may still be looking at it, but it doesn't hold it)
         if(fs_info->total_vnode[i]->ref_count <= 0)
         {
-            free(fs_info->total_vnode[i]);
+            epoch_retire(fs_info->total_vnode[i], vfs_free_vnode);
             fs_info->total_vnode[i] = newVnode;
-            return newVnode;
+            *result = newVnode;
+            return VFS_OK;
+        }
+    }
+
+    vfs_free_vnode(newVnode);
+    return VFS_ERROR;    // cannot create vnode
+}
+
+static int create_vnode(vfs_t* mountpoint, treenode_t* node, vnode_t** result)
+{
+    fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
+    int status = VFS_ENOENT;
+
+    // the usual case, the vnode is already there
+    pthread_rwlock_rdlock(&fs_info->vnode_lock);
+
+    *result = NULL;
+    bool removed = node->removed;
+
+    for(int i = 0; !removed && i < MAX_VNODE_PER_VFS; i++)
+    {
+        if(fs_info->total_vnode[i] != NULL && fs_info->total_vnode[i]->vnode_data == (void*)node)
+        {
+            *result = fs_info->total_vnode[i];
+            (*result)->ref_count++;     // atomic, the other readers may hold it too
+            status = VFS_OK;
+            break;
         }
     }
 
-    free(newVnode);
-    return NULL;    // cannot create vnode
+    pthread_rwlock_unlock(&fs_info->vnode_lock);
+
+    if(*result != NULL || removed)
+        return status;
+
+    pthread_rwlock_wrlock(&fs_info->vnode_lock);
+    status = create_vnode_locked(mountpoint, node, result);
+    pthread_rwlock_unlock(&fs_info->vnode_lock);
+
+    return status;
 }
 
 int lookup(vnode_t* node_dir, const char* name, struct vnode** result)
@@ -365,24 +1525,160 @@ int lookup(vnode_t* node_dir, const char* name, struct vnode** result)
     if(node == NULL)
         return VFS_ENOENT;
 
-    *result = create_vnode(node_dir->vnode_vfs, node);
-
-    if(*result == NULL)
-        return VFS_ERROR;
-    else
-        return VFS_OK;
+    return create_vnode(node_dir->vnode_vfs, node, result);
 }
 
-int read(vnode_t* node, void *buffer, size_t size, uint32_t offset)
+ssize_t read(vnode_t* node, void *buffer, size_t size, uint64_t offset)
 {
     treenode_t* file_node = (treenode_t*)node->vnode_data;
 
     return ramfs_read(file_node, buffer, size, offset);
 }
 
-int write(vnode_t* node, const void *buffer, size_t size, uint32_t offset)
+ssize_t write(vnode_t* node, const void *buffer, size_t size, uint64_t offset)
 {
     treenode_t* file_node = (treenode_t*)node->vnode_data;
 
     return ramfs_write(file_node, buffer, size, offset);
-}
\ No newline at end of file
+}
+
+int allocate(vnode_t* node, uint64_t offset, uint64_t length)
+{
+    treenode_t* file_node = (treenode_t*)node->vnode_data;
+
+    return ramfs_allocate(file_node, offset, length);
+}
+
+int getattr(vnode_t* node, vfs_stat_t* stat)
+{
+    treenode_t* file_node = (treenode_t*)node->vnode_data;
+
+    pthread_rwlock_rdlock(&file_node->lock);
+
+    stat->type = node->vnode_type;
+    stat->flags = VFS_STAT_NONE;
+    stat->size = file_node->meta.size;
+    stat->create_time = file_node->meta.create_time;
+    stat->modify_time = file_node->meta.modify_time;
+    stat->access_time = __atomic_load_n(&file_node->meta.access_time, __ATOMIC_RELAXED);
+
+    pthread_rwlock_unlock(&file_node->lock);
+
+    return VFS_OK;
+}
+
+int create(vnode_t* node_dir, const char* name, vtype type, struct vnode** result)
+{
+    treenode_t* parent = (treenode_t*)node_dir->vnode_data;
+
+    if(ramfs_lookup(parent, name) != NULL)
+        return VFS_EEXIST;
+
+    treenode_t* node = ramfs_create_node(parent, name, (type == VDIR) ? NODE_DIRECTORY : NODE_FILE);
+    if(node == NULL)
+        return VFS_ERROR;
+
+    return create_vnode(node_dir->vnode_vfs, node, result);
+}
+
+/*
+ * Removes a file or an empty directory.
+ * A node still in use (opened) can't be removed, its vnode would point to nothing.
+ * The node is only freed once the lookups that may have found it are done.
+ */
+int remove_node(vnode_t* node_dir, const char* name)
+{
+    fs_info_t* fs_info = (fs_info_t*)node_dir->vnode_vfs->vfs_data;
+    treenode_t* parent = (treenode_t*)node_dir->vnode_data;
+    treenode_t* node;
+    int status = VFS_OK;
+
+    while(true)
+    {
+        node = ramfs_lookup(parent, name);
+        if(node == NULL)
+            return VFS_ENOENT;
+
+        // the clones sharing it (or its parent) must keep their copy
+        ramfs_expand(node);
+        ramfs_detach_dependents(node);
+
+        pthread_rwlock_wrlock(&parent->lock);
+        if(ramfs_find_child(parent, name) == node && !ramfs_has_dependents(node))
+            break;
+
+        pthread_rwlock_unlock(&parent->lock);
+    }
+
+    pthread_rwlock_wrlock(&node->lock);
+
+    if(node->first_child != NULL)
+        status = VFS_ERROR;   // not empty
+
+    pthread_rwlock_wrlock(&fs_info->vnode_lock);
+
+    for(int i = 0; status == VFS_OK && i < MAX_VNODE_PER_VFS; i++)
+    {
+        vnode_t* vnode = fs_info->total_vnode[i];
+        if(vnode == NULL || vnode->vnode_data != (void*)node)
+            continue;
+
+        if(vnode->ref_count > 0)
+            status = VFS_EACCESS;
+        else
+        {
+            fs_info->total_vnode[i] = NULL;
+            epoch_retire(vnode, vfs_free_vnode);
+        }
+    }
+
+    // nothing can be created in it anymore, and the lookups that found it can't make it a vnode
+    if(status == VFS_OK)
+        node->removed = true;
+
+    pthread_rwlock_unlock(&fs_info->vnode_lock);
+
+    if(status == VFS_OK)
+    {
+        treenode_t** link = &parent->first_child;
+        while(*link != node)
+            link = &(*link)->next_sibling;
+        *link = node->next_sibling;
+
+        parent->meta.modify_time = get_current_time();
+    }
+
+    pthread_rwlock_unlock(&node->lock);
+    pthread_rwlock_unlock(&parent->lock);
+
+    if(status == VFS_OK)
+        epoch_retire(node, ramfs_destroy_node);
+
+    return status;
+}
+
+/*
+ * Copies the names of the children of a directory, up to 'max' of them, and returns how many
+ * there are (possibly more than 'max'). The vnodes can't list a directory, the overlay needs it
+ * for its upper layer.
+ */
+int ramfs_list(vnode_t* node_dir, char (*names)[MAX_NAME_LENGTH], int max)
+{
+    treenode_t* dir = (treenode_t*)node_dir->vnode_data;
+    int count = 0;
+
+    if (dir->meta.type != NODE_DIRECTORY)
+        return VFS_ENOTDIR;
+
+    ramfs_expand(dir);
+
+    pthread_rwlock_rdlock(&dir->lock);
+    for (treenode_t* child = dir->first_child; child != NULL; child = child->next_sibling, count++)
+    {
+        if (count < max)
+            memcpy(names[count], child->meta.name, MAX_NAME_LENGTH);
+    }
+    pthread_rwlock_unlock(&dir->lock);
+
+    return count;
+}
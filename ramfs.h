@@ -24,8 +24,18 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "device.h"
+
 /* Ramfs simulates an in-memory file system with an N-ary tree, perfect for initial testing */
 
+#define RAMFS_PAGE_SIZE 4096
+#define RAMFS_INLINE_SIZE 48                    // files up to this size are stored in their node
+#define RAMFS_EXTENT_MAX (4 * RAMFS_PAGE_SIZE)  // then in a single buffer up to this size, then in pages
+
 typedef enum {
     NODE_FILE,
     NODE_DIRECTORY
@@ -41,13 +51,74 @@ typedef struct metadata {
     uint64_t access_time;
 } metadata_t;
 
+/*
+ * File content is stored by pages, a page may be shared by several files (or several
+ * copies of a file) in which case it's copied before being written.
+ * Pages coming from a snapshot point right into its mapping.
+ * In dedup mode, written pages are indexed by their content so identical pages are stored once.
+ */
+typedef struct ramfs_page {
+    _Atomic int ref_count;
+    bool mapped;    // lives in a snapshot mapping, never written nor freed
+    _Atomic bool hashed;    // in the dedup table, it's not written in place while it's there
+    uint8_t *data;
+
+    uint64_t hash;
+    struct ramfs_page *hash_next;
+} ramfs_page_t;
+
+typedef struct ramfs_dedup_stats {
+    uint64_t unique_pages;      // in the dedup table
+    uint64_t deduplicated;      // written pages replaced by an identical one (or by a hole)
+} ramfs_dedup_stats_t;
+
+struct ramfs_snapshot;
+struct vnode;
+
+/* Where the content of a file lives, a file only moves up as it grows */
+typedef enum {
+    RAMFS_STORE_INLINE,
+    RAMFS_STORE_EXTENT,
+    RAMFS_STORE_PAGED
+} ramfs_store_t;
+
 // Structure of a node in the N-ary tree
 typedef struct treenode {
     metadata_t meta;
+
+    // file content, only the part of the current store is used
+    uint8_t store;          // ramfs_store_t
+    uint8_t inline_data[RAMFS_INLINE_SIZE];
+    uint8_t *extent;
+    uint32_t extent_capacity;
+    ramfs_page_t **pages;   // a NULL page reads as zeros
+    uint32_t page_count;
+
     struct treenode *parent;
     struct treenode *first_child;
     struct treenode *next_sibling;
-    uint8_t *data; // file content
+
+    pthread_rwlock_t lock;  // children of a directory, pages and size of a file (see ramfs.c)
+    bool removed;           // unlinked, freed once no lookup can see it
+
+    /* The children (or the pages) of a node loaded from a snapshot are only created on its first use */
+    const struct ramfs_snapshot *_Atomic snapshot;
+    uint32_t snapshot_index;
+
+    /*
+     * Same thing for a node of a clone, it shares the content of its 'source' until its first use.
+     * A node keeps the list of its clones not expanded yet, they're expanded before it changes.
+     */
+    struct treenode *_Atomic source;
+    struct treenode *_Atomic first_dependent;
+    struct treenode *next_dependent;
+    struct treenode *prev_dependent;
 } treenode_t;
 
-void ramfs_init();
\ No newline at end of file
+void ramfs_init();
+int ramfs_save(int device_id, const char *path);
+int ramfs_load(const char *path, const char *device_name);
+int ramfs_clone(int device_id, const char *device_name);
+void ramfs_set_dedup(bool enabled);
+void ramfs_dedup_stats(ramfs_dedup_stats_t *stats);
+int ramfs_list(struct vnode *node_dir, char (*names)[MAX_NAME_LENGTH], int max);
\ No newline at end of file
@@ -0,0 +1,743 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "device.h"
+#include "epoch.h"
+
+#include "shmfs.h"
+
+#define MAX_VNODE_PER_VFS 16
+#define SHMFS_ALIGN 64
+
+#define SHMFS_AT(shm, offset)   ((void*)((uint8_t*)(shm) + (offset)))
+#define SHMFS_NODE(shm, offset) ((shmfs_node_t*)SHMFS_AT(shm, offset))
+#define SHMFS_NODE_SIZE         ((sizeof(shmfs_node_t) + SHMFS_ALIGN - 1) & ~(size_t)(SHMFS_ALIGN - 1))
+
+/* The segment as mapped by this process, in the 'priv' field of its device */
+typedef struct shmfs_segment
+{
+    shmfs_header_t* header;
+    size_t size;
+} shmfs_segment_t;
+
+/* What a vnode knows of its node, the generation tells if it's still the same node */
+typedef struct shmfs_inode
+{
+    uint64_t node;
+    uint32_t generation;
+} shmfs_inode_t;
+
+/* Important information for the file system ! */
+typedef struct shmfs_info
+{
+    pthread_mutex_t vnode_lock;     // the vnode table, taken after the lock of the segment
+    vnode_t* total_vnode[MAX_VNODE_PER_VFS];
+    vnode_t* root_vnode;
+    shmfs_header_t* shm;
+} fs_info_t;
+
+int shmfs_mount(vfs_t* mountpoint, int device_id);
+int shmfs_unmount(vfs_t* mountpoint);
+int shmfs_get_root(vfs_t* mountpoint, vnode_t** result);
+
+ssize_t shmfs_read(vnode_t* node, void *buffer, size_t size, uint64_t offset);
+ssize_t shmfs_write(vnode_t* node, const void *buffer, size_t size, uint64_t offset);
+int shmfs_lookup(vnode_t* node_dir, const char* name, struct vnode** result);
+int shmfs_getattr(vnode_t* node, vfs_stat_t* stat);
+int shmfs_create_node(vnode_t* node_dir, const char* name, vtype type, struct vnode** result);
+int shmfs_remove(vnode_t* node_dir, const char* name);
+
+filesystem_t shmfs_op = {
+    // fs_name will be filled later
+    .get_root = shmfs_get_root,
+    .vfs_mount = shmfs_mount,
+    .vfs_unmount = shmfs_unmount,
+};
+
+vnodeops_t shmfs_vnode_op = {
+    .read = shmfs_read,
+    .write = shmfs_write,
+    .lookup = shmfs_lookup,
+    .getattr = shmfs_getattr,
+    .create = shmfs_create_node,
+    .remove = shmfs_remove,
+};
+
+static objpool_t* vnode_pool = NULL;   // the vnodes and their shmfs_inode_t
+
+static uint64_t get_current_time()
+{
+    return (uint64_t)time(NULL);
+}
+
+void shmfs_init()
+{
+    if(vnode_pool == NULL)
+        vnode_pool = vfs_create_vnode_pool("shmfs vnode", sizeof(shmfs_inode_t));
+
+    strcpy(shmfs_op.fs_name, "shmfs");
+    vfs_register_new_filesystem(&shmfs_op);
+}
+
+/*
+ * Allocation in the segment, called with the segment write locked.
+ * The nodes and the pages have their own free list, the rest of the segment is given in order.
+ */
+static uint64_t shmfs_alloc_space(shmfs_header_t* shm, uint64_t size)
+{
+    if(shm->next_free + size > shm->size)
+        return 0;   // the segment is full
+
+    uint64_t offset = shm->next_free;
+    shm->next_free += size;
+
+    return offset;
+}
+
+static uint64_t shmfs_alloc_node(shmfs_header_t* shm, const char* name, shmfs_type_t type)
+{
+    uint64_t offset = shm->free_nodes;
+
+    if(offset != 0)
+        shm->free_nodes = SHMFS_NODE(shm, offset)->next_free;
+    else if((offset = shmfs_alloc_space(shm, SHMFS_NODE_SIZE)) == 0)
+        return 0;
+
+    shmfs_node_t* node = SHMFS_NODE(shm, offset);
+    uint32_t generation = node->generation;     // a reused node keeps counting
+
+    memset(node, 0, sizeof(shmfs_node_t));
+    node->generation = generation;
+    node->type = type;
+    snprintf(node->name, VFS_MAX_FILENAME, "%s", name);
+
+    uint64_t now = get_current_time();
+    node->create_time = node->modify_time = node->access_time = now;
+
+    return offset;
+}
+
+static void shmfs_free_node(shmfs_header_t* shm, uint64_t offset)
+{
+    shmfs_node_t* node = SHMFS_NODE(shm, offset);
+
+    node->generation++;     // the vnodes still pointing to it will notice
+    node->next_free = shm->free_nodes;
+    shm->free_nodes = offset;
+}
+
+// a zeroed page
+static uint64_t shmfs_alloc_page(shmfs_header_t* shm)
+{
+    uint64_t offset = shm->free_pages;
+
+    if(offset != 0)
+        shm->free_pages = *(uint64_t*)SHMFS_AT(shm, offset);
+    else if((offset = shmfs_alloc_space(shm, SHMFS_PAGE_SIZE)) == 0)
+        return 0;
+
+    memset(SHMFS_AT(shm, offset), 0, SHMFS_PAGE_SIZE);
+    return offset;
+}
+
+static void shmfs_free_page(shmfs_header_t* shm, uint64_t offset)
+{
+    *(uint64_t*)SHMFS_AT(shm, offset) = shm->free_pages;
+    shm->free_pages = offset;
+}
+
+/*
+ * Returns where the offset of page 'index' of a file is stored, NULL if its table doesn't exist.
+ * With 'grow', the missing tables are allocated (NULL if the segment is full).
+ */
+static uint64_t* shmfs_page_slot(shmfs_header_t* shm, shmfs_node_t* file, uint64_t index, bool grow)
+{
+    uint64_t* link = &file->table;
+
+    for(uint64_t table = 0; table <= index / SHMFS_TABLE_ENTRIES; table++)
+    {
+        if(*link == 0 && (!grow || (*link = shmfs_alloc_page(shm)) == 0))
+            return NULL;
+
+        shmfs_table_t* current = SHMFS_AT(shm, *link);
+        if(table == index / SHMFS_TABLE_ENTRIES)
+            return &current->pages[index % SHMFS_TABLE_ENTRIES];
+
+        link = &current->next;
+    }
+
+    return NULL;
+}
+
+static void shmfs_free_pages(shmfs_header_t* shm, shmfs_node_t* file)
+{
+    uint64_t table = file->table;
+
+    while(table != 0)
+    {
+        shmfs_table_t* current = SHMFS_AT(shm, table);
+        uint64_t next = current->next;
+
+        for(uint32_t i = 0; i < SHMFS_TABLE_ENTRIES; i++)
+            if(current->pages[i] != 0)
+                shmfs_free_page(shm, current->pages[i]);
+
+        shmfs_free_page(shm, table);
+        table = next;
+    }
+
+    file->table = 0;
+}
+
+static uint64_t shmfs_find_child(shmfs_header_t* shm, shmfs_node_t* dir, const char* name)
+{
+    for(uint64_t child = dir->first_child; child != 0; child = SHMFS_NODE(shm, child)->next_sibling)
+        if(strcmp(SHMFS_NODE(shm, child)->name, name) == 0)
+            return child;
+
+    return 0;
+}
+
+/* The node of a vnode, NULL if it was removed meanwhile. The segment must be locked. */
+static shmfs_node_t* shmfs_get_node(vnode_t* vnode)
+{
+    fs_info_t* fs_info = (fs_info_t*)vnode->vnode_vfs->vfs_data;
+    shmfs_inode_t* inode = vnode->vnode_data;
+    shmfs_node_t* node = SHMFS_NODE(fs_info->shm, inode->node);
+
+    return (node->generation == inode->generation && node->next_free == 0) ? node : NULL;
+}
+
+/*
+ * Finds (or creates) the vnode of a node, held for the caller. The segment must be locked.
+ * The unused vnodes are evicted when the table is full.
+ */
+static vnode_t* create_vnode(vfs_t* mountpoint, uint64_t offset)
+{
+    fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
+    shmfs_node_t* node = SHMFS_NODE(fs_info->shm, offset);
+    vnode_t* result = NULL;
+
+    pthread_mutex_lock(&fs_info->vnode_lock);
+
+    for(int i = 0; i < MAX_VNODE_PER_VFS && result == NULL; i++)
+    {
+        vnode_t* vnode = fs_info->total_vnode[i];
+        if(vnode != NULL && ((shmfs_inode_t*)vnode->vnode_data)->node == offset && ((shmfs_inode_t*)vnode->vnode_data)->generation == node->generation)
+            result = vnode;    // if the vnode already exist in the vnode table
+    }
+
+    if(result != NULL)
+        result->ref_count++;
+
+    if(result == NULL && (result = vfs_alloc_vnode(vnode_pool)) != NULL)
+    {
+        shmfs_inode_t* inode = result->vnode_data;
+        inode->node = offset;
+        inode->generation = node->generation;
+
+        result->ref_count = 1;
+        result->flags = VNODE_NONE;
+        result->vnode_type = (node->type == SHMFS_DIRECTORY) ? VDIR : VREG;
+        result->vnode_op = &shmfs_vnode_op;
+        result->vnode_vfs = mountpoint;
+
+        int i = 0;
+        for(; i < MAX_VNODE_PER_VFS; i++)
+        {
+            if(fs_info->total_vnode[i] == NULL)
+                break;
+
+            // if the vnode is unused (a path lookup may still be looking at it, but it doesn't hold it)
+            if(fs_info->total_vnode[i]->ref_count <= 0)
+            {
+                epoch_retire(fs_info->total_vnode[i], vfs_free_vnode);
+                break;
+            }
+        }
+
+        if(i < MAX_VNODE_PER_VFS)
+            fs_info->total_vnode[i] = result;
+        else
+        {
+            vfs_free_vnode(result);
+            result = NULL;  // cannot create vnode
+        }
+    }
+
+    pthread_mutex_unlock(&fs_info->vnode_lock);
+
+    return result;
+}
+
+static int add_shmfs_device(const char* name, shmfs_header_t* shm, size_t size)
+{
+    device_t* device = malloc(sizeof(device_t));
+    shmfs_segment_t* segment = malloc(sizeof(shmfs_segment_t));
+
+    if(device == NULL || segment == NULL)
+    {
+        free(device);
+        free(segment);
+        return VFS_ERROR;
+    }
+
+    segment->header = shm;
+    segment->size = size;
+
+    snprintf(device->name, MAX_NAME_LENGTH, "%s", name);
+    device->priv = segment;
+    device->read = NULL;
+    device->write = NULL;
+    device->flush = NULL;
+    add_device(device);
+
+    return device_num - 1;
+}
+
+// shm_open() wants a name starting with a '/'
+static void shmfs_object_name(const char* name, char* object)
+{
+    snprintf(object, MAX_NAME_LENGTH, "%s%s", (name[0] == '/') ? "" : "/", name);
+}
+
+/**
+ * Creates a shared memory segment holding an empty tree, and registers a device for it.
+ *
+ * @param name  the name of the segment, the other processes attach to it with this name.
+ * @param size  the size of the segment, everything the tree holds must fit in it.
+ * @return      the id of the new device, VFS_EEXIST if the segment already exists, or VFS_ERROR.
+ */
+int shmfs_create(const char* name, size_t size)
+{
+    char object[MAX_NAME_LENGTH];
+    shmfs_object_name(name, object);
+
+    if(size < sizeof(shmfs_header_t) + SHMFS_NODE_SIZE + SHMFS_PAGE_SIZE)
+        return VFS_ERROR;
+
+    int fd = shm_open(object, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0)
+        return (errno == EEXIST) ? VFS_EEXIST : VFS_ERROR;
+
+    shmfs_header_t* shm = MAP_FAILED;
+    if(ftruncate(fd, size) == 0)
+        shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(shm == MAP_FAILED)
+    {
+        shm_unlink(object);
+        return VFS_ERROR;
+    }
+
+    // the segment is zeroed, we only need to set the lock and the root
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_rwlock_init(&shm->lock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+
+    memcpy(shm->magic, SHMFS_MAGIC, sizeof(shm->magic));
+    shm->version = SHMFS_VERSION;
+    shm->size = size;
+    shm->next_free = (sizeof(shmfs_header_t) + SHMFS_ALIGN - 1) & ~(uint64_t)(SHMFS_ALIGN - 1);
+    shm->root = shmfs_alloc_node(shm, "", SHMFS_DIRECTORY);
+
+    // from now on the other processes can use it
+    atomic_store_explicit(&shm->ready, 1, memory_order_release);
+
+    int device_id = add_shmfs_device(name, shm, size);
+    if(device_id < 0)
+    {
+        munmap(shm, size);
+        shm_unlink(object);
+    }
+
+    return device_id;
+}
+
+/**
+ * Attaches to a segment created by shmfs_create() (in this process or another one)
+ * and registers a device for it.
+ *
+ * @param name  the name of the segment.
+ * @return      the id of the new device, VFS_ENOENT if there's no such segment, or VFS_ERROR.
+ */
+int shmfs_attach(const char* name)
+{
+    char object[MAX_NAME_LENGTH];
+    shmfs_object_name(name, object);
+
+    int fd = shm_open(object, O_RDWR, 0);
+    if(fd < 0)
+        return (errno == ENOENT) ? VFS_ENOENT : VFS_ERROR;
+
+    struct stat metainfo;
+    shmfs_header_t* shm = MAP_FAILED;
+
+    if(fstat(fd, &metainfo) == 0 && (size_t)metainfo.st_size >= sizeof(shmfs_header_t))
+        shm = mmap(NULL, metainfo.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(shm == MAP_FAILED)
+        return VFS_ERROR;
+
+    // not a shmfs segment, or its creator isn't done yet
+    if(memcmp(shm->magic, SHMFS_MAGIC, sizeof(shm->magic)) != 0 || shm->version != SHMFS_VERSION
+        || shm->size != (uint64_t)metainfo.st_size || atomic_load_explicit(&shm->ready, memory_order_acquire) == 0)
+    {
+        munmap(shm, metainfo.st_size);
+        return VFS_ERROR;
+    }
+
+    int device_id = add_shmfs_device(name, shm, metainfo.st_size);
+    if(device_id < 0)
+        munmap(shm, metainfo.st_size);
+
+    return device_id;
+}
+
+/**
+ * Removes the name of a segment: no process can attach to it anymore, its memory is freed
+ * once every process using it is gone.
+ */
+int shmfs_unlink(const char* name)
+{
+    char object[MAX_NAME_LENGTH];
+    shmfs_object_name(name, object);
+
+    return (shm_unlink(object) == 0) ? VFS_OK : VFS_ENOENT;
+}
+
+int shmfs_mount(vfs_t* mountpoint, int device_id)
+{
+    if(device_id < 0 || device_id >= device_num || device_list[device_id]->priv == NULL)
+        return VFS_ERROR;
+
+    shmfs_segment_t* segment = (shmfs_segment_t*)device_list[device_id]->priv;
+    if(memcmp(segment->header->magic, SHMFS_MAGIC, sizeof(segment->header->magic)) != 0)
+        return VFS_ERROR;   // not one of ours
+
+    fs_info_t* fs_info = malloc(sizeof(fs_info_t));
+    vnode_t* root_vnode = vfs_alloc_vnode(vnode_pool);
+
+    if(fs_info == NULL || root_vnode == NULL)
+    {
+        free(fs_info);
+        vfs_free_vnode(root_vnode);
+        return VFS_ERROR;
+    }
+
+    pthread_mutex_init(&fs_info->vnode_lock, NULL);
+    for(int i = 0; i < MAX_VNODE_PER_VFS; i++)
+        fs_info->total_vnode[i] = NULL;
+
+    fs_info->shm = segment->header;
+    fs_info->root_vnode = root_vnode;
+
+    shmfs_inode_t* inode = root_vnode->vnode_data;
+    inode->node = fs_info->shm->root;
+    inode->generation = SHMFS_NODE(fs_info->shm, inode->node)->generation;
+
+    root_vnode->flags = VNODE_ROOT;
+    root_vnode->vnode_type = VDIR;
+    root_vnode->vnode_op = &shmfs_vnode_op;
+    root_vnode->vnode_vfs = mountpoint;
+
+    // here we need to fill specific filesystem info !
+    mountpoint->vfs_data = fs_info;
+
+    return VFS_OK;
+}
+
+int shmfs_unmount(vfs_t* mountpoint)
+{
+    fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
+
+    for(int i = 0; i < MAX_VNODE_PER_VFS; i++)
+        if(fs_info->total_vnode[i] != NULL)
+            vfs_free_vnode(fs_info->total_vnode[i]);
+
+    vfs_free_vnode(fs_info->root_vnode);
+
+    pthread_mutex_destroy(&fs_info->vnode_lock);
+    free(fs_info);
+
+    return VFS_OK;
+}
+
+int shmfs_get_root(vfs_t* mountpoint, vnode_t** result)
+{
+    fs_info_t* fs_info = (fs_info_t*)mountpoint->vfs_data;
+
+    *result = fs_info->root_vnode;
+    (*result)->ref_count++;
+
+    return VFS_OK;
+}
+
+int shmfs_lookup(vnode_t* node_dir, const char* name, struct vnode** result)
+{
+    fs_info_t* fs_info = (fs_info_t*)node_dir->vnode_vfs->vfs_data;
+    shmfs_header_t* shm = fs_info->shm;
+    int status = VFS_OK;
+
+    pthread_rwlock_rdlock(&shm->lock);
+
+    shmfs_node_t* dir = shmfs_get_node(node_dir);
+    uint64_t child = (dir != NULL) ? shmfs_find_child(shm, dir, name) : 0;
+
+    if(child == 0)
+        status = VFS_ENOENT;
+    else
+    {
+        __atomic_store_n(&dir->access_time, get_current_time(), __ATOMIC_RELAXED);
+
+        *result = create_vnode(node_dir->vnode_vfs, child);
+        if(*result == NULL)
+            status = VFS_ERROR;
+    }
+
+    pthread_rwlock_unlock(&shm->lock);
+
+    return status;
+}
+
+ssize_t shmfs_read(vnode_t* node, void *buffer, size_t size, uint64_t offset)
+{
+    fs_info_t* fs_info = (fs_info_t*)node->vnode_vfs->vfs_data;
+    shmfs_header_t* shm = fs_info->shm;
+
+    pthread_rwlock_rdlock(&shm->lock);
+
+    shmfs_node_t* file = shmfs_get_node(node);
+    if(file == NULL)
+    {
+        pthread_rwlock_unlock(&shm->lock);
+        return VFS_ENOENT;
+    }
+
+    if(offset >= file->size)
+    {
+        pthread_rwlock_unlock(&shm->lock);
+        return 0;
+    }
+
+    if(size > file->size - offset)
+        size = file->size - offset;
+
+    uint64_t done = 0;
+    while(done < size)
+    {
+        uint64_t index = (offset + done) / SHMFS_PAGE_SIZE;
+        uint64_t in_page = (offset + done) % SHMFS_PAGE_SIZE;
+        uint64_t length = (SHMFS_PAGE_SIZE - in_page < size - done) ? SHMFS_PAGE_SIZE - in_page : size - done;
+
+        uint64_t* slot = shmfs_page_slot(shm, file, index, false);
+        if(slot == NULL || *slot == 0)
+            memset((uint8_t*)buffer + done, 0, length);    // a hole
+        else
+            memcpy((uint8_t*)buffer + done, (uint8_t*)SHMFS_AT(shm, *slot) + in_page, length);
+
+        done += length;
+    }
+
+    __atomic_store_n(&file->access_time, get_current_time(), __ATOMIC_RELAXED);
+
+    pthread_rwlock_unlock(&shm->lock);
+
+    return size;
+}
+
+ssize_t shmfs_write(vnode_t* node, const void *buffer, size_t size, uint64_t offset)
+{
+    fs_info_t* fs_info = (fs_info_t*)node->vnode_vfs->vfs_data;
+    shmfs_header_t* shm = fs_info->shm;
+
+    pthread_rwlock_wrlock(&shm->lock);
+
+    shmfs_node_t* file = shmfs_get_node(node);
+    if(file == NULL)
+    {
+        pthread_rwlock_unlock(&shm->lock);
+        return VFS_ENOENT;
+    }
+
+    // the segment may be full before the end, we stop at the last page we could get
+    uint64_t done = 0;
+    while(done < size)
+    {
+        uint64_t index = (offset + done) / SHMFS_PAGE_SIZE;
+        uint64_t in_page = (offset + done) % SHMFS_PAGE_SIZE;
+        uint64_t length = (SHMFS_PAGE_SIZE - in_page < size - done) ? SHMFS_PAGE_SIZE - in_page : size - done;
+
+        uint64_t* slot = shmfs_page_slot(shm, file, index, true);
+        if(slot == NULL || (*slot == 0 && (*slot = shmfs_alloc_page(shm)) == 0))
+            break;
+
+        memcpy((uint8_t*)SHMFS_AT(shm, *slot) + in_page, (const uint8_t*)buffer + done, length);
+        done += length;
+    }
+
+    if(done > 0)
+    {
+        if(offset + done > file->size)
+            file->size = offset + done;
+        file->modify_time = get_current_time();
+    }
+
+    pthread_rwlock_unlock(&shm->lock);
+
+    return (done > 0 || size == 0) ? (ssize_t)done : VFS_ERROR;
+}
+
+int shmfs_getattr(vnode_t* node, vfs_stat_t* stat)
+{
+    fs_info_t* fs_info = (fs_info_t*)node->vnode_vfs->vfs_data;
+
+    pthread_rwlock_rdlock(&fs_info->shm->lock);
+
+    shmfs_node_t* file = shmfs_get_node(node);
+    if(file != NULL)
+    {
+        stat->type = node->vnode_type;
+        stat->flags = VFS_STAT_NONE;
+        stat->size = file->size;
+        stat->create_time = file->create_time;
+        stat->modify_time = file->modify_time;
+        stat->access_time = __atomic_load_n(&file->access_time, __ATOMIC_RELAXED);
+    }
+
+    pthread_rwlock_unlock(&fs_info->shm->lock);
+
+    return (file != NULL) ? VFS_OK : VFS_ENOENT;
+}
+
+int shmfs_create_node(vnode_t* node_dir, const char* name, vtype type, struct vnode** result)
+{
+    fs_info_t* fs_info = (fs_info_t*)node_dir->vnode_vfs->vfs_data;
+    shmfs_header_t* shm = fs_info->shm;
+    int status = VFS_OK;
+
+    pthread_rwlock_wrlock(&shm->lock);
+
+    shmfs_node_t* dir = shmfs_get_node(node_dir);
+    uint64_t child = 0;
+
+    if(dir == NULL)
+        status = VFS_ENOENT;
+    else if(shmfs_find_child(shm, dir, name) != 0)
+        status = VFS_EEXIST;
+    else if((child = shmfs_alloc_node(shm, name, (type == VDIR) ? SHMFS_DIRECTORY : SHMFS_FILE)) == 0)
+        status = VFS_ERROR;     // the segment is full
+    else
+    {
+        // add it at the end of the children of the directory
+        uint64_t* link = &dir->first_child;
+        while(*link != 0)
+            link = &SHMFS_NODE(shm, *link)->next_sibling;
+        *link = child;
+
+        SHMFS_NODE(shm, child)->parent = (uint8_t*)dir - (uint8_t*)shm;
+        dir->modify_time = get_current_time();
+
+        *result = create_vnode(node_dir->vnode_vfs, child);
+        if(*result == NULL)
+            status = VFS_ERROR;
+    }
+
+    pthread_rwlock_unlock(&shm->lock);
+
+    return status;
+}
+
+/*
+ * Removes a file or an empty directory.
+ * A node opened in this process can't be removed, the other processes find out on their next use.
+ */
+int shmfs_remove(vnode_t* node_dir, const char* name)
+{
+    fs_info_t* fs_info = (fs_info_t*)node_dir->vnode_vfs->vfs_data;
+    shmfs_header_t* shm = fs_info->shm;
+    int status = VFS_OK;
+
+    pthread_rwlock_wrlock(&shm->lock);
+
+    shmfs_node_t* dir = shmfs_get_node(node_dir);
+    uint64_t child = (dir != NULL) ? shmfs_find_child(shm, dir, name) : 0;
+    shmfs_node_t* node = SHMFS_NODE(shm, child);
+
+    if(child == 0)
+        status = VFS_ENOENT;
+    else if(node->first_child != 0)
+        status = VFS_ERROR;   // not empty
+
+    pthread_mutex_lock(&fs_info->vnode_lock);
+
+    for(int i = 0; status == VFS_OK && i < MAX_VNODE_PER_VFS; i++)
+    {
+        vnode_t* vnode = fs_info->total_vnode[i];
+        if(vnode == NULL || ((shmfs_inode_t*)vnode->vnode_data)->node != child)
+            continue;
+
+        if(vnode->ref_count > 0)
+            status = VFS_EACCESS;
+        else
+        {
+            fs_info->total_vnode[i] = NULL;
+            epoch_retire(vnode, vfs_free_vnode);
+        }
+    }
+
+    pthread_mutex_unlock(&fs_info->vnode_lock);
+
+    if(status == VFS_OK)
+    {
+        uint64_t* link = &dir->first_child;
+        while(*link != child)
+            link = &SHMFS_NODE(shm, *link)->next_sibling;
+        *link = node->next_sibling;
+
+        shmfs_free_pages(shm, node);
+        shmfs_free_node(shm, child);
+        dir->modify_time = get_current_time();
+    }
+
+    pthread_rwlock_unlock(&shm->lock);
+
+    return status;
+}
@@ -0,0 +1,99 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "vfs.h"
+
+/*
+ * Shmfs is a ramfs living in a POSIX shared memory segment, so several processes can use the same
+ * tree: one creates it with shmfs_create(), the others attach to it by name with shmfs_attach().
+ * Each one gets a device to mount with the "shmfs" file system.
+ *
+ * Every process maps the segment at its own address, so the nodes link each other by offsets
+ * from the start of the segment (0 is NULL). The tree is protected by a process-shared
+ * reader/writer lock stored in the segment. The segment has a fixed size, given at creation.
+ *
+ * A node removed by a process while another one has it open isn't reused under its feet:
+ * the vnodes remember the generation of their node and fail with VFS_ENOENT once it changed.
+ */
+
+#define SHMFS_MAGIC         "SHMFS\0\0\0"
+#define SHMFS_VERSION       1
+#define SHMFS_PAGE_SIZE     4096
+#define SHMFS_TABLE_ENTRIES (SHMFS_PAGE_SIZE / sizeof(uint64_t) - 1)
+
+typedef enum {
+    SHMFS_FILE = 1,
+    SHMFS_DIRECTORY
+} shmfs_type_t;
+
+/* At the start of the segment */
+typedef struct shmfs_header
+{
+    char magic[8];
+    uint32_t version;
+    _Atomic uint32_t ready;     // set once the creator initialized everything
+    uint64_t size;              // of the segment
+    pthread_rwlock_t lock;      // process shared, protects everything below and every node
+
+    uint64_t root;
+    uint64_t next_free;         // what was never allocated starts here
+    uint64_t free_nodes;        // freed nodes and pages, linked by their first word
+    uint64_t free_pages;
+} shmfs_header_t;
+
+typedef struct shmfs_node
+{
+    uint64_t next_free;         // link of the free list, 0 while the node is used
+    uint32_t generation;        // bumped each time the node is freed
+    uint32_t type;              // shmfs_type_t
+    char name[VFS_MAX_FILENAME];
+
+    uint64_t parent;
+    uint64_t first_child;
+    uint64_t next_sibling;
+
+    uint64_t size;
+    uint64_t table;             // first page table of a file
+    uint64_t create_time;
+    uint64_t modify_time;
+    uint64_t access_time;
+} shmfs_node_t;
+
+/* The pages of a file are listed by a chain of tables, a page each, a 0 page reads as zeros */
+typedef struct shmfs_table
+{
+    uint64_t next;
+    uint64_t pages[SHMFS_TABLE_ENTRIES];
+} shmfs_table_t;
+
+void shmfs_init();
+int shmfs_create(const char* name, size_t size);
+int shmfs_attach(const char* name);
+int shmfs_unlink(const char* name);
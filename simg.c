@@ -0,0 +1,721 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "simg.h"
+#include "membudget.h"
+
+#define BITMAP_SET(map, bit)    ((map)[(bit) / 8] |= (1 << ((bit) % 8)))
+#define BITMAP_CLEAR(map, bit)  ((map)[(bit) / 8] &= ~(1 << ((bit) % 8)))
+#define BITMAP_TEST(map, bit)   ((map)[(bit) / 8] & (1 << ((bit) % 8)))
+
+#define RLE_MAX_LITERAL 128
+#define RLE_MIN_REPEAT  3
+#define RLE_MAX_REPEAT  130
+
+static simg_info_t* opened_images = NULL;
+static pthread_mutex_t opened_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t simg_shrink(size_t bytes);
+
+/* The decompressed blocks are a second copy of what the block cache holds, they go first */
+static membudget_account_t simg_account = { .name = "sparse images", .priority = -1, .shrink = simg_shrink };
+
+/**
+ * Compresses a buffer with a simple run length encoding.
+ *
+ * A control byte below 128 is followed by that many + 1 literal bytes, otherwise the
+ * next byte is repeated (control - 125) times. Nothing fancy but empty and formatted
+ * sectors are mostly long runs of the same byte.
+ *
+ * @return  the compressed size, or 0 if it doesn't fit in 'max' bytes.
+ */
+static size_t rle_compress(const uint8_t* in, size_t length, uint8_t* out, size_t max)
+{
+    size_t written = 0;
+    size_t i = 0;
+
+    while(i < length)
+    {
+        size_t run = 1;
+        while(i + run < length && run < RLE_MAX_REPEAT && in[i + run] == in[i])
+            run++;
+
+        if(run >= RLE_MIN_REPEAT)
+        {
+            if(written + 2 > max)
+                return 0;
+
+            out[written++] = (uint8_t)(run + 125);
+            out[written++] = in[i];
+            i += run;
+            continue;
+        }
+
+        // a literal run goes on until the next repeat
+        size_t literal = 0;
+        while(i + literal < length && literal < RLE_MAX_LITERAL)
+        {
+            if(i + literal + 2 < length && in[i + literal] == in[i + literal + 1] && in[i + literal] == in[i + literal + 2])
+                break;
+            literal++;
+        }
+
+        if(written + 1 + literal > max)
+            return 0;
+
+        out[written++] = (uint8_t)(literal - 1);
+        memcpy(out + written, in + i, literal);
+        written += literal;
+        i += literal;
+    }
+
+    return written;
+}
+
+static int rle_decompress(const uint8_t* in, size_t length, uint8_t* out, size_t out_length)
+{
+    size_t written = 0;
+    size_t i = 0;
+
+    while(i < length)
+    {
+        uint8_t control = in[i++];
+
+        if(control < RLE_MAX_LITERAL)
+        {
+            size_t literal = control + 1;
+            if(i + literal > length || written + literal > out_length)
+                return -1;
+
+            memcpy(out + written, in + i, literal);
+            written += literal;
+            i += literal;
+        }
+        else
+        {
+            size_t run = control - 125;
+            if(i >= length || written + run > out_length)
+                return -1;
+
+            memset(out + written, in[i++], run);
+            written += run;
+        }
+    }
+
+    return (written == out_length) ? 0 : -1;
+}
+
+static bool is_zero_block(const uint8_t* data)
+{
+    for(size_t i = 0; i < SIMG_BLOCK_SIZE; i++)
+        if(data[i] != 0)
+            return false;
+
+    return true;
+}
+
+/*
+ * Compresses a block and appends it at the end of the image,
+ * 'entry' describes where it went. Zero blocks aren't stored at all.
+*/
+static int store_block(FILE* stream, uint64_t* data_end, const uint8_t* data, simg_index_entry_t* entry)
+{
+    memset(entry, 0, sizeof(simg_index_entry_t));
+
+    if(is_zero_block(data))
+        return 0;
+
+    uint8_t compressed[SIMG_BLOCK_SIZE];
+    size_t length = rle_compress(data, SIMG_BLOCK_SIZE, compressed, SIMG_BLOCK_SIZE - 1);
+
+    if(length != 0)
+        entry->flags = SIMG_BLOCK_RLE;
+    else
+        length = SIMG_BLOCK_SIZE;
+
+    if(fseeko(stream, *data_end, SEEK_SET) != 0)
+        return -1;
+
+    if(fwrite((length == SIMG_BLOCK_SIZE) ? data : compressed, 1, length, stream) != length)
+        return -1;
+
+    entry->offset = *data_end;
+    entry->length = length;
+    *data_end += length;
+
+    return 0;
+}
+
+/*
+ * Returns the decompressed block, reading it on its first access.
+ * the image lock must be held
+*/
+static uint8_t* load_block(simg_info_t* image, uint32_t block)
+{
+    if(image->blocks[block] != NULL)
+        return image->blocks[block];
+
+    uint8_t* data = calloc(1, SIMG_BLOCK_SIZE);
+    if(data == NULL)
+        return NULL;
+
+    simg_index_entry_t* entry = &image->index[block];
+
+    if(entry->offset != 0)  // unallocated blocks are just zeros
+    {
+        uint8_t compressed[SIMG_BLOCK_SIZE];
+        FILE* stream = image->stream;
+
+        if(entry->flags & SIMG_BLOCK_BASE)
+        {
+            if(image->base_stream == NULL && image->base_path != NULL)
+                image->base_stream = fopen(image->base_path, "rb");
+            stream = image->base_stream;
+        }
+
+        if(stream == NULL || entry->length > SIMG_BLOCK_SIZE || fseeko(stream, entry->offset, SEEK_SET) != 0 ||
+            fread(compressed, 1, entry->length, stream) != entry->length)
+        {
+            free(data);
+            return NULL;
+        }
+
+        if(entry->flags & SIMG_BLOCK_RLE)
+        {
+            if(rle_decompress(compressed, entry->length, data, SIMG_BLOCK_SIZE) != 0)
+            {
+                free(data);
+                return NULL;
+            }
+        }
+        else
+            memcpy(data, compressed, entry->length);
+    }
+
+    image->blocks[block] = data;
+    membudget_charge(&simg_account, SIMG_BLOCK_SIZE);
+    return data;
+}
+
+/*
+ * Frees the decompressed blocks that weren't written since the last flush, they're read again
+ * on their next access. Each image is swept from where the last call stopped.
+ * The caller (membudget_balance(), called once the block cache is unlocked) holds no image lock.
+ */
+static size_t simg_shrink(size_t bytes)
+{
+    size_t freed = 0;
+
+    pthread_mutex_lock(&opened_lock);
+
+    for(simg_info_t* image = opened_images; image != NULL && freed < bytes; image = image->next)
+    {
+        pthread_mutex_lock(&image->lock);
+
+        uint32_t block_count = image->header.block_count;
+        for(uint32_t i = 0; i < block_count && freed < bytes; i++)
+        {
+            uint32_t block = image->shrink_cursor;
+            image->shrink_cursor = (block + 1) % block_count;
+
+            if(image->blocks[block] == NULL || BITMAP_TEST(image->dirty, block))
+                continue;
+
+            free(image->blocks[block]);
+            image->blocks[block] = NULL;
+            freed += SIMG_BLOCK_SIZE;
+        }
+
+        pthread_mutex_unlock(&image->lock);
+    }
+
+    pthread_mutex_unlock(&opened_lock);
+
+    membudget_charge(&simg_account, -(ssize_t)freed);
+    return freed;
+}
+
+static void flush_image(simg_info_t* image)
+{
+    pthread_mutex_lock(&image->lock);
+
+    if(image->stream == NULL)
+    {
+        pthread_mutex_unlock(&image->lock);
+        return;     // suspended, it was flushed before
+    }
+
+    for(uint32_t block = 0; block < image->header.block_count; block++)
+    {
+        if(!BITMAP_TEST(image->dirty, block))
+            continue;
+
+        simg_index_entry_t entry;
+        if(store_block(image->stream, &image->data_end, image->blocks[block], &entry) != 0)
+            continue;   // it stays dirty, we'll try again at the next flush
+
+        if(fseeko(image->stream, image->header.index_offset + (uint64_t)block * sizeof(simg_index_entry_t), SEEK_SET) != 0 ||
+            fwrite(&entry, sizeof(simg_index_entry_t), 1, image->stream) != 1)
+            continue;
+
+        image->index[block] = entry;
+        BITMAP_CLEAR(image->dirty, block);
+    }
+
+    fflush(image->stream);
+
+    pthread_mutex_unlock(&image->lock);
+}
+
+static void simg_shutdown()
+{
+    pthread_mutex_lock(&opened_lock);
+    for(simg_info_t* image = opened_images; image != NULL; image = image->next)
+        flush_image(image);
+    pthread_mutex_unlock(&opened_lock);
+}
+
+/* The path of the base image, its name in the header is relative to the directory of the image */
+static char* resolve_base(const char* image_path, const char* base)
+{
+    const char* slash = strrchr(image_path, '/');
+    size_t directory = (base[0] == '/' || slash == NULL) ? 0 : slash - image_path + 1;
+
+    char* resolved = malloc(directory + strlen(base) + 1);
+    if(resolved != NULL)
+    {
+        memcpy(resolved, image_path, directory);
+        strcpy(resolved + directory, base);
+    }
+
+    return resolved;
+}
+
+/**
+ * Opens a sparse image, only its header and block index are read here.
+ *
+ * @param path  the path of the .simg file.
+ * @return      the image, or NULL if the file isn't a valid sparse image.
+ */
+simg_info_t* simg_open(const char* path)
+{
+    static bool shutdown_registered = false;
+
+    FILE* stream = fopen(path, "rb+");
+    if(stream == NULL)
+        return NULL;
+
+    simg_info_t* image = calloc(1, sizeof(simg_info_t));
+    if(image == NULL)
+    {
+        fclose(stream);
+        return NULL;
+    }
+
+    image->stream = stream;
+
+    if(fread(&image->header, sizeof(simg_header_t), 1, stream) != 1 ||
+        memcmp(image->header.magic, SIMG_MAGIC, 4) != 0 ||
+        image->header.version != SIMG_VERSION ||
+        image->header.sectors_per_block != SIMG_SECTORS_PER_BLOCK ||
+        image->header.block_count != (image->header.total_sectors + SIMG_SECTORS_PER_BLOCK - 1) / SIMG_SECTORS_PER_BLOCK ||
+        memchr(image->header.base, '\0', SIMG_BASE_MAX) == NULL)
+    {
+        fclose(stream);
+        free(image);
+        return NULL;
+    }
+
+    uint32_t block_count = image->header.block_count;
+
+    image->totalSectors = image->header.total_sectors;
+    image->index = malloc(sizeof(simg_index_entry_t) * (block_count + 1));
+    image->blocks = calloc(block_count + 1, sizeof(uint8_t*));
+    image->dirty = calloc(block_count / 8 + 1, 1);
+
+    if(image->header.base[0] != '\0')
+        image->base_path = resolve_base(path, image->header.base);
+
+    if(image->index == NULL || image->blocks == NULL || image->dirty == NULL ||
+        (image->header.base[0] != '\0' && image->base_path == NULL) ||
+        fseeko(stream, image->header.index_offset, SEEK_SET) != 0 ||
+        fread(image->index, sizeof(simg_index_entry_t), block_count, stream) != block_count ||
+        fseeko(stream, 0, SEEK_END) != 0)
+    {
+        simg_close(image);
+        return NULL;
+    }
+
+    image->data_end = ftello(stream);
+    pthread_mutex_init(&image->lock, NULL);
+
+    pthread_mutex_lock(&opened_lock);
+    image->next = opened_images;
+    opened_images = image;
+
+    if(!shutdown_registered)
+    {
+        atexit(simg_shutdown);  // the written blocks only reach the file when flushed
+        shutdown_registered = true;
+    }
+    pthread_mutex_unlock(&opened_lock);
+
+    return image;
+}
+
+void simg_close(simg_info_t* image)
+{
+    if(image == NULL)
+        return;
+
+    pthread_mutex_lock(&opened_lock);
+    for(simg_info_t** link = &opened_images; *link != NULL; link = &(*link)->next)
+    {
+        if(*link == image)
+        {
+            *link = image->next;
+            flush_image(image);
+            pthread_mutex_destroy(&image->lock);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&opened_lock);
+
+    if(image->blocks != NULL)
+    {
+        for(uint32_t block = 0; block < image->header.block_count; block++)
+        {
+            if(image->blocks[block] != NULL)
+                membudget_charge(&simg_account, -SIMG_BLOCK_SIZE);
+            free(image->blocks[block]);
+        }
+    }
+
+    if(image->stream != NULL)
+        fclose(image->stream);
+    if(image->base_stream != NULL)
+        fclose(image->base_stream);
+    free(image->base_path);
+    free(image->blocks);
+    free(image->index);
+    free(image->dirty);
+    free(image);
+}
+
+int simg_read_sectors(uint8_t* buffer, uint32_t lba, uint32_t sector_num, void* priv)
+{
+    if(priv == NULL)
+        return -1;
+
+    simg_info_t* image = (simg_info_t*)priv;
+
+    if(lba > image->totalSectors || (lba + sector_num) > image->totalSectors)
+        return -1;
+
+    pthread_mutex_lock(&image->lock);
+
+    for(uint32_t sector = lba; sector < lba + sector_num; sector++)
+    {
+        uint8_t* data = load_block(image, sector / SIMG_SECTORS_PER_BLOCK);
+        if(data == NULL)
+        {
+            pthread_mutex_unlock(&image->lock);
+            return -1;
+        }
+
+        memcpy(buffer, data + (sector % SIMG_SECTORS_PER_BLOCK) * SIMG_SECTOR_SIZE, SIMG_SECTOR_SIZE);
+        buffer += SIMG_SECTOR_SIZE;
+    }
+
+    pthread_mutex_unlock(&image->lock);
+    return 0;
+}
+
+int simg_write_sectors(const uint8_t* buffer, uint32_t lba, uint32_t sector_num, void* priv)
+{
+    if(priv == NULL)
+        return -1;
+
+    simg_info_t* image = (simg_info_t*)priv;
+
+    if(lba > image->totalSectors || (lba + sector_num) > image->totalSectors)
+        return -1;
+
+    pthread_mutex_lock(&image->lock);
+
+    for(uint32_t sector = lba; sector < lba + sector_num; sector++)
+    {
+        uint32_t block = sector / SIMG_SECTORS_PER_BLOCK;
+
+        uint8_t* data = load_block(image, block);
+        if(data == NULL)
+        {
+            pthread_mutex_unlock(&image->lock);
+            return -1;
+        }
+
+        memcpy(data + (sector % SIMG_SECTORS_PER_BLOCK) * SIMG_SECTOR_SIZE, buffer, SIMG_SECTOR_SIZE);
+        BITMAP_SET(image->dirty, block);
+        buffer += SIMG_SECTOR_SIZE;
+    }
+
+    pthread_mutex_unlock(&image->lock);
+    return 0;
+}
+
+void simg_flush(void* priv)
+{
+    if(priv == NULL)
+        return;
+
+    flush_image((simg_info_t*)priv);
+}
+
+/**
+ * Closes the file of an image, its header, index and decompressed blocks stay in memory.
+ * What was written is flushed first.
+ *
+ * @return  0 on success, -1 if some blocks couldn't be flushed (the file stays open).
+ */
+int simg_suspend(simg_info_t* image)
+{
+    flush_image(image);
+
+    pthread_mutex_lock(&image->lock);
+
+    for(uint32_t i = 0; i < image->header.block_count / 8 + 1; i++)
+    {
+        if(image->dirty[i] != 0)
+        {
+            pthread_mutex_unlock(&image->lock);
+            return -1;
+        }
+    }
+
+    if(image->stream != NULL)
+        fclose(image->stream);
+    if(image->base_stream != NULL)
+        fclose(image->base_stream);
+    image->stream = image->base_stream = NULL;
+
+    pthread_mutex_unlock(&image->lock);
+    return 0;
+}
+
+/* Gives a suspended image its file back, 'stream' is the same file opened again */
+void simg_resume(simg_info_t* image, FILE* stream)
+{
+    pthread_mutex_lock(&image->lock);
+    image->stream = stream;
+    pthread_mutex_unlock(&image->lock);
+}
+
+bool simg_is_suspended(simg_info_t* image)
+{
+    pthread_mutex_lock(&image->lock);
+    bool suspended = (image->stream == NULL);
+    pthread_mutex_unlock(&image->lock);
+
+    return suspended;
+}
+
+/*
+ * How a new image names its base: only the file name when they're in the same directory,
+ * so that the directory can be moved, otherwise its absolute path.
+ */
+static int base_reference(const char* simg_path, const char* base_path, char* reference)
+{
+    const char* slash = strrchr(simg_path, '/');
+    char* directory = (slash != NULL) ? strndup(simg_path, slash - simg_path + 1) : strdup(".");
+    char* directory_real = (directory != NULL) ? realpath(directory, NULL) : NULL;
+    char* base_real = realpath(base_path, NULL);
+    char* image_real = realpath(simg_path, NULL);   // if it already exists
+    int status = -1;
+
+    if(directory_real != NULL && base_real != NULL && (image_real == NULL || strcmp(image_real, base_real) != 0))
+    {
+        size_t length = strlen(directory_real);
+        bool same_directory = strncmp(base_real, directory_real, length) == 0 && base_real[length] == '/' &&
+                              strchr(base_real + length + 1, '/') == NULL;
+        const char* name = same_directory ? base_real + length + 1 : base_real;
+
+        if(strlen(name) < SIMG_BASE_MAX)
+        {
+            strcpy(reference, name);
+            status = 0;
+        }
+    }
+
+    free(directory);
+    free(directory_real);
+    free(base_real);
+    free(image_real);
+
+    return status;
+}
+
+/**
+ * Converts a raw disk image into a sparse image.
+ *
+ * Zero blocks are left unallocated and blocks identical to a previous one
+ * point to its data instead of storing it again. With a base image, the blocks
+ * identical to the base block at the same place point to the data of the base (see simg.h).
+ *
+ * @param raw_path   the raw image to convert.
+ * @param simg_path  the sparse image to create, overwritten if it exists.
+ * @param base_path  the sparse image to make it on top of, or NULL.
+ * @return           0 on success, -1 on error.
+ */
+int simg_convert(const char* raw_path, const char* simg_path, const char* base_path)
+{
+    struct stat metainfo;
+    if(stat(raw_path, &metainfo) != 0)
+        return -1;
+
+    simg_header_t header;
+    memset(&header, 0, sizeof(simg_header_t));
+
+    // before the new image is created, it could be the base itself
+    simg_info_t* base = NULL;
+    if(base_path != NULL)
+    {
+        base = simg_open(base_path);
+        if(base == NULL || base->base_path != NULL || base_reference(simg_path, base_path, header.base) != 0)
+        {
+            simg_close(base);
+            return -1;
+        }
+    }
+
+    FILE* in = fopen(raw_path, "rb");
+    FILE* out = fopen(simg_path, "wb+");
+    if(in == NULL || out == NULL)
+    {
+        if(in != NULL)
+            fclose(in);
+        if(out != NULL)
+            fclose(out);
+        simg_close(base);
+        return -1;
+    }
+
+    memcpy(header.magic, SIMG_MAGIC, 4);
+    header.version = SIMG_VERSION;
+    header.sectors_per_block = SIMG_SECTORS_PER_BLOCK;
+    header.total_sectors = metainfo.st_size / SIMG_SECTOR_SIZE;
+    header.block_count = (header.total_sectors + SIMG_SECTORS_PER_BLOCK - 1) / SIMG_SECTORS_PER_BLOCK;
+    header.index_offset = sizeof(simg_header_t);
+
+    simg_index_entry_t* index = calloc(header.block_count + 1, sizeof(simg_index_entry_t));
+    uint32_t* hashes = calloc(header.block_count + 1, sizeof(uint32_t));
+    uint64_t data_end = header.index_offset + (uint64_t)header.block_count * sizeof(simg_index_entry_t);
+    int status = (index != NULL && hashes != NULL) ? 0 : -1;
+
+    uint8_t data[SIMG_BLOCK_SIZE];
+    uint8_t other[SIMG_BLOCK_SIZE];
+
+    for(uint32_t block = 0; status == 0 && block < header.block_count; block++)
+    {
+        // the last block may be partial, the rest of it reads as zeros
+        memset(data, 0, SIMG_BLOCK_SIZE);
+        size_t wanted = SIMG_BLOCK_SIZE;
+        if((uint64_t)(block + 1) * SIMG_SECTORS_PER_BLOCK > header.total_sectors)
+            wanted = (header.total_sectors - block * SIMG_SECTORS_PER_BLOCK) * SIMG_SECTOR_SIZE;
+
+        if(fread(data, 1, wanted, in) != wanted)
+        {
+            status = -1;
+            break;
+        }
+
+        if(is_zero_block(data))
+            continue;
+
+        // FNV-1a, just to find the candidates for sharing
+        uint32_t hash = 2166136261u;
+        for(size_t i = 0; i < SIMG_BLOCK_SIZE; i++)
+            hash = (hash ^ data[i]) * 16777619u;
+        hashes[block] = hash;
+
+        bool shared = false;
+        if(base != NULL && block < base->header.block_count && base->index[block].offset != 0)
+        {
+            pthread_mutex_lock(&base->lock);
+            uint8_t* base_data = load_block(base, block);
+            shared = (base_data != NULL && memcmp(base_data, data, SIMG_BLOCK_SIZE) == 0);
+            pthread_mutex_unlock(&base->lock);
+
+            if(shared)
+            {
+                index[block] = base->index[block];
+                index[block].flags |= SIMG_BLOCK_BASE;
+            }
+        }
+
+        // we do a linear search, images are converted once
+        for(uint32_t previous = 0; previous < block && !shared; previous++)
+        {
+            if(index[previous].offset == 0 || hashes[previous] != hash)
+                continue;
+
+            // compare with the real content of the candidate
+            off_t position = ftello(in);
+            bool same = fseeko(in, (off_t)previous * SIMG_BLOCK_SIZE, SEEK_SET) == 0 &&
+                        fread(other, 1, SIMG_BLOCK_SIZE, in) == SIMG_BLOCK_SIZE &&
+                        memcmp(data, other, SIMG_BLOCK_SIZE) == 0;
+            fseeko(in, position, SEEK_SET);
+
+            if(same)
+            {
+                index[block] = index[previous];
+                shared = true;
+            }
+        }
+
+        if(!shared && store_block(out, &data_end, data, &index[block]) != 0)
+            status = -1;
+    }
+
+    if(status == 0)
+    {
+        if(fseek(out, 0, SEEK_SET) != 0 ||
+            fwrite(&header, sizeof(simg_header_t), 1, out) != 1 ||
+            fwrite(index, sizeof(simg_index_entry_t), header.block_count, out) != header.block_count)
+            status = -1;
+    }
+
+    if(fclose(out) != 0)
+        status = -1;
+    fclose(in);
+    simg_close(base);
+    free(index);
+    free(hashes);
+
+    return status;
+}
@@ -0,0 +1,125 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ * Sparse Image Format (.simg)
+ *
+ * A sparse image stores a disk as fixed-size blocks of SIMG_SECTORS_PER_BLOCK sectors:
+ *
+ *   | header (one sector) | block index | compressed blocks ... |
+ *
+ * Blocks that were never written have no data at all and read back as zeros. The other
+ * ones are RLE compressed (or stored raw when that doesn't help) and identical blocks
+ * share the same data. So an image costs what is really on it, not its nominal size.
+ *
+ * An image can also be made on top of a base image (mksimg -b): its blocks identical to the
+ * block at the same place in the base are only a reference to the data in the base file.
+ * flp0, flp1 and flp2 made from the same base only store what differs. The base is never
+ * written through the derived image, and as written blocks are appended (see below) the
+ * data it refers to stays valid when the base itself is used. Repacking the base would
+ * break its derived images though, and a base can't have a base itself.
+ *
+ * A block is only decompressed the first time one of its sectors is accessed. Written
+ * blocks are compressed again and appended at the end of the file when the device is
+ * flushed, the space of their previous version is not reused (mksimg repacks an image).
+ * The decompressed blocks count in the memory budget (see membudget.h): the ones not
+ * written since the last flush are dropped when it's tight, and decompressed again.
+*/
+
+#define SIMG_MAGIC              "SIMG"
+#define SIMG_VERSION            1
+#define SIMG_SECTOR_SIZE        512
+#define SIMG_SECTORS_PER_BLOCK  8
+#define SIMG_BLOCK_SIZE         (SIMG_SECTOR_SIZE * SIMG_SECTORS_PER_BLOCK)
+#define SIMG_BASE_MAX           256
+
+typedef struct simg_header
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t sectors_per_block;
+    uint32_t total_sectors;
+    uint32_t block_count;
+    uint32_t index_offset;      // in bytes from the start of the file
+    char base[SIMG_BASE_MAX];   // base image, relative to the directory of this one unless absolute, "" if none
+    uint8_t reserved[492 - SIMG_BASE_MAX];
+} __attribute__((packed)) simg_header_t;
+
+typedef enum simg_block_flags
+{
+    SIMG_BLOCK_RLE = 0x01,      // otherwise the data is stored raw
+    SIMG_BLOCK_BASE = 0x02,     // the data is in the base image, at 'offset' in its file
+} simg_block_flags_t;
+
+typedef struct simg_index_entry
+{
+    uint64_t offset;            // 0 if the block isn't allocated
+    uint32_t length;            // size of the data in the file
+    uint16_t flags;
+    uint16_t reserved;
+} __attribute__((packed)) simg_index_entry_t;
+
+/*
+ * The in memory state of an opened sparse image.
+ * 'blocks' holds the blocks decompressed so far, NULL until their first access (or once
+ * given back to the memory budget).
+*/
+typedef struct simg_info
+{
+    uint32_t totalSectors;
+    FILE* stream;               // NULL while suspended
+    char* base_path;            // NULL without a base image
+    FILE* base_stream;          // opened on the first access to a base block, closed while suspended
+
+    pthread_mutex_t lock;
+    simg_header_t header;
+    simg_index_entry_t* index;
+    uint8_t** blocks;
+    uint8_t* dirty;             // one bit per block
+    uint64_t data_end;          // where the next written block goes
+    uint32_t shrink_cursor;     // next block the memory budget looks at
+
+    struct simg_info* next;     // opened images, to flush them at exit
+} simg_info_t;
+
+simg_info_t* simg_open(const char* path);
+void simg_close(simg_info_t* image);
+
+int simg_read_sectors(uint8_t* buffer, uint32_t lba, uint32_t sector_num, void* priv);
+int simg_write_sectors(const uint8_t* buffer, uint32_t lba, uint32_t sector_num, void* priv);
+void simg_flush(void* priv);
+
+// the disk pool closes the file of an image it doesn't use, and reopens it on its next access
+int simg_suspend(simg_info_t* image);
+void simg_resume(simg_info_t* image, FILE* stream);
+bool simg_is_suspended(simg_info_t* image);
+
+int simg_convert(const char* raw_path, const char* simg_path, const char* base_path);
@@ -0,0 +1,124 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/*
+ * fatdefrag - reports the fragmentation of a FAT image and makes its files contiguous
+ *
+ *   fatdefrag [-n] [-v] device
+ *
+ *   -n   only report, nothing is moved
+ *   -v   list the extents of every file and directory
+ *
+ * The devices are registered like the simulator does (the images of disks/), 'device' is a device
+ * id or a device name. See "Fragmentation" in fat12.c for how the files are laid out.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "../device.h"
+#include "../disk.h"
+#include "../fat12.h"
+#include "../vfs.h"
+
+static void print_file(const char* path, uint32_t clusters, uint32_t extents, void* arg)
+{
+    (void)arg;
+    printf("%6u clusters %6u extent%s  %s\n", clusters, extents, (extents > 1) ? "s" : " ", path);
+}
+
+static void print_stats(const char* when, const fat_frag_stats_t* stats)
+{
+    printf("%s: %u files, %u fragmented, %u extents for %u clusters", when, stats->files, stats->fragmented, stats->extents, stats->clusters);
+    if(stats->moved > 0)
+        printf(", %u clusters moved", stats->moved);
+    printf("\n");
+}
+
+static int find_device(const char* name)
+{
+    if(isdigit((unsigned char)name[0]))
+        return atoi(name);
+
+    for(int i = 0; i < device_num; i++)
+    {
+        if(strcmp(device_list[i]->name, name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+int main(int argc, char** argv)
+{
+    bool report_only = false;
+    bool verbose = false;
+    int i = 1;
+
+    for(; i < argc - 1; i++)
+    {
+        if(strcmp(argv[i], "-n") == 0)
+            report_only = true;
+        else if(strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else
+            break;
+    }
+
+    if(i != argc - 1)
+    {
+        fprintf(stderr, "usage: %s [-n] [-v] <device>\n", argv[0]);
+        return 1;
+    }
+
+    vfs_init();
+    disk_init();
+    fat12_init();
+
+    int device_id = find_device(argv[i]);
+    fat_frag_stats_t stats;
+
+    if(fat12_fragmentation(device_id, verbose ? print_file : NULL, NULL, &stats) != VFS_OK)
+    {
+        fprintf(stderr, "%s: not a FAT volume, or its chains are damaged\n", argv[i]);
+        return 1;
+    }
+
+    print_stats("before", &stats);
+    if(report_only)
+        return 0;
+
+    int status = fat12_defrag(device_id, &stats);
+    print_stats("after", &stats);
+
+    if(status != VFS_OK)
+    {
+        fprintf(stderr, "%s: not enough free space to finish\n", argv[i]);
+        return 1;
+    }
+
+    return 0;
+}
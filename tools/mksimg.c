@@ -0,0 +1,104 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/*
+ * mksimg - converts disk images to and from the sparse image format (see simg.h)
+ *
+ *   mksimg disk.img disk.simg                   raw image to sparse image
+ *   mksimg -b base.simg disk.img disk.simg      the same, on top of a base image
+ *   mksimg -x disk.simg disk.img                sparse image back to a raw image
+ *
+ * Expanding a sparse image and converting it again repacks it, dropping
+ * the space left behind by the blocks written since it was created.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../simg.h"
+
+static int expand(const char* simg_path, const char* raw_path)
+{
+    simg_info_t* image = simg_open(simg_path);
+    if(image == NULL)
+    {
+        fprintf(stderr, "%s is not a valid sparse image\n", simg_path);
+        return 1;
+    }
+
+    FILE* out = fopen(raw_path, "wb");
+    if(out == NULL)
+    {
+        perror(raw_path);
+        simg_close(image);
+        return 1;
+    }
+
+    uint8_t sector[SIMG_SECTOR_SIZE];
+    int status = 0;
+
+    for(uint32_t lba = 0; lba < image->totalSectors && status == 0; lba++)
+    {
+        if(simg_read_sectors(sector, lba, 1, image) != 0 || fwrite(sector, SIMG_SECTOR_SIZE, 1, out) != 1)
+        {
+            fprintf(stderr, "error while expanding sector %u\n", lba);
+            status = 1;
+        }
+    }
+
+    if(fclose(out) != 0)
+        status = 1;
+    simg_close(image);
+
+    return status;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc == 4 && strcmp(argv[1], "-x") == 0)
+        return expand(argv[2], argv[3]);
+
+    const char* base = NULL;
+    if(argc == 5 && strcmp(argv[1], "-b") == 0)
+    {
+        base = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if(argc != 3)
+    {
+        fprintf(stderr, "usage: %s [-b <base sparse image>] <raw image> <sparse image>\n       %s -x <sparse image> <raw image>\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    if(simg_convert(argv[1], argv[2], base) != 0)
+    {
+        fprintf(stderr, "error while converting %s\n", argv[1]);
+        return 1;
+    }
+
+    return 0;
+}
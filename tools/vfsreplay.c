@@ -0,0 +1,333 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+/*
+ * vfsreplay - runs a trace recorded with VFS_TRACE (see trace.h) again and measures it
+ *
+ *   vfsreplay [-p] [-m fs:mount_point:device]... trace
+ *
+ *   -p   keep the pacing of the recording, otherwise the calls are replayed as fast as possible
+ *   -m   mounts done before the replay, the mounts and unmounts of the trace are then skipped
+ *
+ * The devices are registered like the simulator does (the images of disks/, then the ramfs devices),
+ * so the device ids of the trace stay valid. Written data is a pattern, only the sizes are recorded.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../disk.h"
+#include "../fat12.h"
+#include "../membudget.h"
+#include "../ramfs.h"
+#include "../trace.h"
+#include "../vfs.h"
+
+#define REPLAY_MAX_FD       256
+#define REPLAY_MAX_MOUNTS   16
+
+typedef struct op_stats
+{
+    const char* name;
+    uint64_t count;
+    uint64_t errors;        // failed calls
+    uint64_t diverged;      // results different from the recording
+    uint64_t bytes;
+    uint64_t* latencies;    // ns
+    size_t capacity;
+} op_stats_t;
+
+static op_stats_t stats[] = {
+    [TRACE_OPEN] = { .name = "open" },
+    [TRACE_CLOSE] = { .name = "close" },
+    [TRACE_READ] = { .name = "read" },
+    [TRACE_WRITE] = { .name = "write" },
+    [TRACE_SEEK] = { .name = "seek" },
+    [TRACE_MOUNT] = { .name = "mount" },
+    [TRACE_UNMOUNT] = { .name = "unmount" },
+};
+
+#define OP_COUNT (sizeof(stats) / sizeof(stats[0]))
+
+static void add_sample(op_stats_t* op, uint64_t latency, int64_t result, int64_t recorded)
+{
+    if(op->count == op->capacity)
+    {
+        size_t capacity = (op->capacity == 0) ? 1024 : op->capacity * 2;
+        uint64_t* latencies = realloc(op->latencies, capacity * sizeof(uint64_t));
+        if(latencies == NULL)
+            return;
+
+        op->latencies = latencies;
+        op->capacity = capacity;
+    }
+
+    op->latencies[op->count++] = latency;
+
+    if(result < 0)
+        op->errors++;
+    if(result != recorded)
+        op->diverged++;
+}
+
+static int compare_latencies(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_report(uint64_t elapsed)
+{
+    uint64_t calls = 0, bytes = 0;
+
+    printf("%-8s %10s %8s %8s %10s %10s %10s %10s\n", "call", "count", "errors", "diverged", "avg (us)", "p50 (us)", "p99 (us)", "max (us)");
+
+    for(size_t i = 0; i < OP_COUNT; i++)
+    {
+        op_stats_t* op = &stats[i];
+        if(op->name == NULL || op->count == 0)
+            continue;
+
+        qsort(op->latencies, op->count, sizeof(uint64_t), compare_latencies);
+
+        uint64_t total = 0;
+        for(uint64_t j = 0; j < op->count; j++)
+            total += op->latencies[j];
+
+        printf("%-8s %10llu %8llu %8llu %10.2f %10.2f %10.2f %10.2f\n", op->name,
+            (unsigned long long)op->count, (unsigned long long)op->errors, (unsigned long long)op->diverged,
+            total / 1000.0 / op->count, op->latencies[op->count / 2] / 1000.0,
+            op->latencies[op->count * 99 / 100] / 1000.0, op->latencies[op->count - 1] / 1000.0);
+
+        calls += op->count;
+        bytes += op->bytes;
+    }
+
+    double seconds = elapsed / 1e9;
+    printf("\n%llu calls in %.3f s: %.0f calls/s, %.2f MiB/s read and written\n", (unsigned long long)calls,
+        seconds, (seconds > 0) ? calls / seconds : 0, (seconds > 0) ? bytes / seconds / (1024 * 1024) : 0);
+
+    // where the memory went, against VFS_MEMORY_LIMIT if there's one
+    membudget_usage_t usage[16];
+    int accounts = membudget_usage(usage, 16);
+
+    printf("\n%-14s %12s\n", "memory", "usage (KiB)");
+    for(int i = 0; i < accounts && i < 16; i++)
+        printf("%-14s %12zu%s\n", usage[i].name, usage[i].usage / 1024, usage[i].shrinkable ? "" : "  (not shrinkable)");
+
+    if(membudget_get_limit() != 0)
+        printf("%-14s %12zu of %zu\n", "total", membudget_total() / 1024, membudget_get_limit() / 1024);
+    else
+        printf("%-14s %12zu\n", "total", membudget_total() / 1024);
+}
+
+static void wait_until(uint64_t deadline)
+{
+    uint64_t now = trace_clock();
+    if(now >= deadline)
+        return;
+
+    struct timespec delay = { .tv_sec = (deadline - now) / 1000000000ull, .tv_nsec = (deadline - now) % 1000000000ull };
+    nanosleep(&delay, NULL);
+}
+
+// "fs:mount_point:device"
+static int mount_layout(char* layout)
+{
+    char* mount_point = strchr(layout, ':');
+    char* device = (mount_point != NULL) ? strrchr(mount_point + 1, ':') : NULL;
+    if(device == NULL)
+        return VFS_ERROR;
+
+    *mount_point++ = '\0';
+    *device++ = '\0';
+
+    return vfs_mount(layout, mount_point, atoi(device));
+}
+
+static int replay(FILE* file, bool paced, bool recorded_mounts)
+{
+    fd_t fds[REPLAY_MAX_FD];    // descriptor of the recording -> ours
+    for(int i = 0; i < REPLAY_MAX_FD; i++)
+        fds[i] = VFS_EBADF;
+
+    uint8_t* buffer = NULL;
+    size_t buffer_size = 0;
+    char strings[UINT16_MAX];
+    trace_record_t record;
+
+    uint64_t origin = trace_clock();
+
+    while(fread(&record, sizeof(record), 1, file) == 1)
+    {
+        if(record.strings_length < 2 || fread(strings, 1, record.strings_length, file) != record.strings_length
+            || strings[record.strings_length - 1] != '\0' || record.op >= OP_COUNT || stats[record.op].name == NULL)
+        {
+            fprintf(stderr, "corrupted trace\n");
+            free(buffer);
+            return 1;
+        }
+
+        const char* name = strings;
+        const char* path = strings + strlen(strings) + 1;
+        fd_t fd = (record.fd >= 0 && record.fd < REPLAY_MAX_FD) ? fds[record.fd] : VFS_EBADF;
+
+        if((record.op == TRACE_READ || record.op == TRACE_WRITE) && record.arg > buffer_size)
+        {
+            uint8_t* grown = realloc(buffer, record.arg);
+            if(grown == NULL)
+            {
+                fprintf(stderr, "out of memory\n");
+                free(buffer);
+                return 1;
+            }
+
+            memset(grown + buffer_size, 0x5a, record.arg - buffer_size);
+            buffer = grown;
+            buffer_size = record.arg;
+        }
+
+        if((record.op == TRACE_MOUNT || record.op == TRACE_UNMOUNT) && !recorded_mounts)
+            continue;
+
+        if(paced)
+            wait_until(origin + record.time);
+
+        uint64_t start = trace_clock();
+        int64_t result = VFS_ERROR;
+
+        switch (record.op)
+        {
+        case TRACE_OPEN:
+            result = vfs_open(path, record.arg);
+            if(record.result >= 0 && record.result < REPLAY_MAX_FD)
+                fds[record.result] = result;
+            break;
+
+        case TRACE_CLOSE:
+            result = vfs_close(fd);
+            if(record.fd >= 0 && record.fd < REPLAY_MAX_FD)
+                fds[record.fd] = VFS_EBADF;
+            break;
+
+        case TRACE_READ:
+            result = vfs_read(fd, buffer, record.arg);
+            break;
+
+        case TRACE_WRITE:
+            result = vfs_write(fd, buffer, record.arg);
+            break;
+
+        case TRACE_SEEK:
+            result = vfs_seek(fd, (int64_t)record.arg, record.whence);
+            break;
+
+        case TRACE_MOUNT:
+            result = vfs_mount(name, path, (int)record.arg);
+            break;
+
+        case TRACE_UNMOUNT:
+            result = vfs_unmount(path);
+            break;
+        }
+
+        op_stats_t* op = &stats[record.op];
+        add_sample(op, trace_clock() - start, result, record.result);
+
+        if((record.op == TRACE_READ || record.op == TRACE_WRITE) && result > 0)
+            op->bytes += result;
+    }
+
+    print_report(trace_clock() - origin);
+
+    free(buffer);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    bool paced = false;
+    char* layout[REPLAY_MAX_MOUNTS];
+    int layout_count = 0;
+    int i = 1;
+
+    for(; i < argc - 1; i++)
+    {
+        if(strcmp(argv[i], "-p") == 0)
+            paced = true;
+        else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc - 1 && layout_count < REPLAY_MAX_MOUNTS)
+            layout[layout_count++] = argv[++i];
+        else
+            break;
+    }
+
+    if(i != argc - 1)
+    {
+        fprintf(stderr, "usage: %s [-p] [-m fs:mount_point:device]... <trace>\n", argv[0]);
+        return 1;
+    }
+
+    FILE* file = fopen(argv[i], "rb");
+    if(file == NULL)
+    {
+        perror(argv[i]);
+        return 1;
+    }
+
+    trace_header_t header;
+    if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t))
+    {
+        fprintf(stderr, "%s is not a valid trace\n", argv[i]);
+        fclose(file);
+        return 1;
+    }
+
+    // we don't trace the replay itself
+    unsetenv("VFS_TRACE");
+
+    vfs_init();
+    disk_init();
+    fat12_init();
+    ramfs_init();
+
+    for(int m = 0; m < layout_count; m++)
+    {
+        if(mount_layout(layout[m]) != VFS_OK)
+        {
+            fprintf(stderr, "cannot mount %s\n", layout[m]);
+            fclose(file);
+            return 1;
+        }
+    }
+
+    int status = replay(file, paced, layout_count == 0);
+
+    vfs_sync();
+    fclose(file);
+
+    return status;
+}
@@ -0,0 +1,120 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+#include "vfs.h"
+
+atomic_bool trace_active = false;
+
+static FILE* trace_file = NULL;
+static uint64_t trace_origin;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t trace_clock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+ * Starts recording the VFS calls to a new log (an existing file is replaced).
+ *
+ * @param path  the log.
+ * @return      VFS_OK, or VFS_ERROR if the log can't be created.
+ */
+int trace_start(const char* path)
+{
+    trace_stop();
+
+    FILE* file = fopen(path, "wb");
+    if(file == NULL)
+        return VFS_ERROR;
+
+    trace_header_t header = { .version = TRACE_VERSION, .record_size = sizeof(trace_record_t) };
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+
+    if(fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        fclose(file);
+        return VFS_ERROR;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    trace_file = file;
+    trace_origin = trace_clock();
+    atomic_store(&trace_active, true);
+    pthread_mutex_unlock(&trace_lock);
+
+    return VFS_OK;
+}
+
+void trace_stop()
+{
+    pthread_mutex_lock(&trace_lock);
+
+    atomic_store(&trace_active, false);
+    if(trace_file != NULL)
+        fclose(trace_file);
+    trace_file = NULL;
+
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+ * Appends a call that started at 'start' (a trace_clock() value) to the log, the time
+ * fields of the record are filled here. 'name' and 'path' may be NULL.
+ */
+void trace_log(const trace_record_t* record, uint64_t start, const char* name, const char* path)
+{
+    uint64_t end = trace_clock();
+    size_t name_length = (name != NULL) ? strlen(name) + 1 : 1;
+    size_t path_length = (path != NULL) ? strlen(path) + 1 : 1;
+
+    if(name_length + path_length > UINT16_MAX)
+        return;
+
+    trace_record_t entry = *record;
+    entry.duration = (end - start > UINT32_MAX) ? UINT32_MAX : (uint32_t)(end - start);
+    entry.strings_length = name_length + path_length;
+
+    pthread_mutex_lock(&trace_lock);
+
+    if(trace_file != NULL)
+    {
+        entry.time = (start > trace_origin) ? start - trace_origin : 0;
+
+        fwrite(&entry, sizeof(entry), 1, trace_file);
+        fwrite((name != NULL) ? name : "", 1, name_length, trace_file);
+        fwrite((path != NULL) ? path : "", 1, path_length, trace_file);
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+}
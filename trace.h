@@ -0,0 +1,84 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2025 Novice
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/*
+ * VFS call tracing
+ *
+ * Once trace_start() is called, every vfs_open(), vfs_read(), vfs_write(), vfs_seek(), vfs_close(),
+ * vfs_mount() and vfs_unmount() is appended to a binary log with its arguments, its result and
+ * how long it took. tools/vfsreplay runs such a log again. Setting VFS_TRACE=<file> traces a whole
+ * run from vfs_init().
+ *
+ *   | header | record | strings | record | strings | ...
+ *
+ * A record is followed by its strings: the file system name of a mount then the path, each one
+ * terminated by a '\0'. Data isn't recorded, only sizes. The log is in the byte order of the host.
+*/
+
+#define TRACE_MAGIC     "VFSTRACE"
+#define TRACE_VERSION   1
+
+typedef enum trace_op
+{
+    TRACE_OPEN = 1,     // arg: mode, result: the descriptor
+    TRACE_CLOSE,
+    TRACE_READ,         // arg: size, result: bytes read
+    TRACE_WRITE,        // arg: size, result: bytes written
+    TRACE_SEEK,         // arg: offset, whence: the whence of the call, result: the new position
+    TRACE_MOUNT,        // arg: device id
+    TRACE_UNMOUNT,
+} trace_op_t;
+
+typedef struct trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} __attribute__((packed)) trace_header_t;
+
+typedef struct trace_record
+{
+    uint8_t op;
+    uint8_t whence;
+    uint16_t strings_length;    // of the strings following the record, with their '\0'
+    int32_t fd;
+    uint64_t time;              // start of the call, in ns since trace_start()
+    uint32_t duration;          // ns
+    uint64_t arg;
+    int64_t result;
+} __attribute__((packed)) trace_record_t;
+
+extern atomic_bool trace_active;
+
+int trace_start(const char* path);
+void trace_stop();
+
+uint64_t trace_clock();
+void trace_log(const trace_record_t* record, uint64_t start, const char* name, const char* path);
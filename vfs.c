@@ -25,30 +25,51 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "vfs.h"
+#include "epoch.h"
+#include "trace.h"
+#include "membudget.h"
 
 #define VFS_MAX_FS 10
 #define MAX_OPEN_FILES 24
+#define VFS_MAX_PATH_DEPTH 32
+#define VFS_MOUNT_WORKERS 8
 
-vfs_t *vfs_root;
+vfs_t *_Atomic vfs_root;
 filesystem_t *registered_fs[VFS_MAX_FS];
 int num_registered_fs;
 vfs_file_t vfs_open_files[MAX_OPEN_FILES];
 
+/*
+ * Serializes the changes of the mount table (mount and unmount), the lookups never take it:
+ * the pointers they follow are only changed by atomic stores.
+ */
+static pthread_mutex_t mount_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;	// the table of open files
+
+static objpool_t *vfs_pool = NULL;	// the vfs_t of the mounts
+
+// the inode that follows a vnode keeps the alignment of the pool
+#define VNODE_DATA_OFFSET ((sizeof(vnode_t) + 15) & ~(size_t)15)
+
 static void add_mount_point(vfs_t *mountpoint)
 {
-	if(vfs_root == NULL)
+	atomic_store_explicit(&mountpoint->next, NULL, memory_order_relaxed);
+
+	vfs_t *current = atomic_load_explicit(&vfs_root, memory_order_relaxed);
+	if(current == NULL)
 	{
-		vfs_root = mountpoint;
+		atomic_store_explicit(&vfs_root, mountpoint, memory_order_release);
 		return;
 	}
 
-	vfs_t *current = vfs_root;
 	while (current->next != NULL)
 		current = current->next;
 
-	current->next = mountpoint;
+	atomic_store_explicit(&current->next, mountpoint, memory_order_release);
 }
 
 static void remove_mount_point(vfs_t *mountpoint)
@@ -58,7 +79,7 @@ static void remove_mount_point(vfs_t *mountpoint)
 	while (current->next != mountpoint)
 		current = current->next;
 
-	current->next = mountpoint;
+	atomic_store_explicit(&current->next, atomic_load(&mountpoint->next), memory_order_release);
 }
 
  static filesystem_t *find_filesystem_by_name(const char *name)
@@ -95,6 +116,39 @@ static int is_fd_valid(fd_t fd)
 	return 1;
 }
 
+/*
+ * Copies the open file 'fd' into 'file' and holds its vnode for the caller, who releases it after
+ * the driver call: a close running meanwhile can't let the vnode go. NULL if 'fd' isn't open.
+ */
+static vnode_t* hold_file(fd_t fd, vfs_file_t* file)
+{
+	vnode_t* node = NULL;
+
+	pthread_mutex_lock(&fd_lock);
+
+	if(is_fd_valid(fd))
+	{
+		*file = vfs_open_files[fd];
+		node = file->vnode;
+		node->ref_count++;
+	}
+
+	pthread_mutex_unlock(&fd_lock);
+
+	return node;
+}
+
+/* Moves the position of 'fd', unless it was closed since hold_file() */
+static void set_position(fd_t fd, vnode_t* node, uint64_t position)
+{
+	pthread_mutex_lock(&fd_lock);
+
+	if(vfs_open_files[fd].vnode == node)
+		vfs_open_files[fd].position = position;
+
+	pthread_mutex_unlock(&fd_lock);
+}
+
 void vfs_init()
 {
 	vfs_root = NULL;		// 0 mountpoint
@@ -105,185 +159,824 @@ void vfs_init()
 
 	for(int i = 0; i < MAX_OPEN_FILES; i++)
 		vfs_open_files[i].vnode = NULL;
+
+	if(vfs_pool == NULL)
+		vfs_pool = objpool_create("vfs", sizeof(vfs_t));
+
+	// traces the whole run, see trace.h
+	const char* trace_path = getenv("VFS_TRACE");
+	if(trace_path != NULL && trace_start(trace_path) != VFS_OK)
+		fprintf(stderr, "cannot create the trace %s\n", trace_path);
+
+	// the memory budget of the whole run, see membudget.h
+	const char* memory_limit = getenv("VFS_MEMORY_LIMIT");
+	if(memory_limit != NULL)
+	{
+		char* suffix;
+		unsigned long long bytes = strtoull(memory_limit, &suffix, 10);
+
+		switch(*suffix)
+		{
+		case 'G': case 'g': bytes <<= 10; // fall through
+		case 'M': case 'm': bytes <<= 10; // fall through
+		case 'K': case 'k': bytes <<= 10; break;
+		}
+
+		membudget_set_limit(bytes);
+	}
+}
+
+/**
+ * Creates a pool of vnodes for a driver, each one followed by 'data_size' bytes for its inode.
+ * To be called once, when the driver is initialized.
+ */
+objpool_t* vfs_create_vnode_pool(const char* name, size_t data_size)
+{
+	return objpool_create(name, VNODE_DATA_OFFSET + data_size);
+}
+
+/**
+ * Allocates a zeroed vnode from a pool of vfs_create_vnode_pool(), 'vnode_data' points to its inode.
+ * There's no heap allocation as long as the vnodes freed by the thread can be reused.
+ */
+vnode_t* vfs_alloc_vnode(objpool_t* pool)
+{
+	vnode_t* vnode = objpool_alloc(pool);
+	if(vnode == NULL)
+		return NULL;
+
+	memset(vnode, 0, VNODE_DATA_OFFSET);
+	vnode->vnode_data = (uint8_t*)vnode + VNODE_DATA_OFFSET;
+
+	return vnode;
+}
+
+void vfs_free_vnode(void* vnode)
+{
+	objpool_free(vnode);
+}
+
+void vfs_release_vnode(vnode_t* vnode)
+{
+	if(vnode != NULL)
+		atomic_fetch_sub_explicit(&vnode->ref_count, 1, memory_order_release);
 }
 
+/*
+ * Splits an absolute path into its components.
+ *
+ * The path is copied into 'buffer' (VFS_MAX_PATH_LENGTH bytes) and 'components'
+ * receives pointers to each name inside it. Returns the number of components,
+ * or -1 if the path is invalid or too deep.
+ */
+static int split_path(const char* path, char* buffer, char** components)
+{
+	int count = 0;
+	char* save = NULL;
+
+	if(path == NULL || path[0] != '/' || strlen(path) >= VFS_MAX_PATH_LENGTH)
+		return -1;
+
+	strcpy(buffer, path);
+
+	for(char* name = strtok_r(buffer, "/", &save); name != NULL; name = strtok_r(NULL, "/", &save))
+	{
+		if(count >= VFS_MAX_PATH_DEPTH)
+			return -1;
+
+		components[count++] = name;
+	}
+
+	return count;
+}
+
+/*
+ * If 'node' is a mountpoint, returns the root of the file system mounted on it.
+ * The reference held on 'node' is traded for one on the root.
+ */
+static vnode_t* cross_mount_point(vnode_t* node)
+{
+	if(node == NULL)
+		return NULL;
+
+	vfs_t *mounted = atomic_load_explicit(&node->vfs_mountedhere, memory_order_acquire);
+	if(mounted != NULL)
+	{
+		vnode_t* covered = node;
+
+		mounted->vfs_op->get_root(mounted, &node);
+		vfs_release_vnode(covered);
+	}
+
+	return node;
+}
+
+/* Looks up a single path component inside the directory 'dir', the reference held on 'dir' goes to the result. */
+static vnode_t* lookup_component(vnode_t* dir, const char* name)
+{
+	vnode_t* result = NULL;
+
+	dir = cross_mount_point(dir);
+
+	if(dir->vnode_op->lookup(dir, name, &result) != VFS_OK)
+		result = NULL;
+
+	vfs_release_vnode(dir);
+	return result;
+}
+
+static vnode_t* get_root_vnode(void)
+{
+	vnode_t* root = NULL;
+	vfs_t *root_vfs = atomic_load_explicit(&vfs_root, memory_order_acquire);
+
+	if(root_vfs == NULL)
+		return NULL;
+
+	root_vfs->vfs_op->get_root(root_vfs, &root);
+	return root;
+}
+
+/*
+ * Resolves an absolute path, crossing the mount points.
+ * It must run inside an epoch section (epoch_enter()), which keeps the mounts walked valid.
+ * The vnode returned is held, the caller releases it (vfs_release_vnode()).
+ */
 vnode_t* lookup_path_name(const char* path)
 {
-	vnode_t* node_out = NULL;
 	char parsed_path[VFS_MAX_PATH_LENGTH];
-	char* name;
+	char* components[VFS_MAX_PATH_DEPTH];
+	int count = split_path(path, parsed_path, components);
 
-	if(path == NULL || path[0] != '/')
+	if(count < 0)
 		return NULL;
 
-	strcpy(parsed_path, path);
+	vnode_t* node_out = get_root_vnode();
 
-	vfs_root->vfs_op->get_root(vfs_root, &node_out);
-	name = strtok(parsed_path, "/");
- 
-	while(node_out != NULL && name != NULL)
-	{
-		if(node_out->vfs_mountedhere != NULL) // if this is a mountpoint
-			node_out->vfs_mountedhere->vfs_op->get_root(node_out->vfs_mountedhere, &node_out);
+	// the `lookup` vnode operation returns NULL as soon as a component is not found
+	for(int i = 0; node_out != NULL && i < count; i++)
+		node_out = lookup_component(node_out, components[i]);
+
+	return cross_mount_point(node_out);
+}
+
+/*
+ * Finds the vnode a new file system will cover, it must be a directory that isn't already a root.
+ * The very first mount covers nothing. The vnode found stays held as long as it's covered.
+ * Called with the mount lock held.
+ */
+static int find_covered_vnode(const char *mount_point, vnode_t **covered)
+{
+	int status = VFS_OK;
+
+	*covered = NULL;
+
+	if(vfs_root == NULL)	// is this the first mount point ?
+		return VFS_OK;
+
+	epoch_enter();
 
-		node_out->vnode_op->lookup(node_out, name, &node_out);
-		name = strtok(NULL, "/");
+	// find the vnode's mountpoint
+	*covered = lookup_path_name(mount_point);
+	if(*covered == NULL || ((*covered)->flags & VNODE_ROOT) == VNODE_ROOT)
+		status = VFS_ENOENT;
+	else if((*covered)->vnode_type != VDIR)
+		status = VFS_ENOTDIR;
+
+	if(status != VFS_OK)
+	{
+		vfs_release_vnode(*covered);
+		*covered = NULL;
 	}
 
-	// If `name` is not NULL, it means the path has not been fully parsed yet.
-	// This check is commented out because it's unnecessary:
-	// the `lookup` vnode operation will already return NULL if the file is not found.
-	//if(name != NULL)
-	//	return NULL;
+	epoch_exit();
 
-	if(node_out != NULL && node_out->vfs_mountedhere != NULL) // if this is a mountpoint
-			node_out->vfs_mountedhere->vfs_op->get_root(node_out->vfs_mountedhere, &node_out);
-	
-	return node_out;
+	return status;
 }
 
-int vfs_mount(const char *fs_name, const char *mount_point, int device_id)
+/*
+ * Makes a mounted file system visible, path lookups only see it from here: the vfs_t
+ * is completely filled before the stores that publish it.
+ * Called with the mount lock held.
+ */
+static void publish_mount_point(vfs_t *new_vfs, vnode_t *covered)
+{
+	new_vfs->vnodecovered = covered;
+
+	add_mount_point(new_vfs);
+
+	if(covered != NULL)
+		atomic_store_explicit(&covered->vfs_mountedhere, new_vfs, memory_order_release);
+}
+
+static vfs_t *create_vfs(filesystem_t *fs, int device_id)
+{
+	vfs_t *new_vfs = objpool_alloc(vfs_pool);
+	if(new_vfs == NULL)
+		return NULL;
+
+	new_vfs->next = NULL;
+	new_vfs->device_id = device_id;
+	new_vfs->vfs_op = fs;
+	new_vfs->vnodecovered = NULL;
+
+	return new_vfs;
+}
+
+static int mount_fs(const char *fs_name, const char *mount_point, int device_id)
 {
 	vfs_t *new_vfs;
 	filesystem_t *fs;
+	vnode_t *covered;
 
 	fs = find_filesystem_by_name(fs_name);
 
 	if(fs == NULL)
 		return VFS_ERROR; // error code !
 
-	new_vfs = malloc(sizeof(vfs_t));
+	pthread_mutex_lock(&mount_lock);
 
-	new_vfs->next = NULL;
-	new_vfs->device_id = device_id;
-	new_vfs->vfs_op = fs;
+	int status = find_covered_vnode(mount_point, &covered);
+	if(status != VFS_OK)
+	{
+		pthread_mutex_unlock(&mount_lock);
+		return status;
+	}
 
-	if(vfs_root == NULL)	// is this the first mount point ?
-		new_vfs->vnodecovered = NULL;
-	else
+	new_vfs = create_vfs(fs, device_id);
+	status = (new_vfs == NULL) ? VFS_ERROR : new_vfs->vfs_op->vfs_mount(new_vfs, device_id);
+
+	if(status != VFS_OK)
+	{
+		vfs_release_vnode(covered);
+
+		objpool_free(new_vfs);
+		pthread_mutex_unlock(&mount_lock);
+		return status;
+	}
+
+	publish_mount_point(new_vfs, covered);
+	pthread_mutex_unlock(&mount_lock);
+
+	return VFS_OK;	// ok
+}
+
+int vfs_mount(const char *fs_name, const char *mount_point, int device_id)
+{
+	if(!atomic_load_explicit(&trace_active, memory_order_relaxed))
+		return mount_fs(fs_name, mount_point, device_id);
+
+	uint64_t start = trace_clock();
+	int status = mount_fs(fs_name, mount_point, device_id);
+
+	trace_log(&(trace_record_t){ .op = TRACE_MOUNT, .fd = -1, .arg = device_id, .result = status }, start, fs_name, mount_point);
+	return status;
+}
+
+typedef struct mount_batch
+{
+	vfs_mount_request_t *requests;
+	vfs_t **mounted;
+	size_t count;
+	size_t next;		// next request to pick
+	bool warm_up;
+	pthread_mutex_t lock;
+} mount_batch_t;
+
+/*
+ * A worker of vfs_mount_many(): it takes the next request of the batch and lets the driver mount it
+ * (reading its metadata from the device), until there is none left. Nothing is published here.
+ */
+static void *mount_worker(void *arg)
+{
+	mount_batch_t *batch = arg;
+
+	while(true)
 	{
-		// find the vnode's mountpoint
-		new_vfs->vnodecovered = lookup_path_name(mount_point);
-		if(new_vfs->vnodecovered == NULL || (new_vfs->vnodecovered->flags & VNODE_ROOT) == VNODE_ROOT)
+		pthread_mutex_lock(&batch->lock);
+		size_t i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+
+		if(i >= batch->count)
+			return NULL;
+
+		vfs_mount_request_t *request = &batch->requests[i];
+		filesystem_t *fs = find_filesystem_by_name(request->fs_name);
+
+		if(fs == NULL)
+		{
+			request->status = VFS_ERROR;
+			continue;
+		}
+
+		vfs_t *new_vfs = create_vfs(fs, request->device_id);
+		if(new_vfs == NULL)
 		{
-			free(new_vfs);
-			return VFS_ENOENT;
+			request->status = VFS_ERROR;
+			continue;
 		}
 
-		if(new_vfs->vnodecovered->vnode_type != VDIR)
+		request->status = fs->vfs_mount(new_vfs, request->device_id);
+		if(request->status != VFS_OK)
 		{
-			free(new_vfs);
-			return VFS_ENOTDIR;
+			objpool_free(new_vfs);
+			continue;
 		}
 
-		new_vfs->vnodecovered->ref_count++;
-		new_vfs->vnodecovered->vfs_mountedhere = new_vfs;
+		if(batch->warm_up && fs->vfs_warmup != NULL)
+			fs->vfs_warmup(new_vfs);
+
+		batch->mounted[i] = new_vfs;
 	}
+}
 
-	new_vfs->vfs_op->vfs_mount(new_vfs, device_id);
-	add_mount_point(new_vfs);
+/**
+ * Mounts a batch of file systems.
+ *
+ * The devices are probed and their metadata loaded in parallel by a pool of workers, the root
+ * directories being preloaded as well if 'warm_up' is set. Once they're all done, the mounts are
+ * published in the order of 'requests' so a request can mount on a directory of a previous one.
+ * A file system is never visible before it's completely mounted.
+ *
+ * @param requests  the mounts to do, their 'status' gets the result of each one.
+ * @param count     the number of requests.
+ * @param warm_up   preload the root directories.
+ * @return          VFS_OK if every mount succeeded, VFS_ERROR otherwise.
+ */
+int vfs_mount_many(vfs_mount_request_t requests[], size_t count, bool warm_up)
+{
+	uint64_t start = trace_clock();
 
-	return VFS_OK;	// ok
+	mount_batch_t batch = {
+		.requests = requests,
+		.mounted = calloc(count + 1, sizeof(vfs_t *)),
+		.count = count,
+		.next = 0,
+		.warm_up = warm_up,
+	};
+
+	if(batch.mounted == NULL)
+		return VFS_ERROR;
+
+	pthread_mutex_init(&batch.lock, NULL);
+
+	pthread_t workers[VFS_MOUNT_WORKERS];
+	size_t worker_count = (count < VFS_MOUNT_WORKERS) ? count : VFS_MOUNT_WORKERS;
+	size_t started = 0;
+
+	for(; started < worker_count; started++)
+		if(pthread_create(&workers[started], NULL, mount_worker, &batch) != 0)
+			break;
+
+	if(started == 0)
+		mount_worker(&batch);	// no thread ? we'll do it ourselves
+
+	for(size_t i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+
+	pthread_mutex_destroy(&batch.lock);
+
+	int result = VFS_OK;
+	pthread_mutex_lock(&mount_lock);
+
+	for(size_t i = 0; i < count; i++)
+	{
+		vfs_t *new_vfs = batch.mounted[i];
+		vnode_t *covered;
+
+		if(new_vfs != NULL)
+		{
+			requests[i].status = find_covered_vnode(requests[i].mount_point, &covered);
+
+			if(requests[i].status == VFS_OK)
+				publish_mount_point(new_vfs, covered);
+			else
+			{
+				new_vfs->vfs_op->vfs_unmount(new_vfs);
+				objpool_free(new_vfs);
+			}
+		}
+
+		if(requests[i].status != VFS_OK)
+			result = VFS_ERROR;
+	}
+
+	pthread_mutex_unlock(&mount_lock);
+	free(batch.mounted);
+
+	// the whole batch is one call, each mount gets its own record
+	for(size_t i = 0; atomic_load_explicit(&trace_active, memory_order_relaxed) && i < count; i++)
+		trace_log(&(trace_record_t){ .op = TRACE_MOUNT, .fd = -1, .arg = requests[i].device_id, .result = requests[i].status }, start, requests[i].fs_name, requests[i].mount_point);
+
+	return result;
 }
 
- int vfs_unmount(const char *mount_point)
+ static int unmount_fs(const char *mount_point)
  {
+	pthread_mutex_lock(&mount_lock);
+	epoch_enter();
+
+	vfs_t* mountpoint = NULL;
+	int status = VFS_OK;
 	vnode_t* vnode = lookup_path_name(mount_point);
-	if(vnode == NULL)
-		return VFS_ENOENT;
 
-	if((vnode->flags & VNODE_ROOT) != VNODE_ROOT)
-		return VFS_ERROR; // it's not the root of a filesystem, it's not a mount point...
+	if(vnode == NULL)
+		status = VFS_ENOENT;
+	else if((vnode->flags & VNODE_ROOT) != VNODE_ROOT)
+		status = VFS_ERROR; // it's not the root of a filesystem, it's not a mount point...
+	else if ((mountpoint = vnode->vnode_vfs) == vfs_root)
+		status = VFS_EACCESS;  // cannot unmount the root fs
 
-	vfs_t* mountpoint = vnode->vnode_vfs;
+	vfs_release_vnode(vnode);
+	epoch_exit();
 
-	if (mountpoint == vfs_root)
-         return VFS_EACCESS;  // cannot unmount the root fs
+	if(status != VFS_OK)
+	{
+		pthread_mutex_unlock(&mount_lock);
+		return status;
+	}
 
 	// TODO: implemente a mechanism to prevent umounting a filesystem
 	// as long as there are other filesystems mounted on top of it
 
-	// this vnode is no longer a mountpoint
-	mountpoint->vnodecovered->vfs_mountedhere = NULL;
-	mountpoint->vnodecovered->ref_count--;
+	// this vnode is no longer a mountpoint, new lookups can't reach the file system
+	atomic_store_explicit(&mountpoint->vnodecovered->vfs_mountedhere, NULL, memory_order_release);
+	remove_mount_point(mountpoint);
+
+	// but the ones in progress may still be walking it
+	epoch_synchronize();
 
+	vfs_release_vnode(mountpoint->vnodecovered);
 	mountpoint->vfs_op->vfs_unmount(mountpoint);
-	remove_mount_point(mountpoint);
-	free(mountpoint);
+	objpool_free(mountpoint);
+
+	pthread_mutex_unlock(&mount_lock);
 
     return VFS_OK;
  }
 
- fd_t vfs_open(const char *path, uint16_t mode)
+int vfs_unmount(const char *mount_point)
+{
+	if(!atomic_load_explicit(&trace_active, memory_order_relaxed))
+		return unmount_fs(mount_point);
+
+	uint64_t start = trace_clock();
+	int status = unmount_fs(mount_point);
+
+	trace_log(&(trace_record_t){ .op = TRACE_UNMOUNT, .fd = -1, .result = status }, start, NULL, mount_point);
+	return status;
+}
+
+/*
+ * Looks up the directory holding the last component of 'path', that component is copied to 'name'.
+ * The directory is returned held with its mount points crossed, ready for a create or remove.
+ */
+static vnode_t* lookup_parent(const char* path, char* name)
+{
+	char parsed_path[VFS_MAX_PATH_LENGTH];
+	char* components[VFS_MAX_PATH_DEPTH];
+	int count = split_path(path, parsed_path, components);
+
+	if(count <= 0 || strlen(components[count - 1]) >= VFS_MAX_FILENAME)
+		return NULL;
+
+	strcpy(name, components[count - 1]);
+
+	vnode_t* node_out = get_root_vnode();
+
+	for(int i = 0; node_out != NULL && i < count - 1; i++)
+		node_out = lookup_component(node_out, components[i]);
+
+	return cross_mount_point(node_out);
+}
+
+static int create_node(const char* path, vtype type, vnode_t** result)
+{
+	char name[VFS_MAX_FILENAME];
+	int status;
+
+	epoch_enter();
+
+	vnode_t* dir = lookup_parent(path, name);
+
+	if(dir == NULL)
+		status = VFS_ENOENT;
+	else if(dir->vnode_type != VDIR)
+		status = VFS_ENOTDIR;
+	else if(dir->vnode_op->create == NULL)
+		status = VFS_EACCESS;	// read only file system
+	else
+		status = dir->vnode_op->create(dir, name, type, result);
+
+	vfs_release_vnode(dir);
+	epoch_exit();
+
+	return status;
+}
+
+int vfs_mkdir(const char *path)
+{
+	vnode_t* result;
+
+	int status = create_node(path, VDIR, &result);
+	if(status == VFS_OK)
+		vfs_release_vnode(result);
+
+	return status;
+}
+
+int vfs_unlink(const char *path)
+{
+	char name[VFS_MAX_FILENAME];
+	int status;
+
+	epoch_enter();
+
+	vnode_t* dir = lookup_parent(path, name);
+
+	if(dir == NULL)
+		status = VFS_ENOENT;
+	else if(dir->vnode_op->remove == NULL)
+		status = VFS_EACCESS;	// read only file system
+	else
+		status = dir->vnode_op->remove(dir, name);
+
+	vfs_release_vnode(dir);
+	epoch_exit();
+
+	return status;
+}
+
+/*
+ * The path is resolved without any lock. The lookup hands over a reference on the vnode found,
+ * which the descriptor keeps so that the vnode stays valid as long as the file is open.
+ */
+ static fd_t open_file(const char *path, uint16_t mode)
  {
+	fd_t descriptor;
+	int status = VFS_OK;
+
+	epoch_enter();
+
 	vnode_t* file_node = lookup_path_name(path);
 
-	if(file_node == NULL)
-		return VFS_ENOENT;
+	if(file_node == NULL && (mode & VFS_O_CREAT))
+		status = create_node(path, VREG, &file_node);
 
-	if(file_node->vnode_type != VREG)
-		return VFS_EISDIR;
+	mode &= ~VFS_O_CREAT;
 
-	fd_t descriptor = find_free_fd();
-	if(descriptor == VFS_ENFILE)
-		return VFS_ENFILE;
+	if(status != VFS_OK)
+		descriptor = status;
+	else if(file_node == NULL)
+		descriptor = VFS_ENOENT;
+	else if(file_node->vnode_type != VREG)
+		descriptor = VFS_EISDIR;
+	else
+	{
+		pthread_mutex_lock(&fd_lock);
 
-	file_node->ref_count++;
+		descriptor = find_free_fd();
+		if(descriptor != VFS_ENFILE)
+		{
+			vfs_open_files[descriptor].mode = mode;
+			vfs_open_files[descriptor].position = 0;
+			vfs_open_files[descriptor].vnode = file_node;
+		}
+
+		pthread_mutex_unlock(&fd_lock);
+	}
 
-	vfs_open_files[descriptor].mode = mode;
-	vfs_open_files[descriptor].position = 0;
-	vfs_open_files[descriptor].vnode = file_node;
+	if(descriptor < 0 && status == VFS_OK)
+		vfs_release_vnode(file_node);
+
+	epoch_exit();
 
 	return descriptor;
  }
 
-int vfs_close(fd_t descriptor)
+fd_t vfs_open(const char *path, uint16_t mode)
 {
+	if(!atomic_load_explicit(&trace_active, memory_order_relaxed))
+		return open_file(path, mode);
+
+	uint64_t start = trace_clock();
+	fd_t descriptor = open_file(path, mode);
+
+	trace_log(&(trace_record_t){ .op = TRACE_OPEN, .fd = descriptor, .arg = mode, .result = descriptor }, start, NULL, path);
+	return descriptor;
+}
+
+static int close_file(fd_t descriptor)
+{
+	pthread_mutex_lock(&fd_lock);
+
 	if(!is_fd_valid(descriptor))
+	{
+		pthread_mutex_unlock(&fd_lock);
 		return VFS_EBADF;
+	}
 
-	vfs_open_files[descriptor].vnode->ref_count--;
+	vfs_release_vnode(vfs_open_files[descriptor].vnode);
 	vfs_open_files[descriptor].vnode = NULL;
 
+	pthread_mutex_unlock(&fd_lock);
+
     return VFS_OK;
 }
 
-size_t vfs_read(fd_t fd, void *buffer, size_t size)
+int vfs_close(fd_t descriptor)
 {
-	if(!is_fd_valid(fd))
+	if(!atomic_load_explicit(&trace_active, memory_order_relaxed))
+		return close_file(descriptor);
+
+	uint64_t start = trace_clock();
+	int status = close_file(descriptor);
+
+	trace_log(&(trace_record_t){ .op = TRACE_CLOSE, .fd = descriptor, .result = status }, start, NULL, NULL);
+	return status;
+}
+
+static ssize_t read_file(fd_t fd, void *buffer, size_t size)
+{
+	vfs_file_t file;
+	vnode_t* node = hold_file(fd, &file);
+
+	if(node == NULL)
 		return VFS_EBADF;
 
-	if(vfs_open_files[fd].mode != VFS_O_RDONLY && vfs_open_files[fd].mode != VFS_O_RDWR)
-		return VFS_EACCESS;
+	ssize_t ret = VFS_EACCESS;
+	if(file.mode == VFS_O_RDONLY || file.mode == VFS_O_RDWR)
+		ret = node->vnode_op->read(node, buffer, size, file.position);
 
-	int ret = vfs_open_files[fd].vnode->vnode_op->read(vfs_open_files[fd].vnode, buffer, size, vfs_open_files[fd].position);
+	if(ret > 0)	// not an error
+		set_position(fd, node, file.position + ret);
 
-	if(ret < 0)	// it's an error
-		return ret;
+	vfs_release_vnode(node);
 
-	vfs_open_files[fd].position += ret;
+	return ret;
+}
+
+ssize_t vfs_read(fd_t fd, void *buffer, size_t size)
+{
+	if(!atomic_load_explicit(&trace_active, memory_order_relaxed))
+		return read_file(fd, buffer, size);
 
+	uint64_t start = trace_clock();
+	ssize_t ret = read_file(fd, buffer, size);
+
+	trace_log(&(trace_record_t){ .op = TRACE_READ, .fd = fd, .arg = size, .result = ret }, start, NULL, NULL);
 	return ret;
 }
 
-size_t vfs_write(fd_t fd, const void *buffer, size_t size)
+static ssize_t write_file(fd_t fd, const void *buffer, size_t size)
 {
-	if(!is_fd_valid(fd))
+	vfs_file_t file;
+	vnode_t* node = hold_file(fd, &file);
+
+	if(node == NULL)
 		return VFS_EBADF;
 
-	if(vfs_open_files[fd].mode != VFS_O_WRONLY && vfs_open_files[fd].mode != VFS_O_RDWR)
-		return VFS_EACCESS;
+	ssize_t ret = VFS_EACCESS;
+	if(file.mode == VFS_O_WRONLY || file.mode == VFS_O_RDWR)
+		ret = node->vnode_op->write(node, buffer, size, file.position);
 
-	int ret = vfs_open_files[fd].vnode->vnode_op->write(vfs_open_files[fd].vnode, buffer, size, vfs_open_files[fd].position);
-	
-	if(ret < 0)	// it's an error
-		return ret;
+	if(ret > 0)	// not an error
+		set_position(fd, node, file.position + ret);
 
-	vfs_open_files[fd].position += ret;
+	vfs_release_vnode(node);
 
 	return ret;
 }
 
+ssize_t vfs_write(fd_t fd, const void *buffer, size_t size)
+{
+	if(!atomic_load_explicit(&trace_active, memory_order_relaxed))
+		return write_file(fd, buffer, size);
+
+	uint64_t start = trace_clock();
+	ssize_t ret = write_file(fd, buffer, size);
+
+	trace_log(&(trace_record_t){ .op = TRACE_WRITE, .fd = fd, .arg = size, .result = ret }, start, NULL, NULL);
+	return ret;
+}
+
+/*
+ * Moves the position of an open file, it may go past the end of the file (a write there leaves a gap).
+ * Returns the new position, or a negative vfs_error_t.
+ */
+static int64_t seek_file(fd_t fd, int64_t offset, int whence)
+{
+	vfs_file_t file;
+	vnode_t* node = hold_file(fd, &file);
+
+	if(node == NULL)
+		return VFS_EBADF;
+
+	int64_t base = 0;
+	int64_t position = VFS_OK;
+	vfs_stat_t stat;
+
+	switch (whence)
+	{
+	case VFS_SEEK_SET:
+		break;
+
+	case VFS_SEEK_CUR:
+		base = file.position;
+		break;
+
+	case VFS_SEEK_END:
+		if(node->vnode_op->getattr(node, &stat) != VFS_OK)
+			position = VFS_ERROR;
+		else
+			base = stat.size;
+		break;
+
+	default:
+		position = VFS_ERROR;
+	}
+
+	if(position == VFS_OK && (offset < -base || (offset > 0 && base > INT64_MAX - offset)))
+		position = VFS_ERROR;
+
+	if(position == VFS_OK)
+	{
+		position = base + offset;
+		set_position(fd, node, position);
+	}
+
+	vfs_release_vnode(node);
+
+	return position;
+}
+
+int64_t vfs_seek(fd_t fd, int64_t offset, int whence)
+{
+	if(!atomic_load_explicit(&trace_active, memory_order_relaxed))
+		return seek_file(fd, offset, whence);
+
+	uint64_t start = trace_clock();
+	int64_t position = seek_file(fd, offset, whence);
+
+	trace_log(&(trace_record_t){ .op = TRACE_SEEK, .whence = whence, .fd = fd, .arg = offset, .result = position }, start, NULL, NULL);
+	return position;
+}
+
+/*
+ * Reserves the space of [offset, offset + length) in an open file, which grows to cover the range
+ * (the new bytes read as zeros) while the position doesn't move. A writer knowing the final size
+ * of a file gets its storage in one step: a contiguous cluster run on FAT, a single buffer on ramfs.
+ *
+ * Drivers without an allocate operation get zeros written past the end of the file,
+ * like posix_fallocate() does on file systems that can't do better.
+ */
+static int allocate_file(vnode_t* node, uint64_t offset, uint64_t length)
+{
+	if(length == 0 || offset > INT64_MAX - length)
+		return VFS_ERROR;
+
+	if(node->vnode_type != VREG)
+		return VFS_EISDIR;
+
+	if(node->vnode_op->allocate != NULL)
+		return node->vnode_op->allocate(node, offset, length);
+
+	vfs_stat_t stat;
+	if(node->vnode_op->getattr(node, &stat) != VFS_OK)
+		return VFS_ERROR;
+
+	static const uint8_t zeros[4096];
+	for(uint64_t position = stat.size; position < offset + length; )
+	{
+		size_t chunk = (offset + length - position < sizeof(zeros)) ? offset + length - position : sizeof(zeros);
+
+		ssize_t ret = node->vnode_op->write(node, zeros, chunk, position);
+		if(ret <= 0)
+			return (ret < 0) ? (int)ret : VFS_ERROR;
+
+		position += ret;
+	}
+
+	return VFS_OK;
+}
+
+int vfs_fallocate(fd_t fd, uint64_t offset, uint64_t length)
+{
+	vfs_file_t file;
+	vnode_t* node = hold_file(fd, &file);
+
+	if(node == NULL)
+		return VFS_EBADF;
+
+	int status = VFS_EACCESS;
+	if(file.mode == VFS_O_WRONLY || file.mode == VFS_O_RDWR)
+		status = allocate_file(node, offset, length);
+
+	vfs_release_vnode(node);
+
+	return status;
+}
+
 void vfs_register_new_filesystem(filesystem_t* fs)
 {
 	if(num_registered_fs >= VFS_MAX_FS)
@@ -291,4 +984,182 @@ void vfs_register_new_filesystem(filesystem_t* fs)
 
 	registered_fs[num_registered_fs] = fs;
 	num_registered_fs++;
+}
+
+/* Drivers stacked on top of other drivers (like overlay) need to find them */
+filesystem_t* vfs_find_filesystem(const char* name)
+{
+	return find_filesystem_by_name(name);
+}
+
+static int sync_mount_point(vfs_t *mountpoint)
+{
+	if(mountpoint->vfs_op->vfs_sync == NULL)
+		return VFS_OK;	// nothing is cached by this file system
+
+	return mountpoint->vfs_op->vfs_sync(mountpoint);
+}
+
+/*
+ * Makes the content of an open file durable.
+ * File systems don't track which cached blocks belong to which file, so the whole
+ * file system holding it is synchronized.
+ */
+int vfs_fsync(fd_t fd)
+{
+	vfs_file_t file;
+	vnode_t* node = hold_file(fd, &file);
+
+	if(node == NULL)
+		return VFS_EBADF;
+
+	int status = sync_mount_point(node->vnode_vfs);
+	vfs_release_vnode(node);
+
+	return status;
+}
+
+int vfs_sync()
+{
+	int ret = VFS_OK;
+
+	epoch_enter();	// no file system can be freed under us
+
+	for(vfs_t *current = vfs_root; current != NULL; current = current->next)
+	{
+		int status = sync_mount_point(current);
+		if(status != VFS_OK)
+			ret = status;
+	}
+
+	epoch_exit();
+
+	return ret;
+}
+
+int vfs_stat(const char *path, vfs_stat_t *stat)
+{
+	int status = VFS_ENOENT;
+
+	epoch_enter();
+
+	vnode_t* node = lookup_path_name(path);
+	if(node != NULL)
+		status = node->vnode_op->getattr(node, stat);
+
+	vfs_release_vnode(node);
+	epoch_exit();
+
+	return status;
+}
+
+int vfs_fstat(fd_t fd, vfs_stat_t *stat)
+{
+	vfs_file_t file;
+	vnode_t* node = hold_file(fd, &file);
+
+	if(node == NULL)
+		return VFS_EBADF;
+
+	int status = node->vnode_op->getattr(node, stat);
+	vfs_release_vnode(node);
+
+	return status;
+}
+
+/*
+ * Stats a batch of paths at once.
+ *
+ * Paths are resolved one after another, but the directories walked for the previous
+ * path are kept around: a path only looks up the components that differ from the
+ * previous one. Scanning a tree in directory order (like a build system does) therefore
+ * costs a single lookup per file instead of a full walk from the root.
+ *
+ * The directories kept in the prefix keep the reference of their lookup so that the file
+ * system doesn't recycle their vnodes while the batch is running.
+ *
+ * 'results' (optional) receives the status of each entry.
+ * Returns the number of paths successfully stat'ed.
+ */
+int vfs_stat_many(const char *paths[], vfs_stat_t stats[], int results[], size_t count)
+{
+	char buffers[2][VFS_MAX_PATH_LENGTH];
+	char* components[2][VFS_MAX_PATH_DEPTH];
+	vnode_t* prefix[VFS_MAX_PATH_DEPTH + 1];	// prefix[i] is the vnode reached after i components
+	int prefix_depth = 0;						// number of valid entries in prefix, minus the root
+	int succeeded = 0;
+
+	epoch_enter();
+
+	prefix[0] = get_root_vnode();
+	if(prefix[0] == NULL)
+		prefix_depth = -1;
+
+	for(size_t i = 0; i < count; i++)
+	{
+		int current = i % 2, previous = (i + 1) % 2;
+		int depth = split_path(paths[i], buffers[current], components[current]);
+		int status = VFS_OK;
+
+		if(depth < 0 && prefix_depth > 0)
+		{
+			// the components of this path can't be compared with the next one
+			for(int j = 1; j <= prefix_depth; j++)
+				vfs_release_vnode(prefix[j]);
+			prefix_depth = 0;
+		}
+
+		if(depth < 0 || prefix_depth < 0)
+			status = VFS_ENOENT;
+		else
+		{
+			// how many directories can be reused from the previous path ?
+			int common = 0;
+			while(common < prefix_depth && common < depth - 1 && strcmp(components[current][common], components[previous][common]) == 0)
+				common++;
+
+			// release the directories that are no longer part of the prefix
+			for(int j = common + 1; j <= prefix_depth; j++)
+				vfs_release_vnode(prefix[j]);
+			prefix_depth = common;
+
+			// the walk consumes the reference it starts from, the prefix keeps its own
+			vnode_t* node = prefix[common];
+			node->ref_count++;
+
+			for(int j = common; node != NULL && j < depth; j++)
+			{
+				node = lookup_component(node, components[current][j]);
+
+				if(node != NULL && j < depth - 1)
+				{
+					node->ref_count++;
+					prefix[j + 1] = node;
+					prefix_depth = j + 1;
+				}
+			}
+
+			node = cross_mount_point(node);
+
+			if(node == NULL)
+				status = VFS_ENOENT;
+			else
+				status = node->vnode_op->getattr(node, &stats[i]);
+
+			vfs_release_vnode(node);
+		}
+
+		if(results != NULL)
+			results[i] = status;
+
+		if(status == VFS_OK)
+			succeeded++;
+	}
+
+	for(int j = 0; j <= prefix_depth; j++)
+		vfs_release_vnode(prefix[j]);
+
+	epoch_exit();
+
+	return succeeded;
 }
\ No newline at end of file
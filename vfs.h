@@ -25,6 +25,10 @@
 #pragma once
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "pool.h"
 
 #define VFS_MAX_PATH_LENGTH 256
 #define VFS_MAX_FILENAME 64
@@ -34,8 +38,16 @@ typedef enum
     VFS_O_RDONLY = 0x0001,   // read only
     VFS_O_WRONLY = 0x0002,   // write only
     VFS_O_RDWR   = 0x0003,   // read / write
+    VFS_O_CREAT  = 0x0004,   // create the file if it doesn't exist
 } vfs_open_mode_t;
 
+typedef enum
+{
+    VFS_SEEK_SET = 0,   // from the beginning of the file
+    VFS_SEEK_CUR = 1,   // from the current position
+    VFS_SEEK_END = 2,   // from the end of the file
+} vfs_seek_whence_t;
+
 typedef enum
 {
     VFS_OK         = 0,     /* Operation successful */
@@ -57,10 +69,13 @@ struct vnodeops;
 /*
  * Represents a mounted virtual file system.
  * This structure links together the mount point and the file system operations.
+ *
+ * Path lookups don't take any lock: 'next' and 'vfs_mountedhere' are published atomically,
+ * and a vfs_t (or a vnode) is only freed once the lookups that could see it are done (see epoch.h).
  */
 typedef struct vfs
 {
-    struct vfs *next;           /* Pointer to the next mounted file system (used in a linked list) */
+    struct vfs *_Atomic next;   /* Pointer to the next mounted file system (used in a linked list) */
     int device_id;
     struct filesystem *vfs_op;  /* Pointer to the file system operations (driver) associated with this mount */
     struct vnode *vnodecovered; /* The vnode that this file system is mounted over (i.e., the mount point) */
@@ -77,7 +92,9 @@ typedef struct filesystem
     char fs_name[VFS_MAX_FILENAME];                                 /* Name of the file system (e.g., "ramfs", "ext2") */
     int (*vfs_mount)(struct vfs* mountpoint, int device_id);        /* Function to mount the file system on a device */
     int (*vfs_unmount)(struct vfs* mountpoint);                     /* Function to unmount the file system */
-    int (*get_root)(struct vfs* mountpoint, struct vnode** result); /* Get the root vnode of the mounted FS */
+    int (*get_root)(struct vfs* mountpoint, struct vnode** result); /* Get the root vnode of the mounted FS, held */
+    int (*vfs_sync)(struct vfs* mountpoint);                        /* Write every pending change to the device (may be NULL) */
+    int (*vfs_warmup)(struct vfs* mountpoint);                      /* Preload the root directory in the cache (may be NULL) */
 }filesystem_t;
 
 
@@ -95,6 +112,28 @@ typedef enum {
 } vnode_flags_t;
 
 typedef enum {VNON, VREG, VDIR}vtype;
+
+typedef enum {
+    VFS_STAT_NONE     = 0,
+    VFS_STAT_RDONLY   = 1 << 0, // The file cannot be written
+    VFS_STAT_HIDDEN   = 1 << 1, // The file is hidden
+    VFS_STAT_SYSTEM   = 1 << 2, // The file belongs to the system
+} vfs_stat_flags_t;
+
+/*
+ * Attributes of a file or directory, as returned by vfs_stat() and vfs_fstat().
+ * Times are expressed in seconds since the epoch, 0 when the file system doesn't know them.
+ */
+typedef struct vfs_stat
+{
+    vtype type;             /* Type of the node (regular file or directory) */
+    uint16_t flags;         /* Combination of vfs_stat_flags_t */
+    uint64_t size;          /* Size of the file in bytes */
+    uint64_t create_time;
+    uint64_t modify_time;
+    uint64_t access_time;
+} vfs_stat_t;
+
 /*
  * Represents a file or directory within a mounted file system.
  * Abstracts the underlying inode and links to file system operations.
@@ -102,26 +141,51 @@ typedef enum {VNON, VREG, VDIR}vtype;
 typedef struct vnode
 {
     //uint32_t flags;
-    uint32_t ref_count;             /* Reference count for this vnode (used to manage lifetime) */
+    _Atomic uint32_t ref_count;     /* Reference count for this vnode (used to manage lifetime) */
     vtype vnode_type;
     uint16_t flags;
-    struct vfs *vfs_mountedhere;    /* If another file system is mounted here, pointer to it */
+    struct vfs *_Atomic vfs_mountedhere;    /* If another file system is mounted here, pointer to it */
     struct vnodeops *vnode_op;      /* Pointer to the vnode operations supported by this file/directory */
     struct vfs *vnode_vfs;          /* The VFS this vnode belongs to */
     void *vnode_data;               /* File-system-specific data (usually an inode or similar) */
 }vnode_t;
 
+/*
+ * The drivers allocate their vnodes from a pool, along with their inode: 'vnode_data'
+ * points right after the vnode. vfs_free_vnode() can be handed to epoch_retire().
+ */
+objpool_t* vfs_create_vnode_pool(const char* name, size_t data_size);
+vnode_t* vfs_alloc_vnode(objpool_t* pool);
+void vfs_free_vnode(void* vnode);
+
+/*
+ * get_root, lookup and create return their vnode with a reference held for the caller, taken under
+ * the lock of the vnode table so that the vnode can't be evicted in between. The caller gives it back here.
+ */
+void vfs_release_vnode(vnode_t* vnode);
+
 /*
  * Defines the operations that can be performed on a vnode.
  * These must be implemented by each file system.
  */
 typedef struct vnodeops
 {
-    int (*read)(struct vnode* node, void *buffer, size_t size, uint32_t offset);
-    int (*write)(struct vnode* node, const void *buffer, size_t size, uint32_t offset);
+    /* Return the number of bytes transferred, or a negative vfs_error_t */
+    ssize_t (*read)(struct vnode* node, void *buffer, size_t size, uint64_t offset);
+    ssize_t (*write)(struct vnode* node, const void *buffer, size_t size, uint64_t offset);
 
-    /* Find a file/directory by name */
+    /* Find a file/directory by name, the vnode found is held (see vfs_release_vnode()) */
     int (*lookup)(struct vnode* node_dir, const char* name, struct vnode** result);
+
+    /* Fill 'stat' with the attributes of the file/directory */
+    int (*getattr)(struct vnode* node, vfs_stat_t* stat);
+
+    /* Create a file/directory in a directory (held like a lookup), and remove one (may be NULL if the file system is read only) */
+    int (*create)(struct vnode* node_dir, const char* name, vtype type, struct vnode** result);
+    int (*remove)(struct vnode* node_dir, const char* name);
+
+    /* Reserve the storage of [offset, offset + length), the file grows to cover it (may be NULL) */
+    int (*allocate)(struct vnode* node, uint64_t offset, uint64_t length);
 }vnodeops_t;
 
 
@@ -133,19 +197,41 @@ typedef struct vfs_file
 {
     struct vnode *vnode;    /* The vnode associated with this file */
     uint16_t mode;          /* Mode in which the file was opened (read, write, etc.) */
-    uint32_t position;      /* Current position within the file (for reading/writing) */
+    uint64_t position;      /* Current position within the file (for reading/writing) */
 } vfs_file_t;
 
 typedef int fd_t;   // file descriptor
 
+/* One mount of a vfs_mount_many() batch */
+typedef struct vfs_mount_request
+{
+    const char *fs_name;
+    const char *mount_point;
+    int device_id;
+    int status;             /* Result of this mount, filled by vfs_mount_many() */
+} vfs_mount_request_t;
+
 void vfs_init();
 void vfs_register_new_filesystem(filesystem_t* fs);
+filesystem_t* vfs_find_filesystem(const char* name);
 
 int vfs_mount(const char *fs_name, const char *mount_point, int device_id);
+int vfs_mount_many(vfs_mount_request_t requests[], size_t count, bool warm_up);
 int vfs_unmount(const char *mount_point);
 
 fd_t vfs_open(const char *path, uint16_t mode);
+int vfs_mkdir(const char *path);
+int vfs_unlink(const char *path);
 int vfs_close(fd_t descriptor);
 
-size_t vfs_read(fd_t fd, void *buffer, size_t size);
-size_t vfs_write(fd_t fd, const void *buffer, size_t size);
\ No newline at end of file
+ssize_t vfs_read(fd_t fd, void *buffer, size_t size);
+ssize_t vfs_write(fd_t fd, const void *buffer, size_t size);
+int64_t vfs_seek(fd_t fd, int64_t offset, int whence);
+int vfs_fallocate(fd_t fd, uint64_t offset, uint64_t length);
+
+int vfs_fsync(fd_t fd);
+int vfs_sync();
+
+int vfs_stat(const char *path, vfs_stat_t *stat);
+int vfs_fstat(fd_t fd, vfs_stat_t *stat);
+int vfs_stat_many(const char *paths[], vfs_stat_t stats[], int results[], size_t count);
\ No newline at end of file